@@ -39,6 +39,47 @@ t_wordcount_unpack_server_cfg(const char *server_cfg_path, sb_t *err)
     return res;
 }
 
+int wordcount_unix_sockunion(lstr_t path, sockunion_t *su)
+{
+    p_clear(su, 1);
+    su->sunix.sun_family = AF_UNIX;
+
+    /* Keep room for the trailing NUL, which is also what tells the length
+     * of the address of an abstract socket */
+    if (!path.len || path.len >= ssizeof(su->sunix.sun_path)) {
+        return -1;
+    }
+    memcpy(su->sunix.sun_path, path.s, path.len);
+    if (path.s[0] == '@') {
+        /* Abstract namespace */
+        su->sunix.sun_path[0] = '\0';
+    }
+    return 0;
+}
+
+int wordcount_server_sockunion(const wordcount__server_cfg__t *server_cfg,
+                               bool force_tcp, sockunion_t *su)
+{
+    if (!force_tcp && server_cfg->unix_sockets.len) {
+        lstr_t path = server_cfg->unix_sockets.tab[0];
+
+        if (wordcount_unix_sockunion(path, su) < 0) {
+            e_error("invalid unix socket path `%pL`", &path);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (addr_info_str(su, server_cfg->address.s, server_cfg->port,
+                      AF_UNSPEC) < 0)
+    {
+        e_error("unable to resolve address %pL:%d", &server_cfg->address,
+                server_cfg->port);
+        return -1;
+    }
+    return 0;
+}
+
 /** Callback called when a termination signal is received.
  *
  * \param[in] el     The event loop signal handler.
@@ -21,6 +21,7 @@
 
 #include <lib-common/core.h>
 #include <lib-common/container-qvector.h>
+#include <lib-common/net.h>
 
 #include "wordcount.iop.h"
 
@@ -35,6 +36,28 @@
 wordcount__server_cfg__t * nullable
 t_wordcount_unpack_server_cfg(const char *server_cfg_path, sb_t *err);
 
+/** Get the socket union of a Unix domain socket.
+ *
+ * \param[in]  path The path of the socket, starting with `@` for a socket of
+ *                  the abstract namespace.
+ * \param[out] su   The socket union.
+ * \return -1 if the path is too long, 0 otherwise.
+ */
+int wordcount_unix_sockunion(lstr_t path, sockunion_t *su);
+
+/** Get the address of the server to connect to.
+ *
+ * The first Unix domain socket of the server is used if any, the TCP
+ * address otherwise.
+ *
+ * \param[in]  server_cfg The server configuration.
+ * \param[in]  force_tcp  Whether to use the TCP address anyway.
+ * \param[out] su         The socket union of the server.
+ * \return -1 if the address cannot be resolved, 0 otherwise.
+ */
+int wordcount_server_sockunion(const wordcount__server_cfg__t *server_cfg,
+                               bool force_tcp, sockunion_t *su);
+
 /** Module to handle common behaviour between server and client.
  *
  * Handle an event loop blocker and handle termination signals.
@@ -0,0 +1,1348 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <linux/perf_event.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <lib-common/core.h>
+#include <lib-common/container-qhash.h>
+#include <lib-common/el.h>
+#include <lib-common/iop-rpc.h>
+#include <lib-common/parseopt.h>
+
+#include "wordcount-base.h"
+#include "wordcount-count.h"
+
+static const char *short_args_g = "[<file_path>]";
+
+static const char *long_usage_g[] = {
+    "Benchmark of the word counting of wordcount-server",
+    "",
+    "Count the words of a file, or of a generated corpus, and show:",
+    "  - in `stages` mode, the throughput and the allocations of each stage ",
+    "    of the counting: tokenizing, map insertion, sort, lower-case and ",
+    "    copy, with the counting code linked directly, and the folding of ",
+    "    the content first with -u",
+    "  - in `maps` mode, the time, the allocations and the cache misses per ",
+    "    word of the map of words of wordcount-server and of a qm_t hashing ",
+    "    the words on each probe",
+    "  - in `e2e` mode, the throughput and the latency of countOccurrences ",
+    "    queries sent to a running wordcount-server, see -c, on its unix ",
+    "    socket or on TCP with -T, as a row of a table with -R",
+    "  - in `check` mode, whether the counting paths give the result of the ",
+    "    scalar tokenizer by one thread: the SIMD tokenizers, around their ",
+    "    64-byte blocks and returning early, the parallel counting, the ",
+    "    counting chunk by chunk, and the merges of the results of parts of ",
+    "    the content, with and without the UTF-8 tokenizing",
+    "",
+    "The corpora are generated with a fixed seed, so they are the same from ",
+    "a run to another:",
+    "  - zipf:  English-like text, with a Zipf-like distribution of words",
+    "  - unique: very high cardinality, nearly every word is unique",
+    "  - long:  very long words, from 512 to 4096 characters",
+    "  - punct: mostly punctuation, with a few short words",
+    "  - accents: like zipf, with the accented letters of French and German",
+    "",
+    "The UTF-8 tokenizing (-u) is compared to the ASCII one by running the ",
+    "same corpus with and without it: the pure ASCII corpora measure the ",
+    "cost of its ASCII check, the accents corpus the cost of the folding.",
+    NULL,
+};
+
+/* Create the baseline map type lstr_t => unsigned, the words are hashed
+ * case-insensitively on each probe. */
+qm_kvec_t(bench_words, lstr_t, unsigned, qhash_lstr_ascii_ihash,
+          qhash_lstr_ascii_iequal);
+
+/* Create the vector type to store the tokenized words. */
+qvector_t(bench_token, wordcount_token_t);
+
+/* Number of words got from the tokenizer at once */
+#define BENCH_TOKENS_BATCH  256
+
+/* Seed of the generated corpora */
+#define BENCH_SEED  42
+
+static struct {
+    bool opt_help;
+    unsigned opt_rounds;
+    unsigned opt_size;
+    unsigned opt_vocabulary;
+    unsigned opt_limit;
+    const char *opt_corpus;
+    const char *opt_mode;
+    const char *opt_cfg_path;
+    unsigned opt_in_flight;
+    bool opt_tcp;
+    bool opt_row;
+    bool opt_utf8;
+
+    /** The number of calls to the allocation functions of the libc */
+    uint64_t nb_allocs;
+
+    /** The content to count the words of, and its number of words */
+    lstr_t content;
+    uint64_t nb_words;
+
+    /** The tokenizer of the content, UTF-8 with -u */
+    wordcount_tokenize_f *tokenize;
+
+    /** State of the end-to-end mode, and the transport of its
+     * connection */
+    ichannel_t ic;
+    const char *transport;
+    unsigned nb_sent;
+    unsigned nb_received;
+    unsigned nb_failed;
+    int64_t start_nsec;
+    int64_t total_latency_nsec;
+    int64_t max_latency_nsec;
+    int exit_res;
+} wordcount_bench_g = {
+    .opt_rounds = 10,
+    .opt_size = 16 << 20,
+    .opt_vocabulary = 100000,
+    .opt_corpus = "zipf",
+    .opt_mode = "stages",
+    .opt_in_flight = 4,
+};
+#define _G wordcount_bench_g
+
+static popt_t opts_g[] = {
+    OPT_GROUP("Options:"),
+    OPT_FLAG('h', "help", &_G.opt_help, "show this help"),
+    OPT_STR('M', "mode", &_G.opt_mode,
+            "stages, maps, e2e or check (default: stages)"),
+    OPT_STR('C', "corpus", &_G.opt_corpus,
+            "generated corpus: zipf, unique, long, punct or accents "
+            "(default: zipf)"),
+    OPT_UINT('r', "rounds", &_G.opt_rounds,
+             "number of times the content is counted (default: 10)"),
+    OPT_UINT('s', "size", &_G.opt_size,
+             "size in bytes of the generated content (default: 16MiB)"),
+    OPT_UINT('v', "vocabulary", &_G.opt_vocabulary,
+             "number of unique words of the zipf corpus "
+             "(default: 100000)"),
+    OPT_UINT('l', "limit", &_G.opt_limit,
+             "maximum number of words in the result (default: no limit)"),
+    OPT_FLAG('u', "utf8", &_G.opt_utf8,
+             "stages and e2e modes: tokenize the content in UTF-8"),
+    OPT_STR('c', "cfg", &_G.opt_cfg_path,
+            "e2e mode: configuration of the server to query"),
+    OPT_UINT('q', "in-flight", &_G.opt_in_flight,
+             "e2e mode: maximum number of queries in flight (default: 4)"),
+    OPT_FLAG('T', "tcp", &_G.opt_tcp,
+             "e2e mode: connect to the TCP address of the server even if it "
+             "listens on a unix socket"),
+    OPT_FLAG('R', "row", &_G.opt_row,
+             "e2e mode: print the results as a row of an AsciiDoc table"),
+    OPT_END()
+};
+
+/* Allocation counting.
+ *
+ * The program is linked with `--wrap` for the allocation functions of the
+ * libc, so that the calls made by lib-common are counted too. */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&_G.nb_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&_G.nb_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&_G.nb_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+/* Measures */
+
+/** Measures of one counting, or of one stage of the countings. */
+typedef struct bench_measure_t {
+    int64_t nsec;
+    uint64_t allocs;
+    uint64_t cache_misses;
+} bench_measure_t;
+
+/** Open the hardware counter of the cache misses of this thread.
+ *
+ * \return The file descriptor of the counter, -1 if it is not available, for
+ *         example in a container.
+ */
+static int bench_open_cache_misses(void)
+{
+    struct perf_event_attr attr;
+
+    p_clear(&attr, 1);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int64_t bench_now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_measure_start(int perf_fd, bench_measure_t *measure)
+{
+    p_clear(measure, 1);
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    measure->allocs = _G.nb_allocs;
+    measure->nsec = bench_now_nsec();
+}
+
+static void bench_measure_stop(int perf_fd, bench_measure_t *measure)
+{
+    measure->nsec = bench_now_nsec() - measure->nsec;
+    measure->allocs = _G.nb_allocs - measure->allocs;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(perf_fd, &measure->cache_misses,
+                 sizeof(measure->cache_misses)) < 0)
+        {
+            measure->cache_misses = 0;
+        }
+    }
+}
+
+/** Add the measures of a stage of one round to the total of the stage. */
+static void bench_measure_add(bench_measure_t *total,
+                              const bench_measure_t *measure)
+{
+    total->nsec += measure->nsec;
+    total->allocs += measure->allocs;
+    total->cache_misses += measure->cache_misses;
+}
+
+/* Corpora */
+
+/** Generate random words.
+ *
+ * \param[in]  nb_words The number of words.
+ * \param[in]  min_len  The minimum length of the words.
+ * \param[in]  max_len  The maximum length of the words.
+ * \param[in]  alphabet The characters of the words.
+ * \param[out] words    The words, allocated on the heap.
+ */
+static void bench_generate_words(unsigned nb_words, int min_len, int max_len,
+                                 lstr_t alphabet, qv_t(lstr) *words)
+{
+    SB_1k(word);
+
+    for (unsigned i = 0; i < nb_words; i++) {
+        int len = min_len + rand() % (max_len - min_len + 1);
+
+        sb_reset(&word);
+        for (int j = 0; j < len; j++) {
+            sb_addc(&word, alphabet.s[rand() % alphabet.len]);
+        }
+        qv_append(words, lstr_dup(LSTR_SB_V(&word)));
+    }
+    sb_wipe(&word);
+}
+
+/** Generate random words of UTF-8 characters.
+ *
+ * Same as bench_generate_words(), with the ASCII letters and the accented
+ * letters of French and German, in both cases. The accented letters are
+ * less frequent than the ASCII ones, like in real texts.
+ */
+static void bench_generate_accented_words(unsigned nb_words, int min_len,
+                                          int max_len, qv_t(lstr) *words)
+{
+    /* é è ê à â ç ô û ä ö ü ß œ É À Ä Ö Ü */
+    static const char * const accented[] = {
+        "\xc3\xa9", "\xc3\xa8", "\xc3\xaa", "\xc3\xa0", "\xc3\xa2",
+        "\xc3\xa7", "\xc3\xb4", "\xc3\xbb", "\xc3\xa4", "\xc3\xb6",
+        "\xc3\xbc", "\xc3\x9f", "\xc5\x93", "\xc3\x89", "\xc3\x80",
+        "\xc3\x84", "\xc3\x96", "\xc3\x9c",
+    };
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEF";
+    SB_1k(word);
+
+    for (unsigned i = 0; i < nb_words; i++) {
+        int len = min_len + rand() % (max_len - min_len + 1);
+
+        sb_reset(&word);
+        for (int j = 0; j < len; j++) {
+            if (rand() % 8 == 0) {
+                sb_adds(&word, accented[rand() % countof(accented)]);
+            } else {
+                sb_addc(&word, letters[rand() % (countof(letters) - 1)]);
+            }
+        }
+        qv_append(words, lstr_dup(LSTR_SB_V(&word)));
+    }
+    sb_wipe(&word);
+}
+
+/** Generate a content of words with a Zipf-like distribution.
+ *
+ * The rank of each word is drawn log-uniformly, so that the frequency of a
+ * word is roughly inversely proportional to its rank, like in natural
+ * language texts. The words are separated by spaces, with some commas and
+ * periods.
+ */
+static void bench_generate_zipf(const qv_t(lstr) *words, unsigned size,
+                                sb_t *out)
+{
+    while (out->len < (int)size) {
+        double u = (double)rand() / RAND_MAX;
+        int rank = MIN((unsigned)pow(words->len, u), (unsigned)words->len) - 1;
+        int sep = rand() % 16;
+
+        sb_add_lstr(out, words->tab[rank]);
+        if (sep == 0) {
+            sb_adds(out, ".\n");
+        } else
+        if (sep == 1) {
+            sb_adds(out, ", ");
+        } else {
+            sb_addc(out, ' ');
+        }
+    }
+}
+
+/** Generate a content mostly made of punctuation.
+ *
+ * Runs of punctuation and spaces are separated by a few short words, so the
+ * tokenizer mostly skips non-word characters.
+ */
+static void bench_generate_punct(unsigned size, sb_t *out)
+{
+    static const char punct[] = ".,;:!?-()[]{}\"'/\\*&#@ \n";
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+
+    while (out->len < (int)size) {
+        int run_len = 1 + rand() % 16;
+
+        for (int i = 0; i < run_len; i++) {
+            sb_addc(out, punct[rand() % (countof(punct) - 1)]);
+        }
+        if (rand() % 8 == 0) {
+            int word_len = 1 + rand() % 3;
+
+            for (int i = 0; i < word_len; i++) {
+                sb_addc(out, letters[rand() % (countof(letters) - 1)]);
+            }
+        }
+    }
+}
+
+/** Generate a corpus.
+ *
+ * \param[in]  corpus The name of the corpus.
+ * \param[out] out    The generated content.
+ * \return -1 if the corpus is unknown, 0 otherwise.
+ */
+static int bench_generate_corpus(const char *corpus, sb_t *out)
+{
+    lstr_t letters = LSTR("abcdefghijklmnopqrstuvwxyzABCDEFGHIJ");
+    lstr_t alnum = LSTR("abcdefghijklmnopqrstuvwxyz"
+                        "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
+    qv_t(lstr) words;
+
+    qv_init(&words);
+    srand(BENCH_SEED);
+    sb_grow(out, _G.opt_size);
+
+    if (strequal(corpus, "zipf")) {
+        bench_generate_words(MAX(_G.opt_vocabulary, 1U), 2, 12, letters,
+                             &words);
+        bench_generate_zipf(&words, _G.opt_size, out);
+    } else
+    if (strequal(corpus, "unique")) {
+        /* 62^6 possible words of 6 characters and more, so nearly all of
+         * them are unique */
+        while (out->len < (int)_G.opt_size) {
+            qv_clear(&words);
+            bench_generate_words(1, 6, 12, alnum, &words);
+            sb_add_lstr(out, words.tab[0]);
+            sb_addc(out, ' ');
+            lstr_wipe(&words.tab[0]);
+        }
+        qv_clear(&words);
+    } else
+    if (strequal(corpus, "long")) {
+        bench_generate_words(MIN(MAX(_G.opt_vocabulary, 1U), 1000U), 512,
+                             4096, letters, &words);
+        bench_generate_zipf(&words, _G.opt_size, out);
+    } else
+    if (strequal(corpus, "punct")) {
+        bench_generate_punct(_G.opt_size, out);
+    } else
+    if (strequal(corpus, "accents")) {
+        bench_generate_accented_words(MAX(_G.opt_vocabulary, 1U), 2, 12,
+                                      &words);
+        bench_generate_zipf(&words, _G.opt_size, out);
+    } else {
+        e_error("unknown corpus `%s`", corpus);
+        qv_wipe(&words);
+        return -1;
+    }
+
+    qv_deep_wipe(&words, lstr_wipe);
+    return 0;
+}
+
+/** Count the words of the content, for the measures per word. */
+static uint64_t bench_count_tokens(lstr_t content)
+{
+    wordcount_token_t tokens[BENCH_TOKENS_BATCH];
+    const char *pos = content.s;
+    const char *end = content.s + content.len;
+    uint64_t nb_words = 0;
+    int nb_tokens;
+
+    while ((nb_tokens = (*_G.tokenize)(&pos, end, tokens,
+                                       countof(tokens))) > 0)
+    {
+        nb_words += nb_tokens;
+    }
+    return nb_words;
+}
+
+static void bench_print_header(void)
+{
+    printf("content: %d bytes, %ju words, %u unique words estimated, "
+           "tokenizer: %s%s\n", _G.content.len, (uintmax_t)_G.nb_words,
+           wordcount_map_estimate_words(_G.content.len),
+           wordcount_tokenize_impl_name(), _G.opt_utf8 ? " utf8" : "");
+}
+
+/* Stages */
+
+/** Tokenize the content in a vector of words. */
+static void bench_stage_tokenize(lstr_t content, qv_t(bench_token) *tokens)
+{
+    const char *pos = content.s;
+    const char *end = content.s + content.len;
+    int nb_tokens;
+
+    qv_clear(tokens);
+    do {
+        qv_grow(tokens, BENCH_TOKENS_BATCH);
+        nb_tokens = (*_G.tokenize)(&pos, end, tokens->tab + tokens->len,
+                                   BENCH_TOKENS_BATCH);
+        tokens->len += nb_tokens;
+    } while (nb_tokens > 0);
+}
+
+/** Put the tokenized words in the map, like wordcount_split_words(). */
+static void bench_stage_insert(lstr_t content,
+                               const qv_t(bench_token) *tokens,
+                               wordcount_map_t *map)
+{
+    wordcount_map_reset(map, wordcount_map_estimate_words(content.len));
+    tab_for_each_ptr(token, tokens) {
+        wordcount_map_add(map, content.s, token->s, token->len, token->hash,
+                          token->s - content.s, 1, NULL);
+    }
+}
+
+/** Get the words of the map in a vector, and sort them by occurrences. */
+static void t_bench_stage_sort(lstr_t content, const wordcount_map_t *map,
+                               qv_t(word_occurrences_vec) *vec)
+{
+    t_qv_init(vec, wordcount_map_len(map));
+    tab_for_each_ptr(entry, &map->entries) {
+        qv_append(vec, ((wordcount__word_occurrences__t){
+            .word = LSTR_PTR_V(content.s + entry->offset, entry->len),
+            .occurrences = entry->occurrences,
+        }));
+    }
+    vec->len = wordcount_sort_word_occurrences_tab(vec->tab, vec->len,
+                                                   _G.opt_limit);
+}
+
+static void bench_print_stage(const char *name,
+                              const bench_measure_t *measure)
+{
+    double sec = MAX(measure->nsec, 1) / 1e9;
+
+    printf("%-12s %10.1f %12.2f %14.1f", name,
+           (double)_G.content.len * _G.opt_rounds / sec / (1 << 20),
+           (double)_G.nb_words * _G.opt_rounds / sec / 1e6,
+           (double)measure->allocs / _G.opt_rounds);
+    if (measure->cache_misses) {
+        printf(" %14.4f\n", (double)measure->cache_misses
+                            / (_G.nb_words * _G.opt_rounds));
+    } else {
+        printf(" %14s\n", "n/a");
+    }
+}
+
+/** Run the counting stage by stage, and show the measures of each stage.
+ *
+ * The stages are the ones of the counting of a content by one thread of
+ * wordcount-server, the map and the token vector are recycled through the
+ * rounds like the map of a connection. The throughputs are relative to the
+ * whole content, so that they can be compared from a stage to another.
+ */
+static int bench_run_stages(void)
+{
+    enum {
+        STAGE_FOLD,
+        STAGE_TOKENIZE,
+        STAGE_INSERT,
+        STAGE_SORT,
+        STAGE_LOWER,
+        STAGE_COUNT,
+    };
+    static const char *stage_names[STAGE_COUNT] = {
+        [STAGE_FOLD] = "fold",
+        [STAGE_TOKENIZE] = "tokenize",
+        [STAGE_INSERT] = "insert",
+        [STAGE_SORT] = "sort",
+        [STAGE_LOWER] = "lower+copy",
+    };
+    bench_measure_t totals[STAGE_COUNT];
+    bench_measure_t all;
+    qv_t(bench_token) tokens;
+    wordcount_map_t map;
+    sb_t folded;
+    int perf_fd = bench_open_cache_misses();
+
+    if (perf_fd < 0) {
+        e_warning("cache misses counter not available: %m");
+    }
+
+    p_clear(totals, countof(totals));
+    qv_init(&tokens);
+    wordcount_map_init(&map);
+    sb_init(&folded);
+
+    for (unsigned round = 0; round < _G.opt_rounds; round++) {
+        t_scope;
+        qv_t(word_occurrences_vec) vec;
+        bench_measure_t measure;
+        lstr_t content = _G.content;
+
+        /* The folded content is recycled like the map, a pure ASCII
+         * content is only checked */
+        if (_G.opt_utf8) {
+            bench_measure_start(perf_fd, &measure);
+            content = wordcount_utf8_fold(_G.content, &folded);
+            bench_measure_stop(perf_fd, &measure);
+            bench_measure_add(&totals[STAGE_FOLD], &measure);
+        }
+
+        bench_measure_start(perf_fd, &measure);
+        bench_stage_tokenize(content, &tokens);
+        bench_measure_stop(perf_fd, &measure);
+        bench_measure_add(&totals[STAGE_TOKENIZE], &measure);
+
+        bench_measure_start(perf_fd, &measure);
+        bench_stage_insert(content, &tokens, &map);
+        bench_measure_stop(perf_fd, &measure);
+        bench_measure_add(&totals[STAGE_INSERT], &measure);
+
+        bench_measure_start(perf_fd, &measure);
+        t_bench_stage_sort(content, &map, &vec);
+        bench_measure_stop(perf_fd, &measure);
+        bench_measure_add(&totals[STAGE_SORT], &measure);
+
+        bench_measure_start(perf_fd, &measure);
+        t_wordcount_lower_words(&vec);
+        bench_measure_stop(perf_fd, &measure);
+        bench_measure_add(&totals[STAGE_LOWER], &measure);
+    }
+
+    bench_print_header();
+    printf("unique words: %u, map index grows: %u\n",
+           wordcount_map_len(&map), map.nb_grows);
+    printf("%-12s %10s %12s %14s %14s\n", "stage", "MB/s", "Mwords/s",
+           "allocs/round", "misses/word");
+    p_clear(&all, 1);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (i == STAGE_FOLD && !_G.opt_utf8) {
+            continue;
+        }
+        bench_print_stage(stage_names[i], &totals[i]);
+        bench_measure_add(&all, &totals[i]);
+    }
+    bench_print_stage("total", &all);
+
+    sb_wipe(&folded);
+    wordcount_map_wipe(&map);
+    qv_wipe(&tokens);
+    p_close(&perf_fd);
+    return 0;
+}
+
+/* Maps */
+
+/** Count the words with the baseline map.
+ *
+ * The map grows from empty, hashes each word on each probe, and is wiped
+ * after the counting, like it is done for each query without recycling.
+ */
+static uint32_t bench_count_qm(lstr_t content)
+{
+    wordcount_token_t tokens[BENCH_TOKENS_BATCH];
+    qm_t(bench_words) map;
+    const char *pos = content.s;
+    const char *end = content.s + content.len;
+    uint32_t nb_words;
+    int nb_tokens;
+
+    qm_init(bench_words, &map);
+    while ((nb_tokens = wordcount_tokenize(&pos, end, tokens,
+                                           countof(tokens))) > 0)
+    {
+        for (int i = 0; i < nb_tokens; i++) {
+            lstr_t word = LSTR_PTR_V(tokens[i].s, tokens[i].len);
+            uint32_t map_pos;
+
+            map_pos = qm_put(bench_words, &map, &word, 1, 0);
+            if (map_pos & QHASH_COLLISION) {
+                map.values[map_pos ^ QHASH_COLLISION] += 1;
+            }
+        }
+    }
+    nb_words = qm_len(bench_words, &map);
+    qm_wipe(bench_words, &map);
+
+    return nb_words;
+}
+
+/** Count the words with the map of words of wordcount-server.
+ *
+ * The map is recycled from a counting to the next one, and sized from the
+ * estimation of the number of unique words of the content.
+ */
+static uint32_t bench_count_map(lstr_t content, wordcount_map_t *map)
+{
+    wordcount_map_reset(map, wordcount_map_estimate_words(content.len));
+    wordcount_split_words(content, NULL, map);
+
+    return wordcount_map_len(map);
+}
+
+static void bench_print_map(const char *name, const bench_measure_t *measure,
+                            uint64_t nb_words)
+{
+    printf("%-12s %10.2f %14.6f", name, (double)measure->nsec / nb_words,
+           (double)measure->allocs / nb_words);
+    if (measure->cache_misses) {
+        printf(" %14.4f\n", (double)measure->cache_misses / nb_words);
+    } else {
+        printf(" %14s\n", "n/a");
+    }
+}
+
+/** Compare the map of words of wordcount-server with a qm_t. */
+static int bench_run_maps(void)
+{
+    bench_measure_t qm_measure;
+    bench_measure_t map_measure;
+    wordcount_map_t map;
+    uint64_t nb_words = _G.nb_words * _G.opt_rounds;
+    uint32_t nb_unique_qm = 0;
+    uint32_t nb_unique_map = 0;
+    int perf_fd = bench_open_cache_misses();
+
+    if (perf_fd < 0) {
+        e_warning("cache misses counter not available: %m");
+    }
+
+    /* Baseline */
+    bench_measure_start(perf_fd, &qm_measure);
+    for (unsigned i = 0; i < _G.opt_rounds; i++) {
+        nb_unique_qm = bench_count_qm(_G.content);
+    }
+    bench_measure_stop(perf_fd, &qm_measure);
+
+    /* Map of words, recycled through the rounds like the map of a
+     * connection */
+    wordcount_map_init(&map);
+    bench_measure_start(perf_fd, &map_measure);
+    for (unsigned i = 0; i < _G.opt_rounds; i++) {
+        nb_unique_map = bench_count_map(_G.content, &map);
+    }
+    bench_measure_stop(perf_fd, &map_measure);
+
+    if (nb_unique_qm != nb_unique_map) {
+        e_error("maps disagree: %u unique words with qm_t, %u with "
+                "wordcount_map_t", nb_unique_qm, nb_unique_map);
+        wordcount_map_wipe(&map);
+        p_close(&perf_fd);
+        return -1;
+    }
+
+    bench_print_header();
+    printf("unique words: %u\n", nb_unique_map);
+    printf("%-12s %10s %14s %14s\n", "map", "ns/word", "allocs/word",
+           "misses/word");
+    bench_print_map("qm_t", &qm_measure, nb_words);
+    bench_print_map("wordcount", &map_measure, nb_words);
+    printf("wordcount_map_t index grows: %u\n", map.nb_grows);
+
+    wordcount_map_wipe(&map);
+    p_close(&perf_fd);
+    return 0;
+}
+
+/* Checks */
+
+/** Check that the words found by a tokenizer are the expected ones.
+ *
+ * \param[in] name     The name of the checked tokenizer.
+ * \param[in] expected The words found by the scalar tokenizer.
+ * \param[in] actual   The words found by the checked tokenizer.
+ * \return -1 if the words differ, 0 otherwise.
+ */
+static int bench_check_tokens(const char *name,
+                              const qv_t(bench_token) *expected,
+                              const qv_t(bench_token) *actual)
+{
+    if (actual->len != expected->len) {
+        e_error("%s: %d words instead of %d", name, actual->len,
+                expected->len);
+        return -1;
+    }
+    for (int i = 0; i < expected->len; i++) {
+        const wordcount_token_t *e = &expected->tab[i];
+        const wordcount_token_t *a = &actual->tab[i];
+
+        if (a->s != e->s || a->len != e->len || a->hash != e->hash) {
+            e_error("%s: word %d is `%*pM` instead of `%*pM`", name, i,
+                    (int)a->len, a->s, (int)e->len, e->s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Check that a counting path gives the expected word occurrences.
+ *
+ * \param[in] name     The name of the checked counting path.
+ * \param[in] expected The word occurrences counted with the scalar
+ *                     tokenizer, by one thread.
+ * \param[in] actual   The word occurrences of the checked path.
+ * \return -1 if the word occurrences differ, 0 otherwise.
+ */
+static int bench_check_result(const char *name,
+                              const qv_t(word_occurrences_vec) *expected,
+                              const qv_t(word_occurrences_vec) *actual)
+{
+    if (actual->len != expected->len) {
+        e_error("%s: %d words instead of %d", name, actual->len,
+                expected->len);
+        return -1;
+    }
+    for (int i = 0; i < expected->len; i++) {
+        const wordcount__word_occurrences__t *e = &expected->tab[i];
+        const wordcount__word_occurrences__t *a = &actual->tab[i];
+
+        if (!lstr_equal(a->word, e->word)
+        ||  a->occurrences != e->occurrences)
+        {
+            e_error("%s: word %d is `%pL` (%u) instead of `%pL` (%u)", name,
+                    i, &a->word, a->occurrences, &e->word, e->occurrences);
+            return -1;
+        }
+    }
+    printf("%-28s ok, %d words\n", name, actual->len);
+    return 0;
+}
+
+/** Tokenize a content, at most max_tokens words at a time. */
+static void bench_check_tokenize(lstr_t content, bool utf8, int max_tokens,
+                                 qv_t(bench_token) *tokens)
+{
+    wordcount_tokenize_f *tokenize = utf8 ? &wordcount_tokenize_utf8
+                                          : &wordcount_tokenize;
+    const char *pos = content.s;
+    const char *end = content.s + content.len;
+    int nb_tokens;
+
+    qv_clear(tokens);
+    do {
+        qv_grow(tokens, max_tokens);
+        nb_tokens = (*tokenize)(&pos, end, tokens->tab + tokens->len,
+                                max_tokens);
+        tokens->len += nb_tokens;
+    } while (nb_tokens > 0);
+}
+
+/** Check the tokenizers supported by the CPU against the scalar one.
+ *
+ * The content is tokenized with all the words at once, and with a few of
+ * them, so that the tokenizers return early when their words are full.
+ *
+ * \param[in] content The content, folded for the UTF-8 tokenizing.
+ * \param[in] utf8    Whether the content is tokenized in UTF-8.
+ * \param[in] verbose Whether to print the checked tokenizers.
+ * \return -1 if a tokenizer finds other words, 0 otherwise.
+ */
+static int bench_check_tokenizers(lstr_t content, bool utf8, bool verbose)
+{
+    static const int batches[] = { 1, 3, 64, BENCH_TOKENS_BATCH };
+    qv_t(bench_token) expected;
+    qv_t(bench_token) actual;
+    int res = 0;
+
+    qv_init(&expected);
+    qv_init(&actual);
+    wordcount_tokenize_set_impl(WORDCOUNT_TOKENIZE_SCALAR);
+    bench_check_tokenize(content, utf8, BENCH_TOKENS_BATCH, &expected);
+
+    for (int impl = WORDCOUNT_TOKENIZE_SCALAR;
+         impl <= WORDCOUNT_TOKENIZE_AVX2 && res >= 0; impl++)
+    {
+        if (wordcount_tokenize_set_impl(impl) < 0) {
+            continue;
+        }
+        for (int i = 0; i < countof(batches) && res >= 0; i++) {
+            t_scope;
+            const char *name;
+
+            name = t_fmt("tokenize %s, %d words",
+                         wordcount_tokenize_impl_name(), batches[i]);
+            bench_check_tokenize(content, utf8, batches[i], &actual);
+            res = bench_check_tokens(name, &expected, &actual);
+            if (res >= 0 && verbose) {
+                printf("%-28s ok, %d words\n", name, actual.len);
+            }
+        }
+    }
+
+    qv_wipe(&expected);
+    qv_wipe(&actual);
+    return res;
+}
+
+/** Check the tokenizers on words around the 64-byte blocks they classify at
+ * once.
+ *
+ * The words are from 1 to 130 bytes long, start at each position of a
+ * block, and end the content or are followed by another word.
+ *
+ * \param[in] utf8 Whether the words are tokenized in UTF-8, they have a
+ *                 non-ASCII letter then.
+ * \return -1 if a tokenizer finds other words, 0 otherwise.
+ */
+static int bench_check_blocks(bool utf8)
+{
+    lstr_t letters = utf8 ? LSTR("aB3\xc3\xa9") : LSTR("aB3_");
+    SB_1k(content);
+    int res = 0;
+
+    for (int len = 1; len <= 130 && res >= 0; len++) {
+        for (int start = 0; start < 64 && res >= 0; start++) {
+            for (int tail = 0; tail < 2 && res >= 0; tail++) {
+                sb_reset(&content);
+                for (int i = 0; i < start; i++) {
+                    sb_addc(&content, '.');
+                }
+                for (int i = 0; i < len; i++) {
+                    sb_addc(&content, letters.s[i % letters.len]);
+                }
+                if (tail) {
+                    sb_adds(&content, " tail.");
+                }
+                res = bench_check_tokenizers(LSTR_SB_V(&content), utf8,
+                                             false);
+            }
+        }
+    }
+    if (res >= 0) {
+        printf("%-28s ok\n", "tokenize 64-byte blocks");
+    }
+
+    sb_wipe(&content);
+    return res;
+}
+
+/** Count a content with a word counter, fed with chunks of varying sizes so
+ * that words straddle two chunks.
+ *
+ * \param[in]  content              The content, folded for the UTF-8
+ *                                  tokenizing.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The sorted word occurrences, allocated on
+ *                                  the t_scope.
+ */
+static void
+t_bench_check_counter(lstr_t content, const wordcount_params_t *params,
+                      qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    static const int chunk_sizes[] = { 1, 2, 63, 64, 65, 127, 4093, 65537 };
+    wordcount_counter_t counter;
+
+    wordcount_counter_init(&counter);
+    counter.utf8 = params->utf8;
+    for (int pos = 0, i = 0; pos < content.len; i++) {
+        int len = MIN(chunk_sizes[i % countof(chunk_sizes)],
+                      content.len - pos);
+
+        wordcount_counter_feed(&counter, LSTR_PTR_V(content.s + pos, len));
+        pos += len;
+    }
+    wordcount_counter_flush(&counter);
+
+    /* The words are copied on the t_stack by the sort */
+    t_wordcount_counter_sort_word_occurrences(&counter, params,
+                                              word_occurrences_vec);
+    wordcount_counter_wipe(&counter);
+}
+
+/* Number of parts of the content merged by the merge checks */
+#define BENCH_CHECK_PARTS  7
+
+/** Check the merges of the results of parts of a content.
+ *
+ * The content is split at word boundaries, its parts are counted without
+ * limit, and their results are merged with the k-way merge of the
+ * coordinator, and as the partials of a mergeOccurrences query.
+ *
+ * \param[in] content  The content.
+ * \param[in] params   The parameters of the counting of the content.
+ * \param[in] expected The word occurrences of the content.
+ * \return -1 if a merge gives other word occurrences, 0 otherwise.
+ */
+static int bench_check_merges(lstr_t content, const wordcount_params_t *params,
+                              const qv_t(word_occurrences_vec) *expected)
+{
+    t_scope;
+    wordcount_params_t part_params = {
+        .nb_threads = 1,
+        .utf8 = params->utf8,
+    };
+    wordcount_result_t results[BENCH_CHECK_PARTS];
+    const wordcount_result_t *results_ptrs[BENCH_CHECK_PARTS];
+    lstr_t parts[BENCH_CHECK_PARTS];
+    qv_t(word_occurrences_vec) partials;
+    qv_t(word_occurrences_vec) actual;
+    int res;
+
+    t_qv_init(&partials, 0);
+    wordcount_split_content(content, BENCH_CHECK_PARTS, params->utf8,
+                            parts);
+    for (int i = 0; i < BENCH_CHECK_PARTS; i++) {
+        qv_t(word_occurrences_vec) part_vec;
+
+        t_wordcount_split_and_sort_word_occurrences(parts[i], &part_params,
+                                                    &part_vec);
+        wordcount_result_init(&results[i]);
+        wordcount_result_set(&results[i], &part_vec);
+        results_ptrs[i] = &results[i];
+        qv_extend(&partials, part_vec.tab, part_vec.len);
+    }
+
+    t_wordcount_merge_results(results_ptrs, BENCH_CHECK_PARTS, params,
+                              &actual);
+    res = bench_check_result(t_fmt("merge %d results %s", BENCH_CHECK_PARTS,
+                                   wordcount_tokenize_impl_name()),
+                             expected, &actual);
+    if (res >= 0) {
+        t_wordcount_merge_word_occurrences(partials.tab, partials.len,
+                                           params, &actual);
+        res = bench_check_result(t_fmt("merge partials %s",
+                                       wordcount_tokenize_impl_name()),
+                                 expected, &actual);
+    }
+
+    for (int i = 0; i < BENCH_CHECK_PARTS; i++) {
+        wordcount_result_wipe(&results[i]);
+    }
+    return res;
+}
+
+/** Check the counting paths of a content against the scalar tokenizer, by
+ * one thread.
+ *
+ * With each tokenizer supported by the CPU, the content is counted by one
+ * thread, in parallel by the thread pool, chunk by chunk like the
+ * streaming sessions, and in parts whose results are merged.
+ *
+ * \param[in] content The content.
+ * \param[in] utf8    Whether the content is tokenized in UTF-8, after its
+ *                    folding.
+ * \return -1 if a counting path gives other word occurrences, 0 otherwise.
+ */
+static int bench_check_content(lstr_t content, bool utf8)
+{
+    t_scope;
+    wordcount_params_t params = {
+        .nb_threads = 1,
+        .limit = _G.opt_limit,
+        .utf8 = utf8,
+    };
+    qv_t(word_occurrences_vec) expected;
+    SB_1k(buf);
+    lstr_t folded = utf8 ? wordcount_utf8_fold(content, &buf) : content;
+    int res;
+
+    printf("%s tokenizing:\n", utf8 ? "UTF-8" : "ASCII");
+
+    wordcount_tokenize_set_impl(WORDCOUNT_TOKENIZE_SCALAR);
+    t_wordcount_split_and_sort_word_occurrences(content, &params, &expected);
+
+    res = bench_check_tokenizers(folded, utf8, true);
+    if (res >= 0) {
+        res = bench_check_blocks(utf8);
+    }
+
+    for (int impl = WORDCOUNT_TOKENIZE_SCALAR;
+         impl <= WORDCOUNT_TOKENIZE_AVX2 && res >= 0; impl++)
+    {
+        t_scope;
+        wordcount_params_t parallel_params = params;
+        qv_t(word_occurrences_vec) actual;
+        const char *name;
+
+        if (wordcount_tokenize_set_impl(impl) < 0) {
+            printf("%-28s skipped, not supported by the CPU\n",
+                   t_fmt("tokenizer %s", impl == WORDCOUNT_TOKENIZE_SSE42
+                                         ? "sse4.2" : "avx2"));
+            continue;
+        }
+        name = wordcount_tokenize_impl_name();
+
+        t_wordcount_split_and_sort_word_occurrences(content, &params,
+                                                    &actual);
+        res = bench_check_result(t_fmt("count %s", name), &expected,
+                                 &actual);
+        if (res < 0) {
+            break;
+        }
+
+        /* The content is counted by one thread if it is too small to be
+         * split in slices */
+        parallel_params.nb_threads = 0;
+        t_wordcount_split_and_sort_word_occurrences(content,
+                                                    &parallel_params,
+                                                    &actual);
+        res = bench_check_result(t_fmt("count parallel %s", name),
+                                 &expected, &actual);
+        if (res < 0) {
+            break;
+        }
+
+        t_bench_check_counter(folded, &params, &actual);
+        res = bench_check_result(t_fmt("count chunks %s", name), &expected,
+                                 &actual);
+        if (res < 0) {
+            break;
+        }
+
+        res = bench_check_merges(content, &params, &expected);
+    }
+
+    sb_wipe(&buf);
+    return res;
+}
+
+/** Check the counting paths of the content, with and without the UTF-8
+ * tokenizing. */
+static int bench_run_check(void)
+{
+    bench_print_header();
+    if (bench_check_content(_G.content, false) < 0
+    ||  bench_check_content(_G.content, true) < 0)
+    {
+        return -1;
+    }
+    printf("all the counting paths agree\n");
+    return 0;
+}
+
+/* End-to-end */
+
+/** Exit the end-to-end mode.
+ *
+ * The signal is sent to this process only, so that a server started from
+ * the same shell, in the same process group, is not stopped too.
+ */
+static void bench_e2e_exit(int res)
+{
+    if (el_is_terminating()) {
+        return;
+    }
+    _G.exit_res = res;
+    kill(getpid(), SIGQUIT);
+}
+
+/** Print the results of the end-to-end mode.
+ *
+ * With -R, they are printed as a row of the AsciiDoc table of the README,
+ * so that the table of several runs is built by concatenating them.
+ */
+static void bench_e2e_print(void)
+{
+    int64_t nsec = MAX(bench_now_nsec() - _G.start_nsec, 1);
+    unsigned nb_done = _G.nb_received - _G.nb_failed;
+    double sec = nsec / 1e9;
+    double mb_per_sec = (double)_G.content.len * nb_done / sec / (1 << 20);
+    double avg_msec = _G.total_latency_nsec / 1e6 / MAX(_G.nb_received, 1U);
+    double max_msec = _G.max_latency_nsec / 1e6;
+
+    if (_G.opt_row) {
+        printf("| %s | %d | %u | %.1f | %.1f | %.3f | %.3f\n",
+               _G.transport, _G.content.len, _G.opt_in_flight, mb_per_sec,
+               _G.nb_received / sec, avg_msec, max_msec);
+        return;
+    }
+
+    bench_print_header();
+    printf("transport: %s, queries: %u, failed: %u, in flight: %u\n",
+           _G.transport, _G.nb_received, _G.nb_failed, _G.opt_in_flight);
+    printf("total: %.3f s, %.1f MB/s, %.2f Mwords/s, %.1f queries/s\n", sec,
+           mb_per_sec, (double)_G.nb_words * nb_done / sec / 1e6,
+           _G.nb_received / sec);
+    printf("latency: %.3f ms average, %.3f ms max\n", avg_msec, max_msec);
+}
+
+/** Send the next queries, up to the maximum number of queries in flight.
+ *
+ * The time the query is sent at is stored in the message.
+ */
+static void bench_e2e_send_queries(void)
+{
+    while (_G.nb_sent < _G.opt_rounds
+    &&     _G.nb_sent - _G.nb_received < _G.opt_in_flight)
+    {
+        ic_msg_t *msg = ic_msg_new(sizeof(int64_t));
+
+        *(int64_t *)msg->priv = bench_now_nsec();
+        ic_query2(&_G.ic, msg, wordcount__mod, wordcount_iface,
+                  count_occurrences,
+                  .file_content = _G.content,
+                  .limit = _G.opt_limit,
+                  .utf8 = _G.opt_utf8);
+        _G.nb_sent++;
+    }
+}
+
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, count_occurrences)
+{
+    int64_t latency = bench_now_nsec() - *(const int64_t *)msg->priv;
+
+    _G.nb_received++;
+    _G.total_latency_nsec += latency;
+    _G.max_latency_nsec = MAX(_G.max_latency_nsec, latency);
+    if (status != IC_MSG_OK) {
+        e_error("query failed: %s", ic_status_to_string(status));
+        _G.nb_failed++;
+    }
+
+    if (_G.nb_received == _G.opt_rounds) {
+        bench_e2e_print();
+        bench_e2e_exit(_G.nb_failed ? -1 : 0);
+        return;
+    }
+    bench_e2e_send_queries();
+}
+
+/** Called on server status changes. */
+static void bench_e2e_on_event(ichannel_t *ic, ic_event_t evt)
+{
+    if (evt == IC_EVT_CONNECTED) {
+        e_notice("connected to server");
+        if (!_G.nb_sent) {
+            _G.start_nsec = bench_now_nsec();
+            bench_e2e_send_queries();
+        }
+    } else if (evt == IC_EVT_DISCONNECTED && !el_is_terminating()) {
+        e_warning("disconnected from server");
+        bench_e2e_exit(-1);
+    }
+}
+
+/** Initialization callback called when the module is required.
+ *
+ * Connect to the server, the queries are sent as soon as the connection is
+ * established.
+ */
+static int wordcount_bench_e2e_initialize(void *nullable arg)
+{
+    t_scope;
+    SB_1k(err);
+    wordcount__server_cfg__t *server_cfg;
+    sockunion_t su;
+
+    server_cfg = t_wordcount_unpack_server_cfg(_G.opt_cfg_path, &err);
+    if (!server_cfg) {
+        e_error("unable to unpack the server cfg `%s`: %pL",
+                _G.opt_cfg_path, &err);
+        return -1;
+    }
+
+    if (wordcount_server_sockunion(server_cfg, _G.opt_tcp, &su) < 0) {
+        return -1;
+    }
+    _G.transport = su.family == AF_UNIX ? "unix" : "tcp";
+
+    ic_init(&_G.ic);
+    _G.ic.on_event = &bench_e2e_on_event;
+    _G.ic.su = su;
+    if (ic_connect(&_G.ic) < 0) {
+        e_error("cannot connect to the server");
+        return -1;
+    }
+
+    return 0;
+}
+
+/** Called on termination signals. */
+static void wordcount_bench_e2e_on_term(int signo)
+{
+    ic_bye(&_G.ic);
+}
+
+static int wordcount_bench_e2e_shutdown(void)
+{
+    ic_wipe(&_G.ic);
+    return 0;
+}
+
+/** Module to query a running wordcount-server. */
+static MODULE_BEGIN(wordcount_bench_e2e)
+    MODULE_DEPENDS_ON(wordcount_base);
+    MODULE_IMPLEMENTS_INT(on_term, wordcount_bench_e2e_on_term);
+MODULE_END()
+
+/** Send the content to a running wordcount-server for each round. */
+static int bench_run_e2e(void)
+{
+    if (MODULE_REQUIRE(wordcount_bench_e2e) < 0) {
+        return -1;
+    }
+
+    /* Block until all the queries are answered, or until the server is
+     * disconnected */
+    el_loop();
+    MODULE_RELEASE(wordcount_bench_e2e);
+
+    return _G.exit_res;
+}
+
+int main(int argc, char **argv)
+{
+    const char *arg0 = NEXTARG(argc, argv);
+    SB_1k(generated);
+    int res;
+
+    /* Parse the arguments */
+    argc = parseopt(argc, argv, opts_g, 0);
+    if (argc > 1 || _G.opt_help || !_G.opt_rounds || !_G.opt_in_flight) {
+        makeusage(_G.opt_help ? 0 : -1, arg0, short_args_g,
+                  long_usage_g, opts_g);
+    }
+    if (!strequal(_G.opt_mode, "stages") && !strequal(_G.opt_mode, "maps")
+    &&  !strequal(_G.opt_mode, "e2e") && !strequal(_G.opt_mode, "check"))
+    {
+        makeusage(-1, arg0, short_args_g, long_usage_g, opts_g);
+    }
+    if (strequal(_G.opt_mode, "e2e") && !_G.opt_cfg_path) {
+        e_error("the e2e mode needs the configuration of the server");
+        makeusage(-1, arg0, short_args_g, long_usage_g, opts_g);
+    }
+    if (strequal(_G.opt_mode, "maps") && _G.opt_utf8) {
+        e_error("the maps mode does not support the UTF-8 tokenizing");
+        makeusage(-1, arg0, short_args_g, long_usage_g, opts_g);
+    }
+    if (strequal(_G.opt_mode, "check") && _G.opt_utf8) {
+        e_error("the check mode always checks the UTF-8 tokenizing");
+        makeusage(-1, arg0, short_args_g, long_usage_g, opts_g);
+    }
+    _G.tokenize = _G.opt_utf8 ? &wordcount_tokenize_utf8
+                              : &wordcount_tokenize;
+
+    MODULE_REQUIRE(wordcount_count);
+
+    /* Get the content from the file, or generate it */
+    if (argc == 1) {
+        const char *file_path = NEXTARG(argc, argv);
+
+        if (lstr_init_from_file(&_G.content, file_path, PROT_READ,
+                                MAP_PRIVATE) < 0)
+        {
+            e_error("unable to get the content of the file `%s`: %m",
+                    file_path);
+            MODULE_RELEASE(wordcount_count);
+            return -1;
+        }
+    } else {
+        if (bench_generate_corpus(_G.opt_corpus, &generated) < 0) {
+            sb_wipe(&generated);
+            MODULE_RELEASE(wordcount_count);
+            return -1;
+        }
+        _G.content = LSTR_SB_V(&generated);
+    }
+
+    if (_G.opt_utf8) {
+        SB_1k(folded);
+
+        /* The words are the ones of the folded content */
+        _G.nb_words = bench_count_tokens(wordcount_utf8_fold(_G.content,
+                                                             &folded));
+        sb_wipe(&folded);
+    } else {
+        _G.nb_words = bench_count_tokens(_G.content);
+    }
+    if (!_G.nb_words) {
+        e_error("no word in the content");
+        res = -1;
+    } else
+    if (strequal(_G.opt_mode, "stages")) {
+        res = bench_run_stages();
+    } else
+    if (strequal(_G.opt_mode, "maps")) {
+        res = bench_run_maps();
+    } else
+    if (strequal(_G.opt_mode, "check")) {
+        res = bench_run_check();
+    } else {
+        res = bench_run_e2e();
+    }
+
+    lstr_wipe(&_G.content);
+    sb_wipe(&generated);
+    MODULE_RELEASE(wordcount_count);
+
+    return res < 0 ? -1 : 0;
+}
@@ -0,0 +1,276 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <lib-common/hash.h>
+
+#include "wordcount-cache.h"
+
+/* Seed of the hash of the file contents */
+#define WORDCOUNT_CACHE_SEED  0x776f7264
+
+static wordcount_cache_entry_t *
+wordcount_cache_entry_init(wordcount_cache_entry_t *entry)
+{
+    p_clear(entry, 1);
+    wordcount_result_init(&entry->result);
+    dlist_init(&entry->lru_list);
+    return entry;
+}
+
+static void wordcount_cache_entry_wipe(wordcount_cache_entry_t *entry)
+{
+    lstr_wipe(&entry->content);
+    wordcount_result_wipe(&entry->result);
+    dlist_remove(&entry->lru_list);
+}
+
+GENERIC_NEW(wordcount_cache_entry_t, wordcount_cache_entry);
+GENERIC_DELETE(wordcount_cache_entry_t, wordcount_cache_entry);
+
+wordcount_cache_t *wordcount_cache_init(wordcount_cache_t *cache,
+                                        size_t max_size, bool verify_content)
+{
+    p_clear(cache, 1);
+    pthread_mutex_init(&cache->lock, NULL);
+    qm_init(wordcount_cache_entries, &cache->entries);
+    dlist_init(&cache->lru);
+    cache->max_size = max_size;
+    cache->verify_content = verify_content;
+    return cache;
+}
+
+void wordcount_cache_wipe(wordcount_cache_t *cache)
+{
+    qm_deep_wipe(wordcount_cache_entries, &cache->entries, IGNORE,
+                 wordcount_cache_entry_delete);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void wordcount_cache_get_stats(wordcount_cache_t *cache,
+                               wordcount_cache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void wordcount_cache_key_init(wordcount_cache_key_t *key,
+                              wordcount__codec__t codec, lstr_t file_content,
+                              const wordcount_params_t *params)
+{
+    p_clear(key, 1);
+    murmur_hash3_x64_128(file_content.s, file_content.len,
+                         WORDCOUNT_CACHE_SEED, key->hash);
+    key->len = file_content.len;
+    key->codec = codec;
+    key->limit = params->limit;
+    key->min_occurrences = params->min_occurrences;
+    key->sketch_size = params->sketch_size;
+    key->ngram = MAX(params->ngram, 1U);
+    key->utf8 = params->utf8;
+    key->filter = params->filter;
+}
+
+/** Get the index of a key in the map of the entries of a cache.
+ *
+ * The options are mixed in the first half of the hash, the whole key is
+ * compared on lookup.
+ */
+static uint64_t wordcount_cache_key_index(const wordcount_cache_key_t *key)
+{
+    uint64_t options = ((uint64_t)key->limit << 32) | key->min_occurrences;
+
+    return key->hash[0] ^ (options * 0x9e3779b97f4a7c15ULL) ^ key->codec
+         ^ key->sketch_size ^ ((uint64_t)key->ngram << 56)
+         ^ ((uint64_t)key->utf8 << 63)
+         ^ ((uintptr_t)key->filter * 0xff51afd7ed558ccdULL);
+}
+
+static bool wordcount_cache_key_equal(const wordcount_cache_key_t *a,
+                                      const wordcount_cache_key_t *b)
+{
+    return a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1]
+        && a->len == b->len && a->codec == b->codec && a->limit == b->limit
+        && a->min_occurrences == b->min_occurrences
+        && a->sketch_size == b->sketch_size && a->ngram == b->ngram
+        && a->utf8 == b->utf8 && a->filter == b->filter;
+}
+
+/** Remove an entry from a cache, with the lock held.
+ *
+ * \param[in]     cache    The cache.
+ * \param[in]     entry    The entry.
+ * \param[in,out] released The list the entry is added to if it has no other
+ *                         reference, to be deleted once the lock is
+ *                         released.
+ */
+static void wordcount_cache_remove(wordcount_cache_t *cache,
+                                   wordcount_cache_entry_t *entry,
+                                   dlist_t *released)
+{
+    qm_del_key(wordcount_cache_entries, &cache->entries,
+               wordcount_cache_key_index(&entry->key));
+    cache->size -= entry->size;
+    dlist_remove(&entry->lru_list);
+    if (--entry->refcnt == 0) {
+        dlist_add_tail(released, &entry->lru_list);
+    }
+}
+
+/** Delete the entries removed from a cache, with the lock released. */
+static void wordcount_cache_delete_released(dlist_t *released)
+{
+    while (!dlist_is_empty(released)) {
+        wordcount_cache_entry_t *entry;
+
+        entry = dlist_first_entry(released, wordcount_cache_entry_t,
+                                  lru_list);
+        wordcount_cache_entry_delete(&entry);
+    }
+}
+
+const wordcount_cache_entry_t * nullable
+wordcount_cache_get(wordcount_cache_t *cache, const wordcount_cache_key_t *key,
+                    lstr_t file_content)
+{
+    wordcount_cache_entry_t *entry;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = qm_get_def(wordcount_cache_entries, &cache->entries,
+                       wordcount_cache_key_index(key), NULL);
+    if (!entry) {
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    if (!wordcount_cache_key_equal(&entry->key, key)) {
+        /* Same index for another content, or another set of options */
+        cache->stats.collisions++;
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    entry->refcnt++;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* The contents are compared out of the lock, the entry is kept by its
+     * reference even if it is evicted meanwhile */
+    if (cache->verify_content && !lstr_equal(entry->content, file_content)) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stats.collisions++;
+        cache->stats.misses++;
+        pthread_mutex_unlock(&cache->lock);
+        wordcount_cache_release(cache,
+                                (const wordcount_cache_entry_t **)&entry);
+        return NULL;
+    }
+
+    /* Move the entry to the head of the LRU list, if it is still in the
+     * cache */
+    pthread_mutex_lock(&cache->lock);
+    if (!dlist_is_empty(&entry->lru_list)) {
+        dlist_move(&cache->lru, &entry->lru_list);
+    }
+    cache->stats.hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+void wordcount_cache_release(wordcount_cache_t *cache,
+                             const wordcount_cache_entry_t * nullable *entry)
+{
+    wordcount_cache_entry_t *e = (wordcount_cache_entry_t *)*entry;
+    bool last;
+
+    if (!e) {
+        return;
+    }
+    *entry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    last = --e->refcnt == 0;
+    pthread_mutex_unlock(&cache->lock);
+    if (last) {
+        wordcount_cache_entry_delete(&e);
+    }
+}
+
+void wordcount_cache_put(
+    wordcount_cache_t *cache, const wordcount_cache_key_t *key,
+    lstr_t *file_content, bool take_content,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_cache_entry_t *entry;
+    wordcount_cache_entry_t *old_entry;
+    uint64_t index = wordcount_cache_key_index(key);
+    DLIST(released);
+
+    if (!wordcount_cache_is_enabled(cache)) {
+        return;
+    }
+
+    /* Pack the result, and compute the memory used by the entry, before
+     * taking the lock */
+    entry = wordcount_cache_entry_new();
+    entry->key = *key;
+    entry->refcnt = 1;
+    wordcount_result_set(&entry->result, word_occurrences_vec);
+    entry->size = sizeof(*entry) + entry->result.words.len
+                + entry->result.entries.len * sizeof(wordcount_entry_t);
+    if (cache->verify_content) {
+        entry->size += file_content->len;
+    }
+    if (entry->size > cache->max_size) {
+        /* It would evict everything else, do not keep it */
+        wordcount_cache_entry_delete(&entry);
+        return;
+    }
+    if (cache->verify_content && take_content) {
+        entry->content = *file_content;
+        *file_content = LSTR_NULL_V;
+    } else
+    if (cache->verify_content) {
+        entry->content = lstr_dup(*file_content);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* Replace the entry with the same index, if any */
+    old_entry = qm_get_def(wordcount_cache_entries, &cache->entries, index,
+                           NULL);
+    if (old_entry) {
+        wordcount_cache_remove(cache, old_entry, &released);
+    }
+
+    /* Evict the least recently used entries to make room */
+    while (cache->size + entry->size > cache->max_size) {
+        wordcount_cache_entry_t *lru_entry;
+
+        lru_entry = dlist_last_entry(&cache->lru, wordcount_cache_entry_t,
+                                     lru_list);
+        wordcount_cache_remove(cache, lru_entry, &released);
+        cache->stats.evictions++;
+    }
+
+    qm_add(wordcount_cache_entries, &cache->entries, index, entry);
+    dlist_add(&cache->lru, &entry->lru_list);
+    cache->size += entry->size;
+
+    pthread_mutex_unlock(&cache->lock);
+    wordcount_cache_delete_released(&released);
+}
@@ -0,0 +1,202 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_CACHE_H
+#define IS_WORDCOUNT_CACHE_H
+
+#include <pthread.h>
+
+#include <lib-common/core.h>
+#include <lib-common/container-qhash.h>
+
+#include "wordcount-count.h"
+
+/** Key of a cached result: the hash of a file content and the options of
+ * the counting. */
+typedef struct wordcount_cache_key_t {
+    /** The 128-bit hash of the file content. */
+    uint64_t hash[2];
+
+    /** The length of the file content. */
+    uint64_t len;
+
+    /** The codec of the file content, the same bytes are another content
+     * once decompressed. */
+    wordcount__codec__t codec;
+
+    /** The options of the counting that change the result. */
+    unsigned limit;
+    unsigned min_occurrences;
+    size_t sketch_size;
+    unsigned ngram;
+    bool utf8;
+
+    /** The filter of the words, the filters are compiled once for the
+     * lifetime of the server so they are compared by address. */
+    const wordcount_filter_t * nullable filter;
+} wordcount_cache_key_t;
+
+/** Cached result of the counting of a file content. */
+typedef struct wordcount_cache_entry_t {
+    wordcount_cache_key_t key;
+
+    /** Copy of the file content to verify the hits, LSTR_NULL_V when the
+     * content is not verified. */
+    lstr_t content;
+
+    /** The sorted word occurrences. */
+    wordcount_result_t result;
+
+    /** The memory used by the entry, accounted in the size of the cache. */
+    size_t size;
+
+    /** The references to the entry: one while it is in the cache, and one
+     * per result got by wordcount_cache_get() and not released yet. The
+     * entry is released with its last reference. */
+    int refcnt;
+
+    /** Node in the LRU list of the cache. */
+    dlist_t lru_list;
+} wordcount_cache_entry_t;
+
+/* Create the map type index => entry of the cache. */
+qm_k64_t(wordcount_cache_entries, wordcount_cache_entry_t *);
+
+/** Counters of a cache. */
+typedef struct wordcount_cache_stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+
+    /** The lookups that found an entry with the same hash for another
+     * content, they are counted as misses too. */
+    uint64_t collisions;
+} wordcount_cache_stats_t;
+
+/** LRU cache of the results of the counting of file contents.
+ *
+ * The results are addressed by the hash of the file content and the options
+ * of the counting, and stored packed. The size of the cache includes the
+ * copies of the contents used to verify the hits, so that a result is never
+ * returned for another content with the same hash.
+ *
+ * The cache is shared by the event loop thread and the threads of the pool.
+ * Its lock is only held to look up, link and unlink the entries: the keys
+ * are computed, the hits verified and the results packed out of it.
+ */
+typedef struct wordcount_cache_t {
+    pthread_mutex_t lock;
+
+    /** The entries by index, see wordcount_cache_key_index(). */
+    qm_t(wordcount_cache_entries) entries;
+
+    /** The entries, from the most to the least recently used. */
+    dlist_t lru;
+
+    /** The memory used by the entries, and its maximum. */
+    size_t size;
+    size_t max_size;
+
+    /** Whether the contents are copied in the cache to verify the hits. */
+    bool verify_content;
+
+    wordcount_cache_stats_t stats;
+} wordcount_cache_t;
+
+/** Initialize a cache.
+ *
+ * \param[in] cache          The cache.
+ * \param[in] max_size       The maximum memory used by the entries, 0 to
+ *                           disable the cache.
+ * \param[in] verify_content Whether the contents are copied in the cache to
+ *                           verify the hits. Otherwise, the hits only rely on
+ *                           the 128-bit hash and the length of the content.
+ */
+wordcount_cache_t *wordcount_cache_init(wordcount_cache_t *cache,
+                                        size_t max_size, bool verify_content);
+void wordcount_cache_wipe(wordcount_cache_t *cache);
+
+/** Get whether a cache is enabled. */
+static inline bool wordcount_cache_is_enabled(const wordcount_cache_t *cache)
+{
+    return cache->max_size > 0;
+}
+
+/** Compute the key of the result of the counting of a file content.
+ *
+ * \param[out] key          The key.
+ * \param[in]  codec        The codec of the file content.
+ * \param[in]  file_content The file content, compressed with \p codec.
+ * \param[in]  params       The parameters of the counting.
+ */
+void wordcount_cache_key_init(wordcount_cache_key_t *key,
+                              wordcount__codec__t codec, lstr_t file_content,
+                              const wordcount_params_t *params);
+
+/** Get the counters of a cache.
+ *
+ * \param[in]  cache The cache.
+ * \param[out] stats The counters of the cache.
+ */
+void wordcount_cache_get_stats(wordcount_cache_t *cache,
+                               wordcount_cache_stats_t *stats);
+
+/** Look for the result of the counting of a file content.
+ *
+ * \param[in] cache        The cache.
+ * \param[in] key          The key of the file content and the options.
+ * \param[in] file_content The file content, compared to the cached one.
+ * \return The cached entry, with its result, or NULL. It is kept even if it
+ *         is evicted meanwhile, until it is released with
+ *         wordcount_cache_release().
+ */
+const wordcount_cache_entry_t * nullable
+wordcount_cache_get(wordcount_cache_t *cache, const wordcount_cache_key_t *key,
+                    lstr_t file_content);
+
+/** Release an entry got by wordcount_cache_get().
+ *
+ * \param[in]     cache The cache.
+ * \param[in,out] entry The entry, reset to NULL.
+ */
+void wordcount_cache_release(wordcount_cache_t *cache,
+                             const wordcount_cache_entry_t * nullable *entry);
+
+/** Put the result of the counting of a file content in the cache.
+ *
+ * The least recently used entries are evicted to keep the cache in its
+ * maximum size. A result too big for the cache is not put.
+ *
+ * \param[in]     cache                The cache.
+ * \param[in]     key                  The key of the file content and the
+ *                                     options.
+ * \param[in,out] file_content         The file content, kept if it is
+ *                                     verified.
+ * \param[in]     take_content         Whether the cache takes \p
+ *                                     file_content, which is then reset,
+ *                                     instead of copying it. The file content
+ *                                     must then be allocated on the heap.
+ * \param[in]     word_occurrences_vec The sorted word occurrences, packed in
+ *                                     the cache.
+ */
+void wordcount_cache_put(
+    wordcount_cache_t *cache, const wordcount_cache_key_t *key,
+    lstr_t *file_content, bool take_content,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+#endif /* IS_WORDCOUNT_CACHE_H */
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+###########################################################################
+#                                                                         #
+# Copyright 2022 INTERSEC SA                                              #
+#                                                                         #
+# Licensed under the Apache License, Version 2.0 (the "License");         #
+# you may not use this file except in compliance with the License.        #
+# You may obtain a copy of the License at                                 #
+#                                                                         #
+#     http://www.apache.org/licenses/LICENSE-2.0                          #
+#                                                                         #
+# Unless required by applicable law or agreed to in writing, software     #
+# distributed under the License is distributed on an "AS IS" BASIS,       #
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.#
+# See the License for the specific language governing permissions and     #
+# limitations under the License.                                          #
+#                                                                         #
+###########################################################################
+
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+from pathlib import Path
+
+
+SCRIPT_DIR = Path(__file__).parent
+C_CLIENT_PATH = SCRIPT_DIR / "wordcount-client"
+PY_CLIENT_PATH = SCRIPT_DIR / "wordcount-client.py"
+
+
+DESCRIPTION = """
+Compare the C and the Python wordcount clients.
+
+Count the files located at <file_path>, or the files of the directories, in
+batch with each client on one connection to a running server, for several
+rounds, and show the time of the rounds and the throughput of each client.
+Each round runs the client program, so its start is measured too. The
+results of the two clients are checked to be the same.
+""".strip()
+
+
+def list_files(paths):
+    """Get the files of the paths, and of the directories in the paths."""
+    files = []
+    for path in paths:
+        if not os.path.isdir(path):
+            files.append(path)
+            continue
+        for root, _, names in os.walk(path):
+            files.extend(os.path.join(root, name) for name in sorted(names))
+    return files
+
+
+def run_rounds(name, cmd, rounds):
+    """Run a client for several rounds, and get the times and the output of
+    its rounds."""
+    times = []
+    output = None
+    for _ in range(rounds):
+        start = time.perf_counter()
+        res = subprocess.run(cmd, stdout=subprocess.PIPE, check=False)
+        times.append(time.perf_counter() - start)
+        if res.returncode != 0:
+            sys.exit(f"{name} client failed with status {res.returncode}")
+        output = res.stdout
+    return times, output
+
+
+def main():
+    # Parse the arguments
+    parser = argparse.ArgumentParser(description=DESCRIPTION)
+    parser.add_argument("-c", "--cfg",
+                        help="path to the server configuration in YAML",
+                        required=True)
+    parser.add_argument("-r", "--rounds", type=int, default=5,
+                        help="number of rounds of each client")
+    parser.add_argument("-q", "--in-flight", type=int, default=8,
+                        help=(
+                            "maximum number of files being counted at once"
+                        ))
+    parser.add_argument("-l", "--limit", type=int, default=0,
+                        help=(
+                            "only get the words with the most occurrences, "
+                            "up to this number of words"
+                        ))
+    parser.add_argument("-z", "--compress", action="store_true",
+                        help="compress the file contents and the replies")
+    parser.add_argument("-T", "--tcp", action="store_true",
+                        help=(
+                            "connect over TCP even when the server listens "
+                            "on unix sockets"
+                        ))
+    parser.add_argument("file_path", nargs="+",
+                        help="path to a file or a directory to count")
+    args = parser.parse_args()
+
+    # At least two files, so both clients write their results on the
+    # standard output with the paths of the files
+    files = list_files(args.file_path)
+    if len(files) < 2:
+        parser.error("at least two files are needed")
+    size = sum(os.path.getsize(path) for path in files)
+
+    options = ["-c", args.cfg, "-q", str(args.in_flight),
+               "-l", str(args.limit)]
+    if args.compress:
+        options.append("-z")
+    if args.tcp:
+        options.append("-T")
+    clients = [
+        ("C", [str(C_CLIENT_PATH), "-n", "1"] + options + files),
+        ("Python", [sys.executable, str(PY_CLIENT_PATH)] + options + files),
+    ]
+
+    print(f"files: {len(files)}, size: {size} bytes, "
+          f"rounds: {args.rounds}, in flight: {args.in_flight}")
+    print(f"{'client':<8} {'best s':>10} {'median s':>10} {'files/s':>10} "
+          f"{'MB/s':>10}")
+    outputs = []
+    for name, cmd in clients:
+        times, output = run_rounds(name, cmd, args.rounds)
+        best = min(times)
+        print(f"{name:<8} {best:>10.3f} {statistics.median(times):>10.3f} "
+              f"{len(files) / best:>10.1f} {size / best / (1 << 20):>10.1f}")
+        outputs.append(output)
+
+    if outputs[0] != outputs[1]:
+        sys.exit("the results of the clients differ")
+
+
+if __name__ == '__main__':
+    main()
@@ -16,38 +16,240 @@
 /*                                                                         */
 /***************************************************************************/
 
+#include <dirent.h>
+
 #include <lib-common/core.h>
 #include <lib-common/parseopt.h>
 #include <lib-common/iop-rpc.h>
 
 #include "wordcount-base.h"
+#include "wordcount-codec.h"
+#include "wordcount-count.h"
+#include "wordcount-stats.h"
+
+/* Delay before sending again a query rejected by a busy server, doubled on
+ * each rejection of the same query up to the maximum delay */
+#define WORDCOUNT_RETRY_DELAY_MS      100
+#define WORDCOUNT_RETRY_MAX_DELAY_MS  5000
 
-static const char *short_args_g = "-c <server_cfg_path> <file_path>";
+static const char *short_args_g = "-c <server_cfg_path> <file_path>...";
 
 static const char *long_usage_g[] = {
     "Client part of wordcount",
     "",
     "Read the content of the file located at <file_path> and send it to the ",
     "server to get the number of occurrences of each unique words via RPC.",
+    "Files bigger than the chunk size are sent chunk by chunk.",
+    "With --server-side, only the path of the file is sent, and the server ",
+    "reads the file itself. With --pre-aggregate, the client counts the ",
+    "words of the file itself, and only sends them with their occurrences.",
+    "",
+    "Several files, the files of a directory or the files listed on the ",
+    "standard input with --stdin are counted in batch: the queries are ",
+    "pipelined on a pool of connections, and the results are written on the ",
+    "standard output in the order of the files.",
+    "",
+    "With --load, the files are replayed as a load for --duration seconds, ",
+    "either as fast as the server answers (closed loop) or at the --rate ",
+    "queries per second (open loop), and the throughput and the latency of ",
+    "the queries are reported instead of their results.",
     "",
     "The configuration of the server is expected to be in IOP YAML as ",
     "described by the IOP `wordcount.ServerCfg`",
     NULL,
 };
 
+/** Connection of the pool of connections to the server. */
+typedef struct wordcount_conn_t {
+    /** Remote ichannel */
+    ichannel_t ic;
+
+    /** Whether the connection is established. */
+    bool connected;
+
+    /** The number of files being counted through this connection. */
+    int nb_tasks;
+} wordcount_conn_t;
+
+/** Counting of one file. */
+typedef struct wordcount_task_t {
+    /** The path of the file. */
+    lstr_t path;
+
+    /** The connection the file is counted through. */
+    wordcount_conn_t *conn;
+
+    /** The mmapped content of the file, while it is sent chunk by chunk */
+    lstr_t file_content;
+
+    /** The streaming counting session opened on the server */
+    uint64_t session_id;
+
+    /** The result kept on the server while its pages are fetched */
+    uint64_t result_id;
+
+    /** The length of the file content already sent in chunks */
+    size_t sent_len;
+
+    /** The number of chunks sent and not yet acknowledged by the server */
+    unsigned chunks_in_flight;
+
+    /** The status of the first chunk that failed */
+    ic_status_t chunk_status;
+
+    /** Timer to send the query again when the server is busy, and the
+     * number of times in a row the query has been rejected */
+    el_t retry_timer;
+    int retries;
+
+    /** Whether the result, or the error, of the file is known */
+    bool done;
+
+    /** The result of the file, written once the results of the previous
+     * files are */
+    sb_t output;
+} wordcount_task_t;
+
+static wordcount_task_t *wordcount_task_init(wordcount_task_t *task)
+{
+    p_clear(task, 1);
+    sb_init(&task->output);
+    return task;
+}
+
+static void wordcount_task_wipe(wordcount_task_t *task)
+{
+    lstr_wipe(&task->path);
+    lstr_wipe(&task->file_content);
+    el_unregister(&task->retry_timer);
+    sb_wipe(&task->output);
+}
+
+GENERIC_NEW(wordcount_task_t, wordcount_task);
+GENERIC_DELETE(wordcount_task_t, wordcount_task);
+
+/* Create the vector type to store the files to count. */
+qvector_t(wordcount_task, wordcount_task_t *);
+
+/** Query sent in load mode, stored in its message. */
+typedef struct wordcount_load_query_t {
+    /** The time the query is measured from: the time it is sent at in
+     * closed loop, the time it is scheduled at in open loop. */
+    int64_t start_nsec;
+
+    /** The connection the query is sent through. */
+    wordcount_conn_t *conn;
+} wordcount_load_query_t;
+
+/** Measures of the queries of a load, over an interval or over the whole
+ * load. */
+typedef struct wordcount_load_stats_t {
+    /** The latencies of the successful queries, in nanoseconds. */
+    wordcount_histogram_t latency;
+
+    /** The queries that failed, and the ones rejected by a busy server. */
+    uint64_t nb_errors;
+    uint64_t nb_rejected;
+} wordcount_load_stats_t;
+
 static struct {
     bool opt_help;
     const char *opt_cfg_path;
+    unsigned opt_chunk_size;
+    unsigned opt_window;
+    unsigned opt_limit;
+    unsigned opt_min_occurrences;
+    bool opt_server_side;
+    bool opt_stdin;
+    unsigned opt_connections;
+    unsigned opt_in_flight;
+    bool opt_compress;
+    bool opt_tcp;
+    unsigned opt_page_size;
+    bool opt_approximate;
+    unsigned opt_ngram;
+    bool opt_utf8;
+    const char *opt_filter_set;
+    bool opt_pre_aggregate;
+    bool opt_load;
+    unsigned opt_duration;
+    unsigned opt_rate;
+    unsigned opt_report_interval;
+    bool opt_json;
+
+    /** The codec of the file contents and of the replies */
+    wordcount__codec__t codec;
+
+    /** The filter set of the server chosen with --filter-set, LSTR_NULL_V
+     * for none */
+    lstr_t filter_set;
+
+    /** The map of words recycled to count the files with --pre-aggregate */
+    wordcount_map_t map;
 
     /** The exit status status of the main function */
     int exit_res;
 
-    /** The path of the file where to get the content from */
-    const char *file_path;
+    /** Whether several files are counted, their results are then written on
+     * the standard output with their paths */
+    bool batch;
 
-    /** Remote ichannel */
-    ichannel_t  remote_ic;
-} wordcount_client_g;
+    /** The files to count, in the order of their results. The files are
+     * released once their result is written. */
+    qv_t(wordcount_task) tasks;
+
+    /** The next file to count */
+    int next_task;
+
+    /** The next file whose result is to be written */
+    int next_output;
+
+    /** The number of files that could not be counted */
+    int nb_failed;
+
+    /** The pool of connections to the server */
+    wordcount_conn_t *conns;
+    int nb_conns;
+
+    /** The load generated in load mode */
+    struct {
+        /** The queries replayed in turn: the file contents, compressed with
+         * the codec, or their absolute paths with --server-side */
+        qv_t(lstr) queries;
+        int next_query;
+
+        /** Whether the load is started, and whether it is over and only
+         * waits for the queries in flight. */
+        bool started;
+        bool stopping;
+
+        /** The start of the load, and of the current interval */
+        int64_t start_nsec;
+        int64_t interval_nsec;
+
+        /** The number of queries sent, and in flight */
+        uint64_t nb_sent;
+        unsigned nb_in_flight;
+
+        /** The measures of the current interval, and of the whole load */
+        wordcount_load_stats_t interval;
+        wordcount_load_stats_t total;
+
+        /** Timers sending the scheduled queries in open loop, writing the
+         * reports, and stopping the load */
+        el_t send_timer;
+        el_t report_timer;
+        el_t end_timer;
+    } load;
+} wordcount_client_g = {
+    .opt_chunk_size = 1 << 20,
+    .opt_window = 4,
+    .opt_connections = 1,
+    .opt_in_flight = 8,
+    .opt_ngram = 1,
+    .opt_duration = 10,
+    .opt_report_interval = 1,
+};
 #define _G wordcount_client_g
 
 static popt_t opts_g[] = {
@@ -55,6 +257,69 @@ static popt_t opts_g[] = {
     OPT_FLAG('h', "help", &_G.opt_help, "show this help"),
     OPT_STR('c', "cfg", &_G.opt_cfg_path,
             "path to the server configuration in YAML"),
+    OPT_UINT('s', "chunk-size", &_G.opt_chunk_size,
+             "size in bytes of the chunks of the file content sent to the "
+             "server (default: 1MiB)"),
+    OPT_UINT('w', "window", &_G.opt_window,
+             "maximum number of chunks sent and not yet acknowledged by the "
+             "server (default: 4)"),
+    OPT_UINT('l', "limit", &_G.opt_limit,
+             "only get the words with the most occurrences, up to this "
+             "number of words (default: no limit)"),
+    OPT_UINT('m', "min-occurrences", &_G.opt_min_occurrences,
+             "only get the words with at least this number of occurrences"),
+    OPT_FLAG('S', "server-side", &_G.opt_server_side,
+             "let the server read the file, which must be in one of its "
+             "countFileRoots directories"),
+    OPT_FLAG('i', "stdin", &_G.opt_stdin,
+             "also count the files listed on the standard input, one path "
+             "per line"),
+    OPT_UINT('n', "connections", &_G.opt_connections,
+             "number of connections to the server (default: 1)"),
+    OPT_UINT('q', "in-flight", &_G.opt_in_flight,
+             "maximum number of files being counted at once, at most the "
+             "maxConnectionQueries of the server per connection "
+             "(default: 8)"),
+    OPT_FLAG('z', "compress", &_G.opt_compress,
+             "compress the file contents sent to the server, and accept "
+             "compressed replies"),
+    OPT_FLAG('T', "tcp", &_G.opt_tcp,
+             "connect to the TCP address of the server even if it listens "
+             "on a unix socket"),
+    OPT_UINT('p', "page-size", &_G.opt_page_size,
+             "fetch the results by pages of this number of words "
+             "(default: whole results at once)"),
+    OPT_FLAG('a', "approximate", &_G.opt_approximate,
+             "count the words approximately in the bounded memory of the "
+             "server, each count is given with its maximum error"),
+    OPT_UINT('g', "ngram", &_G.opt_ngram,
+             "count the sequences of this number of words, up to 4, instead "
+             "of the words, the files are then sent in one query "
+             "(default: 1)"),
+    OPT_FLAG('u', "utf8", &_G.opt_utf8,
+             "read the files as UTF-8: the non-ASCII letters are parts of "
+             "the words and their case is folded, the files are then sent "
+             "in one query"),
+    OPT_STR('f', "filter-set", &_G.opt_filter_set,
+            "do not count the words rejected by this filter set of the "
+            "server, see the filterSets of its configuration"),
+    OPT_FLAG('P', "pre-aggregate", &_G.opt_pre_aggregate,
+             "count the words of the files on the client, and only send "
+             "the distinct words with their occurrences to the server"),
+    OPT_FLAG('L', "load", &_G.opt_load,
+             "replay the files as a load and report the throughput and the "
+             "latency of the queries instead of their results"),
+    OPT_UINT('d', "duration", &_G.opt_duration,
+             "load mode: duration of the load in seconds (default: 10)"),
+    OPT_UINT('r', "rate", &_G.opt_rate,
+             "load mode: send this number of queries per second (open loop) "
+             "instead of a query as soon as one is answered (default: "
+             "closed loop)"),
+    OPT_UINT('R', "report-interval", &_G.opt_report_interval,
+             "load mode: write a report every this number of seconds "
+             "(default: 1)"),
+    OPT_FLAG('j', "json", &_G.opt_json,
+             "load mode: write the reports in JSON, one object per line"),
     OPT_END()
 };
 
@@ -63,8 +328,8 @@ static popt_t opts_g[] = {
  * The file is mmapped, and thus the content of the file is not duplicated in
  * memory.
  * Thanks to that, parsing big files is not an issue.
- * However, this can still be an issue if the content of the file is passed
- * as is in an RPC.
+ * Big files are not passed as is in an RPC, but sent chunk by chunk in a
+ * streaming counting session.
  *
  * The file content must be wiped after use to munmap the file.
  *
@@ -76,15 +341,8 @@ static popt_t opts_g[] = {
 static int wordcount_get_file_content(const char *file_path,
                                       lstr_t *file_content)
 {
-    if (lstr_init_from_file(file_content, file_path, PROT_READ,
-                            MAP_PRIVATE) < 0)
-    {
-        e_error("unable to get the content of the file `%s` has failed: %m\n",
-                file_path);
-        return -1;
-    }
-
-    return 0;
+    return lstr_init_from_file(file_content, file_path, PROT_READ,
+                               MAP_PRIVATE);
 }
 
 /** Exit the client with the given result status code.
@@ -104,56 +362,1046 @@ static void worcount_client_exit(int res)
     kill(0, SIGQUIT);
 }
 
+/* Files */
+
+/** Add a file to count.
+ *
+ * \param[in] path The path of the file.
+ */
+static void wordcount_client_add_file(const char *path)
+{
+    wordcount_task_t *task = wordcount_task_new();
+
+    task->path = lstr_dups(path, -1);
+    qv_append(&_G.tasks, task);
+}
+
+static void wordcount_client_add_path(const char *path);
+
+/** Add the files of a directory and of its sub-directories to count.
+ *
+ * \param[in] dir_path The path of the directory.
+ */
+static void wordcount_client_add_dir(const char *dir_path)
+{
+    DIR *dir = opendir(dir_path);
+    struct dirent *ent;
+
+    if (!dir) {
+        e_error("unable to open the directory `%s`: %m", dir_path);
+        _G.nb_failed++;
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        t_scope;
+        const char *path;
+        struct stat st;
+
+        if (strequal(ent->d_name, ".") || strequal(ent->d_name, "..")) {
+            continue;
+        }
+        path = t_fmt("%s/%s", dir_path, ent->d_name);
+
+        /* The symbolic links are not followed, a link to a parent directory
+         * would be walked forever */
+        if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
+            e_warning("skipping the symbolic link `%s`", path);
+            continue;
+        }
+        wordcount_client_add_path(path);
+    }
+    closedir(dir);
+}
+
+/** Add a file, or the files of a directory, to count.
+ *
+ * \param[in] path The path of the file or of the directory.
+ */
+static void wordcount_client_add_path(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        _G.batch = true;
+        wordcount_client_add_dir(path);
+    } else {
+        /* The other errors are reported when the file is read */
+        wordcount_client_add_file(path);
+    }
+}
+
+/** Add the files listed on the standard input to count. */
+static void wordcount_client_add_stdin_paths(void)
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &line_size, stdin)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            wordcount_client_add_path(line);
+        }
+    }
+    free(line);
+}
+
+/* Results */
+
+/** Display the sorted word occurrences received from the server.
+ *
+ * \param[in] word_occurrences_array The sorted word occurrences.
+ */
+static void wordcount_client_display(
+    const wordcount__word_occurrences__array_t *word_occurrences_array)
+{
+    tab_for_each_ptr(word_occurrences, word_occurrences_array) {
+        if (OPT_ISSET(word_occurrences->max_error)) {
+            e_info("%pL => %u (-%u)", &word_occurrences->word,
+                   word_occurrences->occurrences,
+                   OPT_VAL(word_occurrences->max_error));
+        } else {
+            e_info("%pL => %u", &word_occurrences->word,
+                   word_occurrences->occurrences);
+        }
+    }
+}
+
+/** Write the results of the files that are done, in the order of the
+ * files. */
+static void wordcount_client_write_outputs(void)
+{
+    while (_G.next_output < _G.next_task
+    &&     _G.tasks.tab[_G.next_output]->done)
+    {
+        wordcount_task_t *task = _G.tasks.tab[_G.next_output];
+
+        if (_G.batch) {
+            fwrite(task->output.data, 1, task->output.len, stdout);
+        }
+        wordcount_task_delete(&_G.tasks.tab[_G.next_output]);
+        _G.next_output++;
+    }
+    fflush(stdout);
+}
+
+/** Mark a file as done, and write the results that can be written.
+ *
+ * \param[in] task The counting of the file.
+ */
+static void wordcount_task_finish(wordcount_task_t *task)
+{
+    task->done = true;
+    task->conn->nb_tasks--;
+    lstr_wipe(&task->file_content);
+    wordcount_client_write_outputs();
+}
+
+/** Add a page of the result of a file.
+ *
+ * \param[in] task                   The counting of the file.
+ * \param[in] word_occurrences_array The sorted word occurrences of the page.
+ */
+static void wordcount_task_add_page(
+    wordcount_task_t *task,
+    const wordcount__word_occurrences__array_t *word_occurrences_array)
+{
+    if (_G.batch) {
+        if (!task->output.len) {
+            sb_addf(&task->output, "%pL:\n", &task->path);
+        }
+        tab_for_each_ptr(word_occurrences, word_occurrences_array) {
+            sb_addf(&task->output, "%pL => %u", &word_occurrences->word,
+                    word_occurrences->occurrences);
+            if (OPT_ISSET(word_occurrences->max_error)) {
+                sb_addf(&task->output, " (-%u)",
+                        OPT_VAL(word_occurrences->max_error));
+            }
+            sb_addc(&task->output, '\n');
+        }
+    } else {
+        wordcount_client_display(word_occurrences_array);
+    }
+}
+
+/** Set the error of a file.
+ *
+ * \param[in] task The counting of the file.
+ * \param[in] fmt  The description of the error.
+ */
+static __attr_printf__(2, 3)
+void wordcount_task_fail(wordcount_task_t *task, const char *fmt, ...)
+{
+    SB_1k(err);
+    va_list va;
+
+    va_start(va, fmt);
+    sb_addvf(&err, fmt, va);
+    va_end(va);
+
+    if (_G.batch) {
+        sb_addf(&task->output, "%pL: error: %pL\n", &task->path, &err);
+    } else {
+        e_error("%pL: %pL", &task->path, &err);
+    }
+    _G.nb_failed++;
+    wordcount_task_finish(task);
+}
+
+static void wordcount_task_fetch_page(wordcount_task_t *task,
+                                      unsigned cursor);
+
+/** Add a page of the result of a file from a reply, compressed or not.
+ *
+ * The file is done on the last page, otherwise the next page is fetched.
+ *
+ * \param[in] task                   The counting of the file.
+ * \param[in] word_occurrences_array The sorted word occurrences, if the
+ *                                   reply is not compressed.
+ * \param[in] codec                  The codec of the reply.
+ * \param[in] compressed             The compressed sorted word occurrences,
+ *                                   if the reply is compressed.
+ * \param[in] next_cursor            The cursor of the next page, if any.
+ */
+static void wordcount_task_set_reply(
+    wordcount_task_t *task,
+    const wordcount__word_occurrences__array_t *word_occurrences_array,
+    wordcount__codec__t codec, lstr_t compressed, opt_u32_t next_cursor)
+{
+    t_scope;
+    wordcount__word_occurrences__array_t decompressed;
+
+    if (codec != CODEC_NONE) {
+        if (t_wordcount_decompress_word_occurrences(codec, compressed, 0,
+                                                    &decompressed) < 0)
+        {
+            wordcount_task_fail(task, "invalid compressed reply");
+            return;
+        }
+        word_occurrences_array = &decompressed;
+    }
+    wordcount_task_add_page(task, word_occurrences_array);
+
+    if (OPT_ISSET(next_cursor)) {
+        wordcount_task_fetch_page(task, OPT_VAL(next_cursor));
+    } else {
+        wordcount_task_finish(task);
+    }
+}
+
+/* Queries */
+
+static void wordcount_client_start_tasks(void);
+static void wordcount_load_on_reply(const ic_msg_t *msg, ic_status_t status);
+
+/** Create a query message bound to the counting of a file. */
+static ic_msg_t *wordcount_task_msg(wordcount_task_t *task)
+{
+    ic_msg_t *msg = ic_msg_new(sizeof(task));
+
+    *(wordcount_task_t **)msg->priv = task;
+    return msg;
+}
+
+/** Get the counting of a file a query message is bound to. */
+static wordcount_task_t *wordcount_msg_task(const ic_msg_t *msg)
+{
+    return *(wordcount_task_t **)msg->priv;
+}
+
+/** Send the words of a file counted by the client, for the server to merge
+ * and sort them.
+ *
+ * The file is tokenized with the rules of the server, and only its distinct
+ * words with their occurrences are sent, which is much smaller than a
+ * repetitive file content.
+ *
+ * \param[in] task The counting of the file.
+ */
+static void wordcount_task_send_partials(wordcount_task_t *task)
+{
+    t_scope;
+    wordcount_params_t params = {
+        .nb_threads = 1,
+        .utf8 = _G.opt_utf8,
+        .map = &_G.map,
+    };
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+    wordcount__word_occurrences__array_t word_occurrences;
+    lstr_t compressed = LSTR_NULL_V;
+
+    if (wordcount_get_file_content(task->path.s, &task->file_content) < 0) {
+        wordcount_task_fail(task, "unable to get the content of the file: %m");
+        return;
+    }
+
+    /* Count all the words in the recycled map, the limit and the minimum
+     * number of occurrences are applied by the server on the merged words.
+     * The words of the vector are lower-cased copies, the file is no longer
+     * needed. */
+    t_wordcount_split_and_sort_word_occurrences(task->file_content, &params,
+                                                &word_occurrences_vec);
+    lstr_wipe(&task->file_content);
+
+    word_occurrences = IOP_TYPED_ARRAY_TAB(wordcount__word_occurrences,
+                                           &word_occurrences_vec);
+    if (_G.codec != CODEC_NONE) {
+        if (t_wordcount_compress_word_occurrences(_G.codec, &word_occurrences,
+                                                  &compressed) < 0)
+        {
+            wordcount_task_fail(task, "unable to compress the words");
+            return;
+        }
+        p_clear(&word_occurrences, 1);
+    }
+    ic_query2(&task->conn->ic, wordcount_task_msg(task), wordcount__mod,
+              wordcount_iface, merge_occurrences,
+              .word_occurrences = word_occurrences,
+              .limit = _G.opt_limit,
+              .min_occurrences = _G.opt_min_occurrences,
+              .codec = _G.codec,
+              .compressed_word_occurrences = compressed,
+              .reply_codec = _G.codec,
+              .page_size = _G.opt_page_size,
+              .filter_set = _G.filter_set);
+}
+
+/** Send the query to count a file.
+ *
+ * \param[in] task The counting of the file.
+ */
+static void wordcount_task_send(wordcount_task_t *task)
+{
+    ichannel_t *ic = &task->conn->ic;
+
+    if (_G.opt_server_side) {
+        char path[PATH_MAX];
+
+        /* Send the absolute path of the file, the server does not run in
+         * the same directory */
+        if (!realpath(task->path.s, path)) {
+            wordcount_task_fail(task, "unable to resolve the path: %m");
+            return;
+        }
+        ic_query2(ic, wordcount_task_msg(task), wordcount__mod,
+                  wordcount_iface, count_file_occurrences,
+                  .path = LSTR(path),
+                  .limit = _G.opt_limit,
+                  .min_occurrences = _G.opt_min_occurrences,
+                  .reply_codec = _G.codec,
+                  .page_size = _G.opt_page_size,
+                  .approximate = _G.opt_approximate,
+                  .ngram = _G.opt_ngram,
+                  .utf8 = _G.opt_utf8,
+                  .filter_set = _G.filter_set);
+        return;
+    }
+    if (_G.opt_pre_aggregate) {
+        wordcount_task_send_partials(task);
+        return;
+    }
+
+    /* Get the file content */
+    if (wordcount_get_file_content(task->path.s, &task->file_content) < 0) {
+        wordcount_task_fail(task, "unable to get the content of the file: %m");
+        return;
+    }
+
+    if (task->file_content.len <= (int)_G.opt_chunk_size
+    ||  _G.opt_ngram > 1 || _G.opt_utf8)
+    {
+        t_scope;
+        lstr_t file_content = task->file_content;
+        lstr_t compressed = LSTR_NULL_V;
+
+        /* Small file, send the file content to the server in one RPC. So
+         * are the files whose n-grams or UTF-8 words are counted, which the
+         * streaming sessions do not support. The query is packed, the file
+         * content is no longer needed. */
+        if (_G.codec != CODEC_NONE) {
+            if (t_wordcount_compress(_G.codec, file_content,
+                                     &compressed) < 0)
+            {
+                wordcount_task_fail(task, "unable to compress the file");
+                return;
+            }
+            file_content = LSTR_EMPTY_V;
+        }
+        ic_query2(ic, wordcount_task_msg(task), wordcount__mod,
+                  wordcount_iface, count_occurrences,
+                  .file_content = file_content,
+                  .limit = _G.opt_limit,
+                  .min_occurrences = _G.opt_min_occurrences,
+                  .codec = _G.codec,
+                  .compressed_content = compressed,
+                  .reply_codec = _G.codec,
+                  .page_size = _G.opt_page_size,
+                  .approximate = _G.opt_approximate,
+                  .ngram = _G.opt_ngram,
+                  .utf8 = _G.opt_utf8,
+                  .filter_set = _G.filter_set);
+        lstr_wipe(&task->file_content);
+        return;
+    }
+
+    /* Big file, open a streaming session to send the file content chunk by
+     * chunk. The file stays mmapped until all the chunks are sent. */
+    ic_query2(ic, wordcount_task_msg(task), wordcount__mod, wordcount_iface,
+              begin_count, .approximate = _G.opt_approximate,
+              .filter_set = _G.filter_set);
+}
+
+static void wordcount_task_on_retry_timer(el_t ev, data_t priv)
+{
+    wordcount_task_t *task = priv.ptr;
+
+    task->retry_timer = NULL;
+    wordcount_task_send(task);
+    wordcount_client_start_tasks();
+}
+
+/** Get the delay before sending again a query rejected by a busy server.
+ *
+ * The delay is doubled on each rejection in a row, and drawn at random in
+ * its upper half so that the clients rejected at once do not all retry at
+ * once.
+ *
+ * \param[in] task The counting of the file.
+ * \return The delay in milliseconds.
+ */
+static int wordcount_task_retry_delay(wordcount_task_t *task)
+{
+    int delay = WORDCOUNT_RETRY_MAX_DELAY_MS;
+
+    if (task->retries < 16) {
+        delay = MIN(WORDCOUNT_RETRY_DELAY_MS << task->retries, delay);
+    }
+    task->retries++;
+    return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+/** Check the status of an RPC query, and fail the file in case of error.
+ *
+ * A query rejected because the server is busy is sent again later, see
+ * wordcount_task_retry_delay().
+ *
+ * \param[in] task   The counting of the file.
+ * \param[in] status The status of the RPC query.
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int wordcount_task_check_status(wordcount_task_t *task,
+                                       ic_status_t status)
+{
+    if (status == IC_MSG_RETRY) {
+        /* Only the queries sent by wordcount_task_send() are rejected */
+        lstr_wipe(&task->file_content);
+        task->retry_timer = el_timer_register(wordcount_task_retry_delay(task),
+                                              0, 0,
+                                              &wordcount_task_on_retry_timer,
+                                              task);
+        return -1;
+    }
+    if (status != IC_MSG_OK) {
+        /* RPC error */
+        const char *error = ic_status_to_string(status);
+
+        wordcount_task_fail(task, "RPC error: %s", error);
+        return -1;
+    }
+    task->retries = 0;
+    return 0;
+}
+
 /** Called when the RPC query is finished with the RPC result if the RPC is
  * successful. */
 static void IOP_RPC_CB(wordcount__mod, wordcount_iface, count_occurrences)
 {
+    wordcount_task_t *task;
+
+    if (_G.opt_load) {
+        wordcount_load_on_reply(msg, status);
+        return;
+    }
+
+    task = wordcount_msg_task(msg);
+
+    if (wordcount_task_check_status(task, status) == 0) {
+        /* Display the sorted word occurrences */
+        task->result_id = OPT_DEFVAL(res->result_id, 0);
+        wordcount_task_set_reply(task, &res->word_occurrences, res->codec,
+                                 res->compressed_word_occurrences,
+                                 res->next_cursor);
+    }
+
+    /* Count the next files */
+    wordcount_client_start_tasks();
+}
+
+/** Called when the file has been counted by the server. */
+static void
+IOP_RPC_CB(wordcount__mod, wordcount_iface, count_file_occurrences)
+{
+    wordcount_task_t *task;
+
+    if (_G.opt_load) {
+        wordcount_load_on_reply(msg, status);
+        return;
+    }
+
+    task = wordcount_msg_task(msg);
+
+    if (wordcount_task_check_status(task, status) == 0) {
+        task->result_id = OPT_DEFVAL(res->result_id, 0);
+        wordcount_task_set_reply(task, &res->word_occurrences, res->codec,
+                                 res->compressed_word_occurrences,
+                                 res->next_cursor);
+    }
+    wordcount_client_start_tasks();
+}
+
+/** Called with the merged words of a file counted by the client. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, merge_occurrences)
+{
+    wordcount_task_t *task = wordcount_msg_task(msg);
+
+    if (wordcount_task_check_status(task, status) == 0) {
+        task->result_id = OPT_DEFVAL(res->result_id, 0);
+        wordcount_task_set_reply(task, &res->word_occurrences, res->codec,
+                                 res->compressed_word_occurrences,
+                                 res->next_cursor);
+    }
+    wordcount_client_start_tasks();
+}
+
+/** Called when the streaming counting session is closed with the results of
+ * all the chunks. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, end_count)
+{
+    wordcount_task_t *task = wordcount_msg_task(msg);
+
+    if (wordcount_task_check_status(task, status) == 0) {
+        task->result_id = OPT_DEFVAL(res->result_id, 0);
+        wordcount_task_set_reply(task, &res->word_occurrences, res->codec,
+                                 res->compressed_word_occurrences,
+                                 res->next_cursor);
+    }
+    wordcount_client_start_tasks();
+}
+
+/** Fetch the next page of the result of a file.
+ *
+ * \param[in] task   The counting of the file.
+ * \param[in] cursor The cursor of the page, given by the previous reply.
+ */
+static void wordcount_task_fetch_page(wordcount_task_t *task, unsigned cursor)
+{
+    ic_query2(&task->conn->ic, wordcount_task_msg(task), wordcount__mod,
+              wordcount_iface, fetch_page,
+              .result_id = task->result_id,
+              .cursor = cursor,
+              .reply_codec = _G.codec);
+}
+
+/** Called when a page of the result of a file is received. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, fetch_page)
+{
+    wordcount_task_t *task = wordcount_msg_task(msg);
+
     if (status != IC_MSG_OK) {
-        /* RPC error */
-        const char *error = ic_status_to_string(status);
+        /* The result is lost when the connection is, do not retry. The
+         * pages already received are dropped. */
+        sb_reset(&task->output);
+        wordcount_task_fail(task, "RPC error: %s",
+                            ic_status_to_string(status));
+    } else {
+        wordcount_task_set_reply(task, &res->word_occurrences, res->codec,
+                                 res->compressed_word_occurrences,
+                                 res->next_cursor);
+    }
+    wordcount_client_start_tasks();
+}
 
-        e_error("RPC error: %s", error);
-        worcount_client_exit(-1);
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, push_chunk);
+
+/** Send the next chunks of the file content to the server.
+ *
+ * Keep at most `opt_window` chunks in flight so the memory used by the
+ * pending queries does not depend on the size of the file. When all the
+ * chunks have been acknowledged, close the session to get the results.
+ *
+ * \param[in] task The counting of the file.
+ */
+static void wordcount_task_push_chunks(wordcount_task_t *task)
+{
+    ichannel_t *ic = &task->conn->ic;
+
+    while (task->chunks_in_flight < _G.opt_window
+    &&     task->sent_len < (size_t)task->file_content.len)
+    {
+        t_scope;
+        lstr_t chunk;
+        lstr_t data;
+
+        chunk = LSTR_PTR_V(task->file_content.s + task->sent_len,
+                           MIN((size_t)_G.opt_chunk_size,
+                               task->file_content.len - task->sent_len));
+
+        /* Each chunk is compressed on its own, so the server can count it
+         * as soon as it is received */
+        data = chunk;
+        if (_G.codec != CODEC_NONE
+        &&  t_wordcount_compress(_G.codec, chunk, &data) < 0)
+        {
+            task->chunk_status = IC_MSG_INVALID;
+            break;
+        }
+        ic_query2(ic, wordcount_task_msg(task), wordcount__mod,
+                  wordcount_iface, push_chunk,
+                  .session_id = task->session_id, .chunk = data,
+                  .codec = _G.codec);
+        task->sent_len += chunk.len;
+        task->chunks_in_flight++;
+    }
+
+    if (task->chunk_status != IC_MSG_OK) {
+        /* Failed once the chunks in flight are acknowledged */
+        if (task->chunks_in_flight == 0) {
+            wordcount_task_fail(task, "unable to compress the file");
+            wordcount_client_start_tasks();
+        }
         return;
     }
 
-    /* Display the sorted word occurrences */
-    tab_for_each_ptr(word_occurrences, &res->word_occurrences) {
-        e_info("%pL => %u", &word_occurrences->word,
-               word_occurrences->occurrences);
+    if (task->chunks_in_flight == 0) {
+        ic_query2(ic, wordcount_task_msg(task), wordcount__mod,
+                  wordcount_iface, end_count,
+                  .session_id = task->session_id,
+                  .limit = _G.opt_limit,
+                  .min_occurrences = _G.opt_min_occurrences,
+                  .reply_codec = _G.codec,
+                  .page_size = _G.opt_page_size);
     }
+}
+
+/** Called when a chunk has been counted by the server. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, push_chunk)
+{
+    wordcount_task_t *task = wordcount_msg_task(msg);
 
-    /* Exit the client */
-    worcount_client_exit(0);
+    task->chunks_in_flight--;
+    if (status != IC_MSG_OK && task->chunk_status == IC_MSG_OK) {
+        /* Stop sending chunks. The file is failed once the chunks in flight
+         * are acknowledged, since their queries reference it. */
+        task->chunk_status = status;
+    }
+    if (task->chunk_status != IC_MSG_OK) {
+        if (task->chunks_in_flight == 0) {
+            if (task->chunk_status == IC_MSG_RETRY) {
+                /* The server closed the session, the whole file is sent
+                 * again in a new one */
+                task->sent_len = 0;
+                task->session_id = 0;
+                task->chunk_status = IC_MSG_OK;
+                wordcount_task_check_status(task, IC_MSG_RETRY);
+            } else {
+                wordcount_task_fail(task, "RPC error: %s",
+                                    ic_status_to_string(task->chunk_status));
+            }
+            wordcount_client_start_tasks();
+        }
+        return;
+    }
+
+    wordcount_task_push_chunks(task);
 }
 
-/** Called when the client is connected to the server. */
-static void wordcount_client_on_connect(void)
+/** Called when the streaming counting session is opened. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, begin_count)
 {
-    lstr_t file_content;
+    wordcount_task_t *task = wordcount_msg_task(msg);
 
-    /* Get the file content */
-    if (wordcount_get_file_content(_G.file_path, &file_content) < 0) {
-        worcount_client_exit(-1);
+    if (wordcount_task_check_status(task, status) < 0) {
+        wordcount_client_start_tasks();
         return;
     }
 
-    /* Send the file content to the server via RPC */
-    ic_query2(&_G.remote_ic, ic_msg_new(0), wordcount__mod, wordcount_iface,
-              count_occurrences, .file_content = file_content);
+    task->session_id = res->session_id;
+    wordcount_task_push_chunks(task);
+}
+
+/** Get the established connection counting the fewest files.
+ *
+ * \return The connection, NULL if no connection is established.
+ */
+static wordcount_conn_t * nullable wordcount_client_pick_conn(void)
+{
+    wordcount_conn_t *best = NULL;
 
-    /* Clean-up */
-    lstr_wipe(&file_content);
+    for (int i = 0; i < _G.nb_conns; i++) {
+        wordcount_conn_t *conn = &_G.conns[i];
+
+        if (conn->connected && (!best || conn->nb_tasks < best->nb_tasks)) {
+            best = conn;
+        }
+    }
+    return best;
+}
+
+/** Start counting the next files, up to the maximum number of files in
+ * flight, and exit once all the results are written.
+ *
+ * The files whose result is not written yet count as in flight, so the
+ * memory used by the results waiting for a slow file stays bounded.
+ */
+static void wordcount_client_start_tasks(void)
+{
+    if (el_is_terminating()) {
+        /* The aborted queries of the connections being closed must not
+         * trigger new ones */
+        return;
+    }
+
+    while (_G.next_task < _G.tasks.len
+    &&     _G.next_task - _G.next_output < (int)_G.opt_in_flight)
+    {
+        wordcount_task_t *task = _G.tasks.tab[_G.next_task];
+        wordcount_conn_t *conn = wordcount_client_pick_conn();
+
+        if (!conn) {
+            break;
+        }
+        _G.next_task++;
+        task->conn = conn;
+        conn->nb_tasks++;
+        wordcount_task_send(task);
+    }
+
+    if (_G.next_output == _G.tasks.len) {
+        /* Exit the client */
+        worcount_client_exit(_G.nb_failed ? -1 : 0);
+    }
+}
+
+/* Load */
+
+/** Get the files replayed by the load.
+ *
+ * The files are read, and compressed, once before the load so that only the
+ * queries are measured.
+ *
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int wordcount_load_prepare(void)
+{
+    qv_init(&_G.load.queries);
+
+    tab_for_each_entry(task, &_G.tasks) {
+        t_scope;
+        lstr_t content;
+        lstr_t compressed;
+
+        if (_G.opt_server_side) {
+            char path[PATH_MAX];
+
+            if (!realpath(task->path.s, path)) {
+                e_error("%pL: unable to resolve the path: %m", &task->path);
+                return -1;
+            }
+            qv_append(&_G.load.queries, lstr_dups(path, -1));
+            continue;
+        }
+
+        if (wordcount_get_file_content(task->path.s, &content) < 0) {
+            e_error("%pL: unable to get the content of the file: %m",
+                    &task->path);
+            return -1;
+        }
+        if (_G.codec != CODEC_NONE) {
+            if (t_wordcount_compress(_G.codec, content, &compressed) < 0) {
+                e_error("%pL: unable to compress the file", &task->path);
+                lstr_wipe(&content);
+                return -1;
+            }
+            lstr_wipe(&content);
+            content = lstr_dup(compressed);
+        }
+        qv_append(&_G.load.queries, content);
+    }
+
+    if (!_G.load.queries.len) {
+        e_error("no file to replay");
+        return -1;
+    }
+    return 0;
+}
+
+/** Send the next query of the load.
+ *
+ * \param[in] conn       The connection to send the query through.
+ * \param[in] start_nsec The time the latency of the query is measured from.
+ */
+static void wordcount_load_send(wordcount_conn_t *conn, int64_t start_nsec)
+{
+    lstr_t query = _G.load.queries.tab[_G.load.next_query];
+    wordcount_load_query_t *load_query;
+    ic_msg_t *msg;
+
+    msg = ic_msg_new(sizeof(wordcount_load_query_t));
+    load_query = (wordcount_load_query_t *)msg->priv;
+    load_query->start_nsec = start_nsec;
+    load_query->conn = conn;
+
+    conn->nb_tasks++;
+    _G.load.nb_in_flight++;
+    _G.load.nb_sent++;
+    _G.load.next_query = (_G.load.next_query + 1) % _G.load.queries.len;
+
+    /* The same queries as the ones counting the files, the results are not
+     * paged since they are dropped */
+    if (_G.opt_server_side) {
+        ic_query2(&conn->ic, msg, wordcount__mod, wordcount_iface,
+                  count_file_occurrences,
+                  .path = query,
+                  .limit = _G.opt_limit,
+                  .min_occurrences = _G.opt_min_occurrences,
+                  .reply_codec = _G.codec,
+                  .approximate = _G.opt_approximate,
+                  .ngram = _G.opt_ngram,
+                  .utf8 = _G.opt_utf8,
+                  .filter_set = _G.filter_set);
+        return;
+    }
+    ic_query2(&conn->ic, msg, wordcount__mod, wordcount_iface,
+              count_occurrences,
+              .file_content = _G.codec == CODEC_NONE ? query : LSTR_EMPTY_V,
+              .limit = _G.opt_limit,
+              .min_occurrences = _G.opt_min_occurrences,
+              .codec = _G.codec,
+              .compressed_content = _G.codec == CODEC_NONE ? LSTR_NULL_V
+                                                           : query,
+              .reply_codec = _G.codec,
+              .approximate = _G.opt_approximate,
+              .ngram = _G.opt_ngram,
+              .utf8 = _G.opt_utf8,
+              .filter_set = _G.filter_set);
+}
+
+/** Send the next queries of the load, up to the maximum number of queries
+ * in flight.
+ *
+ * In closed loop, a query is sent as soon as one is answered, and its
+ * latency is measured from the time it is sent at.
+ *
+ * In open loop, the queries are scheduled at the rate of the load whatever
+ * the time the server takes to answer, and their latency is measured from
+ * the time they are scheduled at. A query that cannot be sent at its time,
+ * because too many queries are in flight, is sent as soon as possible, and
+ * the time it waited counts in its latency, so a server that stalls is not
+ * hidden by the queries that are not sent meanwhile (coordinated omission).
+ */
+static void wordcount_load_send_queries(void)
+{
+    int64_t now = wordcount_now_nsec();
+
+    while (!_G.load.stopping && _G.load.nb_in_flight < _G.opt_in_flight) {
+        wordcount_conn_t *conn = wordcount_client_pick_conn();
+        int64_t scheduled_nsec = now;
+
+        if (!conn) {
+            break;
+        }
+        if (_G.opt_rate) {
+            scheduled_nsec = _G.load.start_nsec
+                           + _G.load.nb_sent * 1000000000 / _G.opt_rate;
+            if (scheduled_nsec > now) {
+                break;
+            }
+        }
+        wordcount_load_send(conn, scheduled_nsec);
+    }
+}
+
+/** Write a report of the load.
+ *
+ * \param[in] name  The name of the report: "interval", or "total" for the
+ *                  report of the whole load.
+ * \param[in] stats The measures of the queries of the report.
+ * \param[in] nsec  The duration of the report.
+ */
+static void wordcount_load_report(const char *name,
+                                  const wordcount_load_stats_t *stats,
+                                  int64_t nsec)
+{
+    wordcount__distribution__t latency;
+    double elapsed = (wordcount_now_nsec() - _G.load.start_nsec) / 1e9;
+    double throughput;
+    uint64_t nb_unsent = 0;
+
+    /* The latencies are reported in microseconds */
+    wordcount_histogram_get_distribution(&stats->latency, 1000, &latency);
+    throughput = latency.count / (MAX(nsec, 1) / 1e9);
+
+    if (_G.opt_rate && strequal(name, "total")) {
+        /* The queries scheduled during the load and never sent, since too
+         * many queries were in flight */
+        uint64_t nb_scheduled = (uint64_t)_G.opt_duration * _G.opt_rate;
+
+        nb_unsent = nb_scheduled - MIN(nb_scheduled, _G.load.nb_sent);
+    }
+
+    if (_G.opt_json) {
+        printf("{\"report\":\"%s\",\"elapsed\":%.3f,\"duration\":%.3f,"
+               "\"queries\":%ju,\"errors\":%ju,\"rejected\":%ju,"
+               "\"unsent\":%ju,\"throughput\":%.1f,"
+               "\"latencyUs\":{\"mean\":%ju,\"p50\":%ju,\"p99\":%ju,"
+               "\"p999\":%ju,\"max\":%ju}}\n",
+               name, elapsed, nsec / 1e9, (uintmax_t)latency.count,
+               (uintmax_t)stats->nb_errors, (uintmax_t)stats->nb_rejected,
+               (uintmax_t)nb_unsent, throughput, (uintmax_t)latency.mean,
+               (uintmax_t)latency.p50, (uintmax_t)latency.p99,
+               (uintmax_t)latency.p999, (uintmax_t)latency.max);
+    } else {
+        printf("%-8s %8.1f s: %10.1f queries/s, latency p50 %.3f ms, "
+               "p99 %.3f ms, p999 %.3f ms, max %.3f ms, errors: %ju, "
+               "rejected: %ju", name, elapsed, throughput,
+               latency.p50 / 1e3, latency.p99 / 1e3, latency.p999 / 1e3,
+               latency.max / 1e3, (uintmax_t)stats->nb_errors,
+               (uintmax_t)stats->nb_rejected);
+        if (nb_unsent) {
+            printf(", unsent: %ju", (uintmax_t)nb_unsent);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/** Write the report of the whole load, and exit the client. */
+static void wordcount_load_finish(void)
+{
+    el_unregister(&_G.load.report_timer);
+    wordcount_load_report("total", &_G.load.total,
+                          wordcount_now_nsec() - _G.load.start_nsec);
+    worcount_client_exit(_G.load.total.nb_errors ? -1 : 0);
+}
+
+/** Called when a query of the load is answered. */
+static void wordcount_load_on_reply(const ic_msg_t *msg, ic_status_t status)
+{
+    const wordcount_load_query_t *load_query;
+    int64_t latency;
+
+    load_query = (const wordcount_load_query_t *)msg->priv;
+    latency = wordcount_now_nsec() - load_query->start_nsec;
+    load_query->conn->nb_tasks--;
+    _G.load.nb_in_flight--;
+
+    if (el_is_terminating()) {
+        /* Query aborted by the connection being closed */
+        return;
+    }
+
+    if (status == IC_MSG_OK) {
+        wordcount_histogram_record(&_G.load.interval.latency, latency);
+        wordcount_histogram_record(&_G.load.total.latency, latency);
+    } else if (status == IC_MSG_RETRY) {
+        _G.load.interval.nb_rejected++;
+        _G.load.total.nb_rejected++;
+    } else {
+        _G.load.interval.nb_errors++;
+        _G.load.total.nb_errors++;
+    }
+
+    if (_G.load.stopping) {
+        if (!_G.load.nb_in_flight) {
+            wordcount_load_finish();
+        }
+        return;
+    }
+    wordcount_load_send_queries();
+}
+
+static void wordcount_load_on_send_timer(el_t ev, data_t priv)
+{
+    wordcount_load_send_queries();
+}
+
+static void wordcount_load_on_report_timer(el_t ev, data_t priv)
+{
+    int64_t now = wordcount_now_nsec();
+
+    wordcount_load_report("interval", &_G.load.interval,
+                          now - _G.load.interval_nsec);
+    p_clear(&_G.load.interval, 1);
+    _G.load.interval_nsec = now;
+}
+
+/** Called at the end of the load, the load is over once the queries in
+ * flight are answered. */
+static void wordcount_load_on_end_timer(el_t ev, data_t priv)
+{
+    _G.load.end_timer = NULL;
+    _G.load.stopping = true;
+    el_unregister(&_G.load.send_timer);
+    if (!_G.load.nb_in_flight) {
+        wordcount_load_finish();
+    }
+}
+
+/** Start the load once all the connections are established. */
+static void wordcount_load_start(void)
+{
+    unsigned report_interval = _G.opt_report_interval * 1000;
+
+    if (_G.load.started) {
+        return;
+    }
+    for (int i = 0; i < _G.nb_conns; i++) {
+        if (!_G.conns[i].connected) {
+            return;
+        }
+    }
+
+    e_notice("starting the load: %u connections, %s loop", _G.nb_conns,
+             _G.opt_rate ? "open" : "closed");
+    _G.load.started = true;
+    _G.load.start_nsec = wordcount_now_nsec();
+    _G.load.interval_nsec = _G.load.start_nsec;
+
+    if (_G.opt_rate) {
+        /* Send the scheduled queries every millisecond */
+        _G.load.send_timer = el_timer_register(1, 1, 0,
+                                               &wordcount_load_on_send_timer,
+                                               NULL);
+    }
+    _G.load.report_timer = el_timer_register(report_interval,
+                                             report_interval, 0,
+                                             &wordcount_load_on_report_timer,
+                                             NULL);
+    _G.load.end_timer = el_timer_register(_G.opt_duration * 1000, 0, 0,
+                                          &wordcount_load_on_end_timer,
+                                          NULL);
+    wordcount_load_send_queries();
 }
 
 /** Called on server status changes. */
 static void wordcount_client_on_event(ichannel_t *ic, ic_event_t evt)
 {
+    wordcount_conn_t *conn = container_of(ic, wordcount_conn_t, ic);
+
     if (evt == IC_EVT_CONNECTED) {
         e_notice("connected to server");
-        wordcount_client_on_connect();
+        conn->connected = true;
+        if (_G.opt_load) {
+            wordcount_load_start();
+        } else {
+            wordcount_client_start_tasks();
+        }
     } else if (evt == IC_EVT_DISCONNECTED && !el_is_terminating()) {
         e_warning("disconnected from server");
+        conn->connected = false;
         worcount_client_exit(-1);
     }
 }
@@ -170,6 +1418,7 @@ static int wordcount_client_initialize(void *nullable arg)
     t_scope;
     SB_1k(err);
     wordcount__server_cfg__t *server_cfg;
+    sockunion_t su;
 
     e_info("starting client");
 
@@ -181,26 +1430,47 @@ static int wordcount_client_initialize(void *nullable arg)
         return -1;
     }
 
-    /* Create the remote ichannel to connect to the server */
-    ic_init(&_G.remote_ic);
-    _G.remote_ic.on_event = &wordcount_client_on_event;
-
-    /* Get the socket union from the address */
-    if (addr_info_str(&_G.remote_ic.su, server_cfg->address.s,
-                      server_cfg->port, AF_UNSPEC) < 0)
+    /* The queries over the maxConnectionQueries of a connection would only
+     * be rejected by the server, and sent again */
+    if (server_cfg->max_connection_queries
+    &&  _G.opt_in_flight > _G.opt_connections
+                         * server_cfg->max_connection_queries)
     {
-        e_error("unable to resolve address %pL:%d", &server_cfg->address,
-                server_cfg->port);
-        return -1;
+        unsigned in_flight = _G.opt_connections
+                           * server_cfg->max_connection_queries;
+
+        e_warning("only %u queries in flight on %u connections are "
+                  "admitted by the server, using --in-flight %u",
+                  in_flight, _G.opt_connections, in_flight);
+        _G.opt_in_flight = in_flight;
     }
 
-    /* Connect to the server */
-    if (ic_connect(&_G.remote_ic) < 0) {
-        e_error("cannot connect to %pL:%d", &server_cfg->address,
-                server_cfg->port);
+    /* Get the socket union from the address, or from the unix socket of
+     * the server */
+    if (wordcount_server_sockunion(server_cfg, _G.opt_tcp, &su) < 0) {
         return -1;
     }
 
+    wordcount_map_init(&_G.map);
+
+    /* Create the remote ichannels of the pool, and connect them to the
+     * server. The files are counted as soon as a connection is
+     * established. */
+    _G.nb_conns = _G.opt_connections;
+    _G.conns = p_new(wordcount_conn_t, _G.nb_conns);
+    for (int i = 0; i < _G.nb_conns; i++) {
+        ichannel_t *ic = &_G.conns[i].ic;
+
+        ic_init(ic);
+        ic->on_event = &wordcount_client_on_event;
+        ic->su = su;
+
+        if (ic_connect(ic) < 0) {
+            e_error("cannot connect to the server");
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -210,7 +1480,12 @@ static int wordcount_client_initialize(void *nullable arg)
  */
 static void wordcount_client_on_term(int signo)
 {
-    ic_bye(&_G.remote_ic);
+    el_unregister(&_G.load.send_timer);
+    el_unregister(&_G.load.report_timer);
+    el_unregister(&_G.load.end_timer);
+    for (int i = 0; i < _G.nb_conns; i++) {
+        ic_bye(&_G.conns[i].ic);
+    }
 }
 
 /** Shutdown callback called when the module is released.
@@ -220,7 +1495,12 @@ static void wordcount_client_on_term(int signo)
 static int wordcount_client_shutdown(void)
 {
     e_info("stopping client");
-    ic_wipe(&_G.remote_ic);
+    for (int i = 0; i < _G.nb_conns; i++) {
+        ic_wipe(&_G.conns[i].ic);
+    }
+    p_delete(&_G.conns);
+    _G.nb_conns = 0;
+    wordcount_map_wipe(&_G.map);
     return 0;
 }
 
@@ -230,6 +1510,9 @@ static MODULE_BEGIN(wordcount_client)
      * after this module */
     MODULE_DEPENDS_ON(wordcount_base);
 
+    /* The files are tokenized like by the server with --pre-aggregate */
+    MODULE_DEPENDS_ON(wordcount_tokenize);
+
     /* Implement module method to react on termination signals */
     MODULE_IMPLEMENTS_INT(on_term, wordcount_client_on_term);
 MODULE_END()
@@ -240,12 +1523,45 @@ int main(int argc, char **argv)
 
     /* Parse the arguments */
     argc = parseopt(argc, argv, opts_g, 0);
-    if (argc != 1 || _G.opt_help || !_G.opt_cfg_path) {
+    if ((argc < 1 && !_G.opt_stdin) || _G.opt_help || !_G.opt_cfg_path) {
         makeusage(_G.opt_help ? 0 : -1, arg0, short_args_g,
                   long_usage_g, opts_g);
     }
+    if (!_G.opt_chunk_size || !_G.opt_window || !_G.opt_connections
+    ||  !_G.opt_in_flight || !_G.opt_duration || !_G.opt_report_interval)
+    {
+        makeusage(-1, arg0, short_args_g, long_usage_g, opts_g);
+    }
+    if (_G.opt_pre_aggregate
+    &&  (_G.opt_server_side || _G.opt_approximate || _G.opt_ngram > 1
+    ||   _G.opt_load))
+    {
+        e_error("--pre-aggregate cannot be used with --server-side, "
+                "--approximate, --ngram or --load");
+        return -1;
+    }
+
+    /* Each client draws its own delays before retrying */
+    srand(getpid() ^ time(NULL));
 
-    _G.file_path = NEXTARG(argc, argv);
+    _G.codec = _G.opt_compress ? CODEC_ZLIB : CODEC_NONE;
+    _G.filter_set = _G.opt_filter_set ? LSTR(_G.opt_filter_set)
+                                      : LSTR_NULL_V;
+
+    /* Get the files to count */
+    qv_init(&_G.tasks);
+    _G.batch = argc > 1 || _G.opt_stdin;
+    while (argc > 0) {
+        wordcount_client_add_path(NEXTARG(argc, argv));
+    }
+    if (_G.opt_stdin) {
+        wordcount_client_add_stdin_paths();
+    }
+    if (_G.opt_load && wordcount_load_prepare() < 0) {
+        qv_deep_wipe(&_G.load.queries, lstr_wipe);
+        qv_deep_wipe(&_G.tasks, wordcount_task_delete);
+        return -1;
+    }
 
     /* Initialize wordcount_client module */
     MODULE_REQUIRE(wordcount_client);
@@ -257,5 +1573,8 @@ int main(int argc, char **argv)
     /* Shutdown the client */
     MODULE_RELEASE(wordcount_client);
 
+    qv_deep_wipe(&_G.tasks, wordcount_task_delete);
+    qv_deep_wipe(&_G.load.queries, lstr_wipe);
+
     return _G.exit_res;
 }
@@ -18,7 +18,16 @@
 ###########################################################################
 
 import argparse
+import collections
+import mmap
+import os
+import random
+import time
+import zlib
 
+from concurrent.futures import ThreadPoolExecutor
+from contextlib import contextmanager
+from functools import partial
 from pathlib import Path
 
 # IOPy is a Python module to be able to easily manipulate the IOPs and call
@@ -30,6 +39,15 @@ import iopy
 SCRIPT_DIR = Path(__file__).parent
 PLUGIN_PATH = SCRIPT_DIR / "wordcount-plugin.so"
 
+# Delay before sending again a query rejected by a busy server, doubled on
+# each rejection in a row up to the maximum, in seconds
+RETRY_DELAY = 0.1
+RETRY_MAX_DELAY = 5.0
+
+# Default number of files being counted at once, within the default
+# maxConnectionQueries of the server
+IN_FLIGHT = 8
+
 
 DESCRIPTION = """
 Client part of wordcount.
@@ -37,23 +55,276 @@ Client part of wordcount.
 Read the content of the file located at <file_path> and send it to the
 server to get the number of occurrences of each unique words via RPC.
 
+Several files are counted in batch: up to --in-flight queries are pipelined
+on the connection, and the results are written in the order of the files.
+The queries rejected by a busy server are sent again after a delay.
+
 The configuration of the server is expected to be in IOP YAML as
 described by the IOP `wordcount.ServerCfg`.
 """.strip()
 
 
+def print_distribution(name, distribution, unit=""):
+    print(f"{name}: count={distribution.count} mean={distribution.mean}{unit} "
+          f"p50={distribution.p50}{unit} p99={distribution.p99}{unit} "
+          f"p999={distribution.p999}{unit} max={distribution.max}{unit}")
+
+
+def print_stats(stats):
+    print(f"uptime: {stats.uptime}s")
+    print(f"connections: {stats.connections} "
+          f"(total: {stats.totalConnections})")
+    print(f"queries: countOccurrences={stats.countOccurrencesQueries} "
+          f"countFileOccurrences={stats.countFileOccurrencesQueries} "
+          f"pushChunk={stats.pushChunkQueries} "
+          f"endCount={stats.endCountQueries} "
+          f"mergeOccurrences={stats.mergeOccurrencesQueries} "
+          f"rejected={stats.rejectedQueries}")
+    print(f"admission: pending={stats.pendingQueries} "
+          f"inflightBytes={stats.inflightBytes} "
+          f"rejectedPayloads={stats.rejectedPayloads} "
+          f"rejectedInflight={stats.rejectedInflightQueries} "
+          f"rejectedPerConnection={stats.rejectedConnectionQueries} "
+          f"rejectedConnections={stats.rejectedConnections}")
+    print(f"cache: hits={stats.cacheHits} misses={stats.cacheMisses} "
+          f"evictions={stats.cacheEvictions}")
+    print(f"bytes: in={stats.bytesIn} out={stats.bytesOut}")
+    for stage in stats.stages:
+        print_distribution(f"latency {stage.stage}", stage.latency, "us")
+    print_distribution("distinct words", stats.distinctWords)
+    print(f"high-water marks: map={stats.mapHighWaterMark} "
+          f"t_stack={stats.tStackHighWaterMark}")
+
+
+def get_word_occurrences(plugin, res):
+    """Get the word occurrences of a reply, compressed or not."""
+    if res.codec.get_as_str() == "ZLIB":
+        # The reply is a packed WordOccurrencesList, compressed
+        packed = zlib.decompress(res.compressedWordOccurrences)
+        return plugin.wordcount.WordOccurrencesList.from_bin(
+            packed).wordOccurrences
+    return res.wordOccurrences
+
+
+def call_retried(call):
+    """Call a query, and call it again while the server rejects it as busy.
+
+    The query rejected with the RETRY status is sent again after a delay
+    doubled on each rejection in a row, and drawn at random in its upper
+    half so that the threads rejected at once do not all retry at once.
+    """
+    delay = RETRY_DELAY
+    while True:
+        try:
+            return call()
+        except Exception as exc:  # pylint: disable=broad-except
+            if "retry" not in str(exc).lower():
+                raise
+        time.sleep(random.uniform(delay / 2, delay))
+        delay = min(2 * delay, RETRY_MAX_DELAY)
+
+
+@contextmanager
+def map_file(path):
+    """Map the content of a file, it is neither read nor decoded.
+
+    Empty files cannot be mapped, their content is then b"".
+    """
+    with open(path, "rb") as f:
+        if os.fstat(f.fileno()).st_size == 0:
+            yield b""
+            return
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as content:
+            yield content
+
+
+class Counter:
+    """Count files through a connection to the server.
+
+    The methods can be called from several threads at once: their queries
+    are then pipelined on the connection, IOPy waiting for the replies
+    without holding the GIL. count_many() does so with a pool of threads.
+    """
+
+    # pylint: disable=too-many-arguments
+    def __init__(self, plugin, ic, limit=0, min_occurrences=0,
+                 server_side=False, compress=False, page_size=0,
+                 approximate=False, ngram=1, utf8=False, filter_set=None):
+        self.plugin = plugin
+        self.iface = ic.wordcount_Mod.wordcountIface
+        self.limit = limit
+        self.min_occurrences = min_occurrences
+        self.server_side = server_side
+        self.compress = compress
+        self.reply_codec = "ZLIB" if compress else "NONE"
+        self.page_size = page_size
+        self.approximate = approximate
+        self.ngram = ngram
+        self.utf8 = utf8
+        self.filter_set = filter_set
+
+    def query(self, path):
+        """Send the query counting a file, and get its first reply."""
+        params = dict(limit=self.limit, minOccurrences=self.min_occurrences,
+                      replyCodec=self.reply_codec, pageSize=self.page_size,
+                      approximate=self.approximate, ngram=self.ngram,
+                      utf8=self.utf8)
+        if self.filter_set:
+            params["filterSet"] = self.filter_set
+
+        if self.server_side:
+            # Let the server read the file, only send its absolute path
+            return self.iface.countFileOccurrences(
+                path=str(Path(path).resolve()), **params)
+
+        with map_file(path) as content:
+            if self.compress:
+                # zlib reads the mapped content in place
+                return self.iface.countOccurrences(
+                    fileContent="", codec="ZLIB",
+                    compressedContent=zlib.compress(content, 1), **params)
+
+            # The bytes are packed by IOPy as they are, without the UTF-8
+            # decoding and encoding of a str
+            return self.iface.countOccurrences(fileContent=content[:],
+                                               **params)
+
+    def count(self, path):
+        """Count a file, and get its word occurrences.
+
+        The pages of a paged result are fetched until the last one.
+        """
+        res = call_retried(partial(self.query, path))
+        result_id = getattr(res, "resultId", None)
+        word_occurrences = []
+        while True:
+            word_occurrences.extend(get_word_occurrences(self.plugin, res))
+            next_cursor = getattr(res, "nextCursor", None)
+            if next_cursor is None:
+                return word_occurrences
+            res = self.iface.fetchPage(resultId=result_id,
+                                       cursor=next_cursor,
+                                       replyCodec=self.reply_codec)
+
+    def try_count(self, path):
+        """Count a file, and get its word occurrences and its error."""
+        try:
+            return self.count(path), None
+        except Exception as exc:  # pylint: disable=broad-except
+            return None, exc
+
+    def count_many(self, paths, in_flight=IN_FLIGHT):
+        """Count files with up to in_flight queries pipelined.
+
+        Yield (path, word_occurrences, error) in the order of the paths, only
+        in_flight files are counted ahead of the next one to yield, so the
+        memory used does not depend on the number of files. Above the
+        maxConnectionQueries of the server, the extra queries are rejected
+        and sent again later.
+        """
+        with ThreadPoolExecutor(max_workers=in_flight) as executor:
+            pending = collections.deque()
+            for path in paths:
+                if len(pending) == in_flight:
+                    done_path, future = pending.popleft()
+                    yield (done_path, *future.result())
+                pending.append((path, executor.submit(self.try_count, path)))
+            while pending:
+                done_path, future = pending.popleft()
+                yield (done_path, *future.result())
+
+
+def print_word_occurrences(word_occurrences):
+    for item in word_occurrences:
+        max_error = getattr(item, "maxError", None)
+        if max_error is None:
+            print(f"{item.word} => {item.occurrences}")
+        else:
+            print(f"{item.word} => {item.occurrences} (-{max_error})")
+
+
 def main():
     # Parse the arguments
     parser = argparse.ArgumentParser(description=DESCRIPTION)
     parser.add_argument("-c", "--cfg",
                         help="path to the server configuration in YAML",
                         required=True)
-    parser.add_argument("file_path",
+    parser.add_argument("-l", "--limit", type=int, default=0,
+                        help=(
+                            "only get the words with the most occurrences, "
+                            "up to this number of words"
+                        ))
+    parser.add_argument("-m", "--min-occurrences", type=int, default=0,
+                        help=(
+                            "only get the words with at least this number of "
+                            "occurrences"
+                        ))
+    parser.add_argument("-S", "--server-side", action="store_true",
+                        help=(
+                            "let the server read the file, which must be in "
+                            "one of its countFileRoots directories"
+                        ))
+    parser.add_argument("-z", "--compress", action="store_true",
+                        help=(
+                            "compress the file content sent to the server, "
+                            "and accept a compressed reply"
+                        ))
+    parser.add_argument("-T", "--tcp", action="store_true",
+                        help=(
+                            "connect over TCP even when the server listens "
+                            "on unix sockets"
+                        ))
+    parser.add_argument("-p", "--page-size", type=int, default=0,
+                        help=(
+                            "fetch the result by pages of this number of "
+                            "words"
+                        ))
+    parser.add_argument("-a", "--approximate", action="store_true",
+                        help=(
+                            "count the words approximately in the bounded "
+                            "memory of the server"
+                        ))
+    parser.add_argument("-g", "--ngram", type=int, default=1,
+                        help=(
+                            "count the sequences of this number of words, up "
+                            "to 4, instead of the words"
+                        ))
+    parser.add_argument("-u", "--utf8", action="store_true",
+                        help=(
+                            "read the file as UTF-8: the non-ASCII letters "
+                            "are parts of the words and their case is folded"
+                        ))
+    parser.add_argument("-f", "--filter-set",
+                        help=(
+                            "do not count the words rejected by this filter "
+                            "set of the server"
+                        ))
+    parser.add_argument("--add-to-corpus", metavar="NAME",
+                        help=(
+                            "add the words of the file to a persistent "
+                            "corpus of the server instead of counting it"
+                        ))
+    parser.add_argument("--query-corpus", metavar="NAME",
+                        help=(
+                            "get the words of a persistent corpus of the "
+                            "server instead of counting a file"
+                        ))
+    parser.add_argument("-q", "--in-flight", type=int, default=IN_FLIGHT,
+                        help=(
+                            "maximum number of files being counted at once"
+                        ))
+    parser.add_argument("-s", "--stats", action="store_true",
+                        help="get the runtime statistics of the server")
+    parser.add_argument("file_path", nargs="*",
                         help=(
                             "path to the file which content is sent to the "
                             "server"
                         ))
     args = parser.parse_args()
+    if not args.stats and not args.query_corpus and not args.file_path:
+        parser.error("the file_path argument is required")
+    if args.in_flight < 1:
+        parser.error("--in-flight must be at least 1")
 
     # Load the plugin
     plugin = iopy.Plugin(str(PLUGIN_PATH))
@@ -61,21 +332,61 @@ def main():
     # Read the configuration
     cfg = plugin.wordcount.ServerCfg.from_file(_yaml=args.cfg)
 
-    # Connect to the server
-    ic = plugin.connect(f"{cfg.address}:{cfg.port}")
+    # Connect to the server, on its first unix socket when it is on the same
+    # host, as it avoids the TCP stack
+    if cfg.unixSockets and not args.tcp:
+        ic = plugin.connect(f"unix:{cfg.unixSockets[0]}")
+    else:
+        ic = plugin.connect(f"{cfg.address}:{cfg.port}")
 
-    # Read the file content
-    with open(args.file_path, "r") as f:
-        file_content = f.read()
+    if args.stats:
+        # Print the statistics of the server instead of counting a file
+        res = ic.wordcount_Mod.statsIface.getStats()
+        print_stats(res.stats)
+        return
 
-    # Query the RPC with the file content
-    res = ic.wordcount_Mod.wordcountIface.countOccurrences(
-        fileContent=file_content)
-    word_occurrences = res.wordOccurrences
+    reply_codec = "ZLIB" if args.compress else "NONE"
+    if args.add_to_corpus:
+        # Send the file contents to be accumulated in the corpus
+        iface = ic.wordcount_Mod.wordcountIface
+        for file_path in args.file_path:
+            with map_file(file_path) as content:
+                call_retried(partial(iface.addToCorpus,
+                                     name=args.add_to_corpus,
+                                     content=content[:]))
+        return
 
-    # Print the word occurrences
-    for item in word_occurrences:
-        print(f"{item.word} => {item.occurrences}")
+    if args.query_corpus:
+        res = ic.wordcount_Mod.wordcountIface.queryCorpus(
+            name=args.query_corpus, limit=args.limit,
+            minOccurrences=args.min_occurrences, replyCodec=reply_codec)
+        print_word_occurrences(get_word_occurrences(plugin, res))
+        return
+
+    counter = Counter(plugin, ic, limit=args.limit,
+                      min_occurrences=args.min_occurrences,
+                      server_side=args.server_side, compress=args.compress,
+                      page_size=args.page_size,
+                      approximate=args.approximate, ngram=args.ngram,
+                      utf8=args.utf8, filter_set=args.filter_set)
+    if len(args.file_path) == 1:
+        # Print the word occurrences of the file
+        print_word_occurrences(counter.count(args.file_path[0]))
+        return
+
+    # Print the word occurrences of each file after its path, in the order
+    # of the files
+    nb_failed = 0
+    for path, word_occurrences, error in counter.count_many(
+            args.file_path, in_flight=args.in_flight):
+        if error is not None:
+            print(f"{path}: error: {error}")
+            nb_failed += 1
+            continue
+        print(f"{path}:")
+        print_word_occurrences(word_occurrences)
+    if nb_failed:
+        raise SystemExit(1)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,167 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <zlib.h>
+
+#include <lib-common/iop.h>
+
+#include "wordcount-codec.h"
+
+/* Compression level of zlib. The fastest level already compresses text
+ * about 3 times, the next ones cost much more for a few percents. */
+#define WORDCOUNT_ZLIB_LEVEL  Z_BEST_SPEED
+
+/* Size of the buffer of the streaming decompression. It is small enough to
+ * stay in the L1/L2 caches while the chunk is tokenized. */
+#define WORDCOUNT_DECOMPRESS_BUF_SIZE  (16 << 10)
+
+int t_wordcount_compress(wordcount__codec__t codec, lstr_t data,
+                         lstr_t *out)
+{
+    uLongf len;
+    char *buf;
+
+    if (codec != CODEC_ZLIB) {
+        return -1;
+    }
+
+    len = compressBound(data.len);
+    buf = t_new_raw(char, len);
+    if (compress2((Bytef *)buf, &len, (const Bytef *)data.s, data.len,
+                  WORDCOUNT_ZLIB_LEVEL) != Z_OK)
+    {
+        return -1;
+    }
+    *out = LSTR_DATA_V(buf, len);
+    return 0;
+}
+
+int wordcount_decompress_stream(wordcount__codec__t codec, lstr_t data,
+                                size_t max_size,
+                                wordcount_decompress_cb_f *cb, void *priv)
+{
+    char buf[WORDCOUNT_DECOMPRESS_BUF_SIZE];
+    size_t size = 0;
+    z_stream zs;
+    int ret;
+
+    if (codec != CODEC_ZLIB) {
+        return -1;
+    }
+
+    p_clear(&zs, 1);
+    if (inflateInit(&zs) != Z_OK) {
+        return -1;
+    }
+    zs.next_in = (Bytef *)data.s;
+    zs.avail_in = data.len;
+
+    /* Give each filled buffer to the callback, until the end of the
+     * compressed stream or an error. A truncated stream ends with
+     * Z_BUF_ERROR since no progress is possible. */
+    do {
+        int len;
+
+        zs.next_out = (Bytef *)buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            break;
+        }
+        len = sizeof(buf) - zs.avail_out;
+        size += len;
+        if (max_size && size > max_size) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        if (len && (*cb)(priv, LSTR_PTR_V(buf, len)) < 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+    } while (ret == Z_OK);
+
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END && zs.avail_in == 0 ? 0 : -1;
+}
+
+/** Buffer receiving decompressed data. */
+typedef struct wordcount_decompress_sb_t {
+    sb_t *out;
+    const volatile bool * nullable canceled;
+} wordcount_decompress_sb_t;
+
+static int wordcount_decompress_to_sb(void *priv, lstr_t chunk)
+{
+    wordcount_decompress_sb_t *decompress_sb = priv;
+
+    if (decompress_sb->canceled && *decompress_sb->canceled) {
+        return -1;
+    }
+    sb_add_lstr(decompress_sb->out, chunk);
+    return 0;
+}
+
+int wordcount_decompress(wordcount__codec__t codec, lstr_t data,
+                         size_t max_size,
+                         const volatile bool * nullable canceled, sb_t *out)
+{
+    wordcount_decompress_sb_t decompress_sb = {
+        .out = out,
+        .canceled = canceled,
+    };
+
+    return wordcount_decompress_stream(codec, data, max_size,
+                                       &wordcount_decompress_to_sb,
+                                       &decompress_sb);
+}
+
+int t_wordcount_compress_word_occurrences(
+    wordcount__codec__t codec,
+    const wordcount__word_occurrences__array_t *word_occurrences_array,
+    lstr_t *out)
+{
+    wordcount__word_occurrences_list__t list = {
+        .word_occurrences = *word_occurrences_array,
+    };
+    lstr_t packed;
+
+    packed = t_iop_bpack_struct(&wordcount__word_occurrences_list__s, &list);
+    return t_wordcount_compress(codec, packed, out);
+}
+
+int t_wordcount_decompress_word_occurrences(
+    wordcount__codec__t codec, lstr_t data, size_t max_size,
+    wordcount__word_occurrences__array_t *word_occurrences_array)
+{
+    wordcount__word_occurrences_list__t list;
+    SB_8k(packed);
+    int res = -1;
+
+    /* The words are copied on the t_stack while unpacking, so the
+     * decompressed buffer can be released */
+    if (wordcount_decompress(codec, data, max_size, NULL, &packed) >= 0
+    &&  iop_bunpack(t_pool(), &wordcount__word_occurrences_list__s, &list,
+                    ps_initsb(&packed), true) >= 0)
+    {
+        *word_occurrences_array = list.word_occurrences;
+        res = 0;
+    }
+
+    sb_wipe(&packed);
+    return res;
+}
@@ -0,0 +1,110 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_CODEC_H
+#define IS_WORDCOUNT_CODEC_H
+
+#include <lib-common/core.h>
+
+#include "wordcount.iop.h"
+
+/** Callback receiving the decompressed data chunk by chunk.
+ *
+ * \param[in] priv  The private data given to wordcount_decompress_stream().
+ * \param[in] chunk The next decompressed chunk, it is only valid during the
+ *                  call.
+ * \return -1 to stop the decompression, 0 otherwise.
+ */
+typedef int (wordcount_decompress_cb_f)(void *priv, lstr_t chunk);
+
+/** Compress data.
+ *
+ * \param[in]  codec The codec, not CODEC_NONE.
+ * \param[in]  data  The data to compress.
+ * \param[out] out   The compressed data, allocated on the t_stack.
+ * \return -1 in case of error, 0 otherwise.
+ */
+int t_wordcount_compress(wordcount__codec__t codec, lstr_t data,
+                         lstr_t *out);
+
+/** Decompress data chunk by chunk.
+ *
+ * The data is decompressed in a fixed-size buffer, so the whole
+ * decompressed data is never in memory.
+ *
+ * \param[in] codec    The codec of the data, not CODEC_NONE.
+ * \param[in] data     The compressed data.
+ * \param[in] max_size The maximum size of the decompressed data, 0 for no
+ *                     limit. The decompression stops as soon as it is
+ *                     exceeded, a few bytes of compressed data can expand
+ *                     to gigabytes.
+ * \param[in] cb       The callback called for each decompressed chunk.
+ * \param[in] priv     The private data given to \p cb.
+ * \return -1 if the data is not valid, if it is bigger than \p max_size
+ *         once decompressed, or if \p cb stopped the decompression, 0
+ *         otherwise.
+ */
+int wordcount_decompress_stream(wordcount__codec__t codec, lstr_t data,
+                                size_t max_size,
+                                wordcount_decompress_cb_f *cb, void *priv);
+
+/** Decompress data in a buffer.
+ *
+ * \param[in]  codec    The codec of the data, not CODEC_NONE.
+ * \param[in]  data     The compressed data.
+ * \param[in]  max_size The maximum size of the decompressed data, 0 for no
+ *                      limit.
+ * \param[in]  canceled Optional flag stopping the decompression when it is
+ *                      set by another thread.
+ * \param[out] out      The buffer the decompressed data is appended to.
+ * \return -1 if the data is not valid, if it is too big once decompressed,
+ *         or if the decompression has been canceled, 0 otherwise.
+ */
+int wordcount_decompress(wordcount__codec__t codec, lstr_t data,
+                         size_t max_size,
+                         const volatile bool * nullable canceled, sb_t *out);
+
+/** Pack and compress sorted word occurrences for a reply.
+ *
+ * \param[in]  codec                  The codec, not CODEC_NONE.
+ * \param[in]  word_occurrences_array The sorted word occurrences.
+ * \param[out] out                    The packed and compressed word
+ *                                    occurrences, allocated on the t_stack.
+ * \return -1 in case of error, 0 otherwise.
+ */
+int t_wordcount_compress_word_occurrences(
+    wordcount__codec__t codec,
+    const wordcount__word_occurrences__array_t *word_occurrences_array,
+    lstr_t *out);
+
+/** Decompress and unpack the sorted word occurrences of a reply.
+ *
+ * \param[in]  codec                  The codec of the word occurrences.
+ * \param[in]  data                   The compressed word occurrences.
+ * \param[in]  max_size               The maximum size of the packed word
+ *                                    occurrences, 0 for no limit.
+ * \param[out] word_occurrences_array The sorted word occurrences, allocated
+ *                                    on the t_stack.
+ * \return -1 if the data is not valid or too big once decompressed, 0
+ *         otherwise.
+ */
+int t_wordcount_decompress_word_occurrences(
+    wordcount__codec__t codec, lstr_t data, size_t max_size,
+    wordcount__word_occurrences__array_t *word_occurrences_array);
+
+#endif /* IS_WORDCOUNT_CODEC_H */
@@ -0,0 +1,591 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lib-common/unix.h>
+
+#include "wordcount-corpus.h"
+
+/* Corpus file */
+
+/** Get a word of a corpus file. */
+static inline lstr_t
+wordcount_corpus_file_word(const wordcount_corpus_file_t *file, uint32_t id)
+{
+    return LSTR_PTR_V(file->words + file->offsets[id],
+                      file->offsets[id + 1] - file->offsets[id]);
+}
+
+/** Compare two lower-cased words by bytes, the order of a corpus file. */
+static int wordcount_corpus_word_cmp(lstr_t a, lstr_t b)
+{
+    int res = memcmp(a.s, b.s, MIN(a.len, b.len));
+
+    return res ? res : CMP(a.len, b.len);
+}
+
+static int wordcount_corpus_word_occurrences_cmp(const void *a, const void *b)
+{
+    const wordcount__word_occurrences__t *wa = a;
+    const wordcount__word_occurrences__t *wb = b;
+
+    return wordcount_corpus_word_cmp(wa->word, wb->word);
+}
+
+/** Find a lower-cased word in a corpus file.
+ *
+ * \return The identifier of the word, -1 if it is not in the file.
+ */
+static int64_t wordcount_corpus_file_find(const wordcount_corpus_file_t *file,
+                                          lstr_t word)
+{
+    uint32_t low = 0;
+    uint32_t high = file->nb_words;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        int cmp = wordcount_corpus_word_cmp(
+            wordcount_corpus_file_word(file, mid), word);
+
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return -1;
+}
+
+/** Map a corpus file and check its format.
+ *
+ * \param[out] file The mapped file.
+ * \param[in]  path The path of the file.
+ * \return -1 with errno set if the file cannot be mapped, -1 with errno set
+ *         to EINVAL if it is not a valid corpus file, 0 otherwise.
+ */
+static int wordcount_corpus_file_map(wordcount_corpus_file_t *file,
+                                     const char *path)
+{
+    const wordcount_corpus_header_t *header;
+    struct stat st;
+    uint64_t size;
+    int fd;
+
+    p_clear(file, 1);
+
+    /* The inode is got from the mapped file itself, so that it is the one
+     * of the mapped content even if the file is replaced meanwhile */
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0
+    ||  lstr_init_from_fd(&file->map, fd, PROT_READ, MAP_SHARED) < 0)
+    {
+        p_close(&fd);
+        return -1;
+    }
+    p_close(&fd);
+    file->ino = st.st_ino;
+
+    /* Check the header and the size of the arrays */
+    header = (const wordcount_corpus_header_t *)file->map.s;
+    if (file->map.len < ssizeof(*header)
+    ||  memcmp(header->magic, WORDCOUNT_CORPUS_MAGIC, sizeof(header->magic))
+    ||  header->version != WORDCOUNT_CORPUS_VERSION)
+    {
+        goto invalid;
+    }
+    size = sizeof(*header) + (3 * (uint64_t)header->nb_words + 1)
+                           * sizeof(uint32_t)
+         + header->words_size;
+    if (size != (uint64_t)file->map.len) {
+        goto invalid;
+    }
+
+    file->nb_words = header->nb_words;
+    file->counts = (const uint32_t *)(header + 1);
+    file->ranks = file->counts + file->nb_words;
+    file->offsets = file->ranks + file->nb_words;
+    file->words = (const char *)(file->offsets + file->nb_words + 1);
+
+    /* Check the offsets and the ranks, so that a corrupted file cannot make
+     * a query read outside of the mapping */
+    if (file->offsets[0] != 0
+    ||  file->offsets[file->nb_words] != header->words_size)
+    {
+        goto invalid;
+    }
+    for (uint32_t i = 0; i < file->nb_words; i++) {
+        if (file->offsets[i] > file->offsets[i + 1]
+        ||  file->ranks[i] >= file->nb_words)
+        {
+            goto invalid;
+        }
+    }
+    return 0;
+
+  invalid:
+    lstr_wipe(&file->map);
+    p_clear(file, 1);
+    errno = EINVAL;
+    return -1;
+}
+
+/* Corpus */
+
+wordcount_corpus_t *wordcount_corpus_init(wordcount_corpus_t *corpus)
+{
+    p_clear(corpus, 1);
+    wordcount_counter_init(&corpus->added);
+    wordcount_counter_init(&corpus->pending);
+    return corpus;
+}
+
+void wordcount_corpus_wipe(wordcount_corpus_t *corpus)
+{
+    p_delete(&corpus->path);
+    lstr_wipe(&corpus->file.map);
+    wordcount_counter_wipe(&corpus->added);
+    wordcount_counter_wipe(&corpus->pending);
+}
+
+int wordcount_corpus_open(wordcount_corpus_t *corpus, const char *path)
+{
+    corpus->path = p_strdup(path);
+    return wordcount_corpus_reload(corpus);
+}
+
+int wordcount_corpus_reload(wordcount_corpus_t *corpus)
+{
+    wordcount_corpus_file_t file;
+    struct stat st;
+
+    if (stat(corpus->path, &st) < 0) {
+        if (errno == ENOENT) {
+            /* Not saved yet, or removed: the mapped file, if any, is still
+             * the latest content */
+            return 0;
+        }
+        e_error("cannot stat corpus file `%s`: %m", corpus->path);
+        return -1;
+    }
+    if (corpus->file.map.s && st.st_ino == corpus->file.ino) {
+        return 0;
+    }
+
+    if (wordcount_corpus_file_map(&file, corpus->path) < 0) {
+        e_error("cannot map corpus file `%s`: %m", corpus->path);
+        return -1;
+    }
+    lstr_wipe(&corpus->file.map);
+    corpus->file = file;
+    return 0;
+}
+
+/** Add the occurrences of the words of a counter to another counter.
+ *
+ * \param[in] counter The counter the words are added to.
+ * \param[in] from    The counter whose words are added.
+ */
+static void wordcount_corpus_merge_counter(wordcount_counter_t *counter,
+                                           const wordcount_counter_t *from)
+{
+    tab_for_each_ptr(entry, &from->map.entries) {
+        const char *word = from->words.data + entry->offset;
+        bool created;
+
+        wordcount_map_add(&counter->map, counter->words.data, word,
+                          entry->len, wordcount_hash_word(word, entry->len),
+                          counter->words.len, entry->occurrences, &created);
+        if (created) {
+            sb_add(&counter->words, word, entry->len);
+        }
+    }
+}
+
+void wordcount_corpus_add(wordcount_corpus_t *corpus,
+                          const wordcount_counter_t *counter)
+{
+    /* The added words must not change while they are saved */
+    wordcount_corpus_merge_counter(corpus->saving ? &corpus->pending
+                                                  : &corpus->added,
+                                   counter);
+}
+
+/** Add occurrences without overflowing. */
+static inline uint32_t wordcount_corpus_add_counts(uint32_t a, uint32_t b)
+{
+    return MIN((uint64_t)a + b, UINT32_MAX);
+}
+
+/** Lower-case the words added to a corpus.
+ *
+ * \return The words, at the same offsets as in the counter, allocated on the
+ *         t_stack.
+ */
+static const char *t_wordcount_corpus_lower_added(
+    const wordcount_corpus_t *corpus)
+{
+    const sb_t *words = &corpus->added.words;
+    char *buf = t_new_raw(char, words->len + 1);
+
+    for (int i = 0; i < words->len; i++) {
+        buf[i] = tolower((unsigned char)words->data[i]);
+    }
+    return buf;
+}
+
+/** Sort the words of a corpus file by decreasing occurrences.
+ *
+ * The LSD radix sort is stable, and the words are initially in increasing
+ * order, so the words with the same occurrences stay sorted.
+ *
+ * \param[in]  counts The occurrences of the words.
+ * \param[in]  len    The number of words.
+ * \param[out] ranks  The identifiers of the sorted words.
+ */
+static void wordcount_corpus_sort_ranks(const uint32_t *counts, uint32_t len,
+                                        uint32_t *ranks)
+{
+    uint32_t *src = ranks;
+    uint32_t *dst;
+    uint32_t *tmp;
+
+    for (uint32_t i = 0; i < len; i++) {
+        ranks[i] = i;
+    }
+    if (len < 2) {
+        return;
+    }
+
+    tmp = p_new_raw(uint32_t, len);
+    dst = tmp;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t offsets[256];
+
+#define DIGIT(id)  ((~counts[id] >> shift) & 0xff)
+
+        p_clear(offsets, countof(offsets));
+        for (uint32_t i = 0; i < len; i++) {
+            offsets[DIGIT(src[i])]++;
+        }
+        if (offsets[DIGIT(src[0])] == len) {
+            /* Same byte for all the words, nothing to do */
+            continue;
+        }
+        for (uint32_t d = 0, pos = 0; d < 256; d++) {
+            uint32_t count = offsets[d];
+
+            offsets[d] = pos;
+            pos += count;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            dst[offsets[DIGIT(src[i])]++] = src[i];
+        }
+        SWAP(uint32_t *, src, dst);
+
+#undef DIGIT
+    }
+
+    if (src != ranks) {
+        p_copy(ranks, src, len);
+    }
+    p_delete(&tmp);
+}
+
+/** Build the content of the new file of a corpus.
+ *
+ * The added words are merged with the words of the latest file, both being
+ * sorted.
+ *
+ * \param[in]  corpus The corpus.
+ * \param[in]  file   The latest file of the corpus.
+ * \param[out] size   The size of the content of the file.
+ * \return The content of the file, allocated on the heap, NULL if the
+ *         corpus is too big for the format.
+ */
+static char *wordcount_corpus_build(const wordcount_corpus_t *corpus,
+                                    const wordcount_corpus_file_t *file,
+                                    size_t *size)
+{
+    t_scope;
+    const wordcount_map_t *added = &corpus->added.map;
+    const char *added_words = t_wordcount_corpus_lower_added(corpus);
+    uint32_t *file_added = t_new(uint32_t, file->nb_words);
+    qv_t(word_occurrences_vec) new_words;
+    wordcount_corpus_header_t *header;
+    uint64_t words_size = file->nb_words ? file->offsets[file->nb_words] : 0;
+    uint64_t nb_words;
+    uint32_t *counts;
+    uint32_t *ranks;
+    uint32_t *offsets;
+    char *image;
+    char *words;
+    uint32_t pos = 0;
+    int i = 0;
+    int j = 0;
+
+    /* Split the added words between the ones already in the file and the
+     * new ones */
+    t_qv_init(&new_words, wordcount_map_len(added));
+    tab_for_each_ptr(entry, &added->entries) {
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = LSTR_PTR_V(added_words + entry->offset, entry->len),
+            .occurrences = entry->occurrences,
+        };
+        int64_t id = wordcount_corpus_file_find(file, word_occurrences.word);
+
+        if (id >= 0) {
+            file_added[id] = entry->occurrences;
+        } else {
+            qv_append(&new_words, word_occurrences);
+            words_size += entry->len;
+        }
+    }
+    qsort(new_words.tab, new_words.len, sizeof(new_words.tab[0]),
+          &wordcount_corpus_word_occurrences_cmp);
+
+    nb_words = file->nb_words + new_words.len;
+    if (nb_words >= UINT32_MAX || words_size > UINT32_MAX) {
+        e_error("corpus `%s` is too big for the corpus file format",
+                corpus->path);
+        return NULL;
+    }
+
+    /* Lay out the file, see wordcount_corpus_header_t */
+    *size = sizeof(*header) + (3 * nb_words + 1) * sizeof(uint32_t)
+          + words_size;
+    image = p_new_raw(char, *size);
+    header = (wordcount_corpus_header_t *)image;
+    p_clear(header, 1);
+    memcpy(header->magic, WORDCOUNT_CORPUS_MAGIC, sizeof(header->magic));
+    header->version = WORDCOUNT_CORPUS_VERSION;
+    header->nb_words = nb_words;
+    header->words_size = words_size;
+    counts = (uint32_t *)(header + 1);
+    ranks = counts + nb_words;
+    offsets = ranks + nb_words;
+    words = (char *)(offsets + nb_words + 1);
+
+    /* Merge the words of the file and the new words */
+    for (uint32_t k = 0; k < nb_words; k++) {
+        lstr_t word;
+
+        if (j >= new_words.len
+        ||  (i < (int)file->nb_words
+        &&   wordcount_corpus_word_cmp(wordcount_corpus_file_word(file, i),
+                                       new_words.tab[j].word) < 0))
+        {
+            word = wordcount_corpus_file_word(file, i);
+            counts[k] = wordcount_corpus_add_counts(file->counts[i],
+                                                    file_added[i]);
+            i++;
+        } else {
+            word = new_words.tab[j].word;
+            counts[k] = new_words.tab[j].occurrences;
+            j++;
+        }
+        offsets[k] = pos;
+        memcpy(words + pos, word.s, word.len);
+        pos += word.len;
+    }
+    offsets[nb_words] = pos;
+
+    wordcount_corpus_sort_ranks(counts, nb_words, ranks);
+    return image;
+}
+
+/** Write a file atomically.
+ *
+ * The content is written and synced in a temporary file, which then
+ * replaces the file, so the file is never seen partially written.
+ */
+static int wordcount_corpus_write(const char *path, const char *content,
+                                  size_t size)
+{
+    char tmp_path[PATH_MAX];
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        e_error("cannot create corpus file `%s`: %m", tmp_path);
+        return -1;
+    }
+    if (xwrite(fd, content, size) < 0 || fsync(fd) < 0) {
+        e_error("cannot write corpus file `%s`: %m", tmp_path);
+        p_close(&fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    p_close(&fd);
+
+    if (rename(tmp_path, path) < 0) {
+        e_error("cannot replace corpus file `%s`: %m", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void wordcount_corpus_begin_save(wordcount_corpus_t *corpus)
+{
+    assert (!corpus->saving);
+    corpus->saving = true;
+}
+
+int wordcount_corpus_save(const wordcount_corpus_t *corpus, bool wait)
+{
+    wordcount_corpus_file_t file;
+    char lock_path[PATH_MAX];
+    char *image = NULL;
+    size_t size;
+    int lock_fd;
+    int res = -1;
+
+    /* Serialize the saves of the processes sharing the corpus */
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", corpus->path);
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd < 0) {
+        e_error("cannot open corpus lock `%s`: %m", lock_path);
+        return -1;
+    }
+    if (flock(lock_fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0) {
+        /* Without waiting, the lock being taken is not an error, the
+         * corpus is saved later */
+        if (errno != EWOULDBLOCK) {
+            e_error("cannot lock corpus `%s`: %m", corpus->path);
+        }
+        p_close(&lock_fd);
+        return -1;
+    }
+
+    /* Another process may have saved its words since the file of the
+     * corpus was mapped, they must not be lost: the latest file is mapped
+     * for the save, the one of the corpus is still queried meanwhile */
+    if (wordcount_corpus_file_map(&file, corpus->path) < 0) {
+        if (errno != ENOENT) {
+            e_error("cannot map corpus file `%s`: %m", corpus->path);
+            goto end;
+        }
+        p_clear(&file, 1);
+    }
+    image = wordcount_corpus_build(corpus, &file, &size);
+    if (image && wordcount_corpus_write(corpus->path, image, size) >= 0) {
+        res = 0;
+    }
+    lstr_wipe(&file.map);
+
+  end:
+    p_delete(&image);
+    p_close(&lock_fd);
+    return res;
+}
+
+int wordcount_corpus_end_save(wordcount_corpus_t *corpus, bool saved)
+{
+    assert (corpus->saving);
+    corpus->saving = false;
+
+    if (!saved) {
+        /* The added words are saved by the next save, with the ones added
+         * meanwhile */
+        wordcount_corpus_merge_counter(&corpus->added, &corpus->pending);
+        wordcount_counter_wipe(&corpus->pending);
+        wordcount_counter_init(&corpus->pending);
+        return 0;
+    }
+
+    /* The saved words are in the file now, they must not be saved again
+     * even if the new file cannot be mapped */
+    wordcount_counter_wipe(&corpus->added);
+    corpus->added = corpus->pending;
+    wordcount_counter_init(&corpus->pending);
+    return wordcount_corpus_reload(corpus);
+}
+
+size_t t_wordcount_corpus_sort_word_occurrences(
+    const wordcount_corpus_t *corpus, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    const wordcount_corpus_file_t *file = &corpus->file;
+    const wordcount_map_t *added = &corpus->added.map;
+    const char *added_words = t_wordcount_corpus_lower_added(corpus);
+    uint64_t *is_added = t_new(uint64_t, DIV_ROUND_UP(file->nb_words, 64));
+    uint32_t nb_file_words = file->nb_words;
+    size_t words_size = 0;
+
+    if (params->limit) {
+        nb_file_words = MIN(nb_file_words, params->limit);
+    }
+    t_qv_init(word_occurrences_vec,
+              wordcount_map_len(added) + nb_file_words);
+
+    /* The added words, with their occurrences in the file */
+    tab_for_each_ptr(entry, &added->entries) {
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = LSTR_PTR_V(added_words + entry->offset, entry->len),
+            .occurrences = entry->occurrences,
+        };
+        int64_t id = wordcount_corpus_file_find(file, word_occurrences.word);
+
+        if (id >= 0) {
+            is_added[id / 64] |= 1ULL << (id % 64);
+            word_occurrences.occurrences = wordcount_corpus_add_counts(
+                word_occurrences.occurrences, file->counts[id]);
+        }
+        if (word_occurrences.occurrences >= params->min_occurrences) {
+            qv_append(word_occurrences_vec, word_occurrences);
+        }
+    }
+
+    /* The words of the file only, by rank: with a limit, no word after the
+     * first limit ones can be part of the result */
+    for (uint32_t rank = 0, nb_kept = 0;
+         rank < file->nb_words && nb_kept < nb_file_words; rank++)
+    {
+        uint32_t id = file->ranks[rank];
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = wordcount_corpus_file_word(file, id),
+            .occurrences = file->counts[id],
+        };
+
+        if (is_added[id / 64] & (1ULL << (id % 64))) {
+            continue;
+        }
+        if (word_occurrences.occurrences < params->min_occurrences) {
+            break;
+        }
+        qv_append(word_occurrences_vec, word_occurrences);
+        nb_kept++;
+    }
+
+    word_occurrences_vec->len = wordcount_sort_word_occurrences_tab(
+        word_occurrences_vec->tab, word_occurrences_vec->len, params->limit);
+    tab_for_each_ptr(word_occurrences, word_occurrences_vec) {
+        words_size += word_occurrences->word.len;
+    }
+    return words_size;
+}
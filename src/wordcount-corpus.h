@@ -0,0 +1,201 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_CORPUS_H
+#define IS_WORDCOUNT_CORPUS_H
+
+#include <lib-common/core.h>
+
+#include "wordcount-count.h"
+
+/* Magic and version of the corpus files, the version is increased on each
+ * incompatible change of the format */
+#define WORDCOUNT_CORPUS_MAGIC    "WCCORPUS"
+#define WORDCOUNT_CORPUS_VERSION  1
+
+/** Header of a corpus file.
+ *
+ * The header is followed by arrays of 32-bit integers in the byte order of
+ * the host, then by the words:
+ *  - counts[nb_words]: the occurrences of each word;
+ *  - ranks[nb_words]: the words by decreasing occurrences, then by
+ *    increasing word, so the top words are read without sorting;
+ *  - offsets[nb_words + 1]: the position of each word in the words, the
+ *    last one being words_size;
+ *  - words[words_size]: the lower-cased words sorted by bytes, one after the
+ *    other, so a word is found by a binary search.
+ *
+ * The file is mapped as is, nothing is rebuilt when it is loaded.
+ */
+typedef struct wordcount_corpus_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_words;
+    uint64_t words_size;
+} wordcount_corpus_header_t;
+
+/** Mapped corpus file. */
+typedef struct wordcount_corpus_file_t {
+    /** The mapped file, LSTR_NULL_V when there is no file yet, and its
+     * inode, to know when it is replaced. */
+    lstr_t map;
+    ino_t ino;
+
+    /** The arrays of the file, see wordcount_corpus_header_t. */
+    uint32_t nb_words;
+    const uint32_t *counts;
+    const uint32_t *ranks;
+    const uint32_t *offsets;
+    const char *words;
+} wordcount_corpus_file_t;
+
+/** Persistent corpus, whose word occurrences are accumulated over many
+ * contents.
+ *
+ * The word occurrences saved by the last save are in the mapped file, the
+ * ones added since then are counted in a word counter, and both are merged
+ * when the corpus is queried.
+ *
+ * Several processes can share the file of a corpus: the saves are
+ * serialized by a lock, and each one merges the counter of its process in
+ * the latest file, which is then replaced atomically.
+ *
+ * A save can run in another thread, between wordcount_corpus_begin_save()
+ * and wordcount_corpus_end_save(): the added words are only read by the
+ * save, the words added meanwhile are kept aside until it ends.
+ */
+typedef struct wordcount_corpus_t {
+    /** The path of the file of the corpus. */
+    char *path;
+
+    /** The mapped file of the corpus. */
+    wordcount_corpus_file_t file;
+
+    /** The words added since the last save. */
+    wordcount_counter_t added;
+
+    /** Whether the added words are being saved, and the words added
+     * meanwhile, which are part of the next save. */
+    bool saving;
+    wordcount_counter_t pending;
+} wordcount_corpus_t;
+
+wordcount_corpus_t *wordcount_corpus_init(wordcount_corpus_t *corpus);
+void wordcount_corpus_wipe(wordcount_corpus_t *corpus);
+GENERIC_NEW(wordcount_corpus_t, wordcount_corpus);
+GENERIC_DELETE(wordcount_corpus_t, wordcount_corpus);
+
+/** Open the file of a corpus.
+ *
+ * The file is mapped if it exists, otherwise the corpus starts empty and the
+ * file is created by the first save.
+ *
+ * \param[in] corpus The corpus.
+ * \param[in] path   The path of the file of the corpus.
+ * \return -1 if the file cannot be mapped or is not a valid corpus file, 0
+ *         otherwise.
+ */
+int wordcount_corpus_open(wordcount_corpus_t *corpus, const char *path);
+
+/** Map the file of a corpus again if it has been replaced.
+ *
+ * \param[in] corpus The corpus.
+ * \return -1 if the new file cannot be mapped or is not valid, the previous
+ *         one is then kept, 0 otherwise.
+ */
+int wordcount_corpus_reload(wordcount_corpus_t *corpus);
+
+/** Add the words counted in a counter to a corpus.
+ *
+ * The content is counted beforehand, in any thread, by a plain counter
+ * flushed at its end, so that only the distinct words are added here.
+ * While the corpus is being saved, the words are kept aside and are not
+ * seen by the queries until the save ends.
+ *
+ * \param[in] corpus  The corpus.
+ * \param[in] counter The flushed counter, it is not referenced after the
+ *                    call.
+ */
+void wordcount_corpus_add(wordcount_corpus_t *corpus,
+                          const wordcount_counter_t *counter);
+
+/** Get whether words have been added to a corpus since its last save. */
+static inline bool wordcount_corpus_is_dirty(const wordcount_corpus_t *corpus)
+{
+    return wordcount_map_len(&corpus->added.map) > 0
+        || wordcount_map_len(&corpus->pending.map) > 0;
+}
+
+/** Start the save of the words added to a corpus.
+ *
+ * Until wordcount_corpus_end_save(), the added words do not change and the
+ * file of the corpus is not reloaded, so that wordcount_corpus_save() can
+ * run in another thread.
+ *
+ * \param[in] corpus The corpus, which is not being saved.
+ */
+void wordcount_corpus_begin_save(wordcount_corpus_t *corpus);
+
+/** Save the words added to a corpus in a new file.
+ *
+ * The added words are merged with the latest file, mapped for the save
+ * only, in a new file which replaces it. The corpus itself is only read,
+ * the new file is mapped by wordcount_corpus_end_save().
+ *
+ * \param[in] corpus The corpus being saved.
+ * \param[in] wait   Whether to wait for the lock of the file when another
+ *                   process is saving the corpus, otherwise the save fails
+ *                   and can be retried later.
+ * \return -1 if the lock is taken, or if the file cannot be written, 0
+ *         otherwise.
+ */
+int wordcount_corpus_save(const wordcount_corpus_t *corpus, bool wait);
+
+/** End the save of the words added to a corpus.
+ *
+ * On success, the saved words are dropped and the new file is mapped,
+ * otherwise they are kept for the next save. The words added during the
+ * save are added back in any case.
+ *
+ * \param[in] corpus The corpus being saved.
+ * \param[in] saved  Whether wordcount_corpus_save() succeeded.
+ * \return -1 if the new file cannot be mapped, the previous one is then
+ *         kept, 0 otherwise.
+ */
+int wordcount_corpus_end_save(wordcount_corpus_t *corpus, bool saved);
+
+/** Sort the words of a corpus by their occurrences.
+ *
+ * With a limit, only the added words and the first words of the ranks of
+ * the file are considered, so a query is fast whatever the size of the
+ * corpus.
+ *
+ * \param[in]  corpus               The corpus.
+ * \param[in]  params               The limit and the minimum number of
+ *                                  occurrences of the words to keep.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope. The words point into the
+ *                                  mapped file, which must not be reloaded
+ *                                  before the vector is used.
+ * \return The size of the words of the result.
+ */
+size_t t_wordcount_corpus_sort_word_occurrences(
+    const wordcount_corpus_t *corpus, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+#endif /* IS_WORDCOUNT_CORPUS_H */
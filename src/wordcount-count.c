@@ -0,0 +1,1588 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <lib-common/thr.h>
+
+#include "wordcount-count.h"
+#include "wordcount-ngram.h"
+#include "wordcount-stats.h"
+
+/* Number of words got from the tokenizer at once */
+#define WORDCOUNT_TOKENS_BATCH  256
+
+/* Minimum size of the slices of the file content counted in parallel.
+ * Smaller contents are not worth the cost of scheduling jobs. */
+#define WORDCOUNT_PARALLEL_MIN_SLICE  (1 << 20)
+
+/* Size of the slices of the file content fed to the counter of an
+ * approximate counting, the cancellation is checked between them */
+#define WORDCOUNT_APPROXIMATE_SLICE  (1 << 20)
+
+/* Maximum number of n-grams the counter of an n-gram counting is sized for,
+ * it grows beyond if needed */
+#define WORDCOUNT_NGRAM_MAX_RESERVED  (1 << 22)
+
+/** Compare two word occurrences for the sort of the results.
+ *
+ * The words are sorted by decreasing occurrences, then by increasing
+ * lower-cased word. Since the words are unique, this is a total order and the
+ * result of the sort does not depend on the order of the words in the map,
+ * so the single-threaded and the parallel paths give the same result.
+ */
+static int wordcount_word_occurrences_cmp(const void *a, const void *b)
+{
+    const wordcount__word_occurrences__t *wa = a;
+    const wordcount__word_occurrences__t *wb = b;
+    int len;
+
+    if (wa->occurrences != wb->occurrences) {
+        return wa->occurrences > wb->occurrences ? -1 : 1;
+    }
+
+    len = MIN(wa->word.len, wb->word.len);
+    for (int i = 0; i < len; i++) {
+        int ca = tolower((unsigned char)wa->word.s[i]);
+        int cb = tolower((unsigned char)wb->word.s[i]);
+
+        if (ca != cb) {
+            return ca - cb;
+        }
+    }
+    return CMP(wa->word.len, wb->word.len);
+}
+
+/** Sort word occurrences with a radix sort on their occurrences.
+ *
+ * The LSD radix sort is stable and skips the bytes of the occurrences that
+ * are the same for all the words, which are most of them. Only the runs of
+ * words with the same occurrences are then sorted by comparison.
+ *
+ * \param[in,out] tab The word occurrences to sort.
+ * \param[in]     len The number of word occurrences.
+ */
+static void wordcount_radix_sort_word_occurrences(
+    wordcount__word_occurrences__t *tab, int len)
+{
+    wordcount__word_occurrences__t *src = tab;
+    wordcount__word_occurrences__t *dst;
+    wordcount__word_occurrences__t *tmp;
+
+    if (len < 64) {
+        /* Not worth the passes over the histograms */
+        qsort(tab, len, sizeof(tab[0]), &wordcount_word_occurrences_cmp);
+        return;
+    }
+
+    tmp = p_new_raw(wordcount__word_occurrences__t, len);
+    dst = tmp;
+
+    /* Sort by the bytes of the complement of the occurrences, to get the
+     * decreasing order */
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[256];
+
+#define DIGIT(o)  ((~(o) >> shift) & 0xff)
+
+        p_clear(offsets, countof(offsets));
+        for (int i = 0; i < len; i++) {
+            offsets[DIGIT(src[i].occurrences)]++;
+        }
+        if (offsets[DIGIT(src[0].occurrences)] == len) {
+            /* Same byte for all the words, nothing to do */
+            continue;
+        }
+        for (int d = 0, pos = 0; d < 256; d++) {
+            int count = offsets[d];
+
+            offsets[d] = pos;
+            pos += count;
+        }
+        for (int i = 0; i < len; i++) {
+            dst[offsets[DIGIT(src[i].occurrences)]++] = src[i];
+        }
+        SWAP(wordcount__word_occurrences__t *, src, dst);
+
+#undef DIGIT
+    }
+
+    if (src != tab) {
+        p_copy(tab, src, len);
+    }
+    p_delete(&tmp);
+
+    /* Sort the words with the same occurrences */
+    for (int start = 0; start < len;) {
+        int end = start + 1;
+
+        while (end < len && tab[end].occurrences == tab[start].occurrences) {
+            end++;
+        }
+        if (end - start > 1) {
+            qsort(tab + start, end - start, sizeof(tab[0]),
+                  &wordcount_word_occurrences_cmp);
+        }
+        start = end;
+    }
+}
+
+/** Restore the order of a heap of word occurrences from a position.
+ *
+ * The root of the heap is the last word occurrences in the sort order.
+ */
+static void wordcount_heap_sift_down(wordcount__word_occurrences__t *heap,
+                                     int len, int pos)
+{
+    for (;;) {
+        int child = 2 * pos + 1;
+
+        if (child >= len) {
+            break;
+        }
+        if (child + 1 < len
+        &&  wordcount_word_occurrences_cmp(&heap[child + 1],
+                                           &heap[child]) > 0)
+        {
+            child++;
+        }
+        if (wordcount_word_occurrences_cmp(&heap[child], &heap[pos]) <= 0) {
+            break;
+        }
+        SWAP(wordcount__word_occurrences__t, heap[pos], heap[child]);
+        pos = child;
+    }
+}
+
+int wordcount_sort_word_occurrences_tab(
+    wordcount__word_occurrences__t *tab, int len, unsigned limit)
+{
+    if (limit && limit < (unsigned)len) {
+        /* Build the heap with the first words... */
+        for (int pos = limit / 2 - 1; pos >= 0; pos--) {
+            wordcount_heap_sift_down(tab, limit, pos);
+        }
+
+        /* ...and replace its last word by each word that comes before */
+        for (int i = limit; i < len; i++) {
+            if (wordcount_word_occurrences_cmp(&tab[i], &tab[0]) < 0) {
+                tab[0] = tab[i];
+                wordcount_heap_sift_down(tab, limit, 0);
+            }
+        }
+        len = limit;
+    }
+
+    wordcount_radix_sort_word_occurrences(tab, len);
+    return len;
+}
+
+/** Split the file content per word and count their occurrences, unless
+ * canceled.
+ *
+ * \param[in]  file_content The file content.
+ * \param[in]  utf8         Whether the file content is a folded UTF-8
+ *                          content, see wordcount_tokenize_utf8().
+ * \param[in]  filter       Optional filter of the words.
+ * \param[in]  canceled     Optional cancellation flag.
+ * \param[out] map          The map countaining the words and their
+ *                          occurrences.
+ * \param[out] ngrams       Optional n-gram counter, given the identifiers
+ *                          of the words in \p map in the order of the
+ *                          content.
+ * \return -1 if the counting has been canceled, 0 otherwise.
+ */
+static int
+wordcount_split_words_cancelable(lstr_t file_content, bool utf8,
+                                 const wordcount_filter_t * nullable filter,
+                                 const volatile bool * nullable canceled,
+                                 wordcount_map_t *map,
+                                 wordcount_ngram_counter_t * nullable ngrams)
+{
+    wordcount_tokenize_f *tokenize = utf8 ? &wordcount_tokenize_utf8
+                                          : &wordcount_tokenize;
+    wordcount_token_t tokens[WORDCOUNT_TOKENS_BATCH];
+    const char *pos = file_content.s;
+    const char *end = file_content.s + file_content.len;
+    int nb_tokens;
+
+    /* Get the words by batches until the end of the content */
+    while ((nb_tokens = (*tokenize)(&pos, end, tokens,
+                                    countof(tokens))) > 0)
+    {
+        /* Stop if the counting is no longer needed */
+        if (unlikely(canceled && *canceled)) {
+            return -1;
+        }
+
+        for (int i = 0; i < nb_tokens; i++) {
+            /* Put the word in the map with the hash computed by the
+             * tokenizer, it is referenced by its offset in the content. The
+             * filter uses the same hash, so a rejected word costs one probe
+             * of its perfect hash and never touches the map. */
+            uint32_t id;
+
+            if (filter && wordcount_filter_rejects(filter, tokens[i].s,
+                                                   tokens[i].len,
+                                                   tokens[i].hash))
+            {
+                continue;
+            }
+            id = wordcount_map_add(map, file_content.s, tokens[i].s,
+                                   tokens[i].len, tokens[i].hash,
+                                   tokens[i].s - file_content.s, 1, NULL);
+            if (ngrams) {
+                wordcount_ngram_counter_add(ngrams, id);
+            }
+        }
+    }
+
+    return 0;
+}
+
+void wordcount_split_words(lstr_t file_content,
+                           const wordcount_filter_t * nullable filter,
+                           wordcount_map_t *map)
+{
+    wordcount_split_words_cancelable(file_content, false, filter, NULL, map,
+                                     NULL);
+}
+
+size_t
+t_wordcount_lower_words(qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    size_t len = 0;
+    char *buf;
+
+    tab_for_each_ptr(word_occurrences, word_occurrences_vec) {
+        len += word_occurrences->word.len;
+    }
+    buf = t_new_raw(char, len + 1);
+
+    tab_for_each_ptr(word_occurrences, word_occurrences_vec) {
+        lstr_t word = word_occurrences->word;
+
+        for (int i = 0; i < word.len; i++) {
+            buf[i] = tolower((unsigned char)word.s[i]);
+        }
+        word_occurrences->word = LSTR_PTR_V(buf, word.len);
+        buf += word.len;
+    }
+    return len;
+}
+
+/** Fill the measures of the result of a counting.
+ *
+ * \param[out] stats                The measures of the counting.
+ * \param[in]  word_occurrences_vec The result, allocated on the t_stack.
+ * \param[in]  words_size           The size of the words of the result.
+ */
+static void wordcount_count_stats_set_result(
+    wordcount_count_stats_t *stats,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec, size_t words_size)
+{
+    stats->words_size = words_size;
+    stats->t_stack_size = words_size + word_occurrences_vec->size
+                        * sizeof(wordcount__word_occurrences__t);
+}
+
+/** Append the words of a map with enough occurrences to a vector.
+ *
+ * The vector must be big enough for all the words of the map.
+ */
+static void wordcount_append_map_words(
+    const wordcount_map_t *map, const char *base, unsigned min_occurrences,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    tab_for_each_ptr(entry, &map->entries) {
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = LSTR_PTR_V(base + entry->offset, entry->len),
+            .occurrences = entry->occurrences,
+        };
+
+        if (entry->occurrences >= min_occurrences) {
+            qv_append(word_occurrences_vec, word_occurrences);
+        }
+    }
+}
+
+void t_wordcount_sort_word_occurrences(
+    const wordcount_map_t *map, const char *base,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    size_t words_size;
+
+    /* Initialize the vector on the t_scope to the size of the map in order to
+     * do only one allocation, and populate it with the map content */
+    t_qv_init(word_occurrences_vec, wordcount_map_len(map));
+    wordcount_append_map_words(map, base, params->min_occurrences,
+                               word_occurrences_vec);
+
+    /* Sort the vector by occurrences, up to the limit */
+    word_occurrences_vec->len = wordcount_sort_word_occurrences_tab(
+        word_occurrences_vec->tab, word_occurrences_vec->len, params->limit);
+
+    /* Copy the kept words on the t_scope and use lower case */
+    words_size = t_wordcount_lower_words(word_occurrences_vec);
+    if (params->stats) {
+        params->stats->nb_unique_words = wordcount_map_len(map);
+        wordcount_count_stats_set_result(params->stats, word_occurrences_vec,
+                                         words_size);
+    }
+}
+
+/* Parallel counting */
+
+/** Job counting the words of one slice of the file content.
+ *
+ * The words are dispatched by hash in one map per partition, so that the
+ * maps of a same partition can be merged independently of the others.
+ */
+typedef struct wordcount_slice_job_t {
+    thr_job_t job;
+
+    /** The slice of the file content, it starts and ends on word
+     * boundaries. */
+    lstr_t slice;
+
+    /** The whole file content, the base buffer of the maps. */
+    const char *base;
+
+    /** The maps of the slice, one per partition. */
+    int nb_partitions;
+    wordcount_map_t *partitions;
+
+    /** Whether the file content is a folded UTF-8 content. */
+    bool utf8;
+
+    /** Optional filter of the words. */
+    const wordcount_filter_t *filter;
+
+    /** Optional cancellation flag of the counting. */
+    const volatile bool *canceled;
+} wordcount_slice_job_t;
+
+/** Job merging the maps of a partition of all the slices. */
+typedef struct wordcount_merge_job_t {
+    thr_job_t job;
+
+    /** The index of the partition to merge. */
+    int partition;
+
+    /** The counted slices. */
+    int nb_slices;
+    wordcount_slice_job_t *slices;
+
+    /** The parameters of the counting. */
+    const wordcount_params_t *params;
+
+    /** The words of the partition sorted by their occurrences. The words
+     * are not lower-cased and point into the file content. */
+    qv_t(word_occurrences_vec) sorted;
+} wordcount_merge_job_t;
+
+/** Get the partition of a word from its hash. */
+static int wordcount_hash_partition(uint32_t hash, int nb_partitions)
+{
+    /* Use the high bits of the hash, the low bits are the ones used by the
+     * map to find the position of the word. */
+    return ((uint64_t)hash * nb_partitions) >> 32;
+}
+
+static void wordcount_slice_job_run(thr_job_t *job, thr_syn_t *syn)
+{
+    wordcount_slice_job_t *slice_job;
+    wordcount_tokenize_f *tokenize;
+    wordcount_token_t tokens[WORDCOUNT_TOKENS_BATCH];
+    const char *pos;
+    const char *end;
+    int nb_tokens;
+
+    slice_job = container_of(job, wordcount_slice_job_t, job);
+    tokenize = slice_job->utf8 ? &wordcount_tokenize_utf8
+                               : &wordcount_tokenize;
+    pos = slice_job->slice.s;
+    end = slice_job->slice.s + slice_job->slice.len;
+
+    while ((nb_tokens = (*tokenize)(&pos, end, tokens,
+                                    countof(tokens))) > 0)
+    {
+        if (unlikely(slice_job->canceled && *slice_job->canceled)) {
+            return;
+        }
+
+        for (int i = 0; i < nb_tokens; i++) {
+            wordcount_map_t *map;
+
+            if (slice_job->filter
+            &&  wordcount_filter_rejects(slice_job->filter, tokens[i].s,
+                                         tokens[i].len, tokens[i].hash))
+            {
+                continue;
+            }
+
+            /* The hash of the tokenizer gives both the partition and the
+             * position in the map of the partition */
+            map = &slice_job->partitions[
+                wordcount_hash_partition(tokens[i].hash,
+                                         slice_job->nb_partitions)];
+            wordcount_map_add(map, slice_job->base, tokens[i].s,
+                              tokens[i].len, tokens[i].hash,
+                              tokens[i].s - slice_job->base, 1, NULL);
+        }
+    }
+}
+
+static void wordcount_merge_job_run(thr_job_t *job, thr_syn_t *syn)
+{
+    wordcount_merge_job_t *merge_job;
+    const char *base;
+    wordcount_map_t *merged;
+
+    merge_job = container_of(job, wordcount_merge_job_t, job);
+    qv_init(&merge_job->sorted);
+    if (merge_job->slices[0].canceled && *merge_job->slices[0].canceled) {
+        return;
+    }
+
+    /* Merge the maps of the partition in the map of the first slice. All
+     * the maps reference the words in the file content, so the words are
+     * moved with their offset and their hash, without hashing or copying
+     * them again. */
+    base = merge_job->slices[0].base;
+    merged = &merge_job->slices[0].partitions[merge_job->partition];
+    for (int i = 1; i < merge_job->nb_slices; i++) {
+        const wordcount_map_t *map;
+
+        map = &merge_job->slices[i].partitions[merge_job->partition];
+        for (uint32_t pos = 0; pos <= map->mask; pos++) {
+            const wordcount_map_slot_t *slot = &map->slots[pos];
+            const wordcount_map_entry_t *entry;
+
+            if (!slot->id) {
+                continue;
+            }
+            entry = &map->entries.tab[slot->id - 1];
+            wordcount_map_add(merged, base, base + entry->offset, entry->len,
+                              slot->hash, entry->offset, entry->occurrences,
+                              NULL);
+        }
+    }
+
+    /* Sort the words of the partition. The vector is allocated on the heap
+     * since the t_stack is local to the thread. Each partition keeps up to
+     * the limit of words, since they could all be in the result. */
+    qv_grow(&merge_job->sorted, wordcount_map_len(merged));
+    wordcount_append_map_words(merged, base,
+                               merge_job->params->min_occurrences,
+                               &merge_job->sorted);
+    merge_job->sorted.len = wordcount_sort_word_occurrences_tab(
+        merge_job->sorted.tab, merge_job->sorted.len,
+        merge_job->params->limit);
+}
+
+/** Get whether a byte is part of a word for the boundaries of the slices.
+ *
+ * With UTF-8 tokenizing, all the non-ASCII bytes are, so that the
+ * boundaries are on ASCII separators whether the content is folded or not.
+ */
+static bool wordcount_is_word_byte(unsigned char c, bool utf8)
+{
+    return ctype_desc_contains(&ctype_iswordpart, c) || (utf8 && c >= 0x80);
+}
+
+void wordcount_split_content(lstr_t file_content, int nb_slices, bool utf8,
+                             lstr_t *slices)
+{
+    const char *start = file_content.s;
+    const char *end = file_content.s + file_content.len;
+
+    for (int i = 0; i < nb_slices; i++) {
+        const char *slice_end;
+
+        if (i == nb_slices - 1) {
+            slice_end = end;
+        } else {
+            slice_end = MAX(start, file_content.s +
+                            (int64_t)file_content.len * (i + 1) / nb_slices);
+            /* A UTF-8 character is not cut either, so that the slices
+             * stay valid strings */
+            while (slice_end > file_content.s && slice_end < end
+            &&     ((wordcount_is_word_byte(slice_end[-1], utf8)
+            &&       wordcount_is_word_byte(slice_end[0], utf8))
+            ||      (slice_end[0] & 0xc0) == 0x80))
+            {
+                slice_end++;
+            }
+        }
+
+        slices[i] = LSTR_PTR_V(start, slice_end - start);
+        start = slice_end;
+    }
+}
+
+/** Get the next word of a sorted partition during the final merge. */
+static const wordcount__word_occurrences__t *
+wordcount_merge_head(const wordcount_merge_job_t *merges, const int *heads,
+                     int partition)
+{
+    return &merges[partition].sorted.tab[heads[partition]];
+}
+
+/** Restore the order of the min-heap of partitions from a position.
+ *
+ * \param[in]     merges   The merge jobs with the sorted words.
+ * \param[in]     heads    The position of the next word of each partition.
+ * \param[in,out] heap     The heap of partitions ordered by their next word.
+ * \param[in]     heap_len The number of partitions in the heap.
+ * \param[in]     pos      The position to sift down.
+ */
+static void wordcount_merge_sift_down(const wordcount_merge_job_t *merges,
+                                      const int *heads, int *heap,
+                                      int heap_len, int pos)
+{
+    for (;;) {
+        int child = 2 * pos + 1;
+
+        if (child >= heap_len) {
+            break;
+        }
+        if (child + 1 < heap_len
+        &&  wordcount_word_occurrences_cmp(
+                wordcount_merge_head(merges, heads, heap[child + 1]),
+                wordcount_merge_head(merges, heads, heap[child])) < 0)
+        {
+            child++;
+        }
+        if (wordcount_word_occurrences_cmp(
+                wordcount_merge_head(merges, heads, heap[child]),
+                wordcount_merge_head(merges, heads, heap[pos])) >= 0)
+        {
+            break;
+        }
+        SWAP(int, heap[pos], heap[child]);
+        pos = child;
+    }
+}
+
+/** Merge the sorted words of the partitions in one sorted vector.
+ *
+ * \param[in]  merges               The merge jobs with the sorted words.
+ * \param[in]  nb_merges            The number of merge jobs.
+ * \param[in]  limit                The maximum number of words to merge, 0
+ *                                  for no limit.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope. The words point into the
+ *                                  file content.
+ */
+static void t_wordcount_merge_sorted_partitions(
+    const wordcount_merge_job_t *merges, int nb_merges, unsigned limit,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    /* Binary min-heap of the partitions ordered by their next word */
+    int *heap = p_alloca(int, nb_merges);
+    int *heads = p_alloca(int, nb_merges);
+    int heap_len = 0;
+    int total = 0;
+
+    for (int i = 0; i < nb_merges; i++) {
+        heads[i] = 0;
+        total += merges[i].sorted.len;
+        if (merges[i].sorted.len) {
+            heap[heap_len++] = i;
+        }
+    }
+    for (int pos = heap_len / 2 - 1; pos >= 0; pos--) {
+        wordcount_merge_sift_down(merges, heads, heap, heap_len, pos);
+    }
+
+    /* Pop the smallest next word until all the partitions are consumed, or
+     * the limit is reached */
+    if (limit) {
+        total = MIN((unsigned)total, limit);
+    }
+    t_qv_init(word_occurrences_vec, total);
+    while (heap_len && word_occurrences_vec->len < total) {
+        int partition = heap[0];
+        wordcount__word_occurrences__t word_occurrences;
+
+        word_occurrences = *wordcount_merge_head(merges, heads, partition);
+        qv_append(word_occurrences_vec, word_occurrences);
+
+        if (++heads[partition] >= merges[partition].sorted.len) {
+            heap[0] = heap[--heap_len];
+        }
+        wordcount_merge_sift_down(merges, heads, heap, heap_len, 0);
+    }
+}
+
+/** Split the file content in slices, count the slices in parallel and merge
+ * the partitions in parallel.
+ *
+ * \param[in]  file_content         The file content.
+ * \param[in]  nb_threads           The number of slices and partitions.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The vector of sorted words.
+ * \return -1 if the counting has been canceled, 0 otherwise.
+ */
+static int t_wordcount_parallel_split_and_sort_word_occurrences(
+    lstr_t file_content, int nb_threads, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    const volatile bool *canceled = params->canceled;
+    wordcount_count_stats_t *stats = params->stats;
+    wordcount_slice_job_t *slices = p_new(wordcount_slice_job_t, nb_threads);
+    wordcount_merge_job_t *merges = p_new(wordcount_merge_job_t, nb_threads);
+    lstr_t *contents = p_alloca(lstr_t, nb_threads);
+    int64_t start_nsec = stats ? wordcount_now_nsec() : 0;
+    thr_syn_t syn;
+    int res = 0;
+
+    thr_syn_init(&syn);
+
+    /* Count the slices in parallel. The words of a slice are spread in the
+     * maps of all the partitions, size them accordingly. */
+    wordcount_split_content(file_content, nb_threads, params->utf8,
+                            contents);
+    for (int i = 0; i < nb_threads; i++) {
+        uint32_t nb_words;
+
+        slices[i].slice = contents[i];
+        nb_words = wordcount_map_estimate_words(slices[i].slice.len);
+        slices[i].job.run = &wordcount_slice_job_run;
+        slices[i].base = file_content.s;
+        slices[i].nb_partitions = nb_threads;
+        slices[i].utf8 = params->utf8;
+        slices[i].filter = params->filter;
+        slices[i].canceled = canceled;
+        slices[i].partitions = p_new(wordcount_map_t, nb_threads);
+        for (int p = 0; p < nb_threads; p++) {
+            wordcount_map_init(&slices[i].partitions[p]);
+            wordcount_map_reset(&slices[i].partitions[p],
+                                nb_words / nb_threads);
+        }
+        thr_syn_schedule(&syn, &slices[i].job);
+    }
+    thr_syn_wait(&syn);
+    if (stats) {
+        int64_t now_nsec = wordcount_now_nsec();
+
+        stats->count_nsec = now_nsec - start_nsec;
+        start_nsec = now_nsec;
+    }
+
+    /* Merge and sort the partitions in parallel */
+    for (int p = 0; p < nb_threads; p++) {
+        merges[p].job.run = &wordcount_merge_job_run;
+        merges[p].partition = p;
+        merges[p].nb_slices = nb_threads;
+        merges[p].slices = slices;
+        merges[p].params = params;
+        thr_syn_schedule(&syn, &merges[p].job);
+    }
+    thr_syn_wait(&syn);
+
+    /* Merge the sorted partitions */
+    if (canceled && *canceled) {
+        res = -1;
+    } else {
+        size_t words_size;
+
+        t_wordcount_merge_sorted_partitions(merges, nb_threads,
+                                            params->limit,
+                                            word_occurrences_vec);
+        words_size = t_wordcount_lower_words(word_occurrences_vec);
+        if (stats) {
+            /* The partitions are disjoint, the maps of the first slice hold
+             * all the distinct words once merged */
+            stats->sort_nsec = wordcount_now_nsec() - start_nsec;
+            stats->nb_unique_words = 0;
+            stats->map_size = 0;
+            for (int p = 0; p < nb_threads; p++) {
+                stats->nb_unique_words +=
+                    wordcount_map_len(&slices[0].partitions[p]);
+            }
+            for (int i = 0; i < nb_threads; i++) {
+                for (int p = 0; p < nb_threads; p++) {
+                    stats->map_size +=
+                        wordcount_map_memory(&slices[i].partitions[p]);
+                }
+            }
+            wordcount_count_stats_set_result(stats, word_occurrences_vec,
+                                             words_size);
+        }
+    }
+
+    /* Clean-up */
+    for (int i = 0; i < nb_threads; i++) {
+        for (int p = 0; p < nb_threads; p++) {
+            wordcount_map_wipe(&slices[i].partitions[p]);
+        }
+        p_delete(&slices[i].partitions);
+        qv_wipe(&merges[i].sorted);
+    }
+    p_delete(&slices);
+    p_delete(&merges);
+    thr_syn_wipe(&syn);
+    return res;
+}
+
+static int t_wordcount_approximate_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+static int t_wordcount_ngram_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Split the words from a file content, folded if needed, and sort them.
+ *
+ * See t_wordcount_split_and_sort_word_occurrences().
+ */
+static int t_wordcount_split_and_sort_content(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_map_t local_map;
+    wordcount_map_t *map = params->map;
+    wordcount_count_stats_t *stats = params->stats;
+    int nb_threads = params->nb_threads;
+    int64_t start_nsec;
+    int res = 0;
+
+    if (params->sketch_size) {
+        return t_wordcount_approximate_split_and_sort_word_occurrences(
+            file_content, params, word_occurrences_vec);
+    }
+    if (params->ngram > 1) {
+        return t_wordcount_ngram_split_and_sort_word_occurrences(
+            file_content, params, word_occurrences_vec);
+    }
+
+    /* Do not use more threads than useful for the size of the content */
+    if (nb_threads <= 0) {
+        nb_threads = thr_parallelism_g;
+    }
+    nb_threads = MIN(nb_threads,
+                     file_content.len / WORDCOUNT_PARALLEL_MIN_SLICE);
+    if (nb_threads > 1) {
+        return t_wordcount_parallel_split_and_sort_word_occurrences(
+            file_content, nb_threads, params, word_occurrences_vec);
+    }
+
+    /* Use the recycled map if any, and size it for the content so that it
+     * does not have to grow while counting */
+    if (!map) {
+        map = wordcount_map_init(&local_map);
+    }
+    start_nsec = stats ? wordcount_now_nsec() : 0;
+    wordcount_map_reset(map, wordcount_map_estimate_words(file_content.len));
+
+    /* Split the file content per word, and sort the words by their
+     * occurrences */
+    if (wordcount_split_words_cancelable(file_content, params->utf8,
+                                         params->filter, params->canceled,
+                                         map, NULL) < 0)
+    {
+        res = -1;
+    } else {
+        if (stats) {
+            int64_t now_nsec = wordcount_now_nsec();
+
+            stats->count_nsec = now_nsec - start_nsec;
+            start_nsec = now_nsec;
+        }
+        t_wordcount_sort_word_occurrences(map, file_content.s, params,
+                                          word_occurrences_vec);
+        if (stats) {
+            stats->sort_nsec = wordcount_now_nsec() - start_nsec;
+            stats->map_size = wordcount_map_memory(map);
+        }
+    }
+
+    /* Clean-up */
+    if (map == &local_map) {
+        wordcount_map_wipe(&local_map);
+    }
+    return res;
+}
+
+int t_wordcount_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_count_stats_t *stats = params->stats;
+    int64_t start_nsec;
+    int64_t fold_nsec;
+    sb_t folded;
+    int res;
+
+    if (!params->utf8) {
+        return t_wordcount_split_and_sort_content(file_content, params,
+                                                  word_occurrences_vec);
+    }
+
+    /* Fold the content first, unless it is pure ASCII. The words of the
+     * result are copied on the t_stack, so the folded content is released
+     * once sorted. */
+    start_nsec = stats ? wordcount_now_nsec() : 0;
+    sb_init(&folded);
+    file_content = wordcount_utf8_fold(file_content, &folded);
+    fold_nsec = stats ? wordcount_now_nsec() - start_nsec : 0;
+
+    res = t_wordcount_split_and_sort_content(file_content, params,
+                                             word_occurrences_vec);
+    if (res == 0 && stats) {
+        stats->count_nsec += fold_nsec;
+    }
+    sb_wipe(&folded);
+    return res;
+}
+
+/* Packed result */
+
+wordcount_result_t *wordcount_result_init(wordcount_result_t *result)
+{
+    p_clear(result, 1);
+    sb_init(&result->words);
+    qv_init(&result->entries);
+    return result;
+}
+
+void wordcount_result_wipe(wordcount_result_t *result)
+{
+    sb_wipe(&result->words);
+    qv_wipe(&result->entries);
+}
+
+void wordcount_result_move(wordcount_result_t *dst, wordcount_result_t *src)
+{
+    wordcount_result_wipe(dst);
+    *dst = *src;
+    wordcount_result_init(src);
+}
+
+void wordcount_result_set(
+    wordcount_result_t *result,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_result_set_tab(result, word_occurrences_vec->tab,
+                             word_occurrences_vec->len);
+}
+
+void wordcount_result_set_tab(wordcount_result_t *result,
+                              const wordcount__word_occurrences__t *tab,
+                              int len)
+{
+    int words_len = 0;
+
+    /* Allocate the words and the entries at once */
+    for (int i = 0; i < len; i++) {
+        words_len += tab[i].word.len;
+    }
+    sb_reset(&result->words);
+    sb_grow(&result->words, words_len);
+    qv_clear(&result->entries);
+    qv_grow(&result->entries, len);
+
+    for (int i = 0; i < len; i++) {
+        wordcount_entry_t entry = {
+            .word_offset = result->words.len,
+            .word_len = tab[i].word.len,
+            .occurrences = tab[i].occurrences,
+            .max_error = tab[i].max_error,
+        };
+
+        sb_add_lstr(&result->words, tab[i].word);
+        qv_append(&result->entries, entry);
+    }
+}
+
+void t_wordcount_result_get(
+    const wordcount_result_t *result,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    t_wordcount_result_get_range(result, 0, result->entries.len,
+                                 word_occurrences_vec);
+}
+
+size_t t_wordcount_result_get_range(
+    const wordcount_result_t *result, int start, int len,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    size_t words_size = 0;
+
+    len = MAX(MIN(len, result->entries.len - start), 0);
+    t_qv_init(word_occurrences_vec, len);
+    for (int i = start; i < start + len; i++) {
+        const wordcount_entry_t *entry = &result->entries.tab[i];
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = LSTR_PTR_V(result->words.data + entry->word_offset,
+                               entry->word_len),
+            .occurrences = entry->occurrences,
+            .max_error = entry->max_error,
+        };
+
+        qv_append(word_occurrences_vec, word_occurrences);
+        words_size += entry->word_len;
+    }
+    return words_size;
+}
+
+/* Merge of results */
+
+/** Filter and sort merged word occurrences.
+ *
+ * Only the total occurrences of a word can be filtered, then the words are
+ * sorted by occurrences again.
+ *
+ * \param[in,out] word_occurrences_vec The merged word occurrences, sorted by
+ *                                     word.
+ * \param[in]     params               The limit and the minimum number of
+ *                                     occurrences of the words to keep.
+ * \return The size of the words kept.
+ */
+static size_t
+wordcount_filter_and_sort_merged(
+    qv_t(word_occurrences_vec) *word_occurrences_vec,
+    const wordcount_params_t *params)
+{
+    size_t words_size = 0;
+
+    if (params->min_occurrences > 1) {
+        int len = 0;
+
+        tab_for_each_entry(word_occurrences, word_occurrences_vec) {
+            if (word_occurrences.occurrences >= params->min_occurrences) {
+                word_occurrences_vec->tab[len++] = word_occurrences;
+            }
+        }
+        word_occurrences_vec->len = len;
+    }
+    word_occurrences_vec->len = wordcount_sort_word_occurrences_tab(
+        word_occurrences_vec->tab, word_occurrences_vec->len,
+        params->limit);
+
+    tab_for_each_ptr(word_occurrences, word_occurrences_vec) {
+        words_size += word_occurrences->word.len;
+    }
+    return words_size;
+}
+
+/** Compare two word occurrences by word, for the merge of results. */
+static int wordcount_word_cmp(const void *a, const void *b)
+{
+    const wordcount__word_occurrences__t *wa = a;
+    const wordcount__word_occurrences__t *wb = b;
+
+    return lstr_cmp(wa->word, wb->word);
+}
+
+/** Get the next word of a result during the merge of results. */
+static const wordcount__word_occurrences__t *
+wordcount_merge_results_head(const qv_t(word_occurrences_vec) *vecs,
+                             const int *heads, int result)
+{
+    return &vecs[result].tab[heads[result]];
+}
+
+/** Restore the order of the min-heap of results from a position.
+ *
+ * \param[in]     vecs     The word occurrences of the results, sorted by
+ *                         word.
+ * \param[in]     heads    The position of the next word of each result.
+ * \param[in,out] heap     The heap of results ordered by their next word.
+ * \param[in]     heap_len The number of results in the heap.
+ * \param[in]     pos      The position to sift down.
+ */
+static void
+wordcount_merge_results_sift_down(const qv_t(word_occurrences_vec) *vecs,
+                                  const int *heads, int *heap, int heap_len,
+                                  int pos)
+{
+    for (;;) {
+        int child = 2 * pos + 1;
+
+        if (child >= heap_len) {
+            break;
+        }
+        if (child + 1 < heap_len
+        &&  wordcount_word_cmp(
+                wordcount_merge_results_head(vecs, heads, heap[child + 1]),
+                wordcount_merge_results_head(vecs, heads, heap[child])) < 0)
+        {
+            child++;
+        }
+        if (wordcount_word_cmp(
+                wordcount_merge_results_head(vecs, heads, heap[child]),
+                wordcount_merge_results_head(vecs, heads, heap[pos])) >= 0)
+        {
+            break;
+        }
+        SWAP(int, heap[pos], heap[child]);
+        pos = child;
+    }
+}
+
+size_t t_wordcount_merge_results(
+    const wordcount_result_t * const *results, int nb_results,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    qv_t(word_occurrences_vec) *vecs;
+    int *heap = t_new_raw(int, nb_results);
+    int *heads = t_new(int, nb_results);
+    int heap_len = 0;
+    int total = 0;
+
+    /* Sort the words of each result alphabetically, they are already
+     * lower-cased */
+    vecs = t_new_raw(qv_t(word_occurrences_vec), nb_results);
+    for (int i = 0; i < nb_results; i++) {
+        t_wordcount_result_get(results[i], &vecs[i]);
+        qsort(vecs[i].tab, vecs[i].len, sizeof(vecs[i].tab[0]),
+              &wordcount_word_cmp);
+        total += vecs[i].len;
+        if (vecs[i].len) {
+            heap[heap_len++] = i;
+        }
+    }
+    for (int pos = heap_len / 2 - 1; pos >= 0; pos--) {
+        wordcount_merge_results_sift_down(vecs, heads, heap, heap_len, pos);
+    }
+
+    /* Pop the smallest next word of the results, the occurrences of the
+     * same word in several results are added */
+    t_qv_init(word_occurrences_vec, total);
+    while (heap_len) {
+        int r = heap[0];
+        const wordcount__word_occurrences__t *head;
+        wordcount__word_occurrences__t *last = NULL;
+
+        head = wordcount_merge_results_head(vecs, heads, r);
+        if (word_occurrences_vec->len) {
+            last = &word_occurrences_vec->tab[word_occurrences_vec->len - 1];
+        }
+        if (last && lstr_equal(last->word, head->word)) {
+            last->occurrences = MIN((uint64_t)last->occurrences
+                                    + head->occurrences, UINT32_MAX);
+        } else {
+            qv_append(word_occurrences_vec, *head);
+        }
+
+        if (++heads[r] >= vecs[r].len) {
+            heap[0] = heap[--heap_len];
+        }
+        wordcount_merge_results_sift_down(vecs, heads, heap, heap_len, 0);
+    }
+
+    return wordcount_filter_and_sort_merged(word_occurrences_vec, params);
+}
+
+size_t t_wordcount_merge_word_occurrences(
+    const wordcount__word_occurrences__t *tab, int len,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    int nb_words = 0;
+
+    /* Copy the words lower-cased, and sort them alphabetically so that the
+     * occurrences of the same word are next to each other */
+    t_qv_init(word_occurrences_vec, len);
+    for (int i = 0; i < len; i++) {
+        wordcount__word_occurrences__t word_occurrences = {
+            .word = tab[i].word,
+            .occurrences = tab[i].occurrences,
+        };
+
+        if (!word_occurrences.word.len || !word_occurrences.occurrences) {
+            continue;
+        }
+        if (params->filter
+        &&  wordcount_filter_rejects(params->filter, word_occurrences.word.s,
+                                     word_occurrences.word.len,
+                                     wordcount_hash_word(
+                                         word_occurrences.word.s,
+                                         word_occurrences.word.len)))
+        {
+            continue;
+        }
+        qv_append(word_occurrences_vec, word_occurrences);
+    }
+    t_wordcount_lower_words(word_occurrences_vec);
+    qsort(word_occurrences_vec->tab, word_occurrences_vec->len,
+          sizeof(word_occurrences_vec->tab[0]), &wordcount_word_cmp);
+
+    /* Add the occurrences of the same word, the sum is capped since the
+     * occurrences come from the client */
+    tab_for_each_entry(word_occurrences, word_occurrences_vec) {
+        wordcount__word_occurrences__t *last = NULL;
+
+        if (nb_words) {
+            last = &word_occurrences_vec->tab[nb_words - 1];
+        }
+        if (last && lstr_equal(last->word, word_occurrences.word)) {
+            last->occurrences = MIN((uint64_t)last->occurrences
+                                    + word_occurrences.occurrences,
+                                    UINT32_MAX);
+        } else {
+            word_occurrences_vec->tab[nb_words++] = word_occurrences;
+        }
+    }
+    word_occurrences_vec->len = nb_words;
+
+    return wordcount_filter_and_sort_merged(word_occurrences_vec, params);
+}
+
+/* Incremental counter */
+
+wordcount_counter_t *wordcount_counter_init(wordcount_counter_t *counter)
+{
+    p_clear(counter, 1);
+    wordcount_map_init(&counter->map);
+    sb_init(&counter->words);
+    sb_init(&counter->pending);
+    return counter;
+}
+
+void wordcount_counter_wipe(wordcount_counter_t *counter)
+{
+    wordcount_map_wipe(&counter->map);
+    sb_wipe(&counter->words);
+    sb_wipe(&counter->pending);
+    if (counter->sketch) {
+        wordcount_sketch_wipe(counter->sketch);
+        p_delete(&counter->sketch);
+    }
+}
+
+void wordcount_counter_set_approximate(wordcount_counter_t *counter,
+                                       size_t sketch_size)
+{
+    counter->sketch = wordcount_sketch_init(p_new_raw(wordcount_sketch_t, 1),
+                                            sketch_size);
+}
+
+size_t wordcount_counter_memory(const wordcount_counter_t *counter)
+{
+    if (counter->sketch) {
+        return wordcount_sketch_memory(counter->sketch);
+    }
+    return wordcount_map_memory(&counter->map) + counter->words.size;
+}
+
+/** Count one occurrence of a word in the counter.
+ *
+ * The word is copied at the end of the words of the counter if it is not
+ * already in the map. It is not counted if the filter of the counter rejects
+ * it.
+ *
+ * \param[in] counter The counter.
+ * \param[in] word    The word, it is not referenced after the call.
+ * \param[in] hash    The hash of the word.
+ */
+static void wordcount_counter_add_word(wordcount_counter_t *counter,
+                                       lstr_t word, uint32_t hash)
+{
+    bool created;
+
+    if (counter->filter
+    &&  wordcount_filter_rejects(counter->filter, word.s, word.len, hash))
+    {
+        return;
+    }
+    if (counter->sketch) {
+        /* The sketch copies the words it monitors itself */
+        wordcount_sketch_add(counter->sketch, word.s, word.len, hash);
+        return;
+    }
+
+    wordcount_map_add(&counter->map, counter->words.data, word.s, word.len,
+                      hash, counter->words.len, 1, &created);
+    if (created) {
+        /* New word, put it where the map expects it */
+        sb_add(&counter->words, word.s, word.len);
+    }
+}
+
+void wordcount_counter_feed(wordcount_counter_t *counter, lstr_t chunk)
+{
+    wordcount_tokenize_f *tokenize = counter->utf8 ? &wordcount_tokenize_utf8
+                                                   : &wordcount_tokenize;
+    wordcount_token_t tokens[WORDCOUNT_TOKENS_BATCH];
+    pstream_t chunk_ps = ps_initlstr(&chunk);
+    const char *pos;
+    int nb_tokens;
+
+    /* Complete the word started at the end of the previous chunk */
+    if (counter->pending.len) {
+        const char *word_end = chunk_ps.s;
+
+        while (word_end < chunk_ps.s_end
+        &&     wordcount_is_word_byte(*word_end, counter->utf8))
+        {
+            word_end++;
+        }
+        sb_add(&counter->pending, chunk_ps.s, word_end - chunk_ps.s);
+        chunk_ps.s = word_end;
+        if (ps_done(&chunk_ps)) {
+            /* The whole chunk is part of the pending word, it can continue
+             * in the next chunk */
+            return;
+        }
+        wordcount_counter_add_word(counter, LSTR_SB_V(&counter->pending),
+                                   wordcount_hash_word(counter->pending.data,
+                                                       counter->pending.len));
+        sb_reset(&counter->pending);
+    }
+
+    pos = chunk_ps.s;
+    while ((nb_tokens = (*tokenize)(&pos, chunk_ps.s_end, tokens,
+                                    countof(tokens))) > 0)
+    {
+        for (int i = 0; i < nb_tokens; i++) {
+            if (tokens[i].s + tokens[i].len == chunk_ps.s_end) {
+                /* The word reaches the end of the chunk, it may continue in
+                 * the next chunk: keep it for later */
+                sb_add(&counter->pending, tokens[i].s, tokens[i].len);
+                break;
+            }
+
+            wordcount_counter_add_word(
+                counter, LSTR_PTR_V(tokens[i].s, tokens[i].len),
+                tokens[i].hash);
+        }
+    }
+}
+
+void wordcount_counter_flush(wordcount_counter_t *counter)
+{
+    if (counter->pending.len) {
+        wordcount_counter_add_word(counter, LSTR_SB_V(&counter->pending),
+                                   wordcount_hash_word(counter->pending.data,
+                                                       counter->pending.len));
+        sb_reset(&counter->pending);
+    }
+}
+
+/** Sort the words of a sketch by their estimated occurrences.
+ *
+ * The words are selected, sorted and lower-cased like the ones of a map by
+ * t_wordcount_sort_word_occurrences(), with the maximum error of their
+ * occurrences.
+ */
+static void t_wordcount_sort_sketch_word_occurrences(
+    const wordcount_sketch_t *sketch, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    size_t words_size;
+
+    t_qv_init(word_occurrences_vec, sketch->nb_entries);
+    word_occurrences_vec->len = wordcount_sketch_get_word_occurrences(
+        sketch, params->min_occurrences, word_occurrences_vec->tab);
+    word_occurrences_vec->len = wordcount_sort_word_occurrences_tab(
+        word_occurrences_vec->tab, word_occurrences_vec->len, params->limit);
+
+    words_size = t_wordcount_lower_words(word_occurrences_vec);
+    if (params->stats) {
+        params->stats->nb_unique_words = sketch->nb_entries;
+        wordcount_count_stats_set_result(params->stats, word_occurrences_vec,
+                                         words_size);
+    }
+}
+
+void t_wordcount_counter_sort_word_occurrences(
+    const wordcount_counter_t *counter, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    if (counter->sketch) {
+        t_wordcount_sort_sketch_word_occurrences(counter->sketch, params,
+                                                 word_occurrences_vec);
+    } else {
+        t_wordcount_sort_word_occurrences(&counter->map, counter->words.data,
+                                          params, word_occurrences_vec);
+    }
+}
+
+/** Flush a counter and sort its words, measuring both.
+ *
+ * \param[in]  counter              The counter fed with the whole content.
+ * \param[in]  params               The parameters of the counting.
+ * \param[in]  start_nsec           The time the counting started.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope.
+ */
+static void t_wordcount_counter_finish(
+    wordcount_counter_t *counter, const wordcount_params_t *params,
+    int64_t start_nsec, qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_count_stats_t *stats = params->stats;
+
+    wordcount_counter_flush(counter);
+    if (stats) {
+        int64_t now_nsec = wordcount_now_nsec();
+
+        stats->count_nsec = now_nsec - start_nsec;
+        start_nsec = now_nsec;
+    }
+
+    /* The words are copied on the t_stack by the sort, the counter can be
+     * released after it */
+    t_wordcount_counter_sort_word_occurrences(counter, params,
+                                              word_occurrences_vec);
+    if (stats) {
+        stats->sort_nsec = wordcount_now_nsec() - start_nsec;
+        stats->map_size = wordcount_counter_memory(counter);
+    }
+}
+
+/* Approximate counting */
+
+/** Split the words from a file content and sort them by their estimated
+ * occurrences, in the fixed memory of a sketch.
+ *
+ * \param[in]  file_content         The file content.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope.
+ * \return -1 if the counting has been canceled, 0 otherwise.
+ */
+static int t_wordcount_approximate_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_counter_t counter;
+    int64_t start_nsec = params->stats ? wordcount_now_nsec() : 0;
+    int res = 0;
+
+    /* Feed the file content to a counter by slices, the words cut by the
+     * slices are completed by the counter */
+    wordcount_counter_init(&counter);
+    wordcount_counter_set_approximate(
+        &counter, wordcount_sketch_size_for_content(file_content.len,
+                                                    params->sketch_size));
+    counter.utf8 = params->utf8;
+    counter.filter = params->filter;
+    for (int pos = 0; pos < file_content.len;
+         pos += WORDCOUNT_APPROXIMATE_SLICE)
+    {
+        if (params->canceled && *params->canceled) {
+            res = -1;
+            break;
+        }
+        wordcount_counter_feed(&counter,
+                               LSTR_PTR_V(file_content.s + pos,
+                                          MIN(WORDCOUNT_APPROXIMATE_SLICE,
+                                              file_content.len - pos)));
+    }
+
+    if (res == 0) {
+        t_wordcount_counter_finish(&counter, params, start_nsec,
+                                   word_occurrences_vec);
+    }
+    wordcount_counter_wipe(&counter);
+    return res;
+}
+
+/* N-gram counting */
+
+/** Split the words from a file content and sort its n-grams by occurrences.
+ *
+ * The words are interned in a map of words by the same tokenizing as
+ * wordcount_split_words(), and the n-grams of their identifiers are counted
+ * as they come, by only one thread.
+ *
+ * \param[in]  file_content         The file content.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The vector of sorted n-grams, allocated
+ *                                  on the t_scope.
+ * \return -1 if the counting has been canceled, 0 otherwise.
+ */
+static int t_wordcount_ngram_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_map_t local_map;
+    wordcount_map_t *map = params->map;
+    wordcount_ngram_counter_t ngrams;
+    wordcount_count_stats_t *stats = params->stats;
+    int64_t start_nsec = stats ? wordcount_now_nsec() : 0;
+    int res = 0;
+
+    if (!map) {
+        map = wordcount_map_init(&local_map);
+    }
+    wordcount_map_reset(map, wordcount_map_estimate_words(file_content.len));
+
+    /* Most n-grams are unique, contrary to words, but do not reserve the
+     * memory of one n-gram per word of a huge content upfront */
+    wordcount_ngram_counter_init(&ngrams, params->ngram,
+                                 MIN(file_content.len / 8,
+                                     WORDCOUNT_NGRAM_MAX_RESERVED));
+
+    if (wordcount_split_words_cancelable(file_content, params->utf8,
+                                         params->filter, params->canceled,
+                                         map, &ngrams) < 0)
+    {
+        res = -1;
+    } else {
+        size_t words_size;
+
+        if (stats) {
+            int64_t now_nsec = wordcount_now_nsec();
+
+            stats->count_nsec = now_nsec - start_nsec;
+            start_nsec = now_nsec;
+        }
+
+        /* Only the strings of the kept n-grams are built */
+        words_size = t_wordcount_sort_ngram_occurrences(
+            &ngrams, map, file_content.s, params, word_occurrences_vec);
+        if (stats) {
+            stats->sort_nsec = wordcount_now_nsec() - start_nsec;
+            stats->nb_unique_words = ngrams.entries.len;
+            stats->map_size = wordcount_map_memory(map)
+                            + wordcount_ngram_counter_memory(&ngrams);
+            wordcount_count_stats_set_result(stats, word_occurrences_vec,
+                                             words_size);
+        }
+    }
+
+    /* Clean-up */
+    wordcount_ngram_counter_wipe(&ngrams);
+    if (map == &local_map) {
+        wordcount_map_wipe(&local_map);
+    }
+    return res;
+}
+
+/* Compressed contents */
+
+/** Word counter fed with the decompressed chunks of a content. */
+typedef struct wordcount_decompress_counter_t {
+    wordcount_counter_t *counter;
+
+    /** Optional cancellation flag of the counting. */
+    const volatile bool * nullable canceled;
+} wordcount_decompress_counter_t;
+
+static int wordcount_decompress_counter_feed(void *priv, lstr_t chunk)
+{
+    wordcount_decompress_counter_t *decompress_counter = priv;
+
+    /* The decompression is stopped once canceled */
+    if (decompress_counter->canceled && *decompress_counter->canceled) {
+        return -1;
+    }
+    wordcount_counter_feed(decompress_counter->counter, chunk);
+    return 0;
+}
+
+int wordcount_counter_feed_compressed(wordcount_counter_t *counter,
+                                      wordcount__codec__t codec,
+                                      lstr_t chunk, size_t max_size)
+{
+    wordcount_decompress_counter_t decompress_counter = {
+        .counter = counter,
+    };
+
+    return wordcount_decompress_stream(codec, chunk, max_size,
+                                       &wordcount_decompress_counter_feed,
+                                       &decompress_counter);
+}
+
+int t_wordcount_decompress_split_and_sort_word_occurrences(
+    wordcount__codec__t codec, lstr_t compressed_content,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    wordcount_counter_t counter;
+    wordcount_decompress_counter_t decompress_counter = {
+        .counter = &counter,
+        .canceled = params->canceled,
+    };
+    int64_t start_nsec;
+    int res = 0;
+
+    if (params->ngram > 1 || params->utf8) {
+        sb_t content;
+
+        /* The words of the n-grams are referenced in the content until the
+         * n-grams are sorted, and a UTF-8 content is folded as a whole, so
+         * it is decompressed first */
+        sb_init(&content);
+        if (wordcount_decompress(codec, compressed_content,
+                                 params->max_content_size, params->canceled,
+                                 &content) < 0)
+        {
+            res = -1;
+        } else {
+            res = t_wordcount_split_and_sort_word_occurrences(
+                LSTR_SB_V(&content), params, word_occurrences_vec);
+        }
+        sb_wipe(&content);
+        return res;
+    }
+
+    /* Count the words of each decompressed chunk. The words are copied in
+     * the counter when they are found for the first time, so neither the
+     * decompressed content nor its chunks are kept. */
+    start_nsec = params->stats ? wordcount_now_nsec() : 0;
+    wordcount_counter_init(&counter);
+    counter.filter = params->filter;
+    if (params->sketch_size) {
+        size_t sketch_size = params->sketch_size;
+
+        /* The size of the decompressed content is only bounded */
+        if (params->max_content_size) {
+            sketch_size = wordcount_sketch_size_for_content(
+                params->max_content_size, sketch_size);
+        }
+        wordcount_counter_set_approximate(&counter, sketch_size);
+    }
+    if (wordcount_decompress_stream(codec, compressed_content,
+                                    params->max_content_size,
+                                    &wordcount_decompress_counter_feed,
+                                    &decompress_counter) < 0
+    ||  (params->canceled && *params->canceled))
+    {
+        res = -1;
+    } else {
+        t_wordcount_counter_finish(&counter, params, start_nsec,
+                                   word_occurrences_vec);
+    }
+
+    wordcount_counter_wipe(&counter);
+    return res;
+}
+
+/* Module */
+
+static int wordcount_count_initialize(void *nullable arg)
+{
+    return 0;
+}
+
+static int wordcount_count_shutdown(void)
+{
+    return 0;
+}
+
+MODULE_BEGIN(wordcount_count)
+    /* The thread pool is used to count big contents in parallel */
+    MODULE_DEPENDS_ON(thr);
+    MODULE_DEPENDS_ON(wordcount_tokenize);
+MODULE_END()
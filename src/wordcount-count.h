@@ -0,0 +1,498 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_COUNT_H
+#define IS_WORDCOUNT_COUNT_H
+
+#include <lib-common/core.h>
+#include <lib-common/container-qvector.h>
+
+#include "wordcount.iop.h"
+#include "wordcount-codec.h"
+#include "wordcount-filter.h"
+#include "wordcount-map.h"
+#include "wordcount-sketch.h"
+#include "wordcount-tokenize.h"
+#include "wordcount-utf8.h"
+
+/* Create the vector type to store the word occurrences. */
+qvector_t(word_occurrences_vec, wordcount__word_occurrences__t);
+
+/** Split the file content per word and count their occurrences.
+ *
+ * Put the words and their occurrences in a map.
+ * The words put in the map are referenced by their offset in
+ * \p file_content, which is the base buffer of the map.
+ *
+ * \param[in]  file_content The file content.
+ * \param[in]  filter       Optional filter, the words it rejects are not
+ *                          put in the map.
+ * \param[out] map          The map countaining the words and their
+ *                          occurrences, usually reset with
+ *                          wordcount_map_reset() before.
+ */
+void wordcount_split_words(lstr_t file_content,
+                           const wordcount_filter_t * nullable filter,
+                           wordcount_map_t *map);
+
+/** Split a file content in slices at word boundaries.
+ *
+ * The slices have roughly the same size, and their boundaries are moved
+ * forward to the end of the word they cut, so that no word is split between
+ * two slices. Nor is a UTF-8 character.
+ *
+ * \param[in]  file_content The file content.
+ * \param[in]  nb_slices    The number of slices.
+ * \param[in]  utf8         Whether the words are tokenized in UTF-8, the
+ *                          non-ASCII characters are then parts of the words
+ *                          for the boundaries.
+ * \param[out] slices       The slices, some of them can be empty.
+ */
+void wordcount_split_content(lstr_t file_content, int nb_slices, bool utf8,
+                             lstr_t *slices);
+
+/** Measures of the counting of a file content. */
+typedef struct wordcount_count_stats_t {
+    /** The time spent tokenizing the file content and counting the words,
+     * and sorting, lower-casing and copying the words. When the content is
+     * counted in parallel, the merge of the maps is in the sort time. */
+    int64_t count_nsec;
+    int64_t sort_nsec;
+
+    /** The number of distinct words of the file content. */
+    uint32_t nb_unique_words;
+
+    /** The memory used by the maps of words. */
+    size_t map_size;
+
+    /** The memory of the result allocated on the t_stack, and the size of
+     * its words. */
+    size_t t_stack_size;
+    size_t words_size;
+} wordcount_count_stats_t;
+
+/** Parameters of the counting of a file content. */
+typedef struct wordcount_params_t {
+    /** The maximum number of slices counted in parallel, 0 to use the
+     * parallelism of the thread pool. */
+    int nb_threads;
+
+    /** The maximum number of words in the result, 0 for no limit. Only the
+     * words with the most occurrences are kept. */
+    unsigned limit;
+
+    /** The minimum number of occurrences of the words in the result. */
+    unsigned min_occurrences;
+
+    /** The memory budget of an approximate counting, 0 to count the words
+     * exactly. The approximate counting uses a wordcount_sketch_t, by only
+     * one thread, and the recycled map is not used. The sketch is smaller
+     * for a small content, see wordcount_sketch_size_for_content(). */
+    size_t sketch_size;
+
+    /** The number of words of the n-grams to count instead of the words,
+     * between 2 and WORDCOUNT_NGRAM_MAX, 0 or 1 to count the words. The
+     * n-grams are counted by only one thread, and cannot be counted
+     * approximately. */
+    unsigned ngram;
+
+    /** Whether the content is tokenized in UTF-8: the non-ASCII letters and
+     * digits are word characters and their case is folded, see
+     * wordcount_utf8_fold(). A content that is not pure ASCII is folded in
+     * a copy first, the pure ASCII ones are counted in place like without
+     * it. */
+    bool utf8;
+
+    /** Optional filter of the words, the words it rejects are not counted,
+     * before they are put in any map. With n-grams, the n-grams are made of
+     * the words kept. */
+    const wordcount_filter_t * nullable filter;
+
+    /** The maximum size of a compressed file content once decompressed, 0
+     * for no limit. */
+    size_t max_content_size;
+
+    /** Optional flag checked while counting, the counting is aborted when it
+     * is set by another thread. */
+    const volatile bool * nullable canceled;
+
+    /** Optional map recycled for the counting by only one thread, to avoid
+     * allocating a new one for each content. */
+    wordcount_map_t * nullable map;
+
+    /** Optional measures of the counting, filled when it is not
+     * canceled. */
+    wordcount_count_stats_t * nullable stats;
+} wordcount_params_t;
+
+/** Sort the words by their occurrences in the map to a vector.
+ *
+ * The words are converted to lower case. The words with the same number of
+ * occurrences are sorted alphabetically.
+ *
+ * With a limit, the words of the result are selected with a heap, and only
+ * them are sorted and lower-cased, in one buffer. Otherwise, the words are
+ * sorted with a radix sort on their occurrences.
+ *
+ * \param[in]  map                  The map countaining the words and their
+ *                                  occurrences.
+ * \param[in]  base                 The buffer the words of the map are in.
+ * \param[in]  params               The limit and the minimum number of
+ *                                  occurrences of the words to keep.
+ * \param[out] word_occurrences_vec The vector of sorted words by their
+ *                                  occurrences.
+ *                                  The vector and words are allocated on the
+ *                                  t_scope.
+ */
+void t_wordcount_sort_word_occurrences(
+    const wordcount_map_t *map, const char *base,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Sort word occurrences, and keep only the first ones.
+ *
+ * The word occurrences are sorted like by
+ * t_wordcount_sort_word_occurrences(), but the words are not lower-cased.
+ * With a limit, the first word occurrences are selected with a heap of the
+ * size of the limit, so only them are sorted.
+ *
+ * \param[in,out] tab   The word occurrences to sort.
+ * \param[in]     len   The number of word occurrences.
+ * \param[in]     limit The maximum number of word occurrences to keep, 0
+ *                      for no limit.
+ * \return The number of word occurrences kept at the beginning of \p tab.
+ */
+int wordcount_sort_word_occurrences_tab(wordcount__word_occurrences__t *tab,
+                                        int len, unsigned limit);
+
+/** Lower-case the words of a vector of word occurrences.
+ *
+ * The words are copied in only one buffer allocated on the t_stack.
+ *
+ * \param[in,out] word_occurrences_vec The word occurrences.
+ * \return The size of the words.
+ */
+size_t
+t_wordcount_lower_words(qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Split the words from the content of a file and sort the words by
+ * occurrences.
+ *
+ * Big contents are split at word boundaries in slices that are counted in
+ * parallel by the thread pool, the maps of the slices are then merged by hash
+ * partition in parallel. The result is the same as when the content is
+ * counted by only one thread.
+ *
+ * With a sketch size, the content is counted approximately by only one
+ * thread, in the memory of a wordcount_sketch_t.
+ *
+ * With an n-gram size, the n-grams of the content are counted instead of its
+ * words, by only one thread, see wordcount_ngram_counter_t. Their words are
+ * lower-cased and separated by a space.
+ *
+ * With UTF-8 tokenizing, the content is folded by wordcount_utf8_fold()
+ * before any of the above, the time of the folding is in the counting time.
+ *
+ * The calling thread waits for the slices, so a thread of the pool counting
+ * in parallel must leave at least one thread of the pool free to run them.
+ *
+ * \param[in]  file_content         The file content.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The vector of sorted words by their
+ *                                  occurrences.
+ *                                  The vector is allocated on the t_scope.
+ * \return -1 if the counting has been canceled, 0 otherwise.
+ */
+int t_wordcount_split_and_sort_word_occurrences(
+    lstr_t file_content, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Word occurrences of a packed result. */
+typedef struct wordcount_entry_t {
+    /** The position of the word in the words of the result. */
+    uint32_t word_offset;
+    uint32_t word_len;
+
+    /** The occurrences of the word. */
+    uint32_t occurrences;
+
+    /** The maximum error of the occurrences of an approximate result. */
+    opt_u32_t max_error;
+} wordcount_entry_t;
+
+/* Create the vector type to store the entries of a packed result. */
+qvector_t(wordcount_entry, wordcount_entry_t);
+
+/** Sorted word occurrences packed in memory allocated on the heap.
+ *
+ * Contrary to the vector of word occurrences allocated on the t_scope, which
+ * is local to the thread that created it, a packed result can be built in a
+ * thread of the pool and sent back by the event loop thread.
+ */
+typedef struct wordcount_result_t {
+    /** The lower-cased words, one after the other. */
+    sb_t words;
+
+    /** The sorted word occurrences, the words are referenced in \p words. */
+    qv_t(wordcount_entry) entries;
+} wordcount_result_t;
+
+wordcount_result_t *wordcount_result_init(wordcount_result_t *result);
+void wordcount_result_wipe(wordcount_result_t *result);
+GENERIC_NEW(wordcount_result_t, wordcount_result);
+GENERIC_DELETE(wordcount_result_t, wordcount_result);
+
+/** Pack a vector of sorted word occurrences in a result.
+ *
+ * \param[out] result               The result, it is reset first.
+ * \param[in]  word_occurrences_vec The vector of sorted word occurrences.
+ */
+void wordcount_result_set(
+    wordcount_result_t *result,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Move a result to another one, without copying it.
+ *
+ * The word occurrences unpacked from the moved result still point into the
+ * result it is moved to.
+ *
+ * \param[out]    dst The result, it is wiped first.
+ * \param[in,out] src The moved result, it is reset to an empty result.
+ */
+void wordcount_result_move(wordcount_result_t *dst, wordcount_result_t *src);
+
+/** Pack sorted word occurrences in a result.
+ *
+ * \param[out] result The result, it is reset first.
+ * \param[in]  tab    The sorted word occurrences.
+ * \param[in]  len    The number of word occurrences.
+ */
+void wordcount_result_set_tab(wordcount_result_t *result,
+                              const wordcount__word_occurrences__t *tab,
+                              int len);
+
+/** Unpack a result to a vector of sorted word occurrences.
+ *
+ * \param[in]  result               The result.
+ * \param[out] word_occurrences_vec The vector of sorted word occurrences,
+ *                                  allocated on the t_scope. The words point
+ *                                  into the result, which must outlive it.
+ */
+void t_wordcount_result_get(
+    const wordcount_result_t *result,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Unpack a range of a result to a vector of sorted word occurrences.
+ *
+ * \param[in]  result               The result.
+ * \param[in]  start                The position of the first word
+ *                                  occurrences of the range.
+ * \param[in]  len                  The maximum number of word occurrences
+ *                                  of the range.
+ * \param[out] word_occurrences_vec The vector of sorted word occurrences,
+ *                                  allocated on the t_scope. The words point
+ *                                  into the result, which must outlive it.
+ * \return The size of the words of the range.
+ */
+size_t t_wordcount_result_get_range(
+    const wordcount_result_t *result, int start, int len,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Merge the results of the counting of several parts of a content.
+ *
+ * The words of each result are sorted alphabetically, then the results are
+ * merged by word with a k-way merge, the occurrences of the same word being
+ * added. The merged words are finally filtered and sorted by occurrences
+ * like by t_wordcount_sort_word_occurrences().
+ *
+ * The results must have been counted without limit nor minimum number of
+ * occurrences, since only the total occurrences of a word can be filtered.
+ *
+ * \param[in]  results              The results of the parts.
+ * \param[in]  nb_results           The number of results.
+ * \param[in]  params               The limit and the minimum number of
+ *                                  occurrences of the words to keep.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope. The words point into the
+ *                                  results, which must outlive it.
+ * \return The size of the words of the merged result.
+ */
+size_t t_wordcount_merge_results(
+    const wordcount_result_t * const *results, int nb_results,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Merge partial word occurrences counted elsewhere, and sort them.
+ *
+ * The words are lower-cased, the occurrences of the same word are added,
+ * then the merged words are filtered and sorted by occurrences like by
+ * t_wordcount_merge_results(). The empty words are ignored, and so are the
+ * words rejected by the filter of the parameters.
+ *
+ * \param[in]  tab                  The partial word occurrences, in any
+ *                                   order, a word can be in several of them.
+ * \param[in]  len                  The number of partial word occurrences.
+ * \param[in]  params               The limit, the minimum number of
+ *                                   occurrences and the filter of the words
+ *                                   to keep.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                   the t_scope with their words.
+ * \return The size of the words of the merged result.
+ */
+size_t t_wordcount_merge_word_occurrences(
+    const wordcount__word_occurrences__t *tab, int len,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Word counter fed with successive chunks of a content.
+ *
+ * Contrary to wordcount_split_words(), the chunks do not need to outlive the
+ * call to wordcount_counter_feed(): the words are copied in \p words, the
+ * base buffer of the map, when they are put for the first time in the map.
+ *
+ * A word that is split between two chunks is kept in \p pending until its
+ * end is known, so counting a content chunk by chunk gives the same result as
+ * counting it in one go.
+ */
+typedef struct wordcount_counter_t {
+    /** The words and their occurrences, the words are in \p words. */
+    wordcount_map_t map;
+
+    /** The unique words, one after the other. */
+    sb_t words;
+
+    /** The beginning of the last word of the previous chunk. */
+    sb_t pending;
+
+    /** The sketch counting the words instead of the map, for an approximate
+     * counting, see wordcount_counter_set_approximate(). */
+    wordcount_sketch_t * nullable sketch;
+
+    /** Whether the chunks are parts of a folded UTF-8 content, tokenized
+     * with wordcount_tokenize_utf8(). They must be folded as a whole before,
+     * since a chunk can cut a UTF-8 character. */
+    bool utf8;
+
+    /** Optional filter of the words, the words it rejects are not
+     * counted. */
+    const wordcount_filter_t * nullable filter;
+} wordcount_counter_t;
+
+wordcount_counter_t *wordcount_counter_init(wordcount_counter_t *counter);
+void wordcount_counter_wipe(wordcount_counter_t *counter);
+GENERIC_NEW(wordcount_counter_t, wordcount_counter);
+GENERIC_DELETE(wordcount_counter_t, wordcount_counter);
+
+/** Count the words of a counter approximately in a fixed memory.
+ *
+ * Must be called before the first chunk is fed.
+ *
+ * \param[in] counter     The counter.
+ * \param[in] sketch_size The memory budget of the counting, see
+ *                        wordcount_params_t.
+ */
+void wordcount_counter_set_approximate(wordcount_counter_t *counter,
+                                       size_t sketch_size);
+
+/** Get the memory used by a counter. */
+size_t wordcount_counter_memory(const wordcount_counter_t *counter);
+
+/** Count the words of the next chunk of the content.
+ *
+ * \param[in] counter The counter.
+ * \param[in] chunk   The next chunk of the content. It is not referenced
+ *                    after the call.
+ */
+void wordcount_counter_feed(wordcount_counter_t *counter, lstr_t chunk);
+
+/** Signal the end of the content.
+ *
+ * Count the pending word, if any. Must be called before reading the map of
+ * the counter.
+ *
+ * \param[in] counter The counter.
+ */
+void wordcount_counter_flush(wordcount_counter_t *counter);
+
+/** Sort the words counted by a counter by their occurrences.
+ *
+ * The words are sorted like by t_wordcount_sort_word_occurrences(), from
+ * the map of the counter, or from its sketch for an approximate counting.
+ *
+ * \param[in]  counter              The flushed counter.
+ * \param[in]  params               The limit and the minimum number of
+ *                                  occurrences of the words to keep.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope.
+ */
+void t_wordcount_counter_sort_word_occurrences(
+    const wordcount_counter_t *counter, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Count the words of the next compressed chunk of the content.
+ *
+ * The chunk is decompressed in a small buffer, and each decompressed part
+ * is fed to the counter, so the decompressed chunk is never in memory.
+ *
+ * \param[in] counter  The counter.
+ * \param[in] codec    The codec of the chunk.
+ * \param[in] chunk    The next compressed chunk of the content, compressed
+ *                     on its own. It is not referenced after the call.
+ * \param[in] max_size The maximum size of the decompressed chunk, 0 for no
+ *                     limit.
+ * \return -1 if the chunk is not valid or too big once decompressed, the
+ *         words of its beginning are counted anyway, 0 otherwise.
+ */
+int wordcount_counter_feed_compressed(wordcount_counter_t *counter,
+                                      wordcount__codec__t codec,
+                                      lstr_t chunk, size_t max_size);
+
+/** Split the words from a compressed file content and sort the words by
+ * occurrences.
+ *
+ * The file content is decompressed chunk by chunk into a word counter, so
+ * the decompressed file content is never in memory. It is counted by only
+ * one thread, and the decompression stops once canceled or once the
+ * decompressed size exceeds the maximum size of the parameters.
+ *
+ * The n-grams are counted from the whole decompressed file content though,
+ * since their words are referenced in it, and so are the UTF-8 words, since
+ * the content is folded as a whole.
+ *
+ * \param[in]  codec                The codec of the file content.
+ * \param[in]  compressed_content   The compressed file content.
+ * \param[in]  params               The parameters of the counting, the
+ *                                  recycled map and the number of threads
+ *                                  are not used.
+ * \param[out] word_occurrences_vec The vector of sorted words by their
+ *                                  occurrences, allocated on the t_scope.
+ * \return -1 if the file content is not valid or too big once
+ *         decompressed, or if the counting has been canceled, 0 otherwise.
+ */
+int t_wordcount_decompress_split_and_sort_word_occurrences(
+    wordcount__codec__t codec, lstr_t compressed_content,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+/** Module to count the words of file contents.
+ *
+ * Depends on thr and wordcount_tokenize modules.
+ */
+MODULE_DECLARE(wordcount_count);
+
+#endif /* IS_WORDCOUNT_COUNT_H */
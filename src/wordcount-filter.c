@@ -0,0 +1,273 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include "wordcount-filter.h"
+#include "wordcount-tokenize.h"
+#include "wordcount-utf8.h"
+
+/* Average number of hashes per bucket of the perfect hash. Bigger buckets
+ * take less memory for the seeds, but are longer to place. */
+#define WORDCOUNT_FILTER_BUCKET_SIZE  4
+
+/* Maximum number of seeds tried for a bucket before giving up, the last
+ * buckets to place need about as many tries as there are slots */
+#define WORDCOUNT_FILTER_MAX_SEEDS  (1U << 24)
+
+wordcount_filter_t *wordcount_filter_init(wordcount_filter_t *filter)
+{
+    p_clear(filter, 1);
+    filter->max_len = UINT32_MAX;
+    qv_init(&filter->collisions);
+    sb_init(&filter->stopwords);
+    return filter;
+}
+
+void wordcount_filter_wipe(wordcount_filter_t *filter)
+{
+    lstr_wipe(&filter->name);
+    p_delete(&filter->seeds);
+    p_delete(&filter->slots);
+    qv_wipe(&filter->collisions);
+    sb_wipe(&filter->stopwords);
+}
+
+/** Compare two stopwords by hash, to gather the ones with the same hash. */
+static int wordcount_filter_slot_cmp(const void *a, const void *b)
+{
+    const wordcount_filter_slot_t *sa = a;
+    const wordcount_filter_slot_t *sb = b;
+
+    return CMP(sa->hash, sb->hash);
+}
+
+/** Put the hashes of a bucket in free slots of the perfect hash.
+ *
+ * \param[in,out] filter   The filter, its slots are filled.
+ * \param[in,out] taken    Whether each slot is taken.
+ * \param[in]     keys     The first stopword of each distinct hash.
+ * \param[in]     bucket   The positions in \p keys of the hashes of the
+ *                         bucket.
+ * \param[in]     len      The number of hashes of the bucket.
+ * \param[out]    seed     The seed of the bucket.
+ * \return -1 if no seed puts the hashes of the bucket in free slots, 0
+ *         otherwise.
+ */
+static int wordcount_filter_place_bucket(wordcount_filter_t *filter,
+                                         bool *taken,
+                                         const wordcount_filter_slot_t *keys,
+                                         const uint32_t *bucket, int len,
+                                         uint32_t *seed)
+{
+    uint32_t *pos = p_alloca(uint32_t, len);
+
+    for (uint32_t s = 0; s < WORDCOUNT_FILTER_MAX_SEEDS; s++) {
+        int i;
+
+        /* The slots are taken as they are tried, so that two hashes of the
+         * bucket cannot get the same slot, and released on failure */
+        for (i = 0; i < len; i++) {
+            pos[i] = wordcount_filter_slot_pos(keys[bucket[i]].hash, s,
+                                               filter->nb_slots);
+            if (taken[pos[i]]) {
+                break;
+            }
+            taken[pos[i]] = true;
+        }
+        if (i == len) {
+            for (i = 0; i < len; i++) {
+                filter->slots[pos[i]] = keys[bucket[i]];
+            }
+            *seed = s;
+            return 0;
+        }
+        while (i-- > 0) {
+            taken[pos[i]] = false;
+        }
+    }
+    return -1;
+}
+
+/** Build the perfect hash of the distinct hashes of the stopwords.
+ *
+ * The hashes are spread in their buckets, and the buckets are placed from
+ * the biggest to the smallest one, while there are still many free slots.
+ *
+ * \param[in,out] filter The filter.
+ * \param[in]     keys   The first stopword of each distinct hash.
+ * \param[in]     len    The number of distinct hashes.
+ * \return -1 if a bucket cannot be placed, 0 otherwise.
+ */
+static int wordcount_filter_build_hash(wordcount_filter_t *filter,
+                                       const wordcount_filter_slot_t *keys,
+                                       uint32_t len)
+{
+    uint32_t nb_buckets = DIV_ROUND_UP(len, WORDCOUNT_FILTER_BUCKET_SIZE);
+    uint32_t *starts = p_new(uint32_t, nb_buckets + 1);
+    uint32_t *by_bucket = p_new_raw(uint32_t, len);
+    uint32_t *order = p_new_raw(uint32_t, nb_buckets);
+    uint32_t nb_ordered = 0;
+    uint32_t max_len = 0;
+    bool *taken = p_new(bool, len);
+    int res = 0;
+
+    filter->nb_slots = len;
+    filter->nb_buckets = nb_buckets;
+    filter->slots = p_new(wordcount_filter_slot_t, len);
+    filter->seeds = p_new(uint32_t, nb_buckets);
+
+    /* Gather the hashes by bucket with a counting sort */
+    for (uint32_t i = 0; i < len; i++) {
+        starts[wordcount_filter_bucket(keys[i].hash, nb_buckets) + 1]++;
+    }
+    for (uint32_t b = 0; b < nb_buckets; b++) {
+        starts[b + 1] += starts[b];
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        uint32_t b = wordcount_filter_bucket(keys[i].hash, nb_buckets);
+
+        by_bucket[starts[b]++] = i;
+    }
+    for (uint32_t b = nb_buckets; b > 0; b--) {
+        starts[b] = starts[b - 1];
+    }
+    starts[0] = 0;
+
+    /* Place the biggest buckets first. The buckets are small, they are
+     * ordered by a pass per size. */
+#define BUCKET_LEN(b)  (starts[(b) + 1] - starts[b])
+    for (uint32_t b = 0; b < nb_buckets; b++) {
+        max_len = MAX(max_len, BUCKET_LEN(b));
+    }
+    for (uint32_t size = max_len; size > 0; size--) {
+        for (uint32_t b = 0; b < nb_buckets; b++) {
+            if (BUCKET_LEN(b) == size) {
+                order[nb_ordered++] = b;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < nb_ordered; i++) {
+        uint32_t b = order[i];
+
+        if (wordcount_filter_place_bucket(filter, taken, keys,
+                                          by_bucket + starts[b],
+                                          BUCKET_LEN(b),
+                                          &filter->seeds[b]) < 0)
+        {
+            res = -1;
+            break;
+        }
+    }
+#undef BUCKET_LEN
+
+    p_delete(&starts);
+    p_delete(&by_bucket);
+    p_delete(&order);
+    p_delete(&taken);
+    return res;
+}
+
+int wordcount_filter_compile(wordcount_filter_t *filter,
+                             const wordcount__filter_set__t *filter_set)
+{
+    qv_t(wordcount_filter_slot) words;
+    qv_t(wordcount_filter_slot) keys;
+    sb_t folded;
+    int res = 0;
+
+    filter->name = lstr_dup(filter_set->name);
+    filter->min_len = filter_set->min_length;
+    filter->max_len = filter_set->max_length ?: UINT32_MAX;
+    filter->exclude_numbers = filter_set->exclude_numbers;
+
+    qv_init(&words);
+    qv_init(&keys);
+    sb_init(&folded);
+
+    /* Fold the stopwords in the stopwords of the filter, and check that
+     * each of them is a whole word */
+    tab_for_each_entry(stopword, &filter_set->stopwords) {
+        lstr_t word = wordcount_utf8_fold(stopword, &folded);
+        const char *pos = word.s;
+        wordcount_token_t token;
+
+        if (wordcount_tokenize_utf8(&pos, word.s + word.len, &token, 1) != 1
+        ||  token.s != word.s || token.len != (uint32_t)word.len)
+        {
+            e_error("stopword `%pL` of filter set `%pL` is not a word",
+                    &stopword, &filter_set->name);
+            res = -1;
+            goto end;
+        }
+        qv_append(&words, ((wordcount_filter_slot_t){
+            .hash = token.hash,
+            .offset = filter->stopwords.len,
+            .len = token.len,
+        }));
+        sb_add_lstr(&filter->stopwords, word);
+    }
+
+    /* Keep the first stopword of each hash for the perfect hash, and chain
+     * the other distinct stopwords with the same hash to it */
+    qsort(words.tab, words.len, sizeof(words.tab[0]),
+          &wordcount_filter_slot_cmp);
+    for (int i = 0; i < words.len; i++) {
+        wordcount_filter_slot_t *last;
+        wordcount_filter_slot_t word = words.tab[i];
+        bool duplicate = false;
+
+        if (!keys.len || keys.tab[keys.len - 1].hash != word.hash) {
+            qv_append(&keys, word);
+            continue;
+        }
+        for (last = &keys.tab[keys.len - 1];;
+             last = &filter->collisions.tab[last->next - 1])
+        {
+            if (last->len == word.len
+            &&  wordcount_word_iequal(filter->stopwords.data + last->offset,
+                                      filter->stopwords.data + word.offset,
+                                      word.len))
+            {
+                duplicate = true;
+                break;
+            }
+            if (!last->next) {
+                break;
+            }
+        }
+        if (!duplicate) {
+            /* Link it before the append, which can move the collisions */
+            last->next = filter->collisions.len + 1;
+            qv_append(&filter->collisions, word);
+        }
+    }
+
+    if (keys.len && wordcount_filter_build_hash(filter, keys.tab,
+                                                keys.len) < 0)
+    {
+        e_error("cannot build the perfect hash of the %d stopwords of "
+                "filter set `%pL`", keys.len, &filter_set->name);
+        res = -1;
+    }
+
+  end:
+    sb_wipe(&folded);
+    qv_wipe(&keys);
+    qv_wipe(&words);
+    return res;
+}
@@ -0,0 +1,191 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_FILTER_H
+#define IS_WORDCOUNT_FILTER_H
+
+#include <lib-common/core.h>
+#include <lib-common/container-qvector.h>
+
+#include "wordcount.iop.h"
+#include "wordcount-map.h"
+
+/** Stopword of a filter.
+ *
+ * The stopwords whose hashes are the same are chained, so that the perfect
+ * hash only has to separate distinct hashes.
+ */
+typedef struct wordcount_filter_slot_t {
+    /** The hash of the stopword, see wordcount_hash_word(). */
+    uint32_t hash;
+
+    /** The position of the stopword in the stopwords of the filter. */
+    uint32_t offset;
+    uint32_t len;
+
+    /** The position plus one of the next stopword with the same hash in the
+     * collisions of the filter, 0 for none. */
+    uint32_t next;
+} wordcount_filter_slot_t;
+
+/* Create the vector type to store the stopwords of a filter. */
+qvector_t(wordcount_filter_slot, wordcount_filter_slot_t);
+
+/** Filter of the words of a counting, compiled from a wordcount.FilterSet.
+ *
+ * The stopwords are indexed by a minimal perfect hash built with the CHD
+ * algorithm (compress, hash and displace): the hashes are spread in buckets
+ * of a few hashes, and each bucket has the seed that puts its hashes in
+ * free slots of a table with exactly one slot per hash. A lookup is thus
+ * one access to the seeds and one to the slots, with the hash computed by
+ * the tokenizer, and never a probe sequence.
+ *
+ * The filter is read-only once compiled, it can be used by several threads
+ * at once.
+ */
+typedef struct wordcount_filter_t {
+    /** The name of the filter set. */
+    lstr_t name;
+
+    /** The length of the words kept, in bytes. */
+    uint32_t min_len;
+    uint32_t max_len;
+
+    /** Whether the words made of ASCII digits only are rejected. */
+    bool exclude_numbers;
+
+    /** The seeds of the buckets of the perfect hash. */
+    uint32_t *seeds;
+    uint32_t nb_buckets;
+
+    /** The slots of the perfect hash, one per distinct hash of the
+     * stopwords. */
+    wordcount_filter_slot_t *slots;
+    uint32_t nb_slots;
+
+    /** The stopwords whose hash is already in a slot. */
+    qv_t(wordcount_filter_slot) collisions;
+
+    /** The folded stopwords, one after the other. */
+    sb_t stopwords;
+} wordcount_filter_t;
+
+wordcount_filter_t *wordcount_filter_init(wordcount_filter_t *filter);
+void wordcount_filter_wipe(wordcount_filter_t *filter);
+GENERIC_NEW(wordcount_filter_t, wordcount_filter);
+GENERIC_DELETE(wordcount_filter_t, wordcount_filter);
+
+/** Compile a filter set.
+ *
+ * The stopwords are folded like by wordcount_utf8_fold(), so that they match
+ * the words of the UTF-8 tokenizing too, and each of them must be one word
+ * of it. The duplicate stopwords are ignored.
+ *
+ * \param[out] filter     The filter, initialized.
+ * \param[in]  filter_set The filter set.
+ * \return -1 if a stopword is not a word, or if the perfect hash cannot be
+ *         built, 0 otherwise.
+ */
+int wordcount_filter_compile(wordcount_filter_t *filter,
+                             const wordcount__filter_set__t *filter_set);
+
+/** Get the slot of a hash in the perfect hash of a filter.
+ *
+ * The bucket is given by the high bits of the hash, and the slot by the hash
+ * mixed with the seed of the bucket.
+ */
+static ALWAYS_INLINE uint32_t
+wordcount_filter_slot_pos(uint32_t hash, uint32_t seed, uint32_t nb_slots)
+{
+    uint32_t h = hash ^ (seed * 0x9e3779b9U);
+
+    /* Finalizer of MurmurHash3 */
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return ((uint64_t)h * nb_slots) >> 32;
+}
+
+/** Get the bucket of a hash in the perfect hash of a filter. */
+static ALWAYS_INLINE uint32_t
+wordcount_filter_bucket(uint32_t hash, uint32_t nb_buckets)
+{
+    return ((uint64_t)hash * nb_buckets) >> 32;
+}
+
+/** Get whether a word is made of ASCII digits only. */
+static inline bool wordcount_is_number(const char *s, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        if ((unsigned char)(s[i] - '0') > 9) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Get whether a word is rejected by a filter.
+ *
+ * \param[in] filter The filter.
+ * \param[in] s      The word.
+ * \param[in] len    The length of the word.
+ * \param[in] hash   The hash of the word, see wordcount_hash_word().
+ * \return true if the word must not be counted.
+ */
+static ALWAYS_INLINE bool
+wordcount_filter_rejects(const wordcount_filter_t *filter, const char *s,
+                         uint32_t len, uint32_t hash)
+{
+    const wordcount_filter_slot_t *slot;
+    uint32_t seed;
+
+    if (len < filter->min_len || len > filter->max_len) {
+        return true;
+    }
+    if (filter->exclude_numbers && wordcount_is_number(s, len)) {
+        return true;
+    }
+    if (!filter->nb_slots) {
+        return false;
+    }
+
+    /* Most words are not stopwords, and are rejected by the hash of their
+     * slot without looking at the stopword */
+    seed = filter->seeds[wordcount_filter_bucket(hash, filter->nb_buckets)];
+    slot = &filter->slots[wordcount_filter_slot_pos(hash, seed,
+                                                    filter->nb_slots)];
+    if (slot->hash != hash) {
+        return false;
+    }
+    for (;;) {
+        if (slot->len == len
+        &&  wordcount_word_iequal(filter->stopwords.data + slot->offset, s,
+                                  len))
+        {
+            return true;
+        }
+        if (!slot->next) {
+            return false;
+        }
+        slot = &filter->collisions.tab[slot->next - 1];
+    }
+}
+
+#endif /* IS_WORDCOUNT_FILTER_H */
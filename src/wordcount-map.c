@@ -0,0 +1,120 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <math.h>
+
+#include "wordcount-map.h"
+
+/* Minimum size of the index of a map */
+#define WORDCOUNT_MAP_MIN_SLOTS  64
+
+/* A recycled index bigger than this factor times the needed size is
+ * reallocated, so that a map used once for a huge content does not keep its
+ * memory, nor costs a huge clear on each reset, forever. */
+#define WORDCOUNT_MAP_SHRINK_FACTOR  8
+
+/* Parameters of Heaps' law V = K * N^beta, where N is the number of words
+ * of a text and V the number of unique words. Natural language texts have K
+ * between 10 and 100 and beta around 0.5. */
+#define WORDCOUNT_HEAPS_K     40.
+#define WORDCOUNT_HEAPS_BETA  0.5
+
+/* Average length of a word, separator included */
+#define WORDCOUNT_AVG_WORD_LEN  6
+
+wordcount_map_t *wordcount_map_init(wordcount_map_t *map)
+{
+    p_clear(map, 1);
+    qv_init(&map->entries);
+    return map;
+}
+
+void wordcount_map_wipe(wordcount_map_t *map)
+{
+    p_delete(&map->slots);
+    qv_wipe(&map->entries);
+}
+
+uint32_t wordcount_map_estimate_words(uint64_t content_len)
+{
+    double nb_words = content_len / WORDCOUNT_AVG_WORD_LEN;
+    double nb_unique;
+
+    /* There cannot be more unique words than words */
+    nb_unique = WORDCOUNT_HEAPS_K * pow(nb_words, WORDCOUNT_HEAPS_BETA);
+    return MIN(nb_unique, nb_words);
+}
+
+/** Get the size of the index of a map for a number of words. */
+static uint32_t wordcount_map_nb_slots(uint32_t nb_words)
+{
+    uint64_t nb_slots = WORDCOUNT_MAP_MIN_SLOTS;
+
+    /* Keep the load factor under 1/2 */
+    while (nb_slots < 2 * (uint64_t)nb_words) {
+        nb_slots *= 2;
+    }
+    return MIN(nb_slots, 1U << 31);
+}
+
+void wordcount_map_reset(wordcount_map_t *map, uint32_t nb_words)
+{
+    uint32_t nb_slots = wordcount_map_nb_slots(nb_words);
+    uint32_t cur_slots = map->slots ? map->mask + 1 : 0;
+
+    if (cur_slots < nb_slots
+    ||  cur_slots / WORDCOUNT_MAP_SHRINK_FACTOR > nb_slots)
+    {
+        p_delete(&map->slots);
+        map->slots = p_new(wordcount_map_slot_t, nb_slots);
+        map->mask = nb_slots - 1;
+    } else {
+        p_clear(map->slots, cur_slots);
+    }
+
+    qv_clear(&map->entries);
+    qv_grow(&map->entries, nb_words);
+}
+
+void wordcount_map_grow(wordcount_map_t *map)
+{
+    uint32_t nb_slots = map->slots ? 2 * (map->mask + 1)
+                                   : WORDCOUNT_MAP_MIN_SLOTS;
+    uint32_t mask = nb_slots - 1;
+    wordcount_map_slot_t *slots = p_new(wordcount_map_slot_t, nb_slots);
+
+    /* Move the words to the new index with their stored hash */
+    if (map->slots) {
+        for (uint32_t i = 0; i <= map->mask; i++) {
+            uint32_t pos = map->slots[i].hash & mask;
+
+            if (!map->slots[i].id) {
+                continue;
+            }
+            while (slots[pos].id) {
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = map->slots[i];
+        }
+        p_delete(&map->slots);
+    }
+
+    map->slots = slots;
+    map->mask = mask;
+    map->nb_grows++;
+}
@@ -0,0 +1,215 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_MAP_H
+#define IS_WORDCOUNT_MAP_H
+
+#include <lib-common/core.h>
+#include <lib-common/container-qvector.h>
+
+#include "wordcount-tokenize.h"
+
+/** Word of a map of words.
+ *
+ * The word is not copied in the map, it is referenced by its position in a
+ * buffer given on each access to the map, usually the content the words come
+ * from.
+ */
+typedef struct wordcount_map_entry_t {
+    /** The position of the word in the buffer. */
+    uint64_t offset;
+    uint32_t len;
+
+    /** The occurrences of the word. */
+    uint32_t occurrences;
+} wordcount_map_entry_t;
+
+/* Create the vector type to store the words of a map. */
+qvector_t(wordcount_map_entry, wordcount_map_entry_t);
+
+/** Slot of the index of a map of words. */
+typedef struct wordcount_map_slot_t {
+    /** The hash of the word, compared before looking at the word itself. */
+    uint32_t hash;
+
+    /** The identifier of the word plus one, 0 for an empty slot. */
+    uint32_t id;
+} wordcount_map_slot_t;
+
+/** Case-insensitive map of words to their occurrences.
+ *
+ * The words are stored in a vector in the order they are added, so the
+ * identifier of a word is its position in the vector. They are indexed by an
+ * open-addressing table with linear probing whose slots contain the hash of
+ * the words: a probe only touches the entry of a word when its hash matches,
+ * and growing the index does not need to hash the words again.
+ *
+ * Resetting a map keeps its memory, so a map can be recycled for the
+ * counting of the next content.
+ */
+typedef struct wordcount_map_t {
+    /** The index of the words, its size is a power of 2. */
+    wordcount_map_slot_t *slots;
+    uint32_t mask;
+
+    /** The words, by identifier. */
+    qv_t(wordcount_map_entry) entries;
+
+    /** The number of times the index had to grow since the initialization
+     * of the map. */
+    uint32_t nb_grows;
+} wordcount_map_t;
+
+wordcount_map_t *wordcount_map_init(wordcount_map_t *map);
+void wordcount_map_wipe(wordcount_map_t *map);
+GENERIC_NEW(wordcount_map_t, wordcount_map);
+GENERIC_DELETE(wordcount_map_t, wordcount_map);
+
+/** Estimate the number of unique words of a content.
+ *
+ * Use Heaps' law with the usual parameters of natural language texts, the
+ * estimation is used to size the maps before counting.
+ *
+ * \param[in] content_len The length of the content.
+ * \return The estimated number of unique words.
+ */
+uint32_t wordcount_map_estimate_words(uint64_t content_len);
+
+/** Remove all the words of a map, and prepare it for a number of words.
+ *
+ * The memory of the map is kept, and only grown if needed.
+ *
+ * \param[in] map      The map.
+ * \param[in] nb_words The expected number of unique words.
+ */
+void wordcount_map_reset(wordcount_map_t *map, uint32_t nb_words);
+
+/** Grow the index of a map. */
+void wordcount_map_grow(wordcount_map_t *map);
+
+/** Get the number of words of a map. */
+static inline uint32_t wordcount_map_len(const wordcount_map_t *map)
+{
+    return map->entries.len;
+}
+
+/** Get the memory used by a map, its index and its words. */
+static inline size_t wordcount_map_memory(const wordcount_map_t *map)
+{
+    size_t size = map->entries.size * sizeof(wordcount_map_entry_t);
+
+    if (map->slots) {
+        size += (size_t)(map->mask + 1) * sizeof(wordcount_map_slot_t);
+    }
+    return size;
+}
+
+/** Compare two words case-insensitively, 8 bytes at a time.
+ *
+ * Only the ASCII letters are case-insensitive, the other characters of the
+ * words, ASCII or complete UTF-8 characters, are compared as is.
+ */
+static inline bool wordcount_word_iequal(const char *a, const char *b,
+                                         uint32_t len)
+{
+    while (len >= 8) {
+        uint64_t wa, wb;
+
+        memcpy(&wa, a, 8);
+        memcpy(&wb, b, 8);
+        if (wordcount_ascii_tolower8(wa) != wordcount_ascii_tolower8(wb)) {
+            return false;
+        }
+        a += 8;
+        b += 8;
+        len -= 8;
+    }
+    if (len) {
+        /* Compare the last bytes the same way, padded with zeros: setting
+         * 0x20 on each byte would make different non-ASCII bytes equal */
+        uint64_t wa = 0, wb = 0;
+
+        memcpy(&wa, a, len);
+        memcpy(&wb, b, len);
+        return wordcount_ascii_tolower8(wa) == wordcount_ascii_tolower8(wb);
+    }
+    return true;
+}
+
+/** Add occurrences of a word to a map.
+ *
+ * \param[in]  map         The map.
+ * \param[in]  base        The buffer the words of the map are in.
+ * \param[in]  word        The word to look for.
+ * \param[in]  len         The length of the word.
+ * \param[in]  hash        The hash of the word, see wordcount_hash_word().
+ * \param[in]  offset      The position of the word in \p base, stored if
+ *                         the word is new. Usually `word - base`, but the
+ *                         caller can copy a new word in \p base after the
+ *                         call.
+ * \param[in]  occurrences The occurrences to add.
+ * \param[out] created     Set to whether the word was new, can be NULL.
+ * \return The identifier of the word.
+ */
+static ALWAYS_INLINE uint32_t
+wordcount_map_add(wordcount_map_t *map, const char *base, const char *word,
+                  uint32_t len, uint32_t hash, uint64_t offset,
+                  uint32_t occurrences, bool * nullable created)
+{
+    uint32_t pos;
+
+    /* Keep the load factor of the index under 1/2 */
+    if (unlikely(2 * (map->entries.len + 1) > map->mask + 1)) {
+        wordcount_map_grow(map);
+    }
+
+    for (pos = hash & map->mask;; pos = (pos + 1) & map->mask) {
+        wordcount_map_slot_t *slot = &map->slots[pos];
+        wordcount_map_entry_t *entry;
+
+        if (!slot->id) {
+            /* New word */
+            entry = qv_growlen(&map->entries, 1);
+            entry->offset = offset;
+            entry->len = len;
+            entry->occurrences = occurrences;
+            slot->hash = hash;
+            slot->id = map->entries.len;
+            if (created) {
+                *created = true;
+            }
+            return slot->id - 1;
+        }
+
+        if (slot->hash != hash) {
+            continue;
+        }
+        entry = &map->entries.tab[slot->id - 1];
+        if (entry->len == len
+        &&  wordcount_word_iequal(base + entry->offset, word, len))
+        {
+            entry->occurrences += occurrences;
+            if (created) {
+                *created = false;
+            }
+            return slot->id - 1;
+        }
+    }
+}
+
+#endif /* IS_WORDCOUNT_MAP_H */
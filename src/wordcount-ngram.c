@@ -0,0 +1,211 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include "wordcount-ngram.h"
+
+/* Minimum size of the index of an n-gram counter */
+#define WORDCOUNT_NGRAM_MIN_SLOTS  64
+
+wordcount_ngram_counter_t *
+wordcount_ngram_counter_init(wordcount_ngram_counter_t *counter, int n,
+                             uint32_t nb_words)
+{
+    uint64_t nb_slots = WORDCOUNT_NGRAM_MIN_SLOTS;
+
+    assert (n >= 2 && n <= WORDCOUNT_NGRAM_MAX);
+    p_clear(counter, 1);
+    counter->n = n;
+    qv_init(&counter->entries);
+
+    /* Most n-grams of a text are unique, so size the index for as many
+     * n-grams as words, with a load factor under 1/2 */
+    while (nb_slots < 2 * (uint64_t)nb_words) {
+        nb_slots *= 2;
+    }
+    nb_slots = MIN(nb_slots, 1U << 31);
+    counter->slots = p_new(wordcount_map_slot_t, nb_slots);
+    counter->mask = nb_slots - 1;
+    qv_grow(&counter->entries, nb_words);
+    return counter;
+}
+
+void wordcount_ngram_counter_wipe(wordcount_ngram_counter_t *counter)
+{
+    p_delete(&counter->slots);
+    qv_wipe(&counter->entries);
+}
+
+size_t wordcount_ngram_counter_memory(const wordcount_ngram_counter_t *counter)
+{
+    return counter->entries.size * sizeof(wordcount_ngram_entry_t)
+         + (size_t)(counter->mask + 1) * sizeof(wordcount_map_slot_t);
+}
+
+void wordcount_ngram_counter_grow(wordcount_ngram_counter_t *counter)
+{
+    uint32_t nb_slots = 2 * (counter->mask + 1);
+    uint32_t mask = nb_slots - 1;
+    wordcount_map_slot_t *slots = p_new(wordcount_map_slot_t, nb_slots);
+
+    /* Move the n-grams to the new index with their stored hash */
+    for (uint32_t i = 0; i <= counter->mask; i++) {
+        uint32_t pos = counter->slots[i].hash & mask;
+
+        if (!counter->slots[i].id) {
+            continue;
+        }
+        while (slots[pos].id) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = counter->slots[i];
+    }
+    p_delete(&counter->slots);
+
+    counter->slots = slots;
+    counter->mask = mask;
+}
+
+/** Restore the order of a min-heap of occurrences from a position. */
+static void wordcount_ngram_heap_sift_down(uint32_t *heap, unsigned len,
+                                           unsigned pos)
+{
+    for (;;) {
+        unsigned child = 2 * pos + 1;
+
+        if (child >= len) {
+            break;
+        }
+        if (child + 1 < len && heap[child + 1] < heap[child]) {
+            child++;
+        }
+        if (heap[child] >= heap[pos]) {
+            break;
+        }
+        SWAP(uint32_t, heap[pos], heap[child]);
+        pos = child;
+    }
+}
+
+/** Get the lowest occurrences of the n-grams kept by a limit.
+ *
+ * The occurrences of the first n-grams are put in a min-heap of the size of
+ * the limit, whose root is replaced by the occurrences of each next n-gram
+ * that are higher. The root is then the occurrences of the last kept
+ * n-grams, only the n-grams with at least as many occurrences are worth
+ * building.
+ */
+static uint32_t
+wordcount_ngram_limit_occurrences(const wordcount_ngram_counter_t *counter,
+                                  unsigned limit)
+{
+    uint32_t *heap;
+    uint32_t res;
+
+    if (!limit || limit >= (unsigned)counter->entries.len) {
+        return 0;
+    }
+
+    heap = p_new_raw(uint32_t, limit);
+    for (unsigned i = 0; i < limit; i++) {
+        heap[i] = counter->entries.tab[i].occurrences;
+    }
+    for (int pos = limit / 2 - 1; pos >= 0; pos--) {
+        wordcount_ngram_heap_sift_down(heap, limit, pos);
+    }
+    for (int i = limit; i < counter->entries.len; i++) {
+        if (counter->entries.tab[i].occurrences > heap[0]) {
+            heap[0] = counter->entries.tab[i].occurrences;
+            wordcount_ngram_heap_sift_down(heap, limit, 0);
+        }
+    }
+    res = heap[0];
+    p_delete(&heap);
+    return res;
+}
+
+/** Get the identifier of the i-th word of an n-gram. */
+static inline uint32_t
+wordcount_ngram_word_id(const wordcount_ngram_entry_t *entry, int i)
+{
+    return entry->key[i / 2] >> (32 * (i % 2));
+}
+
+size_t t_wordcount_sort_ngram_occurrences(
+    const wordcount_ngram_counter_t *counter, const wordcount_map_t *words,
+    const char *base, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    uint32_t min_occurrences;
+    int nb_kept = 0;
+    size_t len = 0;
+    char *buf;
+
+    /* Keep only the n-grams that can be part of the result */
+    min_occurrences = wordcount_ngram_limit_occurrences(counter,
+                                                        params->limit);
+    min_occurrences = MAX(min_occurrences, params->min_occurrences);
+
+    tab_for_each_ptr(entry, &counter->entries) {
+        nb_kept += entry->occurrences >= min_occurrences;
+    }
+    t_qv_init(word_occurrences_vec, nb_kept);
+    tab_for_each_ptr(entry, &counter->entries) {
+        wordcount__word_occurrences__t word_occurrences = {
+            /* The n-gram, until its string is built */
+            .word = LSTR_PTR_V((const char *)entry, 0),
+            .occurrences = entry->occurrences,
+        };
+
+        if (entry->occurrences < min_occurrences) {
+            continue;
+        }
+        for (int i = 0; i < counter->n; i++) {
+            len += words->entries.tab[wordcount_ngram_word_id(entry, i)].len;
+        }
+        len += counter->n - 1;
+        qv_append(word_occurrences_vec, word_occurrences);
+    }
+
+    /* Build the strings of the kept n-grams, the lower-cased words
+     * separated by a space, in one buffer */
+    buf = t_new_raw(char, len + 1);
+    tab_for_each_ptr(word_occurrences, word_occurrences_vec) {
+        const wordcount_ngram_entry_t *entry;
+        const char *start = buf;
+
+        entry = (const wordcount_ngram_entry_t *)word_occurrences->word.s;
+        for (int i = 0; i < counter->n; i++) {
+            const wordcount_map_entry_t *word;
+
+            word = &words->entries.tab[wordcount_ngram_word_id(entry, i)];
+            if (i > 0) {
+                *buf++ = ' ';
+            }
+            for (uint32_t j = 0; j < word->len; j++) {
+                *buf++ = tolower((unsigned char)base[word->offset + j]);
+            }
+        }
+        word_occurrences->word = LSTR_PTR_V(start, buf - start);
+    }
+
+    /* Sort them like words, the ties at the limit are broken by the
+     * strings */
+    word_occurrences_vec->len = wordcount_sort_word_occurrences_tab(
+        word_occurrences_vec->tab, word_occurrences_vec->len, params->limit);
+    return len;
+}
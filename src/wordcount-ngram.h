@@ -0,0 +1,186 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_NGRAM_H
+#define IS_WORDCOUNT_NGRAM_H
+
+#include <lib-common/core.h>
+#include <lib-common/container-qvector.h>
+
+#include "wordcount-count.h"
+#include "wordcount-map.h"
+
+/* Maximum number of words of an n-gram, so that the identifiers of its words
+ * are packed in 128 bits */
+#define WORDCOUNT_NGRAM_MAX  4
+
+/** N-gram of a map of n-grams.
+ *
+ * The n-gram is the sequence of the identifiers of its words in a map of
+ * words, packed two by two in 64-bit integers.
+ */
+typedef struct wordcount_ngram_entry_t {
+    uint64_t key[2];
+
+    /** The occurrences of the n-gram. */
+    uint32_t occurrences;
+} wordcount_ngram_entry_t;
+
+/* Create the vector type to store the n-grams of a map. */
+qvector_t(wordcount_ngram_entry, wordcount_ngram_entry_t);
+
+/** Counter of the n-grams of a content.
+ *
+ * The words of the content are interned in a map of words by the tokenizing
+ * shared with the counting of the words, their identifiers are then given
+ * one by one to the counter, which counts the sequences of the last n of
+ * them. The n-grams are indexed like the words of a map of words, with the
+ * hash of their packed identifiers, so no string is built until the result
+ * is sorted.
+ */
+typedef struct wordcount_ngram_counter_t {
+    /** The number of words of the n-grams. */
+    int n;
+
+    /** The identifiers of the last words, the last one at the end, and the
+     * number of them seen so far, up to n. */
+    uint32_t window[WORDCOUNT_NGRAM_MAX];
+    int nb_words;
+
+    /** The index of the n-grams, its size is a power of 2. */
+    wordcount_map_slot_t *slots;
+    uint32_t mask;
+
+    /** The n-grams, by identifier. */
+    qv_t(wordcount_ngram_entry) entries;
+} wordcount_ngram_counter_t;
+
+/** Initialize an n-gram counter.
+ *
+ * \param[in] counter  The counter.
+ * \param[in] n        The number of words of the n-grams, between 2 and
+ *                     WORDCOUNT_NGRAM_MAX.
+ * \param[in] nb_words The expected number of words of the content.
+ * \return The counter.
+ */
+wordcount_ngram_counter_t *
+wordcount_ngram_counter_init(wordcount_ngram_counter_t *counter, int n,
+                             uint32_t nb_words);
+void wordcount_ngram_counter_wipe(wordcount_ngram_counter_t *counter);
+
+/** Get the memory used by an n-gram counter. */
+size_t wordcount_ngram_counter_memory(const wordcount_ngram_counter_t *counter);
+
+/** Grow the index of an n-gram counter. */
+void wordcount_ngram_counter_grow(wordcount_ngram_counter_t *counter);
+
+/** Hash the packed identifiers of an n-gram. */
+static inline uint32_t wordcount_ngram_hash(const uint64_t key[2])
+{
+    uint64_t h = key[0] * 0x9e3779b97f4a7c15ULL
+               ^ key[1] * 0xc2b2ae3d27d4eb4fULL;
+
+    return h ^ (h >> 32);
+}
+
+/** Count the next word of the content in an n-gram counter.
+ *
+ * \param[in] counter The counter.
+ * \param[in] word_id The identifier of the word in the map of words.
+ */
+static ALWAYS_INLINE void
+wordcount_ngram_counter_add(wordcount_ngram_counter_t *counter,
+                            uint32_t word_id)
+{
+    uint64_t key[2] = { 0, 0 };
+    uint32_t hash;
+    int n = counter->n;
+
+    /* Slide the window of the last words */
+    memmove(counter->window, counter->window + 1,
+            (WORDCOUNT_NGRAM_MAX - 1) * sizeof(uint32_t));
+    counter->window[WORDCOUNT_NGRAM_MAX - 1] = word_id;
+    if (counter->nb_words < n) {
+        if (++counter->nb_words < n) {
+            return;
+        }
+    }
+
+    /* Pack the identifiers of the last n words */
+    for (int i = 0; i < n; i++) {
+        uint64_t id = counter->window[WORDCOUNT_NGRAM_MAX - n + i];
+
+        key[i / 2] |= id << (32 * (i % 2));
+    }
+    hash = wordcount_ngram_hash(key);
+
+    /* Keep the load factor of the index under 1/2 */
+    if (unlikely(2 * (counter->entries.len + 1) > counter->mask + 1)) {
+        wordcount_ngram_counter_grow(counter);
+    }
+
+    for (uint32_t pos = hash & counter->mask;;
+         pos = (pos + 1) & counter->mask)
+    {
+        wordcount_map_slot_t *slot = &counter->slots[pos];
+        wordcount_ngram_entry_t *entry;
+
+        if (!slot->id) {
+            /* New n-gram */
+            entry = qv_growlen(&counter->entries, 1);
+            entry->key[0] = key[0];
+            entry->key[1] = key[1];
+            entry->occurrences = 1;
+            slot->hash = hash;
+            slot->id = counter->entries.len;
+            return;
+        }
+
+        if (slot->hash != hash) {
+            continue;
+        }
+        entry = &counter->entries.tab[slot->id - 1];
+        if (entry->key[0] == key[0] && entry->key[1] == key[1]) {
+            entry->occurrences++;
+            return;
+        }
+    }
+}
+
+/** Sort the n-grams of a counter by their occurrences.
+ *
+ * The n-grams are selected by their occurrences first, and their strings,
+ * the lower-cased words separated by a space, are only built for the
+ * selected ones. They are then sorted like by
+ * t_wordcount_sort_word_occurrences().
+ *
+ * \param[in]  counter              The n-gram counter.
+ * \param[in]  words                The map of the words of the n-grams.
+ * \param[in]  base                 The buffer the words of the map are in.
+ * \param[in]  params               The limit and the minimum number of
+ *                                  occurrences of the n-grams to keep.
+ * \param[out] word_occurrences_vec The vector of sorted n-grams, allocated
+ *                                  on the t_scope.
+ * \return The size of the strings of the n-grams.
+ */
+size_t t_wordcount_sort_ngram_occurrences(
+    const wordcount_ngram_counter_t *counter, const wordcount_map_t *words,
+    const char *base, const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec);
+
+#endif /* IS_WORDCOUNT_NGRAM_H */
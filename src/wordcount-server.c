@@ -16,11 +16,23 @@
 /*                                                                         */
 /***************************************************************************/
 
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
 #include <lib-common/core.h>
+#include <lib-common/el.h>
 #include <lib-common/parseopt.h>
 #include <lib-common/iop-rpc.h>
+#include <lib-common/thr.h>
 
 #include "wordcount-base.h"
+#include "wordcount-cache.h"
+#include "wordcount-corpus.h"
+#include "wordcount-count.h"
+#include "wordcount-ngram.h"
+#include "wordcount-stats.h"
 
 
 static const char *short_args_g = "-c <server_cfg_path>";
@@ -36,16 +48,804 @@ static const char *long_usage_g[] = {
     NULL,
 };
 
+/** State of a client connection, in the priv of its ichannel. */
+typedef struct wordcount_conn_t {
+    /** Map recycled by the counting queries counted inline. */
+    wordcount_map_t map;
+
+    /** The counting queries of the connection admitted and not replied
+     * yet. */
+    int nb_queries;
+} wordcount_conn_t;
+
+static wordcount_conn_t *wordcount_conn_init(wordcount_conn_t *conn)
+{
+    p_clear(conn, 1);
+    wordcount_map_init(&conn->map);
+    return conn;
+}
+
+static void wordcount_conn_wipe(wordcount_conn_t *conn)
+{
+    wordcount_map_wipe(&conn->map);
+}
+
+GENERIC_NEW(wordcount_conn_t, wordcount_conn);
+GENERIC_DELETE(wordcount_conn_t, wordcount_conn);
+
+/** Sorted result kept for a client fetching it page by page. */
+typedef struct wordcount_paged_result_t {
+    /** The identifier of the result sent to the client. */
+    uint64_t id;
+
+    /** The connection of the counting query. */
+    ichannel_t *ic;
+
+    /** The number of words per page. */
+    unsigned page_size;
+
+    /** The packed sorted word occurrences. */
+    wordcount_result_t result;
+
+    /** Timer releasing the result when it is not fetched any more. */
+    el_t ttl_timer;
+} wordcount_paged_result_t;
+
+static wordcount_paged_result_t *
+wordcount_paged_result_init(wordcount_paged_result_t *paged)
+{
+    p_clear(paged, 1);
+    wordcount_result_init(&paged->result);
+    return paged;
+}
+
+static void wordcount_paged_result_wipe(wordcount_paged_result_t *paged)
+{
+    wordcount_result_wipe(&paged->result);
+    el_unregister(&paged->ttl_timer);
+}
+
+GENERIC_NEW(wordcount_paged_result_t, wordcount_paged_result);
+GENERIC_DELETE(wordcount_paged_result_t, wordcount_paged_result);
+
+/* Create the map type result id => paged result. */
+qm_k64_t(wordcount_paged_results, wordcount_paged_result_t *);
+
+/* Maximum length of the name of a persistent corpus */
+#define WORDCOUNT_CORPUS_NAME_MAX  64
+
+/* Create the map type corpus name => persistent corpus. */
+qm_kvec_t(wordcount_corpora, lstr_t, wordcount_corpus_t *, qhash_lstr_hash,
+          qhash_lstr_equal);
+
+/* Create the map type filter set name => compiled filter set, the names are
+ * the ones of the filters. */
+qm_kvec_t(wordcount_filters, lstr_t, wordcount_filter_t *, qhash_lstr_hash,
+          qhash_lstr_equal);
+
+/** Guard of a file mapped by a countFileOccurrences query.
+ *
+ * A file truncated by another process while it is mapped raises SIGBUS when
+ * its lost pages are read. The SIGBUS handler maps zero pages in place of
+ * the lost pages of a guarded file and flags it, so that the counting goes
+ * on and the query is rejected once counted.
+ */
+typedef struct wordcount_mapped_file_t {
+    /** The pages of the file, start is 0 for a free guard. They are read by
+     * the signal handler, in any thread. */
+    volatile uintptr_t start;
+    volatile uintptr_t end;
+
+    /** Set by the signal handler once pages of the file are lost. */
+    volatile bool truncated;
+} wordcount_mapped_file_t;
+
+/** Counting query, countOccurrences, countFileOccurrences,
+ * mergeOccurrences or endCount. */
+typedef struct wordcount_query_t {
+    /** The connection of the client, NULL once it is disconnected. */
+    ichannel_t * nullable ic;
+
+    /** The slot of the query to reply to. */
+    uint64_t slot;
+
+    /** Whether the query is a countFileOccurrences query, and the guard of
+     * its mapped file, NULL for an empty file. */
+    bool count_file;
+    wordcount_mapped_file_t * nullable mapped;
+
+    /** Whether the query is a mergeOccurrences query, or the endCount
+     * query of a session. */
+    bool merge;
+    bool end_count;
+
+    /** The codec of the file content, or of the partials of a merge, and
+     * the codec accepted for the reply. */
+    wordcount__codec__t codec;
+    wordcount__codec__t reply_codec;
+
+    /** The number of words per page of the reply, 0 to reply all the words
+     * at once. */
+    unsigned page_size;
+
+    /** The time the query has been received. */
+    int64_t start_nsec;
+
+    /** The size of the file content held until the query is replied, and
+     * whether the query is counted in the queries of its connection, once
+     * admitted by wordcount_admit_query(). */
+    size_t inflight_size;
+    bool admitted;
+} wordcount_query_t;
+
+static void wordcount_query_release(wordcount_query_t *query);
+
+/** Query of a streaming counting session, pushChunk or endCount. */
+typedef struct wordcount_session_op_t {
+    /** The slot of the query to reply to. */
+    uint64_t slot;
+
+    /** The chunk of a pushChunk query, owned by the operation, and its
+     * codec. */
+    lstr_t chunk;
+    wordcount__codec__t codec;
+
+    /** Whether the query is an endCount query, its parameters, the codec
+     * accepted for the reply and the number of words per page. */
+    bool end;
+    wordcount_params_t params;
+    wordcount__codec__t reply_codec;
+    unsigned page_size;
+
+    /** Node in the queries of the session. */
+    dlist_t list;
+} wordcount_session_op_t;
+
+static wordcount_session_op_t *
+wordcount_session_op_init(wordcount_session_op_t *op)
+{
+    p_clear(op, 1);
+    dlist_init(&op->list);
+    return op;
+}
+
+static void wordcount_session_op_wipe(wordcount_session_op_t *op)
+{
+    lstr_wipe(&op->chunk);
+    dlist_remove(&op->list);
+}
+
+GENERIC_NEW(wordcount_session_op_t, wordcount_session_op);
+GENERIC_DELETE(wordcount_session_op_t, wordcount_session_op);
+
+/** Streaming counting session opened by beginCount.
+ *
+ * The queries of a session are run by a thread of the pool one after the
+ * other, in the order they are received, and replied by the event loop
+ * thread.
+ */
+typedef struct wordcount_session_t {
+    /** The identifier of the session sent to the client. */
+    uint64_t id;
+
+    /** The connection that opened the session, NULL once it is
+     * disconnected. */
+    ichannel_t * nullable ic;
+
+    /** The beginCount query, admitted by wordcount_admit_query() until the
+     * session is closed, for the memory of the counter and of the queued
+     * chunks, see wordcount_session_charge(). */
+    wordcount_query_t query;
+    size_t counter_size;
+    size_t queued_size;
+
+    /** The word counter fed by the received chunks. */
+    wordcount_counter_t counter;
+
+    /** The queries received and not replied yet, in order. */
+    dlist_t ops;
+
+    /** Timer closing the session when it has no query for the sessionTtl
+     * of the server. */
+    el_t ttl_timer;
+
+    /** Whether the first query is run by a thread of the pool, the job
+     * running it, and the job replying to it in the event loop thread. */
+    bool busy;
+    wordcount_session_op_t * nullable op;
+    thr_job_t run_job;
+    thr_job_t done_job;
+
+    /** Whether an endCount query has been received, no chunk can follow
+     * it. */
+    bool ending;
+
+    /** Set by the event loop thread when the session is closed while busy,
+     * it is then released once its query is done. */
+    volatile bool closed;
+
+    /** Set by the thread of the pool if a compressed chunk is not valid. */
+    bool invalid;
+
+    /** The measures of the counting, the count time of all its chunks, and
+     * the sorted word occurrences of the endCount query. */
+    wordcount_count_stats_t count_stats;
+    wordcount_result_t result;
+} wordcount_session_t;
+
+static wordcount_session_t *
+wordcount_session_init(wordcount_session_t *session)
+{
+    p_clear(session, 1);
+    wordcount_counter_init(&session->counter);
+    dlist_init(&session->ops);
+    wordcount_result_init(&session->result);
+    return session;
+}
+
+static void wordcount_session_wipe(wordcount_session_t *session)
+{
+    while (!dlist_is_empty(&session->ops)) {
+        wordcount_session_op_t *op;
+
+        op = dlist_first_entry(&session->ops, wordcount_session_op_t, list);
+        wordcount_session_op_delete(&op);
+    }
+    el_unregister(&session->ttl_timer);
+    wordcount_query_release(&session->query);
+    wordcount_counter_wipe(&session->counter);
+    wordcount_result_wipe(&session->result);
+}
+
+GENERIC_NEW(wordcount_session_t, wordcount_session);
+GENERIC_DELETE(wordcount_session_t, wordcount_session);
+
+/* Create the map type session id => session. */
+qm_k64_t(wordcount_sessions, wordcount_session_t *);
+
+/** Counting job of a countOccurrences query.
+ *
+ * The words are counted by a thread of the pool, and the reply is sent by
+ * the event loop thread once the counting is done.
+ */
+typedef struct wordcount_job_t {
+    /** Job counting the words, run in the thread pool. */
+    thr_job_t count_job;
+
+    /** Job sending the reply, run in the event loop thread. */
+    thr_job_t reply_job;
+
+    /** The query to reply to. */
+    wordcount_query_t query;
+
+    /** The file content, owned by the job. */
+    lstr_t file_content;
+
+    /** Whether the result is looked up in the cache and put in it, the key
+     * of the result and the entry found, if any. The key is computed and
+     * looked up by the counting thread. */
+    bool cache_result;
+    bool cache_looked_up;
+    wordcount_cache_key_t cache_key;
+    const wordcount_cache_entry_t * nullable cache_entry;
+
+    /** Whether the file content is counted by the upstream servers of the
+     * coordinator once looked up in the cache, instead of by the job. The
+     * job then decompresses the file content, or copies a mapped file, and
+     * splits it in shards, see wordcount_job_split(). */
+    bool fanout;
+    int nb_shards;
+    lstr_t * nullable shards;
+
+    /** The parameters of the counting. */
+    wordcount_params_t params;
+
+    /** Whether the job counts its file content in parallel, its thread then
+     * waits for the slices, see wordcount_job_set_threads(). */
+    bool parallel;
+
+    /** The time the job waited for a thread of the pool. */
+    int64_t queue_nsec;
+
+    /** The measures of the counting. */
+    wordcount_count_stats_t count_stats;
+
+    /** Set by the event loop thread when the reply is no longer needed. */
+    volatile bool canceled;
+
+    /** Set by the counting thread if the counting has been aborted, if the
+     * compressed file content is not valid, or if the mapped file has been
+     * truncated while it was counted. */
+    bool aborted;
+    bool invalid;
+    bool truncated;
+
+    /** The sorted word occurrences. */
+    wordcount_result_t result;
+
+    /** Node in the list of the pending jobs. */
+    dlist_t list;
+} wordcount_job_t;
+
+static wordcount_job_t *wordcount_job_init(wordcount_job_t *job)
+{
+    p_clear(job, 1);
+    wordcount_result_init(&job->result);
+    dlist_init(&job->list);
+    return job;
+}
+
+static void wordcount_job_release_threads(wordcount_job_t *job);
+static void wordcount_job_release_cache_entry(wordcount_job_t *job);
+static void
+wordcount_mapped_file_release(wordcount_mapped_file_t * nullable *mapped);
+
+static void wordcount_job_wipe(wordcount_job_t *job)
+{
+    wordcount_job_release_threads(job);
+    wordcount_query_release(&job->query);
+    wordcount_mapped_file_release(&job->query.mapped);
+    lstr_wipe(&job->file_content);
+    wordcount_job_release_cache_entry(job);
+    p_delete(&job->shards);
+    wordcount_result_wipe(&job->result);
+    dlist_remove(&job->list);
+}
+
+GENERIC_NEW(wordcount_job_t, wordcount_job);
+GENERIC_DELETE(wordcount_job_t, wordcount_job);
+
+/** Connection of a coordinator to an upstream server. */
+typedef struct wordcount_upstream_t {
+    ichannel_t ic;
+
+    /** Whether the shards can be sent to the upstream server. */
+    bool connected;
+} wordcount_upstream_t;
+
+struct wordcount_fanout_t;
+
+/** Shard of a file content counted by an upstream server. */
+typedef struct wordcount_shard_t {
+    /** The counting the shard is part of. */
+    struct wordcount_fanout_t *fanout;
+
+    /** The shard of the file content, in the content of the fan-out. */
+    lstr_t content;
+
+    /** The number of times the shard has been sent. Only the reply of the
+     * last attempt is used. */
+    int attempts;
+
+    /** The number of attempts rejected with the INVALID status, for
+     * instance by upstream servers without the filter set of the query. */
+    int invalid_attempts;
+
+    /** Timeout of the last attempt. */
+    el_t timer;
+
+    /** Whether the result of the shard has been received. */
+    bool done;
+
+    /** The word occurrences of the shard. */
+    wordcount_result_t result;
+} wordcount_shard_t;
+
+/** Counting of a file content split in shards counted by the upstream
+ * servers of a coordinator. */
+typedef struct wordcount_fanout_t {
+    /** The query to reply to. */
+    wordcount_query_t query;
+
+    /** The plain file content, taken over from the counting job, the shards
+     * point into it. */
+    lstr_t content;
+
+    /** The key of the result in the cache, if the cache is enabled. */
+    bool cache_result;
+    wordcount_cache_key_t cache_key;
+
+    /** The parameters of the counting. */
+    wordcount_params_t params;
+
+    /** The shards, and the number of them without result. */
+    wordcount_shard_t *shards;
+    int nb_shards;
+    int nb_pending_shards;
+
+    /** The number of queries sent to the upstream servers and not answered
+     * yet, the fan-out is released once they all are. */
+    int nb_msgs;
+
+    /** Set once the query has been replied, rejected or canceled. */
+    bool finished;
+
+    /** Job merging the results of the shards, run in the thread pool, and
+     * job sending the reply, run in the event loop thread. The fan-out is
+     * not released while merging. */
+    thr_job_t merge_job;
+    thr_job_t reply_job;
+    bool merging;
+
+    /** The time spent merging, and the merged word occurrences. */
+    int64_t merge_nsec;
+    wordcount_result_t result;
+
+    /** Node in the list of the pending fan-outs. */
+    dlist_t list;
+} wordcount_fanout_t;
+
+static wordcount_fanout_t *wordcount_fanout_init(wordcount_fanout_t *fanout)
+{
+    p_clear(fanout, 1);
+    wordcount_result_init(&fanout->result);
+    dlist_init(&fanout->list);
+    return fanout;
+}
+
+static void wordcount_fanout_wipe(wordcount_fanout_t *fanout)
+{
+    for (int i = 0; i < fanout->nb_shards; i++) {
+        el_unregister(&fanout->shards[i].timer);
+        wordcount_result_wipe(&fanout->shards[i].result);
+    }
+    p_delete(&fanout->shards);
+    lstr_wipe(&fanout->content);
+    wordcount_result_wipe(&fanout->result);
+    dlist_remove(&fanout->list);
+    wordcount_query_release(&fanout->query);
+}
+
+GENERIC_NEW(wordcount_fanout_t, wordcount_fanout);
+GENERIC_DELETE(wordcount_fanout_t, wordcount_fanout);
+
+/** Job of a mergeOccurrences query.
+ *
+ * The partials are decompressed, merged and sorted by a thread of the pool,
+ * and the reply is sent by the event loop thread.
+ */
+typedef struct wordcount_merge_job_t {
+    /** Job merging the partials, run in the thread pool. */
+    thr_job_t merge_job;
+
+    /** Job sending the reply, run in the event loop thread. */
+    thr_job_t reply_job;
+
+    /** The query to reply to. */
+    wordcount_query_t query;
+
+    /** The parameters of the merge. */
+    wordcount_params_t params;
+
+    /** The partials, owned by the job: compressed with the codec of the
+     * query, or packed as a result otherwise. */
+    lstr_t compressed;
+    wordcount_result_t partials;
+
+    /** Set by the merging thread if the compressed partials are not
+     * valid. */
+    bool invalid;
+
+    /** The time spent merging, and the merged word occurrences. */
+    int64_t merge_nsec;
+    wordcount_result_t result;
+
+    /** Node in the list of the pending merge jobs. */
+    dlist_t list;
+} wordcount_merge_job_t;
+
+static wordcount_merge_job_t *
+wordcount_merge_job_init(wordcount_merge_job_t *job)
+{
+    p_clear(job, 1);
+    wordcount_result_init(&job->partials);
+    wordcount_result_init(&job->result);
+    dlist_init(&job->list);
+    return job;
+}
+
+static void wordcount_merge_job_wipe(wordcount_merge_job_t *job)
+{
+    wordcount_query_release(&job->query);
+    lstr_wipe(&job->compressed);
+    wordcount_result_wipe(&job->partials);
+    wordcount_result_wipe(&job->result);
+    dlist_remove(&job->list);
+}
+
+GENERIC_NEW(wordcount_merge_job_t, wordcount_merge_job);
+GENERIC_DELETE(wordcount_merge_job_t, wordcount_merge_job);
+
+/** Job of an addToCorpus query.
+ *
+ * The content is counted by a thread of the pool, and its words are added to
+ * the corpus by the event loop thread, which replies.
+ */
+typedef struct wordcount_corpus_job_t {
+    /** Job counting the words, run in the thread pool. */
+    thr_job_t count_job;
+
+    /** Job adding the words to the corpus and sending the reply, run in the
+     * event loop thread. */
+    thr_job_t reply_job;
+
+    /** The query to reply to. */
+    wordcount_query_t query;
+
+    /** The corpus, which is kept until the server stops, and the content,
+     * owned by the job. */
+    wordcount_corpus_t *corpus;
+    lstr_t content;
+
+    /** The words of the content. */
+    wordcount_counter_t counter;
+
+    /** Node in the list of the pending corpus jobs. */
+    dlist_t list;
+} wordcount_corpus_job_t;
+
+static wordcount_corpus_job_t *
+wordcount_corpus_job_init(wordcount_corpus_job_t *job)
+{
+    p_clear(job, 1);
+    wordcount_counter_init(&job->counter);
+    dlist_init(&job->list);
+    return job;
+}
+
+static void wordcount_corpus_job_wipe(wordcount_corpus_job_t *job)
+{
+    wordcount_query_release(&job->query);
+    lstr_wipe(&job->content);
+    wordcount_counter_wipe(&job->counter);
+    dlist_remove(&job->list);
+}
+
+GENERIC_NEW(wordcount_corpus_job_t, wordcount_corpus_job);
+GENERIC_DELETE(wordcount_corpus_job_t, wordcount_corpus_job);
+
+/** Job saving the words added to a persistent corpus.
+ *
+ * The new file is written by a thread of the pool, and mapped by the event
+ * loop thread once written.
+ */
+typedef struct wordcount_corpus_save_t {
+    /** Job writing the file, run in the thread pool. */
+    thr_job_t save_job;
+
+    /** Job mapping the new file, run in the event loop thread. */
+    thr_job_t end_job;
+
+    /** The corpus being saved, and whether the file has been written. */
+    wordcount_corpus_t *corpus;
+    bool saved;
+} wordcount_corpus_save_t;
+
+/** Private data of a query sent to an upstream server. */
+typedef struct wordcount_shard_msg_t {
+    wordcount_shard_t *shard;
+
+    /** The attempt of the shard the query is for. */
+    int attempt;
+} wordcount_shard_msg_t;
+
+/** Stages of the counting queries, see wordcount.StageLatency. */
+typedef enum wordcount_stage_t {
+    WORDCOUNT_STAGE_QUEUE,
+    WORDCOUNT_STAGE_COUNT,
+    WORDCOUNT_STAGE_SORT,
+    WORDCOUNT_STAGE_ENCODE,
+    WORDCOUNT_STAGE_TOTAL,
+    WORDCOUNT_STAGE_count,
+} wordcount_stage_t;
+
+static const char *wordcount_stage_names_g[WORDCOUNT_STAGE_count] = {
+    [WORDCOUNT_STAGE_QUEUE]  = "queue",
+    [WORDCOUNT_STAGE_COUNT]  = "count",
+    [WORDCOUNT_STAGE_SORT]   = "sort",
+    [WORDCOUNT_STAGE_ENCODE] = "encode",
+    [WORDCOUNT_STAGE_TOTAL]  = "total",
+};
+
+/** Runtime statistics of the server, see wordcount.Stats.
+ *
+ * They are only updated by the event loop thread, so they need no
+ * synchronization, and recording them costs a few clock reads and counter
+ * increments per query.
+ */
+typedef struct wordcount_server_stats_t {
+    time_t start_time;
+
+    uint64_t count_occurrences_queries;
+    uint64_t count_file_occurrences_queries;
+    uint64_t push_chunk_queries;
+    uint64_t end_count_queries;
+    uint64_t merge_occurrences_queries;
+    uint64_t rejected_queries;
+    uint64_t rejected_payloads;
+    uint64_t rejected_inflight_queries;
+    uint64_t rejected_connection_queries;
+    uint64_t rejected_connections;
+
+    /** The queries admitted and not replied yet, and the size of their file
+     * contents. */
+    unsigned pending_queries;
+    uint64_t inflight_bytes;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    unsigned connections;
+    uint64_t total_connections;
+
+    /** The latencies of the stages, in nanoseconds. */
+    wordcount_histogram_t stages[WORDCOUNT_STAGE_count];
+    wordcount_histogram_t distinct_words;
+
+    size_t map_high_water_mark;
+    size_t t_stack_high_water_mark;
+} wordcount_server_stats_t;
+
+/** Statistics of a worker process, published in the memory shared by the
+ * workers so that any of them can combine them. */
+typedef struct wordcount_worker_stats_t {
+    wordcount_server_stats_t server;
+    wordcount_cache_stats_t cache;
+} wordcount_worker_stats_t;
+
+/* A worker dying sooner than this delay after its start is restarted after
+ * this delay, so that a worker failing at startup is not forked in a loop */
+#define WORDCOUNT_WORKER_RESTART_DELAY  1
+
+/** Worker process, seen from the main process. */
+typedef struct wordcount_worker_t {
+    /** The pid of the worker, 0 when it is not running. */
+    pid_t pid;
+
+    time_t start_time;
+
+    /** When to restart the worker once it is dead. */
+    time_t restart_time;
+} wordcount_worker_t;
+
+qvector_t(wordcount_el, el_t);
+
 static struct {
     bool opt_help;
     const char *opt_cfg_path;
 
-    /* IChannel server */
-    el_t ic_server;
+    /* Server configuration, unpacked on the t_stack of main() */
+    const wordcount__server_cfg__t *server_cfg;
+
+    /* Listening sockets, on the TCP address and on the unix sockets. They
+     * are opened before the workers are forked, so that all the workers
+     * accept the connections of the same sockets */
+    qv_t(i32) listen_fds;
+
+    /* Events of the listening sockets in the event loop */
+    qv_t(wordcount_el) listeners;
+
+    /* Paths of the unix socket files to remove on shutdown */
+    qv_t(lstr) unix_socket_paths;
+
+    /* Identifier of this worker, and number of workers */
+    int worker_id;
+    int nb_workers;
+
+    /* Statistics of the workers, shared by the processes, NULL when the
+     * server runs in a single process */
+    wordcount_worker_stats_t *workers_stats;
+
+    /* Timer publishing the statistics of this worker */
+    el_t stats_timer;
 
     /* RPC implementations table */
     qm_t(ic_cbs) ic_impl;
-} wordcount_server_g;
+
+    /* Resolved directories allowed for countFileOccurrences */
+    qv_t(lstr) file_roots;
+
+    /* Streaming counting sessions by id */
+    qm_t(wordcount_sessions) sessions;
+
+    /* Identifier of the last opened session, the number of sessions whose
+     * query is run by the thread pool, and the time an idle session is
+     * kept, in milliseconds */
+    uint64_t last_session_id;
+    int nb_busy_sessions;
+    int session_ttl;
+
+    /* Paged results by id, the identifier of the last one, and the time
+     * they are kept without being fetched, in milliseconds */
+    qm_t(wordcount_paged_results) paged_results;
+    uint64_t last_result_id;
+    int result_ttl;
+
+    /* Persistent corpora by name, the maximum number of them, the resolved
+     * directory of their files, LSTR_NULL_V when they are disabled, and the
+     * timer saving them */
+    qm_t(wordcount_corpora) corpora;
+    unsigned max_corpora;
+    lstr_t corpus_dir;
+    el_t corpus_timer;
+
+    /* Partials being merged in the thread pool */
+    dlist_t merge_jobs;
+
+    /* Contents being added to the corpora, and the number of corpora being
+     * saved, in the thread pool */
+    dlist_t corpus_jobs;
+    int nb_saving_corpora;
+
+    /* Compiled filter sets by name */
+    qm_t(wordcount_filters) filters;
+
+    /* Maximum number of threads counting a file content */
+    int count_threads;
+
+    /* File contents up to this size are counted in the event loop thread */
+    int inline_count_max_size;
+
+    /* Memory budget of the counting of an approximate query */
+    size_t approximate_memory;
+
+    /* Admission limits, 0 for no limit */
+    size_t max_payload_size;
+    size_t max_chunk_size;
+    size_t max_inflight_bytes;
+    int max_connection_queries;
+    unsigned max_connections;
+
+    /* Cache of the results of the counting queries */
+    wordcount_cache_t cache;
+
+    /* Replies with bigger words are compressed, if the client accepts it */
+    size_t reply_compress_min_size;
+
+    /* Counting jobs, queued or running */
+    dlist_t jobs;
+    int nb_jobs;
+    int max_jobs;
+
+    /* Counting jobs counting their file content in parallel, their threads
+     * of the pool wait for the slices */
+    int nb_parallel_jobs;
+
+    /* Synchronization of the counting jobs, to wait for them on shutdown */
+    thr_syn_t jobs_syn;
+
+    /* Upstream servers of the coordinator, and the next one to send a shard
+     * to */
+    wordcount_upstream_t *upstreams;
+    int nb_upstreams;
+    int next_upstream;
+
+    /* Sharding of the file contents by the coordinator */
+    size_t shard_min_size;
+    int upstream_timeout;
+    int upstream_retries;
+
+    /* Counting of file contents by the upstream servers */
+    dlist_t fanouts;
+
+    /* The number of fan-outs whose shards are being merged */
+    int nb_merging_fanouts;
+
+    /* Guards of the mapped files, one per job and one for the query being
+     * handled, the size of the pages, and the previous SIGBUS handler */
+    wordcount_mapped_file_t *mapped_files;
+    int nb_mapped_files;
+    uintptr_t page_size;
+    struct sigaction old_sigbus;
+
+    /* Runtime statistics */
+    wordcount_server_stats_t stats;
+} wordcount_server_g = {
+    .jobs = DLIST_INIT(wordcount_server_g.jobs),
+    .fanouts = DLIST_INIT(wordcount_server_g.fanouts),
+    .merge_jobs = DLIST_INIT(wordcount_server_g.merge_jobs),
+    .corpus_jobs = DLIST_INIT(wordcount_server_g.corpus_jobs),
+};
 #define _G wordcount_server_g
 
 static popt_t opts_g[] = {
@@ -56,144 +856,2556 @@ static popt_t opts_g[] = {
     OPT_END()
 };
 
-/* Create the map type lstr_t => unsigned with name word_occurrences.
- * The word equality ignore the case. */
-qm_kvec_t(word_occurrences_map, lstr_t, unsigned, qhash_lstr_ascii_ihash,
-          qhash_lstr_ascii_iequal);
+/* Statistics */
+
+/** Record the measures of the counting of a file content. */
+static void
+wordcount_stats_record_count(const wordcount_count_stats_t *count_stats)
+{
+    wordcount_server_stats_t *stats = &_G.stats;
+
+    wordcount_histogram_record(&stats->stages[WORDCOUNT_STAGE_COUNT],
+                               count_stats->count_nsec);
+    wordcount_histogram_record(&stats->stages[WORDCOUNT_STAGE_SORT],
+                               count_stats->sort_nsec);
+    wordcount_histogram_record(&stats->distinct_words,
+                               count_stats->nb_unique_words);
+    stats->map_high_water_mark = MAX(stats->map_high_water_mark,
+                                     count_stats->map_size);
+    stats->t_stack_high_water_mark = MAX(stats->t_stack_high_water_mark,
+                                         count_stats->t_stack_size);
+}
+
+/** Account the size of the words and occurrences of a reply. */
+static void
+wordcount_stats_add_bytes_out(
+    const qv_t(word_occurrences_vec) *word_occurrences_vec, size_t words_size)
+{
+    _G.stats.bytes_out += words_size
+                        + word_occurrences_vec->len * sizeof(uint32_t);
+}
+
+/** Publish the statistics of this worker to the other workers. */
+static void wordcount_stats_publish(void)
+{
+    wordcount_worker_stats_t *worker_stats;
+
+    if (!_G.workers_stats) {
+        return;
+    }
+    worker_stats = &_G.workers_stats[_G.worker_id];
+    worker_stats->server = _G.stats;
+    wordcount_cache_get_stats(&_G.cache, &worker_stats->cache);
+}
+
+static void wordcount_stats_on_timer(el_t ev, data_t priv)
+{
+    wordcount_stats_publish();
+}
+
+/** Add the statistics of a worker to the combined statistics. */
+static void wordcount_stats_merge(wordcount_worker_stats_t *dst,
+                                  const wordcount_worker_stats_t *src)
+{
+    wordcount_server_stats_t *d = &dst->server;
+    const wordcount_server_stats_t *s = &src->server;
+
+    if (!s->start_time) {
+        /* The worker has not started yet */
+        return;
+    }
+    if (!d->start_time || s->start_time < d->start_time) {
+        d->start_time = s->start_time;
+    }
+
+    d->count_occurrences_queries += s->count_occurrences_queries;
+    d->count_file_occurrences_queries += s->count_file_occurrences_queries;
+    d->push_chunk_queries += s->push_chunk_queries;
+    d->end_count_queries += s->end_count_queries;
+    d->merge_occurrences_queries += s->merge_occurrences_queries;
+    d->rejected_queries += s->rejected_queries;
+    d->rejected_payloads += s->rejected_payloads;
+    d->rejected_inflight_queries += s->rejected_inflight_queries;
+    d->rejected_connection_queries += s->rejected_connection_queries;
+    d->rejected_connections += s->rejected_connections;
+    d->pending_queries += s->pending_queries;
+    d->inflight_bytes += s->inflight_bytes;
+    d->bytes_in += s->bytes_in;
+    d->bytes_out += s->bytes_out;
+    d->connections += s->connections;
+    d->total_connections += s->total_connections;
+    for (int i = 0; i < WORDCOUNT_STAGE_count; i++) {
+        wordcount_histogram_merge(&d->stages[i], &s->stages[i]);
+    }
+    wordcount_histogram_merge(&d->distinct_words, &s->distinct_words);
+    d->map_high_water_mark = MAX(d->map_high_water_mark,
+                                 s->map_high_water_mark);
+    d->t_stack_high_water_mark = MAX(d->t_stack_high_water_mark,
+                                     s->t_stack_high_water_mark);
 
-/* Create the vector type to store the word occurrences. */
-qvector_t(word_occurrences_vec, wordcount__word_occurrences__t);
+    dst->cache.hits += src->cache.hits;
+    dst->cache.misses += src->cache.misses;
+    dst->cache.evictions += src->cache.evictions;
+    dst->cache.collisions += src->cache.collisions;
+}
 
-/** Split the file content per word and count their occurrences.
+/** Get the statistics of the server, combined over all the workers.
  *
- * Put the words and their occurrences in a map.
+ * The statistics of the other workers are published every second, so they
+ * are at most a second late.
+ *
+ * \param[out] out The statistics of the server.
+ */
+static void wordcount_stats_collect(wordcount_worker_stats_t *out)
+{
+    if (!_G.workers_stats) {
+        out->server = _G.stats;
+        wordcount_cache_get_stats(&_G.cache, &out->cache);
+        return;
+    }
+
+    wordcount_stats_publish();
+    p_clear(out, 1);
+    for (int i = 0; i < _G.nb_workers; i++) {
+        wordcount_stats_merge(out, &_G.workers_stats[i]);
+    }
+}
+
+/** RPC implementation to get the runtime statistics of the server. */
+static void IOP_RPC_IMPL(wordcount__mod, stats_iface, get_stats)
+{
+    t_scope;
+    wordcount_worker_stats_t *worker_stats;
+    const wordcount_server_stats_t *stats;
+    wordcount__stage_latency__t *stages;
+    wordcount__stats__t res;
+
+    /* The histograms are too big for the stack */
+    worker_stats = t_new_raw(wordcount_worker_stats_t, 1);
+    wordcount_stats_collect(worker_stats);
+    stats = &worker_stats->server;
+
+    iop_init(wordcount__stats, &res);
+    res.uptime = time(NULL) - stats->start_time;
+    res.count_occurrences_queries = stats->count_occurrences_queries;
+    res.count_file_occurrences_queries =
+        stats->count_file_occurrences_queries;
+    res.push_chunk_queries = stats->push_chunk_queries;
+    res.end_count_queries = stats->end_count_queries;
+    res.merge_occurrences_queries = stats->merge_occurrences_queries;
+    res.rejected_queries = stats->rejected_queries;
+    res.rejected_payloads = stats->rejected_payloads;
+    res.rejected_inflight_queries = stats->rejected_inflight_queries;
+    res.rejected_connection_queries = stats->rejected_connection_queries;
+    res.rejected_connections = stats->rejected_connections;
+    res.pending_queries = stats->pending_queries;
+    res.inflight_bytes = stats->inflight_bytes;
+    res.cache_hits = worker_stats->cache.hits;
+    res.cache_misses = worker_stats->cache.misses;
+    res.cache_evictions = worker_stats->cache.evictions;
+    res.bytes_in = stats->bytes_in;
+    res.bytes_out = stats->bytes_out;
+    res.connections = stats->connections;
+    res.total_connections = stats->total_connections;
+    res.map_high_water_mark = stats->map_high_water_mark;
+    res.t_stack_high_water_mark = stats->t_stack_high_water_mark;
+
+    /* The latencies are recorded in nanoseconds, and sent in
+     * microseconds */
+    stages = t_new(wordcount__stage_latency__t, WORDCOUNT_STAGE_count);
+    for (int i = 0; i < WORDCOUNT_STAGE_count; i++) {
+        stages[i].stage = LSTR(wordcount_stage_names_g[i]);
+        wordcount_histogram_get_distribution(&stats->stages[i], 1000,
+                                             &stages[i].latency);
+    }
+    res.stages = IOP_TYPED_ARRAY(wordcount__stage_latency, stages,
+                                 WORDCOUNT_STAGE_count);
+    wordcount_histogram_get_distribution(&stats->distinct_words, 1,
+                                         &res.distinct_words);
+
+    ic_reply(ic, slot, wordcount__mod, stats_iface, get_stats,
+             .stats = res);
+}
+
+/* Admission control */
+
+/** Check the size of the payload of a query.
  *
- * \param[in]  file_content         The file content.
- * \param[out] word_occurrences_map The map countaining the words and their
- *                                  occurrences.
+ * \param[in] ic   The connection of the client.
+ * \param[in] slot The slot of the query, rejected with the INVALID status
+ *                 if its payload is too big, since it can never succeed.
+ * \param[in] size The size of the file content or of the chunk.
+ * \return false if the query has been rejected, true otherwise.
  */
-static void wordcount_split_words(
-    lstr_t file_content, qm_t(word_occurrences_map) *word_occurrences_map)
+static bool wordcount_check_payload(ichannel_t *ic, uint64_t slot,
+                                    size_t size)
+{
+    if (_G.max_payload_size && size > _G.max_payload_size) {
+        e_warning("client %p: payload of %zu bytes over the limit of %zu "
+                  "bytes, rejecting query", ic, size, _G.max_payload_size);
+        _G.stats.rejected_payloads++;
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return false;
+    }
+    return true;
+}
+
+/** Check the n-gram size of a counting query.
+ *
+ * \param[in] ic     The connection of the client.
+ * \param[in] slot   The slot of the query, rejected with the INVALID status
+ *                   if its n-gram size is not supported.
+ * \param[in] params The parameters of the counting of the query.
+ * \return false if the query has been rejected, true otherwise.
+ */
+static bool wordcount_check_ngram(ichannel_t *ic, uint64_t slot,
+                                  const wordcount_params_t *params)
+{
+    if (params->ngram > WORDCOUNT_NGRAM_MAX) {
+        e_warning("client %p: n-grams of %u words over the maximum of %d "
+                  "words", ic, params->ngram, WORDCOUNT_NGRAM_MAX);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return false;
+    }
+    if (params->ngram > 1 && params->sketch_size) {
+        e_warning("client %p: n-grams cannot be counted approximately", ic);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return false;
+    }
+    return true;
+}
+
+/** Get the filter set chosen by a query.
+ *
+ * \param[in]  ic     The connection of the client.
+ * \param[in]  slot   The slot of the query, rejected with the INVALID status
+ *                    if the server has no such filter set.
+ * \param[in]  name   The name of the filter set, LSTR_NULL_V for none.
+ * \param[out] filter The filter set, NULL for none.
+ * \return false if the query has been rejected, true otherwise.
+ */
+static bool wordcount_get_filter(ichannel_t *ic, uint64_t slot, lstr_t name,
+                                 const wordcount_filter_t **filter)
+{
+    *filter = NULL;
+    if (!name.s) {
+        return true;
+    }
+    *filter = qm_get_def(wordcount_filters, &_G.filters, &name, NULL);
+    if (!*filter) {
+        e_warning("client %p: unknown filter set `%pL`", ic, &name);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return false;
+    }
+    return true;
+}
+
+/** Admit a counting query which holds its file content until it is
+ * replied.
+ *
+ * The query is rejected with the RETRY status when its connection already
+ * has too many queries in flight, so that one client cannot take the whole
+ * server, or when the file contents in flight would take too much memory.
+ * A query is always admitted when nothing is in flight, so that a file
+ * content bigger than the limit is not rejected forever.
+ *
+ * \param[in,out] query The counting query, marked as admitted.
+ * \param[in]     size  The size of the file content.
+ * \return false if the query has been rejected, true otherwise.
+ */
+static bool wordcount_admit_query(wordcount_query_t *query, size_t size)
+{
+    wordcount_conn_t *conn = query->ic->priv;
+
+    if (_G.max_connection_queries
+    &&  conn->nb_queries >= _G.max_connection_queries)
+    {
+        e_warning("client %p: too many queries in flight (%d), rejecting "
+                  "query", query->ic, conn->nb_queries);
+        _G.stats.rejected_connection_queries++;
+        ic_reply_err(query->ic, query->slot, IC_MSG_RETRY);
+        return false;
+    }
+    if (_G.max_inflight_bytes && _G.stats.inflight_bytes
+    &&  _G.stats.inflight_bytes + size > _G.max_inflight_bytes)
+    {
+        e_warning("client %p: too many bytes in flight (%ju), rejecting "
+                  "query", query->ic, (uintmax_t)_G.stats.inflight_bytes);
+        _G.stats.rejected_inflight_queries++;
+        ic_reply_err(query->ic, query->slot, IC_MSG_RETRY);
+        return false;
+    }
+
+    query->inflight_size = size;
+    query->admitted = true;
+    conn->nb_queries++;
+    _G.stats.pending_queries++;
+    _G.stats.inflight_bytes += size;
+    return true;
+}
+
+/** Release the admission of a query once it is replied or canceled.
+ *
+ * The query of a job or of a fan-out is released with them, when their file
+ * content is freed. The connection of a canceled query is already gone.
+ */
+static void wordcount_query_release(wordcount_query_t *query)
+{
+    if (!query->admitted) {
+        return;
+    }
+    if (query->ic) {
+        wordcount_conn_t *conn = query->ic->priv;
+
+        conn->nb_queries--;
+    }
+    _G.stats.pending_queries--;
+    _G.stats.inflight_bytes -= query->inflight_size;
+    query->admitted = false;
+}
+
+/* Mapped files */
+
+/** Called when a mapped page cannot be read, in the faulting thread. */
+static void wordcount_mapped_file_on_sigbus(int signo, siginfo_t *si,
+                                            void *ctx)
+{
+    uintptr_t addr = (uintptr_t)si->si_addr;
+
+    for (int i = 0; i < _G.nb_mapped_files; i++) {
+        wordcount_mapped_file_t *mapped = &_G.mapped_files[i];
+        uintptr_t start = mapped->start;
+        uintptr_t page;
+
+        if (!start || addr < start || addr >= mapped->end) {
+            continue;
+        }
+
+        /* Replace the rest of the file by zero pages, the faulting read is
+         * then done again */
+        page = addr & ~(_G.page_size - 1);
+        if (mmap((void *)page, mapped->end - page, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+            == MAP_FAILED)
+        {
+            break;
+        }
+        mapped->truncated = true;
+        return;
+    }
+
+    /* Not a guarded file, the faulting read is done again with the previous
+     * handler */
+    sigaction(SIGBUS, &_G.old_sigbus, NULL);
+}
+
+/** Install the guards of the mapped files. */
+static void wordcount_mapped_files_init(void)
+{
+    struct sigaction sa;
+
+    _G.page_size = sysconf(_SC_PAGESIZE);
+    _G.nb_mapped_files = _G.max_jobs + 1;
+    _G.mapped_files = p_new(wordcount_mapped_file_t, _G.nb_mapped_files);
+
+    p_clear(&sa, 1);
+    sa.sa_sigaction = &wordcount_mapped_file_on_sigbus;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &_G.old_sigbus);
+}
+
+/** Remove the guards of the mapped files, once no file is mapped. */
+static void wordcount_mapped_files_wipe(void)
+{
+    sigaction(SIGBUS, &_G.old_sigbus, NULL);
+    p_delete(&_G.mapped_files);
+    _G.nb_mapped_files = 0;
+}
+
+/** Guard a mapped file against its truncation.
+ *
+ * \param[in] content The mapped file, not empty.
+ * \return The guard of the file, NULL if all the guards are taken.
+ */
+static wordcount_mapped_file_t * nullable
+wordcount_mapped_file_register(lstr_t content)
+{
+    for (int i = 0; i < _G.nb_mapped_files; i++) {
+        wordcount_mapped_file_t *mapped = &_G.mapped_files[i];
+
+        if (mapped->start) {
+            continue;
+        }
+
+        /* The guard is used by the signal handler once its start is set */
+        mapped->truncated = false;
+        mapped->end = ROUND_UP((uintptr_t)content.s + content.len,
+                               _G.page_size);
+        mapped->start = (uintptr_t)content.s;
+        return mapped;
+    }
+    return NULL;
+}
+
+/** Release the guard of a mapped file, before it is unmapped. */
+static void
+wordcount_mapped_file_release(wordcount_mapped_file_t * nullable *mapped)
+{
+    if (*mapped) {
+        (*mapped)->start = 0;
+        *mapped = NULL;
+    }
+}
+
+/** Check that the mapped file of a query has not been truncated while it
+ * was read, the query is rejected with the INVALID status otherwise.
+ *
+ * \param[in] query The counting query.
+ * \return false if the query has been rejected, true otherwise.
+ */
+static bool wordcount_query_check_file(const wordcount_query_t *query)
+{
+    if (!query->mapped || !query->mapped->truncated) {
+        return true;
+    }
+    e_warning("client %p: file truncated while it was counted", query->ic);
+    ic_reply_err(query->ic, query->slot, IC_MSG_INVALID);
+    return false;
+}
+
+/* Counting */
+
+/** Encode the sorted word occurrences of a reply.
+ *
+ * The word occurrences are compressed with the codec accepted by the client
+ * when their words are big enough, otherwise they are sent as is.
+ *
+ * \param[in]  reply_codec          The codec accepted by the client.
+ * \param[in]  word_occurrences_vec The sorted word occurrences.
+ * \param[in]  words_size           The size of the words of the result.
+ * \param[out] word_occurrences     The word occurrences to send, empty when
+ *                                  they are compressed.
+ * \param[out] codec                The codec of the reply.
+ * \param[out] compressed           The compressed word occurrences, allocated
+ *                                  on the t_stack, LSTR_NULL_V when they are
+ *                                  not compressed.
+ */
+static void t_wordcount_encode_word_occurrences(
+    wordcount__codec__t reply_codec,
+    const qv_t(word_occurrences_vec) *word_occurrences_vec,
+    size_t words_size,
+    wordcount__word_occurrences__array_t *word_occurrences,
+    wordcount__codec__t *codec, lstr_t *compressed)
+{
+    /* The vector is converted as an IOP array */
+    *word_occurrences = IOP_TYPED_ARRAY_TAB(wordcount__word_occurrences,
+                                            word_occurrences_vec);
+    *codec = CODEC_NONE;
+    *compressed = LSTR_NULL_V;
+
+    if (reply_codec != CODEC_NONE
+    &&  words_size >= _G.reply_compress_min_size
+    &&  t_wordcount_compress_word_occurrences(reply_codec, word_occurrences,
+                                              compressed) >= 0)
+    {
+        *codec = reply_codec;
+        p_clear(word_occurrences, 1);
+        _G.stats.bytes_out += compressed->len;
+    } else {
+        wordcount_stats_add_bytes_out(word_occurrences_vec, words_size);
+    }
+}
+
+/** Release a paged result. */
+static void wordcount_paged_result_release(wordcount_paged_result_t *paged)
+{
+    qm_del_key(wordcount_paged_results, &_G.paged_results, paged->id);
+    wordcount_paged_result_delete(&paged);
+}
+
+static void wordcount_paged_result_on_ttl(el_t ev, data_t priv)
+{
+    wordcount_paged_result_t *paged = priv.ptr;
+
+    paged->ttl_timer = NULL;
+    e_info("client %p: paged result %ju expired", paged->ic,
+           (uintmax_t)paged->id);
+    wordcount_paged_result_release(paged);
+}
+
+/** Keep a paged result for another resultTtl. */
+static void wordcount_paged_result_touch(wordcount_paged_result_t *paged)
+{
+    el_unregister(&paged->ttl_timer);
+    paged->ttl_timer = el_timer_register(_G.result_ttl, 0, 0,
+                                         &wordcount_paged_result_on_ttl,
+                                         paged);
+}
+
+/** Get a paged result of a connection.
+ *
+ * \param[in] ic        The connection of the client.
+ * \param[in] result_id The identifier of the result.
+ * \return The paged result, NULL if it does not exist or is bound to
+ *         another connection.
+ */
+static wordcount_paged_result_t * nullable
+wordcount_paged_result_get(const ichannel_t *ic, uint64_t result_id)
+{
+    wordcount_paged_result_t *paged;
+
+    paged = qm_get_def(wordcount_paged_results, &_G.paged_results,
+                       result_id, NULL);
+    if (!paged || paged->ic != ic) {
+        return NULL;
+    }
+    return paged;
+}
+
+/** Release all the paged results of a connection.
+ *
+ * \param[in] ic The connection of the client.
+ */
+static void wordcount_release_ic_paged_results(const ichannel_t *ic)
+{
+    qm_for_each_pos(wordcount_paged_results, pos, &_G.paged_results) {
+        wordcount_paged_result_t *paged = _G.paged_results.values[pos];
+
+        if (paged->ic == ic) {
+            qm_del_at(wordcount_paged_results, &_G.paged_results, pos);
+            wordcount_paged_result_delete(&paged);
+        }
+    }
+}
+
+/** Keep a big result so that the client fetches it page by page.
+ *
+ * The result is packed in memory allocated on the heap, and only its first
+ * page is replied.
+ *
+ * \param[in]     ic                   The connection of the client.
+ * \param[in]     page_size            The number of words per page, 0 to
+ *                                     reply all the words at once.
+ * \param[in,out] result               The packed result the word
+ *                                     occurrences point into, taken over
+ *                                     without copy if the result is paged,
+ *                                     NULL if they are not packed yet.
+ * \param[in,out] word_occurrences_vec The sorted word occurrences, replaced
+ *                                     by the first page, allocated on the
+ *                                     t_scope, if the result is paged.
+ * \param[in,out] words_size           The size of the words of the reply.
+ * \param[out]    result_id            The identifier of the paged result.
+ * \param[out]    next_cursor          The cursor of the second page.
+ */
+static void t_wordcount_page_word_occurrences(
+    ichannel_t *ic, unsigned page_size, wordcount_result_t * nullable result,
+    qv_t(word_occurrences_vec) *word_occurrences_vec, size_t *words_size,
+    opt_u64_t *result_id, opt_u32_t *next_cursor)
+{
+    wordcount_paged_result_t *paged;
+
+    OPT_CLR(*result_id);
+    OPT_CLR(*next_cursor);
+    if (!page_size || (unsigned)word_occurrences_vec->len <= page_size) {
+        return;
+    }
+
+    paged = wordcount_paged_result_new();
+    paged->id = ++_G.last_result_id;
+    paged->ic = ic;
+    paged->page_size = page_size;
+    if (result) {
+        wordcount_result_move(&paged->result, result);
+    } else {
+        wordcount_result_set(&paged->result, word_occurrences_vec);
+    }
+    qm_add(wordcount_paged_results, &_G.paged_results, paged->id, paged);
+    wordcount_paged_result_touch(paged);
+
+    *words_size = t_wordcount_result_get_range(&paged->result, 0, page_size,
+                                               word_occurrences_vec);
+    OPT_SET(*result_id, paged->id);
+    OPT_SET(*next_cursor, page_size);
+}
+
+/** Reply to a counting query with the sorted word occurrences.
+ *
+ * The time spent packing the reply and the total time of the query are
+ * recorded in the statistics.
+ *
+ * \param[in]     query                The counting query.
+ * \param[in,out] result               The packed result the word
+ *                                     occurrences point into, taken over by
+ *                                     the paged result if any, NULL if they
+ *                                     are not packed yet.
+ * \param[in]     word_occurrences_vec The sorted word occurrences.
+ * \param[in]     words_size           The size of the words of the result.
+ */
+static void
+wordcount_reply(const wordcount_query_t *query,
+                wordcount_result_t * nullable result,
+                const qv_t(word_occurrences_vec) *word_occurrences_vec,
+                size_t words_size)
+{
+    t_scope;
+    int64_t encode_nsec = wordcount_now_nsec();
+    qv_t(word_occurrences_vec) page = *word_occurrences_vec;
+    wordcount__word_occurrences__array_t word_occurrences;
+    wordcount__codec__t codec;
+    lstr_t compressed;
+    opt_u64_t result_id;
+    opt_u32_t next_cursor;
+
+    t_wordcount_page_word_occurrences(query->ic, query->page_size, result,
+                                      &page, &words_size, &result_id,
+                                      &next_cursor);
+    t_wordcount_encode_word_occurrences(query->reply_codec, &page,
+                                        words_size, &word_occurrences,
+                                        &codec, &compressed);
+    if (query->count_file) {
+        ic_reply(query->ic, query->slot, wordcount__mod, wordcount_iface,
+                 count_file_occurrences,
+                 .word_occurrences = word_occurrences,
+                 .codec = codec,
+                 .compressed_word_occurrences = compressed,
+                 .result_id = result_id,
+                 .next_cursor = next_cursor);
+    } else
+    if (query->merge) {
+        ic_reply(query->ic, query->slot, wordcount__mod, wordcount_iface,
+                 merge_occurrences,
+                 .word_occurrences = word_occurrences,
+                 .codec = codec,
+                 .compressed_word_occurrences = compressed,
+                 .result_id = result_id,
+                 .next_cursor = next_cursor);
+    } else
+    if (query->end_count) {
+        ic_reply(query->ic, query->slot, wordcount__mod, wordcount_iface,
+                 end_count,
+                 .word_occurrences = word_occurrences,
+                 .codec = codec,
+                 .compressed_word_occurrences = compressed,
+                 .result_id = result_id,
+                 .next_cursor = next_cursor);
+    } else {
+        ic_reply(query->ic, query->slot, wordcount__mod, wordcount_iface,
+                 count_occurrences,
+                 .word_occurrences = word_occurrences,
+                 .codec = codec,
+                 .compressed_word_occurrences = compressed,
+                 .result_id = result_id,
+                 .next_cursor = next_cursor);
+    }
+
+    encode_nsec = wordcount_now_nsec() - encode_nsec;
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_ENCODE],
+                               encode_nsec);
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_TOTAL],
+                               wordcount_now_nsec() - query->start_nsec);
+}
+
+/** Count the words of the file content of a query.
+ *
+ * \param[in]  query                The counting query.
+ * \param[in]  file_content         The file content, compressed with the
+ *                                  codec of the query.
+ * \param[in]  params               The parameters of the counting.
+ * \param[out] word_occurrences_vec The vector of sorted words, allocated on
+ *                                  the t_scope.
+ * \return -1 if the counting has been canceled or the compressed file
+ *         content is not valid, 0 otherwise.
+ */
+static int t_wordcount_count_query(
+    const wordcount_query_t *query, lstr_t file_content,
+    const wordcount_params_t *params,
+    qv_t(word_occurrences_vec) *word_occurrences_vec)
+{
+    if (query->codec != CODEC_NONE) {
+        return t_wordcount_decompress_split_and_sort_word_occurrences(
+            query->codec, file_content, params, word_occurrences_vec);
+    }
+    return t_wordcount_split_and_sort_word_occurrences(
+        file_content, params, word_occurrences_vec);
+}
+
+static bool wordcount_coordinator_count(wordcount_job_t *job);
+static void wordcount_job_set_threads(wordcount_job_t *job);
+static void wordcount_job_count(thr_job_t *thr_job, thr_syn_t *syn);
+
+/** Send the reply of a counting job, in the event loop thread.
+ *
+ * The file content of a job counted by the upstream servers is handed to
+ * the coordinator once it is looked up in the cache. It is counted by the
+ * job itself if no upstream server is connected anymore.
+ */
+static void wordcount_job_reply(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_job_t *job = container_of(thr_job, wordcount_job_t, reply_job);
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+
+    _G.nb_jobs--;
+
+    if (job->canceled || job->aborted) {
+        /* The client is gone, nobody to reply to */
+        wordcount_job_delete(&job);
+        return;
+    }
+    if (job->invalid) {
+        e_warning("client %p: invalid or too big compressed file content",
+                  job->query.ic);
+        ic_reply_err(job->query.ic, job->query.slot, IC_MSG_INVALID);
+        wordcount_job_delete(&job);
+        return;
+    }
+    if (job->truncated) {
+        e_warning("client %p: file truncated while it was counted",
+                  job->query.ic);
+        ic_reply_err(job->query.ic, job->query.slot, IC_MSG_INVALID);
+        wordcount_job_delete(&job);
+        return;
+    }
+    if (job->cache_entry) {
+        /* Reply with the cached result, nothing has been counted */
+        t_wordcount_result_get(&job->cache_entry->result,
+                               &word_occurrences_vec);
+        wordcount_reply(&job->query, NULL, &word_occurrences_vec,
+                        job->cache_entry->result.words.len);
+        wordcount_job_delete(&job);
+        return;
+    }
+    if (job->fanout) {
+        if (wordcount_coordinator_count(job)) {
+            wordcount_job_delete(&job);
+            return;
+        }
+
+        /* No upstream server is connected anymore, count it here */
+        job->fanout = false;
+        wordcount_job_set_threads(job);
+        _G.nb_jobs++;
+        thr_syn_schedule(&_G.jobs_syn, &job->count_job);
+        return;
+    }
+
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_QUEUE],
+                               job->queue_nsec);
+    wordcount_stats_record_count(&job->count_stats);
+
+    t_wordcount_result_get(&job->result, &word_occurrences_vec);
+    wordcount_reply(&job->query, &job->result, &word_occurrences_vec,
+                    job->result.words.len);
+    wordcount_job_delete(&job);
+}
+
+/** Choose the number of threads counting the file content of a job.
+ *
+ * A job counting its file content in parallel waits for its slices in its
+ * own thread of the pool. At most all the threads of the pool but one wait
+ * this way, so that the slices always have a thread to run on: the other
+ * jobs count their file content with their own thread only.
+ */
+static void wordcount_job_set_threads(wordcount_job_t *job)
+{
+    const wordcount_params_t *params = &job->params;
+
+    /* Only the plain contents counted exactly by words are split in
+     * slices */
+    if (params->nb_threads == 1 || job->query.codec != CODEC_NONE
+    ||  params->sketch_size || params->ngram > 1)
+    {
+        return;
+    }
+    if (_G.nb_parallel_jobs >= (int)thr_parallelism_g - 1) {
+        job->params.nb_threads = 1;
+        return;
+    }
+    job->parallel = true;
+    _G.nb_parallel_jobs++;
+}
+
+/** Release the threads of a job counting its file content in parallel. */
+static void wordcount_job_release_threads(wordcount_job_t *job)
+{
+    if (job->parallel) {
+        _G.nb_parallel_jobs--;
+        job->parallel = false;
+    }
+}
+
+/** Release the cache entry found by a counting job, if any. */
+static void wordcount_job_release_cache_entry(wordcount_job_t *job)
+{
+    wordcount_cache_release(&_G.cache, &job->cache_entry);
+}
+
+/** Prepare the file content of a job for the upstream servers, in a thread
+ * of the pool.
+ *
+ * The file content is decompressed, or a mapped file is copied since it can
+ * change while the shards are sent, and it is split in shards at word
+ * boundaries. The coordinator then takes it over from the job.
+ */
+static void wordcount_job_split(wordcount_job_t *job)
+{
+    if (job->query.codec != CODEC_NONE) {
+        sb_t content;
+
+        sb_init(&content);
+        if (wordcount_decompress(job->query.codec, job->file_content,
+                                 job->params.max_content_size,
+                                 &job->canceled, &content) < 0)
+        {
+            if (job->canceled) {
+                job->aborted = true;
+            } else {
+                job->invalid = true;
+            }
+            sb_wipe(&content);
+            return;
+        }
+        lstr_wipe(&job->file_content);
+        lstr_transfer_sb(&job->file_content, &content, false);
+        job->query.codec = CODEC_NONE;
+    } else
+    if (job->query.count_file) {
+        lstr_t copy = lstr_dup(job->file_content);
+
+        if (job->query.mapped && job->query.mapped->truncated) {
+            job->truncated = true;
+            lstr_wipe(&copy);
+            return;
+        }
+        wordcount_mapped_file_release(&job->query.mapped);
+        lstr_wipe(&job->file_content);
+        job->file_content = copy;
+    }
+
+    job->shards = p_new(lstr_t, job->nb_shards);
+    wordcount_split_content(job->file_content, job->nb_shards,
+                            job->params.utf8, job->shards);
+}
+
+/** Count the words of a counting job, in a thread of the pool.
+ *
+ * The result is looked up in the cache first, and put in it once counted.
+ * The file content of a job counted by the upstream servers is only looked
+ * up, and split in shards.
+ */
+static void wordcount_job_count(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    wordcount_job_t *job = container_of(thr_job, wordcount_job_t, count_job);
+
+    job->queue_nsec = wordcount_now_nsec() - job->query.start_nsec;
+
+    /* The job may have been canceled while it was queued */
+    if (!job->canceled && job->cache_result && !job->cache_looked_up) {
+        wordcount_cache_key_init(&job->cache_key, job->query.codec,
+                                 job->file_content, &job->params);
+        job->cache_entry = wordcount_cache_get(&_G.cache, &job->cache_key,
+                                               job->file_content);
+        job->cache_looked_up = true;
+    }
+    if (!job->canceled && !job->cache_entry && job->fanout) {
+        wordcount_job_split(job);
+    } else
+    if (!job->canceled && !job->cache_entry) {
+        t_scope;
+        qv_t(word_occurrences_vec) word_occurrences_vec;
+
+        if (t_wordcount_count_query(&job->query, job->file_content,
+                                    &job->params, &word_occurrences_vec) < 0)
+        {
+            if (job->canceled) {
+                job->aborted = true;
+            } else {
+                job->invalid = true;
+            }
+        } else {
+            /* The result of a file truncated meanwhile is wrong */
+            if (job->query.mapped && job->query.mapped->truncated) {
+                job->truncated = true;
+            } else
+            if (job->cache_result) {
+                /* The copy of the file content is given to the cache, a
+                 * mapped file is copied since it can be changed */
+                wordcount_cache_put(&_G.cache, &job->cache_key,
+                                    &job->file_content,
+                                    !job->query.count_file,
+                                    &word_occurrences_vec);
+            }
+
+            /* Pack the result out of the t_stack of this thread */
+            wordcount_result_set(&job->result, &word_occurrences_vec);
+        }
+    }
+
+    /* The file content is no longer needed, release it now, unless it is
+     * counted by the upstream servers */
+    if (!job->fanout || job->cache_entry) {
+        wordcount_mapped_file_release(&job->query.mapped);
+        lstr_wipe(&job->file_content);
+    }
+
+    /* Reply from the event loop thread */
+    job->reply_job.run = &wordcount_job_reply;
+    thr_queue(thr_queue_main_g, &job->reply_job);
+}
+
+/* Coordinator */
+
+/** Get the next connected upstream server, in turn.
+ *
+ * \return The upstream server, NULL if none is connected.
+ */
+static wordcount_upstream_t * nullable wordcount_next_upstream(void)
+{
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        wordcount_upstream_t *upstream = &_G.upstreams[_G.next_upstream];
+
+        _G.next_upstream = (_G.next_upstream + 1) % _G.nb_upstreams;
+        if (upstream->connected) {
+            return upstream;
+        }
+    }
+    return NULL;
+}
+
+/** Stop waiting for the shards of a fan-out.
+ *
+ * The fan-out is released once all its queries to the upstream servers are
+ * answered, see wordcount_fanout_release().
+ */
+static void wordcount_fanout_finish(wordcount_fanout_t *fanout)
+{
+    fanout->finished = true;
+    for (int i = 0; i < fanout->nb_shards; i++) {
+        el_unregister(&fanout->shards[i].timer);
+    }
+}
+
+/** Release a finished fan-out if no query to the upstream servers is
+ * pending. */
+static void wordcount_fanout_release(wordcount_fanout_t *fanout)
+{
+    if (fanout->finished && !fanout->nb_msgs && !fanout->merging) {
+        wordcount_fanout_delete(&fanout);
+    }
+}
+
+/** Reject the query of a fan-out whose shards cannot be counted.
+ *
+ * \param[in] fanout The fan-out.
+ * \param[in] status IC_MSG_RETRY if the client can retry later,
+ *                   IC_MSG_INVALID if the upstream servers reject the query.
+ */
+static void wordcount_fanout_fail(wordcount_fanout_t *fanout,
+                                  ic_status_t status)
+{
+    if (fanout->query.ic) {
+        if (status == IC_MSG_RETRY) {
+            _G.stats.rejected_queries++;
+        }
+        ic_reply_err(fanout->query.ic, fanout->query.slot, status);
+    }
+    wordcount_fanout_finish(fanout);
+}
+
+/** Reply to the query of a fan-out with the merged word occurrences, in the
+ * event loop thread. */
+static void wordcount_fanout_reply(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_fanout_t *fanout;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+
+    fanout = container_of(thr_job, wordcount_fanout_t, reply_job);
+    fanout->merging = false;
+    _G.nb_merging_fanouts--;
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_SORT],
+                               fanout->merge_nsec);
+
+    if (fanout->query.ic) {
+        t_wordcount_result_get(&fanout->result, &word_occurrences_vec);
+        wordcount_reply(&fanout->query, &fanout->result,
+                        &word_occurrences_vec, fanout->result.words.len);
+    }
+    wordcount_fanout_finish(fanout);
+    wordcount_fanout_release(fanout);
+}
+
+/** Merge the results of the shards of a fan-out, in a thread of the
+ * pool. */
+static void wordcount_fanout_merge(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_fanout_t *fanout;
+    const wordcount_result_t **results;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+    int64_t merge_nsec = wordcount_now_nsec();
+
+    fanout = container_of(thr_job, wordcount_fanout_t, merge_job);
+    results = t_new_raw(const wordcount_result_t *, fanout->nb_shards);
+    for (int i = 0; i < fanout->nb_shards; i++) {
+        results[i] = &fanout->shards[i].result;
+    }
+    t_wordcount_merge_results(results, fanout->nb_shards, &fanout->params,
+                              &word_occurrences_vec);
+
+    /* No shard is sent anymore, the file content can be given to the
+     * cache */
+    if (fanout->cache_result) {
+        wordcount_cache_put(&_G.cache, &fanout->cache_key, &fanout->content,
+                            true, &word_occurrences_vec);
+    }
+
+    /* Pack the result out of the t_stack of this thread */
+    wordcount_result_set(&fanout->result, &word_occurrences_vec);
+    fanout->merge_nsec = wordcount_now_nsec() - merge_nsec;
+
+    fanout->reply_job.run = &wordcount_fanout_reply;
+    thr_queue(thr_queue_main_g, &fanout->reply_job);
+}
+
+/** Merge the results of the shards of a fan-out in the thread pool, once
+ * they are all received. */
+static void wordcount_fanout_schedule_merge(wordcount_fanout_t *fanout)
+{
+    /* The shards are counted by the upstream servers, and merged by the
+     * coordinator in the sort stage */
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_COUNT],
+                               wordcount_now_nsec()
+                             - fanout->query.start_nsec);
+
+    fanout->merging = true;
+    _G.nb_merging_fanouts++;
+    fanout->merge_job.run = &wordcount_fanout_merge;
+    thr_syn_schedule(&_G.jobs_syn, &fanout->merge_job);
+}
+
+static void wordcount_shard_on_timeout(el_t ev, data_t priv);
+
+/** Send a shard to the next connected upstream server.
+ *
+ * The query of the fan-out is rejected if the shard has been sent too many
+ * times, or if no upstream server is connected. It is rejected with the
+ * INVALID status if all the attempts were, since retrying it later would
+ * not help, and with the RETRY status otherwise.
+ */
+static void wordcount_shard_send(wordcount_shard_t *shard)
+{
+    wordcount_fanout_t *fanout = shard->fanout;
+    wordcount_upstream_t *upstream = NULL;
+    wordcount_shard_msg_t *shard_msg;
+    ic_msg_t *msg;
+
+    if (shard->attempts <= _G.upstream_retries) {
+        upstream = wordcount_next_upstream();
+    }
+    if (!upstream) {
+        e_warning("client %p: cannot count a shard of %d bytes on the "
+                  "upstream servers", fanout->query.ic, shard->content.len);
+        if (shard->attempts
+        &&  shard->invalid_attempts == shard->attempts)
+        {
+            wordcount_fanout_fail(fanout, IC_MSG_INVALID);
+        } else {
+            wordcount_fanout_fail(fanout, IC_MSG_RETRY);
+        }
+        return;
+    }
+
+    shard->attempts++;
+    msg = ic_msg_new(sizeof(wordcount_shard_msg_t));
+    shard_msg = (wordcount_shard_msg_t *)msg->priv;
+    shard_msg->shard = shard;
+    shard_msg->attempt = shard->attempts;
+    fanout->nb_msgs++;
+
+    /* The shards are counted without limit, since the occurrences of a word
+     * are only known once all the shards are merged */
+    ic_query2(&upstream->ic, msg, wordcount__mod, wordcount_iface,
+              count_occurrences,
+              .file_content = shard->content,
+              .reply_codec = CODEC_ZLIB,
+              .utf8 = fanout->params.utf8,
+              .filter_set = fanout->params.filter ? fanout->params.filter->name
+                                                  : LSTR_NULL_V);
+    shard->timer = el_timer_register(_G.upstream_timeout, 0, 0,
+                                     &wordcount_shard_on_timeout, shard);
+}
+
+/** Called when an upstream server is too slow to count a shard. */
+static void wordcount_shard_on_timeout(el_t ev, data_t priv)
+{
+    wordcount_shard_t *shard = priv.ptr;
+
+    shard->timer = NULL;
+    e_warning("client %p: timeout of a shard, attempt %d",
+              shard->fanout->query.ic, shard->attempts);
+
+    /* Send the shard to another upstream server, the reply of the slow one
+     * is ignored */
+    wordcount_shard_send(shard);
+}
+
+/** Called with the word occurrences of a shard counted by an upstream
+ *  server. */
+static void IOP_RPC_CB(wordcount__mod, wordcount_iface, count_occurrences)
+{
+    t_scope;
+    const wordcount_shard_msg_t *shard_msg = (void *)msg->priv;
+    wordcount_shard_t *shard = shard_msg->shard;
+    wordcount_fanout_t *fanout = shard->fanout;
+    wordcount__word_occurrences__array_t word_occurrences;
+
+    fanout->nb_msgs--;
+    if (fanout->finished || shard->done
+    ||  shard_msg->attempt != shard->attempts)
+    {
+        /* Reply of an attempt that timed out, or no longer needed */
+        wordcount_fanout_release(fanout);
+        return;
+    }
+    el_unregister(&shard->timer);
+
+    if (status == IC_MSG_OK) {
+        word_occurrences = res->word_occurrences;
+        if (res->codec != CODEC_NONE
+        &&  t_wordcount_decompress_word_occurrences(
+                res->codec, res->compressed_word_occurrences,
+                _G.max_payload_size, &word_occurrences) < 0)
+        {
+            status = IC_MSG_INVALID;
+        }
+    }
+    if (status != IC_MSG_OK) {
+        e_warning("client %p: error on a shard, attempt %d: %s",
+                  fanout->query.ic, shard->attempts,
+                  ic_status_to_string(status));
+        if (status == IC_MSG_INVALID) {
+            shard->invalid_attempts++;
+        }
+        wordcount_shard_send(shard);
+        wordcount_fanout_release(fanout);
+        return;
+    }
+
+    /* Copy the word occurrences out of the reply */
+    wordcount_result_set_tab(&shard->result, word_occurrences.tab,
+                             word_occurrences.len);
+    shard->done = true;
+    if (--fanout->nb_pending_shards == 0) {
+        wordcount_fanout_schedule_merge(fanout);
+    }
+    wordcount_fanout_release(fanout);
+}
+
+/** Get the number of upstream servers a file content can be counted on.
+ *
+ * \param[in] len    The size of the file content.
+ * \param[in] params The parameters of the counting.
+ * \return 0 if the file content is not worth sharding, if no upstream
+ *         server is connected, or if the query is approximate.
+ */
+static int wordcount_coordinator_nb_shards(int len,
+                                           const wordcount_params_t *params)
+{
+    int nb_connected = 0;
+
+    /* The top words of the shards of an approximate query cannot be
+     * merged with a bounded error, it is counted in the memory of the
+     * coordinator itself. So are the n-grams, which would be cut at the
+     * boundaries of the shards. */
+    if (!_G.nb_upstreams || len < _G.shard_min_size
+    ||  params->sketch_size || params->ngram > 1)
+    {
+        return 0;
+    }
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        nb_connected += _G.upstreams[i].connected;
+    }
+    return nb_connected;
+}
+
+/** Count a file content on the upstream servers of the coordinator.
+ *
+ * The file content has been split at word boundaries in shards by its
+ * counting job, see wordcount_job_split(). The shards are counted in
+ * parallel by the upstream servers, and their results are merged by word in
+ * the thread pool. A shard is sent to another upstream server when its
+ * server fails or is too slow.
+ *
+ * \param[in,out] job The counting job, its query, the admission of the
+ *                    query, and its file content are taken over by the
+ *                    counting.
+ * \return false if no upstream server is connected anymore, true if the
+ *         query is handled.
+ */
+static bool wordcount_coordinator_count(wordcount_job_t *job)
+{
+    wordcount_fanout_t *fanout;
+    bool connected = false;
+
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        connected |= _G.upstreams[i].connected;
+    }
+    if (!connected) {
+        return false;
+    }
+
+    /* The shards point into the file content of the job, which is taken
+     * over without copy */
+    fanout = wordcount_fanout_new();
+    fanout->query = job->query;
+    fanout->query.mapped = NULL;
+    job->query.admitted = false;
+    fanout->content = job->file_content;
+    job->file_content = LSTR_NULL_V;
+    fanout->params = job->params;
+    fanout->params.canceled = NULL;
+    fanout->params.stats = NULL;
+    fanout->cache_result = job->cache_result;
+    fanout->cache_key = job->cache_key;
+    dlist_add_tail(&_G.fanouts, &fanout->list);
+
+    fanout->nb_shards = job->nb_shards;
+    fanout->nb_pending_shards = job->nb_shards;
+    fanout->shards = p_new(wordcount_shard_t, job->nb_shards);
+    for (int i = 0; i < job->nb_shards; i++) {
+        wordcount_shard_t *shard = &fanout->shards[i];
+
+        shard->fanout = fanout;
+        shard->content = job->shards[i];
+        wordcount_result_init(&shard->result);
+    }
+    for (int i = 0; i < fanout->nb_shards && !fanout->finished; i++) {
+        wordcount_shard_send(&fanout->shards[i]);
+    }
+    wordcount_fanout_release(fanout);
+    return true;
+}
+
+/** Called on upstream server status changes. */
+static void wordcount_upstream_on_event(ichannel_t *ic, ic_event_t evt)
+{
+    wordcount_upstream_t *upstream;
+
+    upstream = container_of(ic, wordcount_upstream_t, ic);
+    if (evt == IC_EVT_CONNECTED) {
+        e_notice("connected to upstream server %d",
+                 (int)(upstream - _G.upstreams));
+        upstream->connected = true;
+    } else
+    if (evt == IC_EVT_DISCONNECTED) {
+        e_warning("disconnected from upstream server %d",
+                  (int)(upstream - _G.upstreams));
+        upstream->connected = false;
+    }
+}
+
+/** Connect to the upstream servers of the coordinator.
+ *
+ * \param[in] server_cfg The server configuration.
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int
+wordcount_connect_upstreams(const wordcount__server_cfg__t *server_cfg)
+{
+    _G.shard_min_size = server_cfg->shard_min_size;
+    _G.upstream_timeout = server_cfg->upstream_timeout;
+    _G.upstream_retries = server_cfg->upstream_retries;
+    _G.nb_upstreams = server_cfg->upstreams.len;
+    _G.upstreams = p_new(wordcount_upstream_t, _G.nb_upstreams);
+
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        const wordcount__upstream__t *upstream_cfg;
+        ichannel_t *ic = &_G.upstreams[i].ic;
+
+        upstream_cfg = &server_cfg->upstreams.tab[i];
+        ic_init(ic);
+        ic->on_event = &wordcount_upstream_on_event;
+        ic->auto_reconn = true;
+        if (addr_info_str(&ic->su, upstream_cfg->address.s,
+                          upstream_cfg->port, AF_UNSPEC) < 0)
+        {
+            e_error("unable to resolve upstream address %pL:%d",
+                    &upstream_cfg->address, upstream_cfg->port);
+            return -1;
+        }
+        if (ic_connect(ic) < 0) {
+            e_error("cannot connect to upstream server %pL:%d",
+                    &upstream_cfg->address, upstream_cfg->port);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** Cancel the counting jobs of a connection.
+ *
+ * The jobs are released when they reach the event loop thread again, and the
+ * counting of the shards once the upstream servers answer.
+ *
+ * \param[in] ic The connection of the client, NULL for all the jobs.
+ */
+static void wordcount_cancel_jobs(const ichannel_t * nullable ic)
+{
+    wordcount_job_t *job;
+    wordcount_fanout_t *fanout;
+    wordcount_merge_job_t *merge_job;
+    wordcount_corpus_job_t *corpus_job;
+
+    dlist_for_each_entry(job, &_G.jobs, list) {
+        if (!ic || job->query.ic == ic) {
+            job->canceled = true;
+            job->query.ic = NULL;
+        }
+    }
+    dlist_for_each_entry(fanout, &_G.fanouts, list) {
+        if (!ic || fanout->query.ic == ic) {
+            fanout->query.ic = NULL;
+            wordcount_fanout_finish(fanout);
+        }
+    }
+
+    dlist_for_each_entry(merge_job, &_G.merge_jobs, list) {
+        if (!ic || merge_job->query.ic == ic) {
+            merge_job->query.ic = NULL;
+        }
+    }
+
+    /* The contents added to the corpora are kept, only their reply is
+     * dropped */
+    dlist_for_each_entry(corpus_job, &_G.corpus_jobs, list) {
+        if (!ic || corpus_job->query.ic == ic) {
+            corpus_job->query.ic = NULL;
+        }
+    }
+}
+
+/** Count the words of a small file content in the event loop thread.
+ *
+ * Counting a small file content inline is cheaper than scheduling a job, and
+ * so is looking it up in the cache.
+ *
+ * \param[in] query        The counting query.
+ * \param[in] file_content The plain file content.
+ * \param[in] params       The parameters of the counting.
+ */
+static void wordcount_count_inline(const wordcount_query_t *query,
+                                   lstr_t file_content,
+                                   const wordcount_params_t *params)
+{
+    t_scope;
+    ichannel_t *ic = query->ic;
+    bool use_cache = wordcount_cache_is_enabled(&_G.cache);
+    wordcount_cache_key_t cache_key;
+    wordcount_params_t inline_params = *params;
+    wordcount_count_stats_t count_stats;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+
+    if (use_cache) {
+        const wordcount_cache_entry_t *entry;
+
+        /* Reply with the cached result without counting anything, if
+         * any */
+        wordcount_cache_key_init(&cache_key, query->codec, file_content,
+                                 params);
+        entry = wordcount_cache_get(&_G.cache, &cache_key, file_content);
+        if (entry) {
+            t_wordcount_result_get(&entry->result, &word_occurrences_vec);
+            wordcount_reply(query, NULL, &word_occurrences_vec,
+                            entry->result.words.len);
+            wordcount_cache_release(&_G.cache, &entry);
+            return;
+        }
+    }
+
+    /* Recycle the map of the connection instead of allocating a new one.
+     * The file content is plain, and the counting cannot be canceled. */
+    inline_params.nb_threads = 1;
+    inline_params.map = &((wordcount_conn_t *)ic->priv)->map;
+    inline_params.stats = &count_stats;
+    t_wordcount_split_and_sort_word_occurrences(file_content, &inline_params,
+                                                &word_occurrences_vec);
+    if (!wordcount_query_check_file(query)) {
+        return;
+    }
+    wordcount_stats_record_count(&count_stats);
+
+    /* Send the word occurrences back */
+    wordcount_reply(query, NULL, &word_occurrences_vec,
+                    count_stats.words_size);
+
+    if (use_cache) {
+        wordcount_cache_put(&_G.cache, &cache_key, &file_content, false,
+                            &word_occurrences_vec);
+    }
+}
+
+/** Count the words of a file content and reply to the counting query.
+ *
+ * Small file contents are counted directly. The bigger ones are looked up
+ * in the cache by a job in the thread pool, and then counted by the job, or
+ * by the upstream servers of a coordinator: the event loop thread never
+ * hashes nor compares them.
+ *
+ * \param[in]     query        The counting query. For a
+ *                             countFileOccurrences query, the file content
+ *                             is a mapped file, which is given to the job if
+ *                             any. Otherwise, the file content is in the
+ *                             buffer of the query, and is copied for the
+ *                             job.
+ * \param[in,out] file_content The file content, compressed with the codec
+ *                             of the query.
+ * \param[in]     params       The parameters of the counting.
+ */
+static void wordcount_count_and_reply(wordcount_query_t *query,
+                                      lstr_t *file_content,
+                                      const wordcount_params_t *params)
+{
+    ichannel_t *ic = query->ic;
+    int nb_shards;
+    wordcount_job_t *job;
+
+    /* Big file contents are counted by the upstream servers of a
+     * coordinator, the size of a compressed file content is compared as
+     * is */
+    nb_shards = wordcount_coordinator_nb_shards(file_content->len, params);
+
+    /* A compressed file content is never counted inline, since a small one
+     * can expand to a huge content */
+    if (!nb_shards && query->codec == CODEC_NONE
+    &&  file_content->len <= _G.inline_count_max_size)
+    {
+        wordcount_count_inline(query, *file_content, params);
+        return;
+    }
+
+    /* The other file contents are held until the query is replied, they
+     * must fit in the limits */
+    if (!wordcount_admit_query(query, file_content->len)) {
+        return;
+    }
+
+    if (_G.nb_jobs >= _G.max_jobs) {
+        /* Too many jobs queued, reject the query quickly so that the client
+         * can retry later */
+        e_warning("client %p: too many pending counting jobs (%d), "
+                  "rejecting query", ic, _G.nb_jobs);
+        _G.stats.rejected_queries++;
+        ic_reply_err(ic, query->slot, IC_MSG_RETRY);
+        wordcount_query_release(query);
+        return;
+    }
+
+    /* Count the words in the thread pool so the event loop keeps serving the
+     * other clients. The file contents counted by the upstream servers are
+     * prepared in the thread pool too. */
+    job = wordcount_job_new();
+    job->query = *query;
+    if (query->count_file) {
+        /* The job takes the ownership of the mapped file, and of its
+         * guard */
+        job->file_content = *file_content;
+        *file_content = LSTR_NULL_V;
+        query->mapped = NULL;
+    } else {
+        /* The file content is unpacked in the read buffer of the connection,
+         * which is reused once the query is handled, so it is copied once.
+         * The copy is then shared by the counting, the shards and the
+         * cache. */
+        job->file_content = lstr_dup(*file_content);
+    }
+    job->params = *params;
+    job->params.canceled = &job->canceled;
+    job->params.stats = &job->count_stats;
+    job->fanout = nb_shards > 0;
+    job->nb_shards = nb_shards;
+    if (!job->fanout) {
+        wordcount_job_set_threads(job);
+    }
+
+    /* The result of a compressed file content counted by the upstream
+     * servers is not cached, since only its decompressed content is
+     * kept */
+    job->cache_result = wordcount_cache_is_enabled(&_G.cache)
+                     && (!job->fanout || query->codec == CODEC_NONE);
+    job->count_job.run = &wordcount_job_count;
+    dlist_add_tail(&_G.jobs, &job->list);
+    _G.nb_jobs++;
+
+    thr_syn_schedule(&_G.jobs_syn, &job->count_job);
+}
+
+/** RPC implementation, this function is called on RPC query. */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, count_occurrences)
+{
+    wordcount_params_t params = {
+        .nb_threads = _G.count_threads,
+        .limit = arg->limit,
+        .min_occurrences = arg->min_occurrences,
+        .sketch_size = arg->approximate ? _G.approximate_memory : 0,
+        .ngram = arg->ngram,
+        .utf8 = arg->utf8,
+        .max_content_size = _G.max_payload_size,
+    };
+    wordcount_query_t query = {
+        .ic = ic,
+        .slot = slot,
+        .codec = arg->codec,
+        .reply_codec = arg->reply_codec,
+        .page_size = arg->page_size,
+        .start_nsec = wordcount_now_nsec(),
+    };
+    lstr_t file_content = arg->file_content;
+
+    _G.stats.count_occurrences_queries++;
+    if (!wordcount_check_ngram(ic, slot, &params)
+    ||  !wordcount_get_filter(ic, slot, arg->filter_set, &params.filter))
+    {
+        return;
+    }
+
+    /* A compressed file content is in its own field, so that it is not
+     * validated as a string */
+    if (arg->codec != CODEC_NONE) {
+        if (!arg->compressed_content.s || arg->file_content.len) {
+            e_warning("client %p: a compressed file content must be in "
+                      "compressedContent only", ic);
+            ic_reply_err(ic, slot, IC_MSG_INVALID);
+            return;
+        }
+        file_content = arg->compressed_content;
+    }
+    _G.stats.bytes_in += file_content.len;
+    if (!wordcount_check_payload(ic, slot, file_content.len)) {
+        return;
+    }
+
+    wordcount_count_and_reply(&query, &file_content, &params);
+}
+
+/** Check that a resolved path is in one of the countFileRoots directories.
+ *
+ * \param[in] path The resolved path.
+ * \return true if the path is allowed, false otherwise.
+ */
+static bool wordcount_is_path_allowed(lstr_t path)
+{
+    tab_for_each_entry(root, &_G.file_roots) {
+        /* The path must be the directory itself or be below it: `/data` does
+         * not allow `/database` */
+        if (lstr_startswith(path, root)
+        &&  (path.len == root.len || path.s[root.len] == '/'
+        ||   root.s[root.len - 1] == '/'))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Get the path of an opened file.
+ *
+ * \param[in]  fd   The file descriptor of the file.
+ * \param[out] path The path of the file, as resolved by the kernel.
+ * \return -1 if the path cannot be got, 0 otherwise.
+ */
+static int wordcount_get_fd_path(int fd, char path[PATH_MAX])
+{
+    char proc_path[64];
+    ssize_t len;
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    len = readlink(proc_path, path, PATH_MAX);
+    if (len < 0 || len >= PATH_MAX) {
+        return -1;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+/** RPC implementation to count the words of a file read by the server.
+ *
+ * The file is mapped in memory and tokenized in place: contrary to
+ * countOccurrences, the file content is neither sent nor copied.
+ */
+static void
+IOP_RPC_IMPL(wordcount__mod, wordcount_iface, count_file_occurrences)
+{
+    wordcount_params_t params = {
+        .nb_threads = _G.count_threads,
+        .limit = arg->limit,
+        .min_occurrences = arg->min_occurrences,
+        .sketch_size = arg->approximate ? _G.approximate_memory : 0,
+        .ngram = arg->ngram,
+        .utf8 = arg->utf8,
+    };
+    wordcount_query_t query = {
+        .ic = ic,
+        .slot = slot,
+        .count_file = true,
+        .reply_codec = arg->reply_codec,
+        .page_size = arg->page_size,
+        .start_nsec = wordcount_now_nsec(),
+    };
+    char resolved_path[PATH_MAX];
+    char opened_path[PATH_MAX];
+    lstr_t file_content;
+    struct stat st;
+    int fd;
+
+    _G.stats.count_file_occurrences_queries++;
+    if (!wordcount_check_ngram(ic, slot, &params)
+    ||  !wordcount_get_filter(ic, slot, arg->filter_set, &params.filter))
+    {
+        return;
+    }
+
+    /* Resolve the path first, so that neither `..` nor a symbolic link can
+     * be used to get out of the allowed directories */
+    if (!realpath(arg->path.s, resolved_path)) {
+        e_warning("client %p: cannot resolve path `%pL`: %m", ic,
+                  &arg->path);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+    if (!wordcount_is_path_allowed(LSTR(resolved_path))) {
+        e_warning("client %p: path `%s` is not in an allowed directory",
+                  ic, resolved_path);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+
+    /* The path is opened once, without following a symbolic link put there
+     * meanwhile, nor waiting for the writer of a FIFO. A directory of the
+     * path may have been replaced too, so the path of the opened file is
+     * checked again. */
+    fd = open(resolved_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        e_warning("client %p: unable to open file `%s`: %m", ic,
+                  resolved_path);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+    if (wordcount_get_fd_path(fd, opened_path) < 0
+    ||  !wordcount_is_path_allowed(LSTR(opened_path)))
+    {
+        e_warning("client %p: file `%s` moved out of the allowed "
+                  "directories", ic, resolved_path);
+        p_close(&fd);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+
+    /* Only a regular file can be mapped, reading a FIFO or a device could
+     * block the event loop */
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        e_warning("client %p: `%s` is not a regular file", ic,
+                  resolved_path);
+        p_close(&fd);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+    if (!wordcount_check_payload(ic, slot, st.st_size)) {
+        p_close(&fd);
+        return;
+    }
+    if (lstr_init_from_fd(&file_content, fd, PROT_READ, MAP_SHARED) < 0) {
+        e_warning("client %p: unable to map file `%s`: %m", ic,
+                  resolved_path);
+        p_close(&fd);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+    p_close(&fd);
+
+    /* Guard the mapped file against its truncation by another process */
+    if (file_content.len) {
+        query.mapped = wordcount_mapped_file_register(file_content);
+        if (!query.mapped) {
+            e_warning("client %p: too many mapped files, rejecting query",
+                      ic);
+            _G.stats.rejected_queries++;
+            lstr_wipe(&file_content);
+            ic_reply_err(ic, slot, IC_MSG_RETRY);
+            return;
+        }
+    }
+
+    wordcount_count_and_reply(&query, &file_content, &params);
+
+    /* Unmap the file, unless it has been given to a job */
+    wordcount_mapped_file_release(&query.mapped);
+    lstr_wipe(&file_content);
+}
+
+/** Reply to a mergeOccurrences query with the merged word occurrences, in
+ * the event loop thread. */
+static void wordcount_merge_job_reply(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_merge_job_t *job;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+
+    job = container_of(thr_job, wordcount_merge_job_t, reply_job);
+    _G.nb_jobs--;
+    wordcount_histogram_record(&_G.stats.stages[WORDCOUNT_STAGE_SORT],
+                               job->merge_nsec);
+
+    if (!job->query.ic) {
+        /* The client is gone, nobody to reply to */
+        wordcount_merge_job_delete(&job);
+        return;
+    }
+    if (job->invalid) {
+        e_warning("client %p: invalid or too big compressed partials",
+                  job->query.ic);
+        ic_reply_err(job->query.ic, job->query.slot, IC_MSG_INVALID);
+        wordcount_merge_job_delete(&job);
+        return;
+    }
+
+    t_wordcount_result_get(&job->result, &word_occurrences_vec);
+    wordcount_reply(&job->query, &job->result, &word_occurrences_vec,
+                    job->result.words.len);
+    wordcount_merge_job_delete(&job);
+}
+
+/** Merge the partials of a mergeOccurrences query, in a thread of the
+ * pool. */
+static void wordcount_merge_job_run(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_merge_job_t *job;
+    wordcount__word_occurrences__array_t partials;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+    int64_t merge_nsec = wordcount_now_nsec();
+
+    job = container_of(thr_job, wordcount_merge_job_t, merge_job);
+    if (job->query.codec != CODEC_NONE) {
+        /* The decompressed partials are bounded like a payload */
+        if (t_wordcount_decompress_word_occurrences(
+                job->query.codec, job->compressed, _G.max_payload_size,
+                &partials) < 0)
+        {
+            job->invalid = true;
+            goto reply;
+        }
+    } else {
+        qv_t(word_occurrences_vec) partials_vec;
+
+        t_wordcount_result_get(&job->partials, &partials_vec);
+        partials.tab = partials_vec.tab;
+        partials.len = partials_vec.len;
+    }
+
+    t_wordcount_merge_word_occurrences(partials.tab, partials.len,
+                                       &job->params, &word_occurrences_vec);
+
+    /* Pack the result out of the t_stack of this thread */
+    wordcount_result_set(&job->result, &word_occurrences_vec);
+
+  reply:
+    job->merge_nsec = wordcount_now_nsec() - merge_nsec;
+    job->reply_job.run = &wordcount_merge_job_reply;
+    thr_queue(thr_queue_main_g, &job->reply_job);
+}
+
+/** RPC implementation to merge the partial word occurrences counted by a
+ * client.
+ *
+ * The partials are copied, and held until the query is replied like the
+ * file content of a counting query. They are merged and sorted in the
+ * thread pool.
+ */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, merge_occurrences)
+{
+    wordcount_query_t query = {
+        .ic = ic,
+        .slot = slot,
+        .merge = true,
+        .codec = arg->codec,
+        .reply_codec = arg->reply_codec,
+        .page_size = arg->page_size,
+        .start_nsec = wordcount_now_nsec(),
+    };
+    wordcount_params_t params = {
+        .limit = arg->limit,
+        .min_occurrences = arg->min_occurrences,
+    };
+    const wordcount__word_occurrences__array_t *partials;
+    wordcount_merge_job_t *job;
+    size_t size = 0;
+
+    _G.stats.merge_occurrences_queries++;
+    if (!wordcount_get_filter(ic, slot, arg->filter_set, &params.filter)) {
+        return;
+    }
+
+    partials = &arg->word_occurrences;
+    if (arg->codec != CODEC_NONE) {
+        if (!arg->compressed_word_occurrences.s || partials->len) {
+            e_warning("client %p: compressed partials must be in "
+                      "compressedWordOccurrences only", ic);
+            ic_reply_err(ic, slot, IC_MSG_INVALID);
+            return;
+        }
+        size = arg->compressed_word_occurrences.len;
+    } else {
+        tab_for_each_ptr(partial, partials) {
+            size += partial->word.len + sizeof(partial->occurrences);
+        }
+    }
+    _G.stats.bytes_in += size;
+    if (!wordcount_check_payload(ic, slot, size)
+    ||  !wordcount_admit_query(&query, size))
+    {
+        return;
+    }
+
+    /* The merge jobs are queued in the same thread pool as the counting
+     * ones, and bounded by the same limit */
+    if (_G.nb_jobs >= _G.max_jobs) {
+        e_warning("client %p: too many pending counting jobs (%d), "
+                  "rejecting query", ic, _G.nb_jobs);
+        _G.stats.rejected_queries++;
+        ic_reply_err(ic, slot, IC_MSG_RETRY);
+        wordcount_query_release(&query);
+        return;
+    }
+
+    job = wordcount_merge_job_new();
+    job->query = query;
+    job->params = params;
+    if (arg->codec != CODEC_NONE) {
+        job->compressed = lstr_dup(arg->compressed_word_occurrences);
+    } else {
+        wordcount_result_set_tab(&job->partials, partials->tab,
+                                 partials->len);
+    }
+    dlist_add_tail(&_G.merge_jobs, &job->list);
+    job->merge_job.run = &wordcount_merge_job_run;
+    _G.nb_jobs++;
+    thr_syn_schedule(&_G.jobs_syn, &job->merge_job);
+}
+
+/** Release a streaming counting session removed from the sessions.
+ *
+ * A session closed while its query is run by a thread of the pool is
+ * released once the query is done.
+ *
+ * \param[in] session The session.
+ */
+static void wordcount_session_close(wordcount_session_t *session)
+{
+    if (session->busy) {
+        session->closed = true;
+        return;
+    }
+    wordcount_session_delete(&session);
+}
+
+/** Close a streaming counting session and release it.
+ *
+ * \param[in] session The session.
+ * \param[in] status  The status the queries queued in the session are
+ *                    rejected with.
+ */
+static void wordcount_session_release(wordcount_session_t *session,
+                                      ic_status_t status)
+{
+    wordcount_session_op_t *op;
+
+    qm_del_key(wordcount_sessions, &_G.sessions, session->id);
+    dlist_for_each_entry(op, &session->ops, list) {
+        ic_reply_err(session->ic, op->slot, status);
+    }
+    wordcount_session_close(session);
+}
+
+/** Account the memory of a session in the bytes in flight.
+ *
+ * The counter of an exact session grows with its chunks, so its memory is
+ * charged after each chunk, with the chunks queued in the session.
+ *
+ * \param[in] session The session, which is not busy if its counter has
+ *                    grown.
+ */
+static void wordcount_session_charge(wordcount_session_t *session)
+{
+    size_t size = session->counter_size + session->queued_size;
+
+    _G.stats.inflight_bytes -= session->query.inflight_size;
+    _G.stats.inflight_bytes += size;
+    session->query.inflight_size = size;
+}
+
+static void wordcount_session_on_ttl(el_t ev, data_t priv)
+{
+    wordcount_session_t *session = priv.ptr;
+
+    session->ttl_timer = NULL;
+    e_info("client %p: session %ju expired", session->ic,
+           (uintmax_t)session->id);
+    wordcount_session_release(session, IC_MSG_INVALID);
+}
+
+/** Keep an idle session for another sessionTtl, a session with queries to
+ * run is kept until they are replied. */
+static void wordcount_session_touch(wordcount_session_t *session)
+{
+    el_unregister(&session->ttl_timer);
+    if (dlist_is_empty(&session->ops)) {
+        session->ttl_timer = el_timer_register(_G.session_ttl, 0, 0,
+                                               &wordcount_session_on_ttl,
+                                               session);
+    }
+}
+
+static void wordcount_session_schedule(wordcount_session_t *session);
+
+/** Reply to the query of a session run by the thread pool, in the event
+ * loop thread, and run the next one. */
+static void wordcount_session_done(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    t_scope;
+    wordcount_session_t *session;
+    wordcount_session_op_t *op;
+
+    session = container_of(thr_job, wordcount_session_t, done_job);
+    op = session->op;
+    session->op = NULL;
+    session->busy = false;
+    _G.nb_busy_sessions--;
+
+    if (session->closed) {
+        wordcount_session_delete(&session);
+        return;
+    }
+
+    if (session->invalid) {
+        /* The words of the beginning of the chunk are already counted, so
+         * the session is dropped with the queries that follow it */
+        e_warning("client %p: invalid compressed chunk for session %ju, "
+                  "closing it", session->ic, (uintmax_t)session->id);
+        wordcount_session_release(session, IC_MSG_INVALID);
+        return;
+    }
+
+    if (op->end) {
+        wordcount_query_t query = {
+            .ic = session->ic,
+            .slot = op->slot,
+            .end_count = true,
+            .reply_codec = op->reply_codec,
+            .page_size = op->page_size,
+            .start_nsec = session->query.start_nsec,
+        };
+        qv_t(word_occurrences_vec) word_occurrences_vec;
+
+        wordcount_stats_record_count(&session->count_stats);
+        t_wordcount_result_get(&session->result, &word_occurrences_vec);
+        wordcount_reply(&query, &session->result, &word_occurrences_vec,
+                        session->result.words.len);
+
+        /* The reply is packed, the session can be released. No query can
+         * follow the endCount one. */
+        wordcount_session_op_delete(&op);
+        wordcount_session_release(session, IC_MSG_INVALID);
+        return;
+    }
+
+    ic_reply(session->ic, op->slot, wordcount__mod, wordcount_iface,
+             push_chunk);
+
+    /* The chunk is counted, its words are in the counter now */
+    session->queued_size -= op->chunk.len;
+    session->counter_size = MAX(session->counter_size,
+                                wordcount_counter_memory(&session->counter));
+    wordcount_session_charge(session);
+    wordcount_session_op_delete(&op);
+    wordcount_session_touch(session);
+    wordcount_session_schedule(session);
+}
+
+/** Run a query of a session, in a thread of the pool.
+ *
+ * \param[in] session The session.
+ * \param[in] op      The pushChunk or endCount query.
+ */
+static void wordcount_session_run_op(wordcount_session_t *session,
+                                     wordcount_session_op_t *op)
+{
+    t_scope;
+    wordcount_count_stats_t *stats = &session->count_stats;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+    int64_t start_nsec = wordcount_now_nsec();
+
+    if (!op->end) {
+        /* A compressed chunk is decompressed and counted part by part */
+        if (op->codec == CODEC_NONE) {
+            wordcount_counter_feed(&session->counter, op->chunk);
+        } else
+        if (wordcount_counter_feed_compressed(&session->counter, op->codec,
+                                              op->chunk,
+                                              _G.max_chunk_size) < 0)
+        {
+            session->invalid = true;
+        }
+        stats->count_nsec += wordcount_now_nsec() - start_nsec;
+        return;
+    }
+
+    /* Count the last word, sort the words by their occurrences, and pack
+     * them out of the t_stack of this thread */
+    wordcount_counter_flush(&session->counter);
+    op->params.stats = stats;
+    t_wordcount_counter_sort_word_occurrences(&session->counter, &op->params,
+                                              &word_occurrences_vec);
+    stats->map_size = wordcount_counter_memory(&session->counter);
+    wordcount_result_set(&session->result, &word_occurrences_vec);
+    stats->sort_nsec = wordcount_now_nsec() - start_nsec;
+}
+
+/** Run the first query of a session, in a thread of the pool. */
+static void wordcount_session_run(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    wordcount_session_t *session;
+
+    session = container_of(thr_job, wordcount_session_t, run_job);
+
+    /* A closed session has nobody to reply to */
+    if (!session->closed) {
+        wordcount_session_run_op(session, session->op);
+    }
+
+    session->done_job.run = &wordcount_session_done;
+    thr_queue(thr_queue_main_g, &session->done_job);
+}
+
+/** Run the next query of a session in the thread pool, unless one is
+ * already running. */
+static void wordcount_session_schedule(wordcount_session_t *session)
+{
+    if (session->busy || dlist_is_empty(&session->ops)) {
+        return;
+    }
+
+    session->busy = true;
+    session->op = dlist_first_entry(&session->ops, wordcount_session_op_t,
+                                    list);
+    _G.nb_busy_sessions++;
+    session->run_job.run = &wordcount_session_run;
+    thr_syn_schedule(&_G.jobs_syn, &session->run_job);
+}
+
+/** Get a streaming counting session opened by a connection, to queue a
+ * query in.
+ *
+ * \param[in] ic         The connection of the client.
+ * \param[in] slot       The slot of the query, rejected with the INVALID
+ *                       status if there is no such session for this
+ *                       connection, or if it is being ended.
+ * \param[in] session_id The identifier of the session.
+ * \return The session, NULL if the query has been rejected.
+ */
+static wordcount_session_t * nullable
+wordcount_session_get_open(ichannel_t *ic, uint64_t slot,
+                           uint64_t session_id)
+{
+    wordcount_session_t *session;
+
+    session = qm_get_def(wordcount_sessions, &_G.sessions, session_id, NULL);
+    if (!session || session->ic != ic || session->ending) {
+        e_warning("client %p: unknown or ending session %ju", ic,
+                  (uintmax_t)session_id);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return NULL;
+    }
+    return session;
+}
+
+/** RPC implementation to open a streaming counting session. */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, begin_count)
+{
+    const wordcount_filter_t *filter;
+    wordcount_session_t *session;
+    wordcount_query_t query = {
+        .ic = ic,
+        .slot = slot,
+        .start_nsec = wordcount_now_nsec(),
+    };
+
+    if (!wordcount_get_filter(ic, slot, arg->filter_set, &filter)) {
+        return;
+    }
+
+    /* The counter of a session is held until the session is closed, like
+     * the file content of a job. Only the memory of an approximate counter
+     * is known in advance. */
+    if (!wordcount_admit_query(&query,
+                               arg->approximate ? _G.approximate_memory : 0))
+    {
+        return;
+    }
+
+    session = wordcount_session_new();
+    session->id = ++_G.last_session_id;
+    session->ic = ic;
+    session->query = query;
+    session->counter_size = query.inflight_size;
+    session->counter.filter = filter;
+    if (arg->approximate) {
+        wordcount_counter_set_approximate(&session->counter,
+                                          _G.approximate_memory);
+    }
+    qm_add(wordcount_sessions, &_G.sessions, session->id, session);
+    wordcount_session_touch(session);
+
+    ic_reply(ic, slot, wordcount__mod, wordcount_iface, begin_count,
+             .session_id = session->id);
+}
+
+/** RPC implementation to count the words of the next chunk of a session.
+ *
+ * The chunk is counted in the thread pool after the previous ones, so the
+ * whole content is never buffered on the server side.
+ */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, push_chunk)
+{
+    wordcount_session_t *session;
+    wordcount_session_op_t *op;
+
+    _G.stats.push_chunk_queries++;
+    _G.stats.bytes_in += arg->chunk.len;
+
+    /* A chunk is held and counted at once, like a small file content, so it
+     * is bounded more tightly than a payload */
+    if (_G.max_chunk_size && (size_t)arg->chunk.len > _G.max_chunk_size) {
+        e_warning("client %p: chunk of %d bytes over the limit of %zu "
+                  "bytes, rejecting query", ic, arg->chunk.len,
+                  _G.max_chunk_size);
+        _G.stats.rejected_payloads++;
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+
+    session = wordcount_session_get_open(ic, slot, arg->session_id);
+    if (!session) {
+        return;
+    }
+
+    /* The memory of a session grows with its chunks, a chunk is rejected
+     * when the bytes in flight would exceed the limit, unless they are all
+     * the ones of the session. The chunks cannot be sent again out of
+     * order, so the whole session is closed and has to be sent again. */
+    if (_G.max_inflight_bytes
+    &&  _G.stats.inflight_bytes > session->query.inflight_size
+    &&  _G.stats.inflight_bytes + arg->chunk.len > _G.max_inflight_bytes)
+    {
+        e_warning("client %p: too many bytes in flight (%ju), closing "
+                  "session %ju", ic, (uintmax_t)_G.stats.inflight_bytes,
+                  (uintmax_t)session->id);
+        _G.stats.rejected_inflight_queries++;
+        ic_reply_err(ic, slot, IC_MSG_RETRY);
+        wordcount_session_release(session, IC_MSG_RETRY);
+        return;
+    }
+
+    op = wordcount_session_op_new();
+    op->slot = slot;
+    op->chunk = lstr_dup(arg->chunk);
+    op->codec = arg->codec;
+    dlist_add_tail(&session->ops, &op->list);
+    session->queued_size += op->chunk.len;
+    wordcount_session_charge(session);
+    wordcount_session_touch(session);
+    wordcount_session_schedule(session);
+}
+
+/** RPC implementation to close a session and send back its results.
+ *
+ * The words are sorted in the thread pool once all the chunks of the session
+ * are counted.
+ */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, end_count)
+{
+    wordcount_session_t *session;
+    wordcount_session_op_t *op;
+
+    _G.stats.end_count_queries++;
+
+    session = wordcount_session_get_open(ic, slot, arg->session_id);
+    if (!session) {
+        return;
+    }
+
+    op = wordcount_session_op_new();
+    op->slot = slot;
+    op->end = true;
+    op->params.limit = arg->limit;
+    op->params.min_occurrences = arg->min_occurrences;
+    op->reply_codec = arg->reply_codec;
+    op->page_size = arg->page_size;
+    session->ending = true;
+    dlist_add_tail(&session->ops, &op->list);
+    wordcount_session_touch(session);
+    wordcount_session_schedule(session);
+}
+
+/** RPC implementation to fetch a page of a paged result. */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, fetch_page)
+{
+    t_scope;
+    wordcount_paged_result_t *paged;
+    qv_t(word_occurrences_vec) word_occurrences_vec;
+    wordcount__word_occurrences__array_t word_occurrences;
+    wordcount__codec__t codec;
+    lstr_t compressed;
+    opt_u32_t next_cursor;
+    size_t words_size;
+    unsigned next;
+
+    paged = wordcount_paged_result_get(ic, arg->result_id);
+    if (!paged || arg->cursor >= (unsigned)paged->result.entries.len) {
+        e_warning("client %p: unknown paged result %ju or cursor %u", ic,
+                  (uintmax_t)arg->result_id, arg->cursor);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return;
+    }
+
+    words_size = t_wordcount_result_get_range(&paged->result, arg->cursor,
+                                              paged->page_size,
+                                              &word_occurrences_vec);
+    t_wordcount_encode_word_occurrences(arg->reply_codec,
+                                        &word_occurrences_vec, words_size,
+                                        &word_occurrences, &codec,
+                                        &compressed);
+    next = arg->cursor + word_occurrences_vec.len;
+    OPT_CLR(next_cursor);
+    if (next < (unsigned)paged->result.entries.len) {
+        OPT_SET(next_cursor, next);
+    }
+
+    ic_reply(ic, slot, wordcount__mod, wordcount_iface, fetch_page,
+             .word_occurrences = word_occurrences,
+             .codec = codec,
+             .compressed_word_occurrences = compressed,
+             .next_cursor = next_cursor);
+
+    /* The reply is packed, the result can be released once fully
+     * consumed */
+    if (OPT_ISSET(next_cursor)) {
+        wordcount_paged_result_touch(paged);
+    } else {
+        wordcount_paged_result_release(paged);
+    }
+}
+
+/** RPC implementation to release a paged result. */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, release_result)
+{
+    wordcount_paged_result_t *paged;
+
+    paged = wordcount_paged_result_get(ic, arg->result_id);
+    if (paged) {
+        wordcount_paged_result_release(paged);
+    }
+    ic_reply(ic, slot, wordcount__mod, wordcount_iface, release_result);
+}
+
+/* Persistent corpora */
+
+/** Check the name of a corpus, which is the name of its file. */
+static bool wordcount_is_corpus_name_valid(lstr_t name)
+{
+    if (name.len <= 0 || name.len > WORDCOUNT_CORPUS_NAME_MAX) {
+        return false;
+    }
+    for (int i = 0; i < name.len; i++) {
+        if (!isalnum((unsigned char)name.s[i])
+        &&  name.s[i] != '-' && name.s[i] != '_')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Get a persistent corpus, opening it on its first use.
+ *
+ * \param[in] ic     The connection of the client.
+ * \param[in] slot   The slot of the query, rejected with the INVALID status
+ *                   if the corpus cannot be got.
+ * \param[in] name   The name of the corpus.
+ * \param[in] create Whether to create the corpus if it has never been
+ *                   saved.
+ * \return The corpus, NULL if the query has been rejected.
+ */
+static wordcount_corpus_t * nullable
+wordcount_corpus_get(ichannel_t *ic, uint64_t slot, lstr_t name,
+                     bool create)
+{
+    wordcount_corpus_t *corpus;
+    char path[PATH_MAX];
+    lstr_t key;
+
+    if (!_G.corpus_dir.s) {
+        e_warning("client %p: corpora are disabled, there is no corpusDir",
+                  ic);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return NULL;
+    }
+    if (!wordcount_is_corpus_name_valid(name)) {
+        e_warning("client %p: invalid corpus name `%pL`", ic, &name);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return NULL;
+    }
+
+    corpus = qm_get_def(wordcount_corpora, &_G.corpora, &name, NULL);
+    if (corpus) {
+        return corpus;
+    }
+
+    /* The corpora are kept until the server stops, their number is bounded
+     * so that their names cannot exhaust the memory */
+    if (_G.max_corpora
+    &&  qm_len(wordcount_corpora, &_G.corpora) >= _G.max_corpora)
+    {
+        e_warning("client %p: too many corpora (%u), cannot open corpus "
+                  "`%pL`", ic, _G.max_corpora, &name);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return NULL;
+    }
+
+    /* The file of the corpus is mapped as is, so the first query after a
+     * restart does not have to count the corpus again */
+    snprintf(path, sizeof(path), "%.*s/%.*s.corpus", _G.corpus_dir.len,
+             _G.corpus_dir.s, name.len, name.s);
+    corpus = wordcount_corpus_new();
+    if (wordcount_corpus_open(corpus, path) < 0
+    ||  (!create && !corpus->file.map.s))
+    {
+        e_warning("client %p: cannot open corpus `%pL`", ic, &name);
+        wordcount_corpus_delete(&corpus);
+        ic_reply_err(ic, slot, IC_MSG_INVALID);
+        return NULL;
+    }
+    key = lstr_dup(name);
+    qm_add(wordcount_corpora, &_G.corpora, &key, corpus);
+    return corpus;
+}
+
+/** Map the new file of a corpus once saved, in the event loop thread. */
+static void wordcount_corpus_save_end(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    wordcount_corpus_save_t *save;
+
+    save = container_of(thr_job, wordcount_corpus_save_t, end_job);
+    wordcount_corpus_end_save(save->corpus, save->saved);
+    _G.nb_saving_corpora--;
+    p_delete(&save);
+}
+
+/** Save the words added to a corpus, in a thread of the pool. */
+static void wordcount_corpus_save_run(thr_job_t *thr_job, thr_syn_t *syn)
 {
-    pstream_t file_ps;
+    wordcount_corpus_save_t *save;
 
-    /* Initialize the stream parser from the content */
-    file_ps = ps_initlstr(&file_content);
+    save = container_of(thr_job, wordcount_corpus_save_t, save_job);
 
-    /* Iterate until the stream parser is empty */
-    while (!ps_done(&file_ps)) {
-        pstream_t word_ps;
-        lstr_t word_lstr;
-        uint32_t pos;
+    /* The save of the corpus by another worker is not waited for, the
+     * words are saved on the next tick of the timer instead */
+    save->saved = wordcount_corpus_save(save->corpus, false) >= 0;
 
-        /* Get the next word */
-        word_ps = ps_get_span(&file_ps, &ctype_iswordpart);
+    save->end_job.run = &wordcount_corpus_save_end;
+    thr_queue(thr_queue_main_g, &save->end_job);
+}
 
-        /* Skip the characters to the next word for next loop */
-        ps_skip_cspan(&file_ps, &ctype_iswordpart);
+/** Save the words added to the persistent corpora in the thread pool.
+ *
+ * The corpora without added words map the file again if another worker has
+ * saved it, so that they see its words.
+ */
+static void wordcount_corpora_schedule_save(void)
+{
+    qm_for_each_pos(wordcount_corpora, pos, &_G.corpora) {
+        wordcount_corpus_t *corpus = _G.corpora.values[pos];
+        wordcount_corpus_save_t *save;
 
-        /* Do nothing if word is empty */
-        if (ps_done(&word_ps)) {
+        if (corpus->saving) {
+            /* Still being saved since the previous tick */
             continue;
         }
-
-        /* Put the word in the map */
-        /* Store 1 as value if `word_lstr` is not already in the map... */
-        word_lstr = LSTR_PS_V(&word_ps);
-        pos = qm_put(word_occurrences_map, word_occurrences_map, &word_lstr,
-                     1, 0);
-        if (pos & QHASH_COLLISION) {
-            /* ...increment the value by 1 if `word_lstr` is already in the
-             * map. */
-            word_occurrences_map->values[pos ^ QHASH_COLLISION] += 1;
+        if (!wordcount_corpus_is_dirty(corpus)) {
+            wordcount_corpus_reload(corpus);
+            continue;
         }
+
+        save = p_new(wordcount_corpus_save_t, 1);
+        save->corpus = corpus;
+        wordcount_corpus_begin_save(corpus);
+        _G.nb_saving_corpora++;
+        save->save_job.run = &wordcount_corpus_save_run;
+        thr_syn_schedule(&_G.jobs_syn, &save->save_job);
     }
 }
 
-/** Sort the words by their occurrences in the map to a vector.
+/** Save the words added to the persistent corpora when the server stops.
  *
- * The words are converted to lower case.
- *
- * \param[in]  word_occurrences_map The map countaining the words and their
- *                                  occurrences.
- * \param[out] word_occurrences_vec The vector of sorted words by their
- *                                  occurrences.
- *                                  The vector and words are allocated on the
- *                                  t_scope.
+ * No corpus is being saved anymore, and the saves of the other workers are
+ * waited for, so that no word is lost.
  */
-static void t_wordcount_sort_word_occurrences(
-    const qm_t(word_occurrences_map) *word_occurrences_map,
-    qv_t(word_occurrences_vec) *word_occurrences_vec)
+static void wordcount_corpora_save(void)
 {
-    /* Initialize the vector on the t_scope to the size of the map in order to
-     * do only one allocation */
-    t_qv_init(word_occurrences_vec,
-              qm_len(word_occurrences_map, word_occurrences_map));
+    qm_for_each_pos(wordcount_corpora, pos, &_G.corpora) {
+        wordcount_corpus_t *corpus = _G.corpora.values[pos];
 
-    /* Populate the vector with the map content */
-    qm_for_each_key_value(word_occurrences_map, word, occurrences,
-                          word_occurrences_map)
-    {
-        wordcount__word_occurrences__t word_occurrences = {
-            /* Duplicate the word on the t_scope and use lower case */
-            .word = t_lstr_ascii_tolower(word),
-            .occurrences = occurrences,
-        };
+        if (wordcount_corpus_is_dirty(corpus)) {
+            bool saved;
+
+            wordcount_corpus_begin_save(corpus);
+            saved = wordcount_corpus_save(corpus, true) >= 0;
+            wordcount_corpus_end_save(corpus, saved);
+        }
+    }
+}
 
-        qv_append(word_occurrences_vec, word_occurrences);
+static void wordcount_corpus_on_timer(el_t ev, data_t priv)
+{
+    wordcount_corpora_schedule_save();
+}
+
+/** Add the words of a corpus job to its corpus and reply to its query, in
+ * the event loop thread. */
+static void wordcount_corpus_job_reply(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    wordcount_corpus_job_t *job;
+
+    job = container_of(thr_job, wordcount_corpus_job_t, reply_job);
+
+    /* The content has been received, its words are added even if its
+     * client is gone */
+    wordcount_corpus_add(job->corpus, &job->counter);
+    if (job->query.ic) {
+        ic_reply(job->query.ic, job->query.slot, wordcount__mod,
+                 wordcount_iface, add_to_corpus);
     }
+    wordcount_corpus_job_delete(&job);
+}
+
+/** Count the words of the content of a corpus job, in a thread of the
+ * pool. */
+static void wordcount_corpus_job_count(thr_job_t *thr_job, thr_syn_t *syn)
+{
+    wordcount_corpus_job_t *job;
+
+    job = container_of(thr_job, wordcount_corpus_job_t, count_job);
 
-    /* Sort the vector by occurrences.
-     * Use iop_sort() which does some introspection to get the sorting fields.
-     */
-    iop_sort(wordcount__word_occurrences, word_occurrences_vec->tab,
-             word_occurrences_vec->len, LSTR("occurrences"), IOP_SORT_REVERSE,
-             NULL);
+    /* The content is complete, its last word is not continued by the next
+     * content */
+    wordcount_counter_feed(&job->counter, job->content);
+    wordcount_counter_flush(&job->counter);
+
+    job->reply_job.run = &wordcount_corpus_job_reply;
+    thr_queue(thr_queue_main_g, &job->reply_job);
 }
 
-/** Split the words from the content of a file and sort the words by
- * occurrences.
+/** RPC implementation to add the words of a content to a corpus.
  *
- * \param[in]  file_content         The file content.
- * \param[out] word_occurrences_vec The vector of sorted words by their
- *                                  occurrences.
- *                                  The vector is allocated on the t_scope.
+ * The content is counted in the thread pool, like the file content of a
+ * counting query, and only its distinct words are added to the corpus by the
+ * event loop thread.
  */
-static void t_wordcount_split_and_sort_word_occurrences(
-    lstr_t file_content, qv_t(word_occurrences_vec) *word_occurrences_vec)
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, add_to_corpus)
 {
-    qm_t(word_occurrences_map) word_occurrences_map;
-
-    /* Initialize the map of word occurrences */
-    qm_init(word_occurrences_map, &word_occurrences_map);
+    wordcount_query_t query = {
+        .ic = ic,
+        .slot = slot,
+        .start_nsec = wordcount_now_nsec(),
+    };
+    wordcount_corpus_t *corpus;
+    wordcount_corpus_job_t *job;
 
-    /* Split the file content per word */
-    wordcount_split_words(file_content, &word_occurrences_map);
+    _G.stats.bytes_in += arg->content.len;
+    if (!wordcount_check_payload(ic, slot, arg->content.len)) {
+        return;
+    }
+    corpus = wordcount_corpus_get(ic, slot, arg->name, true);
+    if (!corpus) {
+        return;
+    }
 
-    /* Sort the words by their occurrences */
-    t_wordcount_sort_word_occurrences(&word_occurrences_map,
-                                      word_occurrences_vec);
+    /* The content is held until it is counted, it must fit in the limits */
+    if (!wordcount_admit_query(&query, arg->content.len)) {
+        return;
+    }
 
-    /* Clean-up */
-    qm_wipe(word_occurrences_map, &word_occurrences_map);
+    job = wordcount_corpus_job_new();
+    job->query = query;
+    job->corpus = corpus;
+    job->content = lstr_dup(arg->content);
+    dlist_add_tail(&_G.corpus_jobs, &job->list);
+    job->count_job.run = &wordcount_corpus_job_count;
+    thr_syn_schedule(&_G.jobs_syn, &job->count_job);
 }
 
-/** RPC implementation, this function is called on RPC query. */
-static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, count_occurrences)
+/** RPC implementation to get the sorted words of a corpus. */
+static void IOP_RPC_IMPL(wordcount__mod, wordcount_iface, query_corpus)
 {
     t_scope;
+    wordcount_params_t params = {
+        .limit = arg->limit,
+        .min_occurrences = arg->min_occurrences,
+    };
+    wordcount_corpus_t *corpus;
     qv_t(word_occurrences_vec) word_occurrences_vec;
+    wordcount__word_occurrences__array_t word_occurrences;
+    wordcount__codec__t codec;
+    lstr_t compressed;
+    size_t words_size;
+
+    corpus = wordcount_corpus_get(ic, slot, arg->name, false);
+    if (!corpus) {
+        return;
+    }
+
+    /* The words point into the mapped file, which is not reloaded before
+     * the reply is packed */
+    words_size = t_wordcount_corpus_sort_word_occurrences(
+        corpus, &params, &word_occurrences_vec);
+    t_wordcount_encode_word_occurrences(arg->reply_codec,
+                                        &word_occurrences_vec, words_size,
+                                        &word_occurrences, &codec,
+                                        &compressed);
+    ic_reply(ic, slot, wordcount__mod, wordcount_iface, query_corpus,
+             .word_occurrences = word_occurrences,
+             .codec = codec,
+             .compressed_word_occurrences = compressed);
+}
 
-    /* Split the words from the content of a file and sort the words by
-     * occurrences */
-    t_wordcount_split_and_sort_word_occurrences(
-        arg->file_content, &word_occurrences_vec);
+/** Release all the sessions opened by a connection.
+ *
+ * \param[in] ic The connection of the client.
+ */
+static void wordcount_release_ic_sessions(const ichannel_t *ic)
+{
+    qm_for_each_pos(wordcount_sessions, pos, &_G.sessions) {
+        wordcount_session_t *session = _G.sessions.values[pos];
 
-    /* Send the word occurrences back.
-     * The vector is converted as an IOP array. */
-    ic_reply(ic, slot, wordcount__mod, wordcount_iface, count_occurrences,
-             .word_occurrences = IOP_TYPED_ARRAY_TAB(
-                 wordcount__word_occurrences, &word_occurrences_vec));
+        if (session->ic == ic) {
+            /* Nobody to reply to, the connection is gone */
+            qm_del_at(wordcount_sessions, &_G.sessions, pos);
+            session->ic = NULL;
+            session->query.ic = NULL;
+            wordcount_session_close(session);
+        }
+    }
 }
 
 /** Called on client status changes. */
@@ -201,9 +3413,28 @@ static void wordcount_server_on_event(ichannel_t *ic, ic_event_t evt)
 {
     if (evt == IC_EVT_CONNECTED) {
         e_notice("client %p connected", ic);
+        _G.stats.connections++;
+        _G.stats.total_connections++;
     } else
     if (evt == IC_EVT_DISCONNECTED) {
         e_warning("client %p disconnected", ic);
+        _G.stats.connections--;
+
+        /* The pending sessions of the client can no longer be ended, nor
+         * its paged results be fetched */
+        wordcount_release_ic_sessions(ic);
+        wordcount_release_ic_paged_results(ic);
+
+        /* Nor its counting jobs be replied */
+        wordcount_cancel_jobs(ic);
+
+        /* Release the state of the connection */
+        if (ic->priv) {
+            wordcount_conn_t *conn = ic->priv;
+
+            wordcount_conn_delete(&conn);
+            ic->priv = NULL;
+        }
     }
 }
 
@@ -212,16 +3443,43 @@ static int wordcount_server_on_accept(el_t ev, int fd)
 {
     ichannel_t *ic;
 
+    if (_G.max_connections && _G.stats.connections >= _G.max_connections) {
+        e_warning("too many connections (%u), closing incoming connection",
+                  _G.stats.connections);
+        _G.stats.rejected_connections++;
+        close(fd);
+        return 0;
+    }
+
     e_info("incoming connection");
     ic              = ic_new();
     ic->on_event    = &wordcount_server_on_event;
     ic->impl        = &_G.ic_impl;
     ic->do_el_unref = true;
 
+    /* State of the connection, with the map recycled by its queries */
+    ic->priv        = wordcount_conn_new();
+
     ic_spawn(ic, fd, NULL);
     return 0;
 }
 
+/** Called when connections are pending on a listening socket.
+ *
+ * The listening sockets are shared by the workers, so another worker may
+ * have accepted the connections first.
+ */
+static int wordcount_server_on_listener(el_t ev, int fd, short events,
+                                        data_t priv)
+{
+    int client_fd;
+
+    while ((client_fd = acceptx(fd, O_NONBLOCK)) >= 0) {
+        wordcount_server_on_accept(ev, client_fd);
+    }
+    return 0;
+}
+
 /** Initialization callback called when the module is required.
  *
  * \param[in] arg  An optional argument provided to the module.
@@ -231,45 +3489,138 @@ static int wordcount_server_on_accept(el_t ev, int fd)
  */
 static int wordcount_server_initialize(void *nullable arg)
 {
-    t_scope;
-    SB_1k(err);
-    wordcount__server_cfg__t *server_cfg;
-    sockunion_t su;
+    const wordcount__server_cfg__t *server_cfg = _G.server_cfg;
 
     e_info("starting server");
 
-    /* Unpack the server configuration */
-    server_cfg = t_wordcount_unpack_server_cfg(_G.opt_cfg_path, &err);
-    if (!server_cfg) {
-        e_error("unable to unpack the server cfg `%s`: %pL",
-                _G.opt_cfg_path, &err);
-        return -1;
+    _G.count_threads = server_cfg->count_threads;
+    wordcount_cache_init(&_G.cache, server_cfg->cache_max_size,
+                         server_cfg->cache_verify_content);
+    _G.inline_count_max_size = server_cfg->inline_count_max_size;
+    _G.approximate_memory = server_cfg->approximate_memory;
+    _G.max_payload_size = server_cfg->max_payload_size;
+    _G.max_chunk_size = server_cfg->max_chunk_size;
+    if (_G.max_payload_size) {
+        _G.max_chunk_size = _G.max_chunk_size
+                          ? MIN(_G.max_chunk_size, _G.max_payload_size)
+                          : _G.max_payload_size;
+    }
+    _G.max_inflight_bytes = server_cfg->max_inflight_bytes;
+    _G.max_connection_queries = server_cfg->max_connection_queries;
+    _G.max_connections = server_cfg->max_connections;
+    _G.max_jobs = server_cfg->max_pending_jobs;
+    _G.reply_compress_min_size = server_cfg->reply_compress_min_size;
+    thr_syn_init(&_G.jobs_syn);
+    wordcount_mapped_files_init();
+
+    /* A restarted worker goes on with the statistics of the dead one, but
+     * its connections are gone */
+    if (_G.workers_stats) {
+        const wordcount_worker_stats_t *worker_stats;
+
+        worker_stats = &_G.workers_stats[_G.worker_id];
+        _G.stats = worker_stats->server;
+        _G.stats.connections = 0;
+        _G.stats.pending_queries = 0;
+        _G.stats.inflight_bytes = 0;
+        _G.cache.stats = worker_stats->cache;
+        _G.stats_timer = el_timer_register(1000, 1000, 0,
+                                           &wordcount_stats_on_timer, NULL);
+    }
+    if (!_G.stats.start_time) {
+        _G.stats.start_time = time(NULL);
+    }
+
+    /* Resolve the directories allowed for countFileOccurrences, the
+     * requested paths are resolved the same way */
+    qv_init(&_G.file_roots);
+    tab_for_each_entry(root, &server_cfg->count_file_roots) {
+        char resolved_root[PATH_MAX];
+
+        if (!realpath(root.s, resolved_root)) {
+            e_error("cannot resolve count file root `%pL`: %m", &root);
+            return -1;
+        }
+        qv_append(&_G.file_roots, lstr_dups(resolved_root, -1));
     }
 
     /* Initialize the RPC implementations table */
     qm_init(ic_cbs, &_G.ic_impl);
 
-    /* Get the socket union from the address */
-    if (addr_info_str(&su, server_cfg->address.s, server_cfg->port,
-                      AF_UNSPEC) < 0)
-    {
-        e_error("unable to resolve address %pL:%d", &server_cfg->address,
-                server_cfg->port);
-        return -1;
+    /* Initialize the streaming counting sessions */
+    qm_init(wordcount_sessions, &_G.sessions);
+
+    /* Initialize the paged results */
+    qm_init(wordcount_paged_results, &_G.paged_results);
+    _G.result_ttl = server_cfg->result_ttl * 1000;
+    _G.session_ttl = MAX(server_cfg->session_ttl, 1U) * 1000;
+
+    /* Open the persistent corpora on their first use, and save them
+     * regularly */
+    qm_init(wordcount_corpora, &_G.corpora);
+    _G.max_corpora = server_cfg->max_corpora;
+    if (server_cfg->corpus_dir.s) {
+        char resolved_dir[PATH_MAX];
+        int interval = MAX(server_cfg->corpus_save_interval, 1U) * 1000;
+
+        if (!realpath(server_cfg->corpus_dir.s, resolved_dir)) {
+            e_error("cannot resolve corpus directory `%pL`: %m",
+                    &server_cfg->corpus_dir);
+            return -1;
+        }
+        _G.corpus_dir = lstr_dups(resolved_dir, -1);
+        _G.corpus_timer = el_timer_register(interval, interval, 0,
+                                            &wordcount_corpus_on_timer,
+                                            NULL);
     }
 
-    /* Start the IChannel server */
-    _G.ic_server = ic_listento(&su, SOCK_STREAM, IPPROTO_TCP,
-                               &wordcount_server_on_accept);
-    if (!_G.ic_server) {
-        e_error("cannot bind on %pL:%d", &server_cfg->address,
-                server_cfg->port);
-        return -1;
+    /* Compile the filter sets, the queries only look them up */
+    qm_init(wordcount_filters, &_G.filters);
+    tab_for_each_ptr(filter_set, &server_cfg->filter_sets) {
+        wordcount_filter_t *filter = wordcount_filter_new();
+
+        if (wordcount_filter_compile(filter, filter_set) < 0) {
+            wordcount_filter_delete(&filter);
+            return -1;
+        }
+        if (qm_add(wordcount_filters, &_G.filters, &filter->name,
+                   filter) < 0)
+        {
+            e_error("duplicate filter set `%pL`", &filter->name);
+            wordcount_filter_delete(&filter);
+            return -1;
+        }
+        e_info("filter set `%pL`: %u stopwords", &filter->name,
+               filter->nb_slots + filter->collisions.len);
+    }
+
+    /* Connect to the upstream servers, if the server is a coordinator */
+    RETHROW(wordcount_connect_upstreams(server_cfg));
+
+    /* Accept the connections of the listening sockets opened by main() */
+    qv_init(&_G.listeners);
+    tab_for_each_entry(fd, &_G.listen_fds) {
+        qv_append(&_G.listeners,
+                  el_fd_register(fd, true, POLLIN,
+                                 &wordcount_server_on_listener, NULL));
     }
 
     /* Register the RPC */
     ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface,
                 count_occurrences);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface,
+                count_file_occurrences);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface,
+                merge_occurrences);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, begin_count);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, push_chunk);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, end_count);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, fetch_page);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface,
+                release_result);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, add_to_corpus);
+    ic_register(&_G.ic_impl, wordcount__mod, wordcount_iface, query_corpus);
+    ic_register(&_G.ic_impl, wordcount__mod, stats_iface, get_stats);
 
     return 0;
 }
@@ -280,8 +3631,23 @@ static int wordcount_server_initialize(void *nullable arg)
  */
 static void wordcount_server_on_term(int signo)
 {
-    /* Release the server on termination signal. */
-    el_unregister(&_G.ic_server);
+    /* Release the servers on termination signal. Only the sockets of this
+     * process are closed, the main process still has them to restart the
+     * workers. */
+    tab_for_each_ptr(listener, &_G.listeners) {
+        el_unregister(listener);
+    }
+    el_unregister(&_G.stats_timer);
+    el_unregister(&_G.corpus_timer);
+
+    /* Abort the counting jobs, nobody will get their reply */
+    wordcount_cancel_jobs(NULL);
+
+    /* Disconnect from the upstream servers */
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        _G.upstreams[i].ic.auto_reconn = false;
+        ic_bye(&_G.upstreams[i].ic);
+    }
 }
 
 /** Shutdown callback called when the module is released.
@@ -292,8 +3658,67 @@ static int wordcount_server_shutdown(void)
 {
     e_info("stopping server");
 
+    /* Wait for the canceled counting jobs, for the fan-outs and the
+     * partials being merged, for the queries of the sessions, and for the
+     * corpus jobs and saves, to be released in the event loop thread */
+    thr_syn_wait(&_G.jobs_syn);
+    while (!dlist_is_empty(&_G.jobs) || _G.nb_merging_fanouts
+    ||     !dlist_is_empty(&_G.merge_jobs) || _G.nb_busy_sessions
+    ||     !dlist_is_empty(&_G.corpus_jobs) || _G.nb_saving_corpora)
+    {
+        el_loop_timeout(10);
+    }
+    thr_syn_wipe(&_G.jobs_syn);
+    wordcount_mapped_files_wipe();
+    wordcount_stats_publish();
+
+    /* The pending queries to the upstream servers are aborted, which
+     * releases the canceled fan-outs */
+    for (int i = 0; i < _G.nb_upstreams; i++) {
+        ic_wipe(&_G.upstreams[i].ic);
+    }
+    p_delete(&_G.upstreams);
+    _G.nb_upstreams = 0;
+    while (!dlist_is_empty(&_G.fanouts)) {
+        wordcount_fanout_t *fanout;
+
+        fanout = dlist_first_entry(&_G.fanouts, wordcount_fanout_t, list);
+        wordcount_fanout_delete(&fanout);
+    }
+
     /* Clean-up the RPC implementations table */
     qm_wipe(ic_cbs, &_G.ic_impl);
+
+    qv_deep_wipe(&_G.file_roots, lstr_wipe);
+    qv_wipe(&_G.listeners);
+
+    /* Clean-up the cache of the results */
+    if (wordcount_cache_is_enabled(&_G.cache)) {
+        e_info("cache: %ju hits, %ju misses (%ju collisions), "
+               "%ju evictions",
+               (uintmax_t)_G.cache.stats.hits,
+               (uintmax_t)_G.cache.stats.misses,
+               (uintmax_t)_G.cache.stats.collisions,
+               (uintmax_t)_G.cache.stats.evictions);
+    }
+    wordcount_cache_wipe(&_G.cache);
+
+    /* Clean-up the remaining streaming counting sessions and paged
+     * results */
+    qm_deep_wipe(wordcount_sessions, &_G.sessions, IGNORE,
+                 wordcount_session_delete);
+    qm_deep_wipe(wordcount_paged_results, &_G.paged_results, IGNORE,
+                 wordcount_paged_result_delete);
+
+    /* Save the words added to the corpora since the last save */
+    wordcount_corpora_save();
+    qm_deep_wipe(wordcount_corpora, &_G.corpora, lstr_wipe,
+                 wordcount_corpus_delete);
+    lstr_wipe(&_G.corpus_dir);
+
+    /* No query uses the filter sets any more */
+    qm_deep_wipe(wordcount_filters, &_G.filters, IGNORE,
+                 wordcount_filter_delete);
     return 0;
 }
 
@@ -302,22 +3727,119 @@ static MODULE_BEGIN(wordcount_server)
     /* wordcount_base module is initialized before this module, and released
      * after this module */
     MODULE_DEPENDS_ON(wordcount_base);
+    MODULE_DEPENDS_ON(wordcount_count);
 
     /* Implement module method to react on termination signals */
     MODULE_IMPLEMENTS_INT(on_term, wordcount_server_on_term);
 MODULE_END()
 
-int main(int argc, char **argv)
+/* Listening sockets */
+
+/** Open a listening socket.
+ *
+ * \param[in] su    The address to listen on.
+ * \param[in] proto The protocol of the socket.
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int wordcount_server_listen(const sockunion_t *su, int proto)
 {
-    const char *arg0 = NEXTARG(argc, argv);
+    int fd;
 
-    /* Parse the arguments */
-    argc = parseopt(argc, argv, opts_g, 0);
-    if (argc != 0 || _G.opt_help || !_G.opt_cfg_path) {
-        makeusage(_G.opt_help ? 0 : -1, arg0, short_args_g,
-                  long_usage_g, opts_g);
+    fd = RETHROW(listenx(-1, su, 1, SOCK_STREAM, proto, O_NONBLOCK));
+    qv_append(&_G.listen_fds, fd);
+    return 0;
+}
+
+/** Listen on a unix socket.
+ *
+ * A stale socket file left by a previous run is removed first. The sockets
+ * of the abstract namespace have no file, and are released with the last
+ * file descriptor.
+ *
+ * \param[in] path The path of the socket, starting with `@` for a socket of
+ *                 the abstract namespace.
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int wordcount_server_listen_unix(lstr_t path)
+{
+    sockunion_t su;
+
+    if (wordcount_unix_sockunion(path, &su) < 0) {
+        e_error("invalid unix socket path `%pL`", &path);
+        return -1;
+    }
+
+    if (path.s[0] != '@') {
+        struct stat st;
+
+        /* Only remove a socket, never another kind of file */
+        if (lstat(path.s, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path.s);
+        }
+    }
+
+    if (wordcount_server_listen(&su, 0) < 0) {
+        e_error("cannot listen on unix socket `%pL`: %m", &path);
+        return -1;
+    }
+    if (path.s[0] != '@') {
+        qv_append(&_G.unix_socket_paths, lstr_dup(path));
+    }
+
+    e_info("listening on unix socket `%pL`", &path);
+    return 0;
+}
+
+/** Open the listening sockets of the server.
+ *
+ * \param[in] server_cfg The server configuration.
+ * \return -1 in case of error, 0 otherwise.
+ */
+static int
+wordcount_server_open_listeners(const wordcount__server_cfg__t *server_cfg)
+{
+    sockunion_t su;
+
+    /* Get the socket union from the address */
+    if (addr_info_str(&su, server_cfg->address.s, server_cfg->port,
+                      AF_UNSPEC) < 0)
+    {
+        e_error("unable to resolve address %pL:%d", &server_cfg->address,
+                server_cfg->port);
+        return -1;
+    }
+
+    /* Listen on the TCP address */
+    if (wordcount_server_listen(&su, IPPROTO_TCP) < 0) {
+        e_error("cannot bind on %pL:%d", &server_cfg->address,
+                server_cfg->port);
+        return -1;
+    }
+
+    /* And on the unix sockets, for the clients of the same host */
+    tab_for_each_entry(path, &server_cfg->unix_sockets) {
+        RETHROW(wordcount_server_listen_unix(path));
     }
+    return 0;
+}
+
+/** Remove the files of the unix sockets. */
+static void wordcount_server_remove_unix_sockets(void)
+{
+    tab_for_each_entry(path, &_G.unix_socket_paths) {
+        unlink(path.s);
+    }
+    qv_deep_wipe(&_G.unix_socket_paths, lstr_wipe);
+}
 
+/* Workers */
+
+/** Run the server in this process, until a termination signal.
+ *
+ * \return The exit status of the process.
+ */
+static int wordcount_worker_run(void)
+{
     /* Initialize the server */
     MODULE_REQUIRE(wordcount_server);
 
@@ -330,3 +3852,205 @@ int main(int argc, char **argv)
 
     return 0;
 }
+
+/** Get the signals handled by the main process. */
+static void wordcount_master_sigset(sigset_t *sigset)
+{
+    sigemptyset(sigset);
+    sigaddset(sigset, SIGTERM);
+    sigaddset(sigset, SIGINT);
+    sigaddset(sigset, SIGQUIT);
+    sigaddset(sigset, SIGCHLD);
+}
+
+/** Fork a worker process.
+ *
+ * \param[in] worker The worker.
+ * \param[in] id     The identifier of the worker.
+ */
+static void wordcount_master_spawn_worker(wordcount_worker_t *worker, int id)
+{
+    pid_t master_pid = getpid();
+    pid_t pid;
+
+    pid = fork();
+    if (pid < 0) {
+        e_error("cannot fork worker %d: %m", id);
+        worker->restart_time = time(NULL) + WORDCOUNT_WORKER_RESTART_DELAY;
+        return;
+    }
+
+    if (pid == 0) {
+        sigset_t sigset;
+
+        /* The worker handles the signals in its event loop, and stops with
+         * the main process */
+        wordcount_master_sigset(&sigset);
+        sigprocmask(SIG_UNBLOCK, &sigset, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master_pid) {
+            _exit(0);
+        }
+
+        /* The listening sockets are removed by the main process */
+        qv_deep_wipe(&_G.unix_socket_paths, lstr_wipe);
+
+        _G.worker_id = id;
+        _exit(wordcount_worker_run());
+    }
+
+    e_info("started worker %d, pid %d", id, pid);
+    worker->pid = pid;
+    worker->start_time = time(NULL);
+}
+
+/** Reap the dead workers, and schedule their restart.
+ *
+ * \param[in] workers    The workers.
+ * \param[in] nb_workers The number of workers.
+ */
+static void wordcount_master_reap_workers(wordcount_worker_t *workers,
+                                          int nb_workers)
+{
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < nb_workers; i++) {
+            wordcount_worker_t *worker = &workers[i];
+            time_t now = time(NULL);
+
+            if (worker->pid != pid) {
+                continue;
+            }
+            if (WIFSIGNALED(status)) {
+                e_error("worker %d (pid %d) killed by signal %d", i, pid,
+                        WTERMSIG(status));
+            } else {
+                e_error("worker %d (pid %d) exited with status %d", i, pid,
+                        WEXITSTATUS(status));
+            }
+            worker->pid = 0;
+            worker->restart_time = now;
+            if (now - worker->start_time < WORDCOUNT_WORKER_RESTART_DELAY) {
+                worker->restart_time += WORDCOUNT_WORKER_RESTART_DELAY;
+            }
+        }
+    }
+}
+
+/** Run the main process of the workers, until a termination signal.
+ *
+ * The main process forks the workers, restarts the ones that die, and stops
+ * them on termination. It handles its signals synchronously, and has no
+ * event loop, so that the workers are forked from a clean process.
+ *
+ * \param[in] nb_workers The number of workers.
+ * \return The exit status of the process.
+ */
+static int wordcount_master_run(int nb_workers)
+{
+    wordcount_worker_t *workers;
+    sigset_t sigset;
+
+    /* Share the statistics of the workers */
+    _G.workers_stats = mmap(NULL, nb_workers * sizeof(*_G.workers_stats),
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (_G.workers_stats == MAP_FAILED) {
+        e_error("cannot map the statistics of the workers: %m");
+        _G.workers_stats = NULL;
+        return 1;
+    }
+    _G.nb_workers = nb_workers;
+
+    wordcount_master_sigset(&sigset);
+    sigprocmask(SIG_BLOCK, &sigset, NULL);
+
+    e_info("starting %d workers", nb_workers);
+    workers = p_new(wordcount_worker_t, nb_workers);
+    for (int i = 0; i < nb_workers; i++) {
+        wordcount_master_spawn_worker(&workers[i], i);
+    }
+
+    /* Supervise the workers, the timeout lets the workers dead too early
+     * be restarted after their delay */
+    for (;;) {
+        struct timespec timeout = { .tv_sec = 1 };
+        int signo = sigtimedwait(&sigset, NULL, &timeout);
+
+        if (signo == SIGTERM || signo == SIGINT || signo == SIGQUIT) {
+            e_info("stopping %d workers", nb_workers);
+            break;
+        }
+
+        wordcount_master_reap_workers(workers, nb_workers);
+        for (int i = 0; i < nb_workers; i++) {
+            if (!workers[i].pid && workers[i].restart_time <= time(NULL)) {
+                wordcount_master_spawn_worker(&workers[i], i);
+            }
+        }
+    }
+
+    /* Stop the workers, and wait for them to finish their jobs */
+    for (int i = 0; i < nb_workers; i++) {
+        if (workers[i].pid) {
+            kill(workers[i].pid, SIGTERM);
+        }
+    }
+    for (int i = 0; i < nb_workers; i++) {
+        if (workers[i].pid) {
+            waitpid(workers[i].pid, NULL, 0);
+        }
+    }
+
+    tab_for_each_entry(fd, &_G.listen_fds) {
+        close(fd);
+    }
+    p_delete(&workers);
+    munmap(_G.workers_stats, nb_workers * sizeof(*_G.workers_stats));
+    _G.workers_stats = NULL;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    t_scope;
+    const char *arg0 = NEXTARG(argc, argv);
+    SB_1k(err);
+    wordcount__server_cfg__t *server_cfg;
+    int res;
+
+    /* Parse the arguments */
+    argc = parseopt(argc, argv, opts_g, 0);
+    if (argc != 0 || _G.opt_help || !_G.opt_cfg_path) {
+        makeusage(_G.opt_help ? 0 : -1, arg0, short_args_g,
+                  long_usage_g, opts_g);
+    }
+
+    /* Unpack the server configuration */
+    server_cfg = t_wordcount_unpack_server_cfg(_G.opt_cfg_path, &err);
+    if (!server_cfg) {
+        e_error("unable to unpack the server cfg `%s`: %pL",
+                _G.opt_cfg_path, &err);
+        return 1;
+    }
+    _G.server_cfg = server_cfg;
+
+    /* Open the listening sockets, before forking the workers */
+    qv_init(&_G.listen_fds);
+    qv_init(&_G.unix_socket_paths);
+    if (wordcount_server_open_listeners(server_cfg) < 0) {
+        return 1;
+    }
+
+    if (server_cfg->workers > 1) {
+        res = wordcount_master_run(server_cfg->workers);
+    } else {
+        res = wordcount_worker_run();
+    }
+
+    wordcount_server_remove_unix_sockets();
+    qv_wipe(&_G.listen_fds);
+    return res;
+}
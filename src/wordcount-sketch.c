@@ -0,0 +1,389 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include "wordcount-map.h"
+#include "wordcount-sketch.h"
+
+/* Number of rows of the Count-Min sketch: an estimate is off by more than
+ * the error bound with a probability under e^-4, about 2% */
+#define WORDCOUNT_SKETCH_DEPTH  4
+
+/* Minimum width of the rows and capacity of the summary, for tiny budgets */
+#define WORDCOUNT_SKETCH_MIN_WIDTH     64
+#define WORDCOUNT_SKETCH_MIN_CAPACITY  16
+
+/* Expected size of a monitored word, it is counted twice since the replaced
+ * words are only dropped when they take as much room as the live ones */
+#define WORDCOUNT_SKETCH_WORD_SIZE  16
+
+/* Memory used by each monitored word: the entry, its heap and index slots
+ * (the index is kept half empty), and its word */
+#define WORDCOUNT_SKETCH_ENTRY_SIZE                                         \
+    (sizeof(wordcount_sketch_entry_t) + 3 * sizeof(uint32_t)               \
+     + 2 * WORDCOUNT_SKETCH_WORD_SIZE)
+
+/** Get the highest power of 2 lower or equal to a value, at least 1. */
+static uint32_t wordcount_sketch_pow2_floor(uint64_t value)
+{
+    value = MAX(value, 1ULL);
+    value = MIN(value, 1ULL << 31);
+    return 1U << (63 - __builtin_clzll(value));
+}
+
+wordcount_sketch_t *wordcount_sketch_init(wordcount_sketch_t *sketch,
+                                          size_t size)
+{
+    uint32_t width;
+    size_t capacity;
+    uint32_t nb_slots;
+
+    p_clear(sketch, 1);
+
+    /* Half of the memory for the Count-Min sketch */
+    width = wordcount_sketch_pow2_floor(size / 2 / WORDCOUNT_SKETCH_DEPTH
+                                        / sizeof(uint32_t));
+    width = MAX(width, WORDCOUNT_SKETCH_MIN_WIDTH);
+    sketch->counters = p_new(uint32_t, WORDCOUNT_SKETCH_DEPTH * width);
+    sketch->width_mask = width - 1;
+
+    /* The other half for the SpaceSaving summary */
+    capacity = size / 2 / WORDCOUNT_SKETCH_ENTRY_SIZE;
+    capacity = MAX(capacity, (size_t)WORDCOUNT_SKETCH_MIN_CAPACITY);
+    sketch->capacity = MIN(capacity, (size_t)1 << 30);
+    sketch->entries = p_new_raw(wordcount_sketch_entry_t, sketch->capacity);
+    sketch->heap = p_new_raw(uint32_t, sketch->capacity);
+    nb_slots = 2 * wordcount_sketch_pow2_floor(2 * sketch->capacity - 1);
+    sketch->index = p_new(uint32_t, nb_slots);
+    sketch->index_mask = nb_slots - 1;
+    sb_init(&sketch->words);
+    return sketch;
+}
+
+void wordcount_sketch_wipe(wordcount_sketch_t *sketch)
+{
+    p_delete(&sketch->counters);
+    p_delete(&sketch->entries);
+    p_delete(&sketch->heap);
+    p_delete(&sketch->index);
+    sb_wipe(&sketch->words);
+}
+
+size_t wordcount_sketch_memory(const wordcount_sketch_t *sketch)
+{
+    return WORDCOUNT_SKETCH_DEPTH * (sketch->width_mask + 1)
+             * sizeof(uint32_t)
+         + sketch->capacity * (sizeof(wordcount_sketch_entry_t)
+                               + sizeof(uint32_t))
+         + (sketch->index_mask + 1) * sizeof(uint32_t)
+         + sketch->words.size;
+}
+
+size_t wordcount_sketch_size_for_content(size_t len, size_t max_size)
+{
+    /* A content has at most one distinct word every 2 bytes, the summary
+     * takes half of the memory */
+    size_t size = (len / 2 + 1) * 2 * WORDCOUNT_SKETCH_ENTRY_SIZE;
+
+    return MIN(size, max_size);
+}
+
+/* Count-Min sketch */
+
+/** Get the counter of a word in a row of the Count-Min sketch.
+ *
+ * The positions in the rows are derived from the hash of the word by double
+ * hashing, which is as good as independent hash functions for the error
+ * bound of the sketch.
+ */
+static uint32_t *wordcount_sketch_counter(const wordcount_sketch_t *sketch,
+                                          uint32_t hash, int row)
+{
+    uint32_t step = ((hash * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+    uint32_t pos = (hash + row * step) & sketch->width_mask;
+
+    return &sketch->counters[row * (sketch->width_mask + 1) + pos];
+}
+
+/** Get the estimated occurrences of a word in the Count-Min sketch. */
+static uint32_t wordcount_sketch_estimate(const wordcount_sketch_t *sketch,
+                                          uint32_t hash)
+{
+    uint32_t estimate = UINT32_MAX;
+
+    for (int row = 0; row < WORDCOUNT_SKETCH_DEPTH; row++) {
+        estimate = MIN(estimate, *wordcount_sketch_counter(sketch, hash, row));
+    }
+    return estimate;
+}
+
+/** Count one occurrence of a word in the Count-Min sketch.
+ *
+ * With conservative update, only the counters of the word that are lower
+ * than its new estimate are raised, the others already count it.
+ */
+static void wordcount_sketch_cms_add(wordcount_sketch_t *sketch,
+                                     uint32_t hash)
+{
+    uint32_t estimate = wordcount_sketch_estimate(sketch, hash) + 1;
+
+    for (int row = 0; row < WORDCOUNT_SKETCH_DEPTH; row++) {
+        uint32_t *counter = wordcount_sketch_counter(sketch, hash, row);
+
+        *counter = MAX(*counter, estimate);
+    }
+}
+
+/* SpaceSaving summary */
+
+static void wordcount_sketch_heap_swap(wordcount_sketch_t *sketch,
+                                       uint32_t a, uint32_t b)
+{
+    SWAP(uint32_t, sketch->heap[a], sketch->heap[b]);
+    sketch->entries[sketch->heap[a]].heap_pos = a;
+    sketch->entries[sketch->heap[b]].heap_pos = b;
+}
+
+static uint32_t wordcount_sketch_heap_count(const wordcount_sketch_t *sketch,
+                                            uint32_t pos)
+{
+    return sketch->entries[sketch->heap[pos]].count;
+}
+
+/** Move an entry of the heap toward the root while it has fewer
+ * occurrences than its parent. */
+static void wordcount_sketch_sift_up(wordcount_sketch_t *sketch,
+                                     uint32_t pos)
+{
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+
+        if (wordcount_sketch_heap_count(sketch, parent)
+        <=  wordcount_sketch_heap_count(sketch, pos))
+        {
+            break;
+        }
+        wordcount_sketch_heap_swap(sketch, parent, pos);
+        pos = parent;
+    }
+}
+
+/** Move an entry of the heap toward the leaves while it has more
+ * occurrences than one of its children. */
+static void wordcount_sketch_sift_down(wordcount_sketch_t *sketch,
+                                       uint32_t pos)
+{
+    for (;;) {
+        uint32_t child = 2 * pos + 1;
+
+        if (child >= sketch->nb_entries) {
+            break;
+        }
+        if (child + 1 < sketch->nb_entries
+        &&  wordcount_sketch_heap_count(sketch, child + 1)
+        <   wordcount_sketch_heap_count(sketch, child))
+        {
+            child++;
+        }
+        if (wordcount_sketch_heap_count(sketch, pos)
+        <=  wordcount_sketch_heap_count(sketch, child))
+        {
+            break;
+        }
+        wordcount_sketch_heap_swap(sketch, pos, child);
+        pos = child;
+    }
+}
+
+/** Look for a monitored word.
+ *
+ * \param[in]  sketch The sketch.
+ * \param[in]  word   The word.
+ * \param[in]  len    The length of the word.
+ * \param[in]  hash   The hash of the word.
+ * \param[out] pos    The slot of the word in the index, or the empty slot
+ *                    where to put it.
+ * \return The identifier of the entry of the word, -1 if it is not
+ *         monitored.
+ */
+static int64_t wordcount_sketch_find(const wordcount_sketch_t *sketch,
+                                     const char *word, uint32_t len,
+                                     uint32_t hash, uint32_t *pos)
+{
+    for (*pos = hash & sketch->index_mask;;
+         *pos = (*pos + 1) & sketch->index_mask)
+    {
+        uint32_t slot = sketch->index[*pos];
+        const wordcount_sketch_entry_t *entry;
+
+        if (!slot) {
+            return -1;
+        }
+        entry = &sketch->entries[slot - 1];
+        if (entry->hash == hash && entry->word_len == len
+        &&  wordcount_word_iequal(sketch->words.data + entry->word_offset,
+                                  word, len))
+        {
+            return slot - 1;
+        }
+    }
+}
+
+/** Remove the slot of an entry from the index.
+ *
+ * The next slots of the same cluster are shifted backward when their word
+ * would no longer be found, so that no tombstone is needed.
+ */
+static void wordcount_sketch_index_remove(wordcount_sketch_t *sketch,
+                                          uint32_t pos)
+{
+    uint32_t mask = sketch->index_mask;
+    uint32_t next = pos;
+
+    for (;;) {
+        uint32_t home;
+
+        next = (next + 1) & mask;
+        if (!sketch->index[next]) {
+            break;
+        }
+
+        /* The slot can fill the hole if its home is not between the hole
+         * and it, cyclically */
+        home = sketch->entries[sketch->index[next] - 1].hash & mask;
+        if (((next - home) & mask) >= ((next - pos) & mask)) {
+            sketch->index[pos] = sketch->index[next];
+            pos = next;
+        }
+    }
+    sketch->index[pos] = 0;
+}
+
+/** Drop the replaced words from the words of a sketch. */
+static void wordcount_sketch_compact_words(wordcount_sketch_t *sketch)
+{
+    sb_t words;
+
+    sb_init(&words);
+    sb_grow(&words, sketch->live_words_size);
+    for (uint32_t i = 0; i < sketch->nb_entries; i++) {
+        wordcount_sketch_entry_t *entry = &sketch->entries[i];
+        uint32_t offset = words.len;
+
+        sb_add(&words, sketch->words.data + entry->word_offset,
+               entry->word_len);
+        entry->word_offset = offset;
+    }
+    sb_wipe(&sketch->words);
+    sketch->words = words;
+}
+
+/** Set the word of an entry, copied at the end of the words of a sketch. */
+static void wordcount_sketch_set_word(wordcount_sketch_t *sketch,
+                                      wordcount_sketch_entry_t *entry,
+                                      const char *word, uint32_t len)
+{
+    if (sketch->words.len >= 2 * sketch->live_words_size
+                           + WORDCOUNT_SKETCH_WORD_SIZE * 64)
+    {
+        wordcount_sketch_compact_words(sketch);
+    }
+    entry->word_offset = sketch->words.len;
+    entry->word_len = len;
+    sb_add(&sketch->words, word, len);
+    sketch->live_words_size += len;
+}
+
+void wordcount_sketch_add(wordcount_sketch_t *sketch, const char *word,
+                          uint32_t len, uint32_t hash)
+{
+    wordcount_sketch_entry_t *entry;
+    int64_t id;
+    uint32_t pos;
+
+    sketch->nb_words++;
+    wordcount_sketch_cms_add(sketch, hash);
+
+    id = wordcount_sketch_find(sketch, word, len, hash, &pos);
+    if (id >= 0) {
+        /* Monitored word */
+        entry = &sketch->entries[id];
+        entry->count++;
+        wordcount_sketch_sift_down(sketch, entry->heap_pos);
+        return;
+    }
+
+    if (sketch->nb_entries < sketch->capacity) {
+        /* Room left in the summary, monitor the word */
+        id = sketch->nb_entries++;
+        entry = &sketch->entries[id];
+        entry->hash = hash;
+        entry->count = 1;
+        entry->error = 0;
+        entry->heap_pos = id;
+        sketch->heap[id] = id;
+        wordcount_sketch_set_word(sketch, entry, word, len);
+        sketch->index[pos] = id + 1;
+        wordcount_sketch_sift_up(sketch, id);
+        return;
+    }
+
+    /* Replace the word with the fewest occurrences. Its occurrences may be
+     * the ones of the new word, they become the error of the new word. */
+    id = sketch->heap[0];
+    entry = &sketch->entries[id];
+    wordcount_sketch_find(sketch, sketch->words.data + entry->word_offset,
+                          entry->word_len, entry->hash, &pos);
+    wordcount_sketch_index_remove(sketch, pos);
+    sketch->live_words_size -= entry->word_len;
+
+    entry->hash = hash;
+    entry->error = entry->count;
+    entry->count++;
+    wordcount_sketch_set_word(sketch, entry, word, len);
+
+    /* The removal may have moved the empty slot of the new word */
+    wordcount_sketch_find(sketch, word, len, hash, &pos);
+    sketch->index[pos] = id + 1;
+    wordcount_sketch_sift_down(sketch, 0);
+}
+
+int wordcount_sketch_get_word_occurrences(const wordcount_sketch_t *sketch,
+                                          unsigned min_occurrences,
+                                          wordcount__word_occurrences__t *tab)
+{
+    int len = 0;
+
+    for (uint32_t i = 0; i < sketch->nb_entries; i++) {
+        const wordcount_sketch_entry_t *entry = &sketch->entries[i];
+        uint32_t estimate = MIN(entry->count,
+                                wordcount_sketch_estimate(sketch,
+                                                          entry->hash));
+
+        /* The true occurrences are at least the count minus the error */
+        if (estimate < min_occurrences) {
+            continue;
+        }
+        tab[len++] = (wordcount__word_occurrences__t){
+            .word = LSTR_PTR_V(sketch->words.data + entry->word_offset,
+                               entry->word_len),
+            .occurrences = estimate,
+            .max_error = OPT(estimate - (entry->count - entry->error)),
+        };
+    }
+    return len;
+}
@@ -0,0 +1,155 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_SKETCH_H
+#define IS_WORDCOUNT_SKETCH_H
+
+#include <lib-common/core.h>
+
+#include "wordcount.iop.h"
+
+/** Word monitored by the SpaceSaving summary of a sketch. */
+typedef struct wordcount_sketch_entry_t {
+    /** The hash of the word, see wordcount_hash_word(). */
+    uint32_t hash;
+
+    /** The position of the word in the words of the sketch. */
+    uint32_t word_offset;
+    uint32_t word_len;
+
+    /** The counted occurrences of the word, and the maximum number of them
+     * that belong to the words it replaced. */
+    uint32_t count;
+    uint32_t error;
+
+    /** The position of the entry in the heap of the summary. */
+    uint32_t heap_pos;
+} wordcount_sketch_entry_t;
+
+/** Approximate counter of the words of a content in a fixed memory.
+ *
+ * Half of the memory is a Count-Min sketch estimating the occurrences of any
+ * word, the other half is a SpaceSaving summary of the words with the most
+ * occurrences.
+ *
+ * The Count-Min sketch has WORDCOUNT_SKETCH_DEPTH rows of counters, a word
+ * incrementing one counter per row, and its estimate is the lowest of its
+ * counters. With conservative update, only the counters equal to that
+ * estimate are incremented. It never underestimates, and overestimates by
+ * more than e / width of the number of counted words with a probability
+ * under e^-depth.
+ *
+ * The SpaceSaving summary monitors a fixed number of words. A word that is
+ * not monitored replaces the word with the fewest occurrences, and inherits
+ * them as its error. Every word with more occurrences than the total divided
+ * by the capacity of the summary is monitored, and the count of a monitored
+ * word is at most error more than its occurrences.
+ *
+ * The words are copied in the sketch, so the counted content does not need
+ * to outlive it.
+ */
+typedef struct wordcount_sketch_t {
+    /** The counters of the Count-Min sketch, row after row, the width of a
+     * row is a power of 2. */
+    uint32_t *counters;
+    uint32_t width_mask;
+
+    /** The monitored words of the SpaceSaving summary. */
+    wordcount_sketch_entry_t *entries;
+    uint32_t nb_entries;
+    uint32_t capacity;
+
+    /** The identifiers of the entries in a min-heap on their counts, so the
+     * entry with the fewest occurrences is the first one. */
+    uint32_t *heap;
+
+    /** The open-addressing index of the entries by word, with linear
+     * probing. Its slots are the identifier of the entry plus one, 0 for an
+     * empty slot, its size is a power of 2. */
+    uint32_t *index;
+    uint32_t index_mask;
+
+    /** The monitored words, one after the other, and the size of the ones
+     * still monitored. The replaced words are dropped when they take as
+     * much room as the monitored ones. */
+    sb_t words;
+    size_t live_words_size;
+
+    /** The number of words counted. */
+    uint64_t nb_words;
+} wordcount_sketch_t;
+
+/** Initialize a sketch for a memory budget.
+ *
+ * \param[in] sketch The sketch.
+ * \param[in] size   The memory budget of the sketch, in bytes. The words
+ *                   are expected to be short, long words make the sketch
+ *                   use a bit more memory.
+ * \return The sketch.
+ */
+wordcount_sketch_t *wordcount_sketch_init(wordcount_sketch_t *sketch,
+                                          size_t size);
+void wordcount_sketch_wipe(wordcount_sketch_t *sketch);
+
+/** Get the memory used by a sketch. */
+size_t wordcount_sketch_memory(const wordcount_sketch_t *sketch);
+
+/** Get the memory budget of a sketch counting a content of a given size.
+ *
+ * A small content does not have enough distinct words to fill a big
+ * sketch, whose allocation and clearing would then cost more than the
+ * counting itself.
+ *
+ * \param[in] len      The size of the content, or its maximum size.
+ * \param[in] max_size The memory budget of the counting.
+ * \return The memory budget of the sketch, at most \p max_size.
+ */
+size_t wordcount_sketch_size_for_content(size_t len, size_t max_size);
+
+/** Count one occurrence of a word in a sketch.
+ *
+ * \param[in] sketch The sketch.
+ * \param[in] word   The word, it is not referenced after the call.
+ * \param[in] len    The length of the word.
+ * \param[in] hash   The hash of the word, see wordcount_hash_word().
+ */
+void wordcount_sketch_add(wordcount_sketch_t *sketch, const char *word,
+                          uint32_t len, uint32_t hash);
+
+/** Get the words with the most occurrences of a sketch.
+ *
+ * The occurrences of each word are the lowest of its estimates by the
+ * Count-Min sketch and by the SpaceSaving summary. Both never underestimate,
+ * and the summary guarantees at least its count minus its error, so the
+ * occurrences are exact up to max_error. A word which is not returned has at
+ * most the occurrences of the least counted word of the summary.
+ *
+ * \param[in]  sketch          The sketch.
+ * \param[in]  min_occurrences The minimum estimated occurrences of the
+ *                             words to get.
+ * \param[out] tab             The word occurrences, not sorted. It must have
+ *                             room for the capacity of the sketch. The words
+ *                             point into the sketch, they are neither
+ *                             lower-cased nor copied.
+ * \return The number of word occurrences.
+ */
+int wordcount_sketch_get_word_occurrences(const wordcount_sketch_t *sketch,
+                                          unsigned min_occurrences,
+                                          wordcount__word_occurrences__t *tab);
+
+#endif /* IS_WORDCOUNT_SKETCH_H */
@@ -0,0 +1,90 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#include <math.h>
+
+#include "wordcount-stats.h"
+
+/** Get the highest value of a bucket of a histogram. */
+static uint64_t wordcount_histogram_bucket_max(int bucket)
+{
+    int exp;
+    uint64_t sub;
+
+    if (bucket < WORDCOUNT_HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    /* Reverse of wordcount_histogram_bucket() */
+    exp = bucket / WORDCOUNT_HISTOGRAM_SUB_BUCKETS
+        + WORDCOUNT_HISTOGRAM_SUB_BITS - 1;
+    sub = bucket % WORDCOUNT_HISTOGRAM_SUB_BUCKETS;
+    return ((WORDCOUNT_HISTOGRAM_SUB_BUCKETS + sub + 1)
+            << (exp - WORDCOUNT_HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void wordcount_histogram_merge(wordcount_histogram_t *dst,
+                               const wordcount_histogram_t *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    dst->max = MAX(dst->max, src->max);
+    for (int i = 0; i < WORDCOUNT_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+uint64_t wordcount_histogram_percentile(const wordcount_histogram_t *histogram,
+                                        double percentile)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    if (!histogram->count) {
+        return 0;
+    }
+
+    /* Find the bucket of the value of this rank */
+    rank = MAX(ceil(histogram->count * percentile / 100.), 1.);
+    for (int i = 0; i < WORDCOUNT_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            return MIN(wordcount_histogram_bucket_max(i), histogram->max);
+        }
+    }
+    return histogram->max;
+}
+
+void wordcount_histogram_get_distribution(
+    const wordcount_histogram_t *histogram, uint64_t divisor,
+    wordcount__distribution__t *distribution)
+{
+    p_clear(distribution, 1);
+    distribution->count = histogram->count;
+    if (!histogram->count) {
+        return;
+    }
+    distribution->mean = histogram->sum / histogram->count / divisor;
+    distribution->p50 = wordcount_histogram_percentile(histogram, 50)
+                      / divisor;
+    distribution->p99 = wordcount_histogram_percentile(histogram, 99)
+                      / divisor;
+    distribution->p999 = wordcount_histogram_percentile(histogram, 99.9)
+                       / divisor;
+    distribution->max = histogram->max / divisor;
+}
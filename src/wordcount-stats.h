@@ -0,0 +1,125 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_STATS_H
+#define IS_WORDCOUNT_STATS_H
+
+#include <lib-common/core.h>
+
+#include "wordcount.iop.h"
+
+/* A power of two range of values is split in 2^4 buckets of the same width,
+ * so the values are known with a relative error under 1/16. */
+#define WORDCOUNT_HISTOGRAM_SUB_BITS     4
+#define WORDCOUNT_HISTOGRAM_SUB_BUCKETS  (1 << WORDCOUNT_HISTOGRAM_SUB_BITS)
+
+/* The values under WORDCOUNT_HISTOGRAM_SUB_BUCKETS have a bucket each, then
+ * each power of two up to 2^63 has WORDCOUNT_HISTOGRAM_SUB_BUCKETS buckets */
+#define WORDCOUNT_HISTOGRAM_BUCKETS  \
+    ((64 - WORDCOUNT_HISTOGRAM_SUB_BITS + 1) * WORDCOUNT_HISTOGRAM_SUB_BUCKETS)
+
+/** Log-linear histogram of the values of a measure.
+ *
+ * Like an HDR histogram, the buckets are linear inside each power of two,
+ * so the percentiles are known with a bounded relative error over the whole
+ * range of the values, and recording a value is a few instructions without
+ * any allocation.
+ */
+typedef struct wordcount_histogram_t {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[WORDCOUNT_HISTOGRAM_BUCKETS];
+} wordcount_histogram_t;
+
+/** Get the bucket of a value in a histogram. */
+static inline int wordcount_histogram_bucket(uint64_t value)
+{
+    int exp;
+
+    if (value < WORDCOUNT_HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    /* The position of the highest bit gives the power of two, the next bits
+     * give the bucket inside it */
+    exp = 63 - __builtin_clzll(value);
+    return (exp - WORDCOUNT_HISTOGRAM_SUB_BITS + 1)
+         * WORDCOUNT_HISTOGRAM_SUB_BUCKETS
+         + ((value >> (exp - WORDCOUNT_HISTOGRAM_SUB_BITS))
+            & (WORDCOUNT_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/** Record a value in a histogram.
+ *
+ * \param[in] histogram The histogram.
+ * \param[in] value     The value to record.
+ */
+static inline void wordcount_histogram_record(wordcount_histogram_t *histogram,
+                                              uint64_t value)
+{
+    histogram->count++;
+    histogram->sum += value;
+    histogram->max = MAX(histogram->max, value);
+    histogram->buckets[wordcount_histogram_bucket(value)]++;
+}
+
+/** Add the values recorded in a histogram to another one.
+ *
+ * \param[in,out] dst The histogram to add the values to.
+ * \param[in]     src The histogram of the added values.
+ */
+void wordcount_histogram_merge(wordcount_histogram_t *dst,
+                               const wordcount_histogram_t *src);
+
+/** Get a percentile of the values recorded in a histogram.
+ *
+ * \param[in] histogram  The histogram.
+ * \param[in] percentile The percentile, between 0 and 100.
+ * \return The highest value of the bucket of the percentile, so that at least
+ *         \p percentile percents of the values are lower or equal to it, 0
+ *         if no value has been recorded.
+ */
+uint64_t wordcount_histogram_percentile(const wordcount_histogram_t *histogram,
+                                        double percentile);
+
+/** Summarize a histogram in an IOP distribution.
+ *
+ * \param[in]  histogram    The histogram.
+ * \param[in]  divisor      The divisor of the values, for example 1000 to
+ *                          get microseconds from nanoseconds.
+ * \param[out] distribution The summary of the histogram.
+ */
+void wordcount_histogram_get_distribution(
+    const wordcount_histogram_t *histogram, uint64_t divisor,
+    wordcount__distribution__t *distribution);
+
+/** Get the time of the monotonic clock, in nanoseconds.
+ *
+ * It is cheap enough (tens of nanoseconds, without syscall) to measure each
+ * stage of each query.
+ */
+static inline int64_t wordcount_now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif /* IS_WORDCOUNT_STATS_H */
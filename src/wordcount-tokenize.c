@@ -0,0 +1,373 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "wordcount-tokenize.h"
+
+/* The content is classified by blocks of this size, so that the masks of a
+ * block stay in the L1 cache while the words are extracted from them. */
+#define WORDCOUNT_TOKENIZE_BLOCK  4096
+
+/** Classify the bytes of a block of content.
+ *
+ * \param[in]  p     The block.
+ * \param[in]  len   The length of the block, at most
+ *                   WORDCOUNT_TOKENIZE_BLOCK.
+ * \param[out] masks The masks of the block, the bit i of masks[j] is set if
+ *                   the byte 64 * j + i is a word character. The bits after
+ *                   the end of the block are cleared.
+ */
+typedef void (wordcount_classify_f)(const char *p, int len, uint64_t *masks);
+
+static struct {
+    /* The implementation in use */
+    wordcount_tokenize_impl_t impl;
+    wordcount_classify_f *classify;
+} wordcount_tokenize_g;
+#define _G wordcount_tokenize_g
+
+/* Scalar implementation */
+
+static void wordcount_classify_scalar(const char *p, int len,
+                                      uint64_t *masks)
+{
+    for (int i = 0; i < len; i += 64) {
+        int block_len = MIN(64, len - i);
+        uint64_t mask = 0;
+
+        for (int j = 0; j < block_len; j++) {
+            if (ctype_desc_contains(&ctype_iswordpart,
+                                    (unsigned char)p[i + j]))
+            {
+                mask |= 1ULL << j;
+            }
+        }
+        masks[i / 64] = mask;
+    }
+}
+
+#if defined(__x86_64__)
+
+/* SSE4.2 implementation */
+
+/** Classify 16 bytes with the string comparison instruction of SSE4.2.
+ *
+ * The word characters are described by the ranges 0-9, A-Z, _-_ and a-z.
+ */
+__attribute__((target("sse4.2")))
+static inline uint64_t wordcount_classify16_sse42(const char *p)
+{
+    const __m128i ranges = _mm_setr_epi8('0', '9', 'A', 'Z', '_', '_',
+                                         'a', 'z', 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i data = _mm_loadu_si128((const __m128i *)p);
+    __m128i mask;
+
+    mask = _mm_cmpestrm(ranges, 8, data, 16,
+                        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_BIT_MASK);
+    return (uint16_t)_mm_cvtsi128_si32(mask);
+}
+
+__attribute__((target("sse4.2")))
+static void wordcount_classify_sse42(const char *p, int len,
+                                     uint64_t *masks)
+{
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        masks[i / 64] = wordcount_classify16_sse42(p + i)
+                      | wordcount_classify16_sse42(p + i + 16) << 16
+                      | wordcount_classify16_sse42(p + i + 32) << 32
+                      | wordcount_classify16_sse42(p + i + 48) << 48;
+    }
+    if (i < len) {
+        /* Do not read after the end of the content */
+        wordcount_classify_scalar(p + i, len - i, &masks[i / 64]);
+    }
+}
+
+/* AVX2 implementation */
+
+/** Classify 32 bytes with AVX2.
+ *
+ * A byte is a word character if it is a digit, a letter once lower-cased,
+ * or '_'. The ranges are checked with signed comparisons, after the range is
+ * shifted to start at -128.
+ */
+__attribute__((target("avx2")))
+static inline uint64_t wordcount_classify32_avx2(const char *p)
+{
+    __m256i data = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lower = _mm256_or_si256(data, _mm256_set1_epi8(0x20));
+    __m256i alpha;
+    __m256i digit;
+    __m256i underscore;
+
+    alpha = _mm256_add_epi8(lower, _mm256_set1_epi8((char)(0x80 - 'a')));
+    alpha = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)), alpha);
+    digit = _mm256_add_epi8(data, _mm256_set1_epi8((char)(0x80 - '0')));
+    digit = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 10)), digit);
+    underscore = _mm256_cmpeq_epi8(data, _mm256_set1_epi8('_'));
+
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_or_si256(alpha, digit), underscore));
+}
+
+__attribute__((target("avx2")))
+static void wordcount_classify_avx2(const char *p, int len, uint64_t *masks)
+{
+    int i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        masks[i / 64] = wordcount_classify32_avx2(p + i)
+                      | wordcount_classify32_avx2(p + i + 32) << 32;
+    }
+    if (i < len) {
+        /* Do not read after the end of the content */
+        wordcount_classify_scalar(p + i, len - i, &masks[i / 64]);
+    }
+}
+
+#endif /* __x86_64__ */
+
+/* UTF-8 */
+
+/** Set the bits of the non-ASCII bytes of a block in its masks.
+ *
+ * The non-ASCII bytes of a folded UTF-8 content are all parts of word
+ * characters, see wordcount_utf8_fold().
+ */
+static void wordcount_classify_non_ascii(const char *p, int len,
+                                         uint64_t *masks)
+{
+    int i = 0;
+
+#if defined(__x86_64__)
+    /* SSE2 is always available on x86_64 */
+    for (; i + 64 <= len; i += 64) {
+        uint64_t mask = 0;
+
+        for (int j = 0; j < 64; j += 16) {
+            __m128i data = _mm_loadu_si128((const __m128i *)(p + i + j));
+
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(data) << j;
+        }
+        masks[i / 64] |= mask;
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (p[i] & 0x80) {
+            masks[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+}
+
+/* Tokenizer */
+
+/** Find the next words of a content, see wordcount_tokenize().
+ *
+ * \param[in] utf8 Whether the non-ASCII bytes are word characters too.
+ */
+static ALWAYS_INLINE int
+wordcount_tokenize_content(const char **pos, const char *end,
+                           wordcount_token_t *tokens, int max_tokens,
+                           bool utf8)
+{
+    uint64_t masks[WORDCOUNT_TOKENIZE_BLOCK / 64];
+    const char *p = *pos;
+    const char *word_start = NULL;
+    uint64_t in_word = 0;
+    int nb_tokens = 0;
+
+    assert (max_tokens > 0);
+
+    while (p < end) {
+        int block_len = MIN(end - p, WORDCOUNT_TOKENIZE_BLOCK);
+
+        (*_G.classify)(p, block_len, masks);
+        if (utf8) {
+            wordcount_classify_non_ascii(p, block_len, masks);
+        }
+
+        for (int i = 0; i < DIV_ROUND_UP(block_len, 64); i++) {
+            const char *base = p + 64 * i;
+            uint64_t mask = masks[i];
+
+            /* The bits set in transitions are the starts and the ends of
+             * the words, the previous bit of the first one is the last bit
+             * of the previous mask. */
+            uint64_t transitions = mask ^ ((mask << 1) | in_word);
+
+            in_word = mask >> 63;
+
+            while (transitions) {
+                const char *q = base + bsf64(transitions);
+
+                transitions &= transitions - 1;
+                if (!word_start) {
+                    word_start = q;
+                    continue;
+                }
+
+                tokens[nb_tokens].s = word_start;
+                tokens[nb_tokens].len = q - word_start;
+                tokens[nb_tokens].hash = wordcount_hash_word(word_start,
+                                                             q - word_start);
+                word_start = NULL;
+                if (++nb_tokens == max_tokens) {
+                    *pos = q;
+                    return nb_tokens;
+                }
+            }
+        }
+
+        p += block_len;
+    }
+
+    /* The last word ends with the content */
+    if (word_start) {
+        tokens[nb_tokens].s = word_start;
+        tokens[nb_tokens].len = end - word_start;
+        tokens[nb_tokens].hash = wordcount_hash_word(word_start,
+                                                     end - word_start);
+        nb_tokens++;
+    }
+
+    *pos = end;
+    return nb_tokens;
+}
+
+int wordcount_tokenize(const char **pos, const char *end,
+                       wordcount_token_t *tokens, int max_tokens)
+{
+    return wordcount_tokenize_content(pos, end, tokens, max_tokens, false);
+}
+
+int wordcount_tokenize_utf8(const char **pos, const char *end,
+                            wordcount_token_t *tokens, int max_tokens)
+{
+    return wordcount_tokenize_content(pos, end, tokens, max_tokens, true);
+}
+
+/* Implementation selection */
+
+/** Check that an implementation classifies the bytes like
+ * `ctype_iswordpart`.
+ *
+ * \param[in] classify The classification function of the implementation.
+ * \return -1 if the classification differs for a byte, 0 otherwise.
+ */
+static int wordcount_classify_check(wordcount_classify_f *classify)
+{
+    char bytes[256];
+    uint64_t masks[4];
+
+    for (int c = 0; c < 256; c++) {
+        bytes[c] = c;
+    }
+    (*classify)(bytes, countof(bytes), masks);
+
+    for (int c = 0; c < 256; c++) {
+        bool is_word = (masks[c / 64] >> (c % 64)) & 1;
+
+        if (is_word != ctype_desc_contains(&ctype_iswordpart, c)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int wordcount_tokenize_set_impl(wordcount_tokenize_impl_t impl)
+{
+    wordcount_classify_f *classify = NULL;
+
+    switch (impl) {
+      case WORDCOUNT_TOKENIZE_SCALAR:
+        classify = &wordcount_classify_scalar;
+        break;
+
+#if defined(__x86_64__)
+      case WORDCOUNT_TOKENIZE_SSE42:
+        if (__builtin_cpu_supports("sse4.2")) {
+            classify = &wordcount_classify_sse42;
+        }
+        break;
+
+      case WORDCOUNT_TOKENIZE_AVX2:
+        if (__builtin_cpu_supports("avx2")) {
+            classify = &wordcount_classify_avx2;
+        }
+        break;
+#endif
+
+      default:
+        break;
+    }
+
+    if (!classify) {
+        return -1;
+    }
+
+    /* The SIMD implementations hardcode the word characters, make sure they
+     * did not diverge from `ctype_iswordpart` */
+    if (wordcount_classify_check(classify) < 0) {
+        e_warning("tokenizer implementation %d does not match "
+                  "ctype_iswordpart, ignoring it", impl);
+        return -1;
+    }
+
+    _G.impl = impl;
+    _G.classify = classify;
+    return 0;
+}
+
+const char *wordcount_tokenize_impl_name(void)
+{
+    switch (_G.impl) {
+      case WORDCOUNT_TOKENIZE_SCALAR: return "scalar";
+      case WORDCOUNT_TOKENIZE_SSE42:  return "sse4.2";
+      case WORDCOUNT_TOKENIZE_AVX2:   return "avx2";
+    }
+    return "unknown";
+}
+
+/* Module */
+
+static int wordcount_tokenize_initialize(void *nullable arg)
+{
+    /* Select the best implementation supported by the CPU */
+    if (wordcount_tokenize_set_impl(WORDCOUNT_TOKENIZE_AVX2) < 0
+    &&  wordcount_tokenize_set_impl(WORDCOUNT_TOKENIZE_SSE42) < 0)
+    {
+        wordcount_tokenize_set_impl(WORDCOUNT_TOKENIZE_SCALAR);
+    }
+
+    e_trace(1, "using %s tokenizer", wordcount_tokenize_impl_name());
+    return 0;
+}
+
+static int wordcount_tokenize_shutdown(void)
+{
+    return 0;
+}
+
+MODULE_BEGIN(wordcount_tokenize)
+MODULE_END()
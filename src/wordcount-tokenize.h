@@ -0,0 +1,147 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_TOKENIZE_H
+#define IS_WORDCOUNT_TOKENIZE_H
+
+#include <lib-common/core.h>
+
+/** Word found by the tokenizer. */
+typedef struct wordcount_token_t {
+    /** The word, it points into the tokenized content. */
+    const char *s;
+    uint32_t len;
+
+    /** The case-insensitive hash of the word, see wordcount_hash_word(). */
+    uint32_t hash;
+} wordcount_token_t;
+
+/** Implementations of the tokenizer. */
+typedef enum wordcount_tokenize_impl_t {
+    WORDCOUNT_TOKENIZE_SCALAR,
+    WORDCOUNT_TOKENIZE_SSE42,
+    WORDCOUNT_TOKENIZE_AVX2,
+} wordcount_tokenize_impl_t;
+
+/** Lower-case the ASCII upper-case letters of 8 bytes at once.
+ *
+ * The bytes must be ASCII, which is the case of the word characters, or be
+ * parts of complete UTF-8 characters, which are left as is: the carries of
+ * the additions only go from a lead byte to the continuation byte after it,
+ * whose result does not change.
+ */
+static ALWAYS_INLINE uint64_t wordcount_ascii_tolower8(uint64_t x)
+{
+    /* The high bit of a byte of t1 is set if the byte is >= 'A', and the
+     * high bit of a byte of t2 is set if the byte is > 'Z'. */
+    uint64_t t1 = x + 0x3f3f3f3f3f3f3f3fULL;
+    uint64_t t2 = x + 0x2525252525252525ULL;
+    uint64_t upper = t1 & ~t2 & 0x8080808080808080ULL;
+
+    /* 0x80 >> 2 is 0x20, the difference between the two cases */
+    return x | (upper >> 2);
+}
+
+/** Compute the case-insensitive hash of a word.
+ *
+ * The word is lower-cased and hashed 8 bytes at a time. This is the hash
+ * computed by the tokenizer for each word, and the hash function of the maps
+ * of words, so the tokenized words can be put in the maps without hashing
+ * them again.
+ *
+ * \param[in] s   The word, made of ASCII characters or of complete UTF-8
+ *                characters.
+ * \param[in] len The length of the word.
+ * \return The hash of the lower-cased word.
+ */
+static inline uint32_t wordcount_hash_word(const char *s, uint32_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL;
+
+    while (len >= 8) {
+        uint64_t w;
+
+        memcpy(&w, s, 8);
+        h = (h ^ wordcount_ascii_tolower8(w)) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+        s += 8;
+        len -= 8;
+    }
+    if (len) {
+        uint64_t w = 0;
+
+        memcpy(&w, s, len);
+        h = (h ^ wordcount_ascii_tolower8(w)) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    return h ^ (h >> 32);
+}
+
+/** Find the next words of a content.
+ *
+ * The words are the longest spans of characters of `ctype_iswordpart`. The
+ * content is classified 64 bytes at a time with the best SIMD implementation
+ * supported by the CPU, and each word is hashed as soon as it is found.
+ *
+ * A word that ends at \p end is returned as a complete word.
+ *
+ * \param[in,out] pos        The position where to start looking for words.
+ *                           It is set to the position after the last
+ *                           returned word, or to \p end when the whole
+ *                           content has been tokenized.
+ * \param[in]     end        The end of the content.
+ * \param[out]    tokens     The found words.
+ * \param[in]     max_tokens The size of \p tokens.
+ * \return The number of words put in \p tokens, 0 at the end of the content.
+ */
+int wordcount_tokenize(const char **pos, const char *end,
+                       wordcount_token_t *tokens, int max_tokens);
+
+/** Find the next words of a folded UTF-8 content.
+ *
+ * Same as wordcount_tokenize(), but the non-ASCII bytes are word characters
+ * too, the other non-ASCII characters having been replaced by spaces by
+ * wordcount_utf8_fold(). A pure ASCII content is tokenized like by
+ * wordcount_tokenize().
+ */
+int wordcount_tokenize_utf8(const char **pos, const char *end,
+                            wordcount_token_t *tokens, int max_tokens);
+
+/** Tokenizer function, wordcount_tokenize() or
+ * wordcount_tokenize_utf8(). */
+typedef int (wordcount_tokenize_f)(const char **pos, const char *end,
+                                   wordcount_token_t *tokens,
+                                   int max_tokens);
+
+/** Force the implementation of the tokenizer.
+ *
+ * \param[in] impl The implementation to use.
+ * \return -1 if the implementation is not supported by the CPU, 0 otherwise.
+ */
+int wordcount_tokenize_set_impl(wordcount_tokenize_impl_t impl);
+
+/** Get the name of the implementation of the tokenizer in use. */
+const char *wordcount_tokenize_impl_name(void);
+
+/** Module to tokenize the file contents.
+ *
+ * Select the best implementation of the tokenizer for the CPU.
+ */
+MODULE_DECLARE(wordcount_tokenize);
+
+#endif /* IS_WORDCOUNT_TOKENIZE_H */
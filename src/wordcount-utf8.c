@@ -0,0 +1,462 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "wordcount-utf8.h"
+
+/* ASCII check */
+
+size_t wordcount_utf8_ascii_len(const char *s, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__x86_64__)
+    /* SSE2 is always available on x86_64. The high bit of the bytes is
+     * checked 64 bytes at a time, then 16 bytes at a time to find the
+     * first byte that is not ASCII. */
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(s + i + 48));
+
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+                                           _mm_or_si128(c, d))))
+        {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16) {
+        int mask;
+
+        mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+        if (mask) {
+            return i + bsf32(mask);
+        }
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+
+        memcpy(&w, s + i, 8);
+        w &= 0x8080808080808080ULL;
+        if (w) {
+            return i + bsf64(le_to_cpu64(w)) / 8;
+        }
+    }
+#endif
+
+    while (i < len && !(s[i] & 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+/* Classification */
+
+/** Range of code points. */
+typedef struct wordcount_utf8_range_t {
+    uint32_t first;
+    uint32_t last;
+} wordcount_utf8_range_t;
+
+/* Non-ASCII word characters, sorted */
+static const wordcount_utf8_range_t wordcount_utf8_words_g[] = {
+    /* Latin-1, Latin Extended-A and B, IPA, modifier letters */
+    { 0x00aa, 0x00aa }, { 0x00b5, 0x00b5 }, { 0x00ba, 0x00ba },
+    { 0x00c0, 0x00d6 }, { 0x00d8, 0x00f6 }, { 0x00f8, 0x02c1 },
+    { 0x02c6, 0x02d1 }, { 0x02e0, 0x02e4 }, { 0x02ec, 0x02ec },
+    { 0x02ee, 0x02ee },
+    /* Combining diacritical marks, Greek, Coptic */
+    { 0x0300, 0x0374 }, { 0x0376, 0x0377 }, { 0x037a, 0x037d },
+    { 0x037f, 0x037f }, { 0x0386, 0x0386 }, { 0x0388, 0x038a },
+    { 0x038c, 0x038c }, { 0x038e, 0x03a1 }, { 0x03a3, 0x03f5 },
+    /* Cyrillic */
+    { 0x03f7, 0x0481 }, { 0x0483, 0x052f },
+    /* Armenian */
+    { 0x0531, 0x0556 }, { 0x0559, 0x0559 }, { 0x0560, 0x0588 },
+    /* Hebrew */
+    { 0x0591, 0x05bd }, { 0x05bf, 0x05bf }, { 0x05c1, 0x05c2 },
+    { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x05d0, 0x05ea },
+    { 0x05ef, 0x05f2 },
+    /* Arabic */
+    { 0x0610, 0x061a }, { 0x0620, 0x0669 }, { 0x066e, 0x06d3 },
+    { 0x06d5, 0x06dc }, { 0x06df, 0x06e8 }, { 0x06ea, 0x06fc },
+    { 0x06ff, 0x06ff },
+    /* Devanagari */
+    { 0x0900, 0x0963 }, { 0x0966, 0x096f }, { 0x0971, 0x097f },
+    /* Thai */
+    { 0x0e01, 0x0e3a }, { 0x0e40, 0x0e4e }, { 0x0e50, 0x0e59 },
+    /* Georgian, Hangul Jamo */
+    { 0x10a0, 0x10c5 }, { 0x10c7, 0x10c7 }, { 0x10cd, 0x10cd },
+    { 0x10d0, 0x10fa }, { 0x10fc, 0x11ff },
+    /* Phonetic extensions, Latin Extended Additional, Greek Extended */
+    { 0x1d00, 0x1f15 }, { 0x1f18, 0x1f1d }, { 0x1f20, 0x1f45 },
+    { 0x1f48, 0x1f4d }, { 0x1f50, 0x1f57 }, { 0x1f59, 0x1f59 },
+    { 0x1f5b, 0x1f5b }, { 0x1f5d, 0x1f5d }, { 0x1f5f, 0x1f7d },
+    { 0x1f80, 0x1fb4 }, { 0x1fb6, 0x1fbc }, { 0x1fbe, 0x1fbe },
+    { 0x1fc2, 0x1fc4 }, { 0x1fc6, 0x1fcc }, { 0x1fd0, 0x1fd3 },
+    { 0x1fd6, 0x1fdb }, { 0x1fe0, 0x1fec }, { 0x1ff2, 0x1ff4 },
+    { 0x1ff6, 0x1ffc },
+    /* Superscript and letterlike letters */
+    { 0x2071, 0x2071 }, { 0x207f, 0x207f }, { 0x2090, 0x209c },
+    { 0x2102, 0x2102 }, { 0x2107, 0x2107 }, { 0x210a, 0x2113 },
+    { 0x2115, 0x2115 }, { 0x2119, 0x211d }, { 0x2124, 0x2124 },
+    { 0x2126, 0x2126 }, { 0x2128, 0x2128 }, { 0x212a, 0x212d },
+    { 0x212f, 0x2139 }, { 0x213c, 0x213f }, { 0x2145, 0x2149 },
+    { 0x214e, 0x214e }, { 0x2183, 0x2184 },
+    /* Glagolitic, Latin Extended-C, Coptic, Georgian Supplement */
+    { 0x2c00, 0x2ce4 }, { 0x2ceb, 0x2cee }, { 0x2d00, 0x2d25 },
+    { 0x2d27, 0x2d27 }, { 0x2d2d, 0x2d2d },
+    /* Kana, CJK ideographs */
+    { 0x3005, 0x3006 }, { 0x3031, 0x3035 }, { 0x3041, 0x3096 },
+    { 0x3099, 0x309f }, { 0x30a1, 0x30fa }, { 0x30fc, 0x30ff },
+    { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff },
+    /* Cyrillic Extended-B, Latin Extended-D and E */
+    { 0xa640, 0xa66d }, { 0xa680, 0xa69d }, { 0xa722, 0xa788 },
+    { 0xa78b, 0xa7ca }, { 0xab30, 0xab5a }, { 0xab5c, 0xab69 },
+    /* Hangul syllables, CJK compatibility ideographs, Latin ligatures */
+    { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfb00, 0xfb06 },
+    /* Fullwidth and halfwidth forms */
+    { 0xff10, 0xff19 }, { 0xff21, 0xff3a }, { 0xff41, 0xff5a },
+    { 0xff66, 0xffdc },
+    /* CJK ideographs of the supplementary planes */
+    { 0x20000, 0x2fa1f },
+};
+
+bool wordcount_utf8_is_word(uint32_t cp)
+{
+    int lo = 0;
+    int hi = countof(wordcount_utf8_words_g);
+
+    /* Fast path for the letters of the Western European languages */
+    if (cp >= 0xc0 && cp <= 0x24f) {
+        return cp != 0xd7 && cp != 0xf7;
+    }
+
+    /* Find the first range that ends at or after the code point */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (wordcount_utf8_words_g[mid].last < cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < countof(wordcount_utf8_words_g)
+        && wordcount_utf8_words_g[lo].first <= cp;
+}
+
+/* Case folding */
+
+/** Case folding of a range of code points. */
+typedef struct wordcount_utf8_fold_t {
+    uint32_t first;
+    uint32_t last;
+
+    /** The difference between the folded code points and the code
+     * points. */
+    int32_t delta;
+
+    /** 1 if all the code points of the range are folded, 2 if only one out
+     * of two is, starting with the first one: the upper-case and lower-case
+     * letters of many scripts alternate. */
+    uint32_t stride;
+} wordcount_utf8_fold_t;
+
+#define FOLD(first, last, to)  { first, last, (to) - (first), 1 }
+#define FOLD_ALT(first, last)  { first, last, 1, 2 }
+
+/* Simple case folding of the non-ASCII code points, sorted */
+static const wordcount_utf8_fold_t wordcount_utf8_folds_g[] = {
+    /* Latin */
+    FOLD(0x00b5, 0x00b5, 0x03bc), FOLD(0x00c0, 0x00d6, 0x00e0),
+    FOLD(0x00d8, 0x00de, 0x00f8), FOLD_ALT(0x0100, 0x012e),
+    FOLD_ALT(0x0132, 0x0136), FOLD_ALT(0x0139, 0x0147),
+    FOLD_ALT(0x014a, 0x0176), FOLD(0x0178, 0x0178, 0x00ff),
+    FOLD_ALT(0x0179, 0x017d), FOLD(0x017f, 0x017f, 's'),
+    FOLD(0x0181, 0x0181, 0x0253), FOLD_ALT(0x0182, 0x0184),
+    FOLD(0x0186, 0x0186, 0x0254), FOLD_ALT(0x0187, 0x0187),
+    FOLD(0x0189, 0x018a, 0x0256), FOLD_ALT(0x018b, 0x018b),
+    FOLD(0x018e, 0x018e, 0x01dd), FOLD(0x018f, 0x018f, 0x0259),
+    FOLD(0x0190, 0x0190, 0x025b), FOLD_ALT(0x0191, 0x0191),
+    FOLD(0x0193, 0x0193, 0x0260), FOLD(0x0194, 0x0194, 0x0263),
+    FOLD(0x0196, 0x0196, 0x0269), FOLD(0x0197, 0x0197, 0x0268),
+    FOLD_ALT(0x0198, 0x0198), FOLD(0x019c, 0x019c, 0x026f),
+    FOLD(0x019d, 0x019d, 0x0272), FOLD(0x019f, 0x019f, 0x0275),
+    FOLD_ALT(0x01a0, 0x01a4), FOLD(0x01a6, 0x01a6, 0x0280),
+    FOLD_ALT(0x01a7, 0x01a7), FOLD(0x01a9, 0x01a9, 0x0283),
+    FOLD_ALT(0x01ac, 0x01ac), FOLD(0x01ae, 0x01ae, 0x0288),
+    FOLD_ALT(0x01af, 0x01af), FOLD(0x01b1, 0x01b2, 0x028a),
+    FOLD_ALT(0x01b3, 0x01b5), FOLD(0x01b7, 0x01b7, 0x0292),
+    FOLD_ALT(0x01b8, 0x01b8), FOLD_ALT(0x01bc, 0x01bc),
+    FOLD(0x01c4, 0x01c4, 0x01c6), FOLD_ALT(0x01c5, 0x01c5),
+    FOLD(0x01c7, 0x01c7, 0x01c9), FOLD_ALT(0x01c8, 0x01c8),
+    FOLD(0x01ca, 0x01ca, 0x01cc), FOLD_ALT(0x01cb, 0x01db),
+    FOLD_ALT(0x01de, 0x01ee), FOLD(0x01f1, 0x01f1, 0x01f3),
+    FOLD_ALT(0x01f2, 0x01f4), FOLD(0x01f6, 0x01f6, 0x0195),
+    FOLD(0x01f7, 0x01f7, 0x01bf), FOLD_ALT(0x01f8, 0x021e),
+    FOLD(0x0220, 0x0220, 0x019e), FOLD_ALT(0x0222, 0x0232),
+    FOLD(0x023a, 0x023a, 0x2c65), FOLD_ALT(0x023b, 0x023b),
+    FOLD(0x023d, 0x023d, 0x019a), FOLD(0x023e, 0x023e, 0x2c66),
+    FOLD_ALT(0x0241, 0x0241), FOLD(0x0243, 0x0243, 0x0180),
+    FOLD(0x0244, 0x0244, 0x0289), FOLD(0x0245, 0x0245, 0x028c),
+    FOLD_ALT(0x0246, 0x024e),
+
+    /* Greek */
+    FOLD(0x0345, 0x0345, 0x03b9), FOLD_ALT(0x0370, 0x0372),
+    FOLD_ALT(0x0376, 0x0376), FOLD(0x037f, 0x037f, 0x03f3),
+    FOLD(0x0386, 0x0386, 0x03ac), FOLD(0x0388, 0x038a, 0x03ad),
+    FOLD(0x038c, 0x038c, 0x03cc), FOLD(0x038e, 0x038f, 0x03cd),
+    FOLD(0x0391, 0x03a1, 0x03b1), FOLD(0x03a3, 0x03ab, 0x03c3),
+    FOLD_ALT(0x03c2, 0x03c2), FOLD(0x03cf, 0x03cf, 0x03d7),
+    FOLD(0x03d0, 0x03d0, 0x03b2), FOLD(0x03d1, 0x03d1, 0x03b8),
+    FOLD(0x03d5, 0x03d5, 0x03c6), FOLD(0x03d6, 0x03d6, 0x03c0),
+    FOLD_ALT(0x03d8, 0x03ee), FOLD(0x03f0, 0x03f0, 0x03ba),
+    FOLD(0x03f1, 0x03f1, 0x03c1), FOLD(0x03f4, 0x03f4, 0x03b8),
+    FOLD(0x03f5, 0x03f5, 0x03b5), FOLD_ALT(0x03f7, 0x03f7),
+    FOLD(0x03f9, 0x03f9, 0x03f2), FOLD_ALT(0x03fa, 0x03fa),
+    FOLD(0x03fd, 0x03ff, 0x037b),
+
+    /* Cyrillic, Armenian */
+    FOLD(0x0400, 0x040f, 0x0450), FOLD(0x0410, 0x042f, 0x0430),
+    FOLD_ALT(0x0460, 0x0480), FOLD_ALT(0x048a, 0x04be),
+    FOLD(0x04c0, 0x04c0, 0x04cf), FOLD_ALT(0x04c1, 0x04cd),
+    FOLD_ALT(0x04d0, 0x052e), FOLD(0x0531, 0x0556, 0x0561),
+
+    /* Georgian */
+    FOLD(0x10a0, 0x10c5, 0x2d00), FOLD(0x10c7, 0x10c7, 0x2d27),
+    FOLD(0x10cd, 0x10cd, 0x2d2d),
+
+    /* Latin Extended Additional */
+    FOLD_ALT(0x1e00, 0x1e94), FOLD(0x1e9b, 0x1e9b, 0x1e61),
+    FOLD(0x1e9e, 0x1e9e, 0x00df), FOLD_ALT(0x1ea0, 0x1efe),
+
+    /* Greek Extended */
+    FOLD(0x1f08, 0x1f0f, 0x1f00), FOLD(0x1f18, 0x1f1d, 0x1f10),
+    FOLD(0x1f28, 0x1f2f, 0x1f20), FOLD(0x1f38, 0x1f3f, 0x1f30),
+    FOLD(0x1f48, 0x1f4d, 0x1f40), { 0x1f59, 0x1f5f, -8, 2 },
+    FOLD(0x1f68, 0x1f6f, 0x1f60), FOLD(0x1f88, 0x1f8f, 0x1f80),
+    FOLD(0x1f98, 0x1f9f, 0x1f90), FOLD(0x1fa8, 0x1faf, 0x1fa0),
+    FOLD(0x1fb8, 0x1fb9, 0x1fb0), FOLD(0x1fba, 0x1fbb, 0x1f70),
+    FOLD(0x1fbc, 0x1fbc, 0x1fb3), FOLD(0x1fbe, 0x1fbe, 0x03b9),
+    FOLD(0x1fc8, 0x1fcb, 0x1f72), FOLD(0x1fcc, 0x1fcc, 0x1fc3),
+    FOLD(0x1fd8, 0x1fd9, 0x1fd0), FOLD(0x1fda, 0x1fdb, 0x1f76),
+    FOLD(0x1fe8, 0x1fe9, 0x1fe0), FOLD(0x1fea, 0x1feb, 0x1f7a),
+    FOLD(0x1fec, 0x1fec, 0x1fe5), FOLD(0x1ff8, 0x1ff9, 0x1f78),
+    FOLD(0x1ffa, 0x1ffb, 0x1f7c), FOLD(0x1ffc, 0x1ffc, 0x1ff3),
+
+    /* Letterlike symbols */
+    FOLD(0x2126, 0x2126, 0x03c9), FOLD(0x212a, 0x212a, 'k'),
+    FOLD(0x212b, 0x212b, 0x00e5), FOLD(0x2132, 0x2132, 0x214e),
+    FOLD_ALT(0x2183, 0x2183),
+
+    /* Glagolitic, Latin Extended-C, Coptic */
+    FOLD(0x2c00, 0x2c2f, 0x2c30), FOLD_ALT(0x2c60, 0x2c60),
+    FOLD(0x2c62, 0x2c62, 0x026b), FOLD(0x2c63, 0x2c63, 0x1d7d),
+    FOLD(0x2c64, 0x2c64, 0x027d), FOLD_ALT(0x2c67, 0x2c6b),
+    FOLD(0x2c6d, 0x2c6d, 0x0251), FOLD(0x2c6e, 0x2c6e, 0x0271),
+    FOLD(0x2c6f, 0x2c6f, 0x0250), FOLD(0x2c70, 0x2c70, 0x0252),
+    FOLD_ALT(0x2c72, 0x2c72), FOLD_ALT(0x2c75, 0x2c75),
+    FOLD(0x2c7e, 0x2c7f, 0x023f), FOLD_ALT(0x2c80, 0x2ce2),
+    FOLD_ALT(0x2ceb, 0x2ced),
+
+    /* Cyrillic Extended-B, Latin Extended-D */
+    FOLD_ALT(0xa640, 0xa66c), FOLD_ALT(0xa680, 0xa69a),
+    FOLD_ALT(0xa722, 0xa72e), FOLD_ALT(0xa732, 0xa76e),
+    FOLD_ALT(0xa779, 0xa77b), FOLD(0xa77d, 0xa77d, 0x1d79),
+    FOLD_ALT(0xa77e, 0xa786), FOLD_ALT(0xa78b, 0xa78b),
+    FOLD(0xa78d, 0xa78d, 0x0265), FOLD_ALT(0xa790, 0xa792),
+    FOLD_ALT(0xa796, 0xa7a8), FOLD(0xa7aa, 0xa7aa, 0x0266),
+    FOLD(0xa7ab, 0xa7ab, 0x025c), FOLD(0xa7ac, 0xa7ac, 0x0261),
+    FOLD(0xa7ad, 0xa7ad, 0x026c), FOLD(0xa7ae, 0xa7ae, 0x026a),
+    FOLD(0xa7b0, 0xa7b0, 0x029e), FOLD(0xa7b1, 0xa7b1, 0x0287),
+    FOLD(0xa7b2, 0xa7b2, 0x029d), FOLD(0xa7b3, 0xa7b3, 0xab53),
+    FOLD_ALT(0xa7b4, 0xa7c2), FOLD(0xa7c4, 0xa7c4, 0xa794),
+    FOLD(0xa7c5, 0xa7c5, 0x0282), FOLD(0xa7c6, 0xa7c6, 0x1d8e),
+    FOLD_ALT(0xa7c7, 0xa7c9),
+
+    /* Fullwidth forms */
+    FOLD(0xff21, 0xff3a, 0xff41),
+};
+
+#undef FOLD
+#undef FOLD_ALT
+
+uint32_t wordcount_utf8_fold_cp(uint32_t cp)
+{
+    const wordcount_utf8_fold_t *fold;
+    int lo = 0;
+    int hi = countof(wordcount_utf8_folds_g);
+
+    /* Fast path for Latin-1 */
+    if (cp < 0x100 && cp != 0xb5) {
+        return (cp >= 0xc0 && cp <= 0xde && cp != 0xd7) ? cp + 0x20 : cp;
+    }
+
+    /* Find the first range that ends at or after the code point */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (wordcount_utf8_folds_g[mid].last < cp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == countof(wordcount_utf8_folds_g)) {
+        return cp;
+    }
+    fold = &wordcount_utf8_folds_g[lo];
+    if (cp < fold->first || (cp - fold->first) % fold->stride) {
+        return cp;
+    }
+    return cp + fold->delta;
+}
+
+/* Folding */
+
+/** Decode the UTF-8 character at a position.
+ *
+ * \param[in,out] pos The position of the character, moved after it, or
+ *                    after its first byte if it is not valid.
+ * \param[in]     end The end of the content.
+ * \return The code point of the character, -1 if it is not a valid UTF-8
+ *         sequence: truncated, overlong, surrogate or out of range.
+ */
+static int wordcount_utf8_decode(const char **pos, const char *end)
+{
+    const unsigned char *p = (const unsigned char *)*pos;
+    uint32_t cp;
+    uint32_t min;
+    int len;
+
+    if (p[0] < 0xc2) {
+        /* Continuation byte, or overlong 2-byte sequence */
+        goto invalid;
+    } else
+    if (p[0] < 0xe0) {
+        cp = p[0] & 0x1f;
+        min = 0x80;
+        len = 2;
+    } else
+    if (p[0] < 0xf0) {
+        cp = p[0] & 0x0f;
+        min = 0x800;
+        len = 3;
+    } else
+    if (p[0] < 0xf5) {
+        cp = p[0] & 0x07;
+        min = 0x10000;
+        len = 4;
+    } else {
+        goto invalid;
+    }
+
+    if (end - *pos < len) {
+        goto invalid;
+    }
+    for (int i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            goto invalid;
+        }
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        goto invalid;
+    }
+
+    *pos += len;
+    return cp;
+
+  invalid:
+    *pos += 1;
+    return -1;
+}
+
+/** Encode a code point in UTF-8.
+ *
+ * \param[in]  cp  The code point, a valid Unicode scalar value.
+ * \param[out] buf The buffer the character is appended to.
+ */
+static void wordcount_utf8_encode(uint32_t cp, sb_t *buf)
+{
+    char *p;
+
+    if (cp < 0x80) {
+        sb_addc(buf, cp);
+    } else
+    if (cp < 0x800) {
+        p = sb_growlen(buf, 2);
+        p[0] = 0xc0 | (cp >> 6);
+        p[1] = 0x80 | (cp & 0x3f);
+    } else
+    if (cp < 0x10000) {
+        p = sb_growlen(buf, 3);
+        p[0] = 0xe0 | (cp >> 12);
+        p[1] = 0x80 | ((cp >> 6) & 0x3f);
+        p[2] = 0x80 | (cp & 0x3f);
+    } else {
+        p = sb_growlen(buf, 4);
+        p[0] = 0xf0 | (cp >> 18);
+        p[1] = 0x80 | ((cp >> 12) & 0x3f);
+        p[2] = 0x80 | ((cp >> 6) & 0x3f);
+        p[3] = 0x80 | (cp & 0x3f);
+    }
+}
+
+lstr_t wordcount_utf8_fold(lstr_t content, sb_t *buf)
+{
+    const char *pos = content.s;
+    const char *end = content.s + content.len;
+    size_t ascii_len = wordcount_utf8_ascii_len(pos, content.len);
+
+    /* Most contents are pure ASCII, they are tokenized in place */
+    if (ascii_len == (size_t)content.len) {
+        return content;
+    }
+
+    /* The folded content has about the size of the content, the folding
+     * only changes the length of a few code points */
+    sb_reset(buf);
+    sb_grow(buf, content.len);
+    for (;;) {
+        int cp;
+
+        /* Copy the ASCII characters by runs */
+        sb_add(buf, pos, ascii_len);
+        pos += ascii_len;
+        if (pos >= end) {
+            break;
+        }
+
+        cp = wordcount_utf8_decode(&pos, end);
+        if (cp < 0 || !wordcount_utf8_is_word(cp)) {
+            sb_addc(buf, ' ');
+        } else {
+            wordcount_utf8_encode(wordcount_utf8_fold_cp(cp), buf);
+        }
+        ascii_len = wordcount_utf8_ascii_len(pos, end - pos);
+    }
+
+    return LSTR_SB_V(buf);
+}
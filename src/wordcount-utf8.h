@@ -0,0 +1,72 @@
+/***************************************************************************/
+/*                                                                         */
+/* Copyright 2022 INTERSEC SA                                              */
+/*                                                                         */
+/* Licensed under the Apache License, Version 2.0 (the "License");         */
+/* you may not use this file except in compliance with the License.        */
+/* You may obtain a copy of the License at                                 */
+/*                                                                         */
+/*     http://www.apache.org/licenses/LICENSE-2.0                          */
+/*                                                                         */
+/* Unless required by applicable law or agreed to in writing, software     */
+/* distributed under the License is distributed on an "AS IS" BASIS,       */
+/* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.*/
+/* See the License for the specific language governing permissions and     */
+/* limitations under the License.                                          */
+/*                                                                         */
+/***************************************************************************/
+
+#ifndef IS_WORDCOUNT_UTF8_H
+#define IS_WORDCOUNT_UTF8_H
+
+#include <lib-common/core.h>
+
+/** Get the length of the ASCII beginning of a string.
+ *
+ * The string is checked 64 bytes at a time with SIMD instructions, so a
+ * pure ASCII string is scanned at the speed of the memory.
+ *
+ * \param[in] s   The string.
+ * \param[in] len The length of the string.
+ * \return The position of the first byte that is not ASCII, \p len if there
+ *         is none.
+ */
+size_t wordcount_utf8_ascii_len(const char *s, size_t len);
+
+/** Get whether a non-ASCII code point is a word character.
+ *
+ * The word characters are the letters, the decimal digits and the combining
+ * marks of the main scripts: Latin, Greek, Cyrillic, Armenian, Georgian,
+ * Hebrew, Arabic, Devanagari, Thai, Hangul, kana and CJK ideographs. This is
+ * a compact approximation of the Unicode categories L, Nd and Mn.
+ */
+bool wordcount_utf8_is_word(uint32_t cp);
+
+/** Get the simple case folding of a non-ASCII code point.
+ *
+ * The mappings of the statuses C and S of the CaseFolding.txt file of
+ * Unicode are applied for the scripts of wordcount_utf8_is_word(), the code
+ * points without mapping are returned as is.
+ */
+uint32_t wordcount_utf8_fold_cp(uint32_t cp);
+
+/** Fold the case of a UTF-8 content for the UTF-8 tokenizing.
+ *
+ * The non-ASCII word characters are case-folded, and the other non-ASCII
+ * characters, as well as the invalid UTF-8 sequences, are replaced by a
+ * space. The ASCII characters are copied as is: the ASCII letters are
+ * lower-cased by the hashing and the comparison of the words. The text is
+ * not normalized, so a precomposed and a decomposed letter are different
+ * words.
+ *
+ * The folded content is valid UTF-8 whose non-ASCII bytes are all parts of
+ * word characters, it is tokenized by wordcount_tokenize_utf8().
+ *
+ * \param[in]  content The content, in UTF-8.
+ * \param[out] buf     The buffer of the folded content, reset first.
+ * \return The folded content: \p content itself when it is pure ASCII, so
+ *         it is not copied, otherwise the content of \p buf.
+ */
+lstr_t wordcount_utf8_fold(lstr_t content, sb_t *buf);
+
+#endif /* IS_WORDCOUNT_UTF8_H */